@@ -56,24 +56,27 @@ void usage()
 
 /* Extract basin values for the specified points */
 int extract_basins(int n, ucvm_point_t *pnts, \
-		   ucvm_point_t *qpnts, ucvm_data_t *qprops,
+		   double *qz, ucvm_data_t *qprops,
 		   double max_depth, double z_inter, double vs_thresh)
 {
   int i, p, dnum, numz;
   double vs_prev;
   double depths[3];
+  double lonlat[2];
   
+  /* Setup query depths */
   numz = (int)(max_depth / z_inter);
+  for (i = 0; i < numz; i++) {
+    qz[i] = (double)i * z_inter;
+  }
+
   for (p = 0; p < n; p++) {
-    /* Setup query points */
-    for (i = 0; i < numz; i++) {
-      qpnts[i].coord[0] = pnts[p].coord[0];
-      qpnts[i].coord[1] = pnts[p].coord[1];
-      qpnts[i].coord[2] = (double)i * z_inter;
-    }
+    lonlat[0] = pnts[p].coord[0];
+    lonlat[1] = pnts[p].coord[1];
 
-    /* Query the UCVM */
-    if (ucvm_query(numz, qpnts, qprops) != UCVM_CODE_SUCCESS) {
+    /* Query the UCVM profile */
+    if (ucvm_query_columns(1, lonlat, numz, qz, qprops) != 
+	UCVM_CODE_SUCCESS) {
       fprintf(stderr, "Query CVM failed\n");
       return(1);
     }
@@ -132,7 +135,7 @@ int main(int argc, char **argv)
   int have_map = 0;
 
   ucvm_point_t *pnts;
-  ucvm_point_t *qpnts;
+  double *qz;
   ucvm_data_t *qprops;
   int numread = 0;
   char map_label[UCVM_MAX_LABEL_LEN];
@@ -263,7 +266,7 @@ int main(int argc, char **argv)
 
   /* Allocate buffers */
   pnts = malloc(NUM_POINTS * sizeof(ucvm_point_t));
-  qpnts = malloc((int)(max_depth/z_inter) * sizeof(ucvm_point_t));
+  qz = malloc((int)(max_depth/z_inter) * sizeof(double));
   qprops = malloc((int)(max_depth/z_inter) * sizeof(ucvm_data_t));
 
   /* Read in coords */
@@ -281,7 +284,7 @@ int main(int argc, char **argv)
 
       numread++;
       if (numread == NUM_POINTS) {
-	if (extract_basins(numread, pnts, qpnts, qprops, 
+	if (extract_basins(numread, pnts, qz, qprops, 
 			   max_depth, z_inter, 
 			   vs_thresh) != UCVM_CODE_SUCCESS) {
 	  fprintf(stderr, "Query basins failed\n");
@@ -293,7 +296,7 @@ int main(int argc, char **argv)
   }
 
   if (numread > 0) {
-    if (extract_basins(numread, pnts, qpnts, qprops,
+    if (extract_basins(numread, pnts, qz, qprops,
 		       max_depth, z_inter, 
 		       vs_thresh) != UCVM_CODE_SUCCESS) {
       fprintf(stderr, "Query basins failed\n");
@@ -304,7 +307,7 @@ int main(int argc, char **argv)
 
   ucvm_finalize();
   free(pnts);
-  free(qpnts);
+  free(qz);
   free(qprops);
 
   return(0);
@@ -2,11 +2,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "ucvm.h"
 #include "ucvm_config.h"
 #include "ucvm_utils.h"
 #include "ucvm_proj_ucvm.h"
 #include "ucvm_map.h"
+#include "ucvm_qcache.h"
+#include "ucvm_shm.h"
 /* Interpolation functions */
 #include "ucvm_interp.h"
 /* Crustal models */
@@ -50,22 +57,37 @@
 #include "ucvm_model_etree.h"
 #include "ucvm_model_cmuetree.h"
 #include "ucvm_model_patch.h"
+#include "ucvm_model_grid.h"
 
 /* Constants */
 #define UCVM_MODELLIST_DELIM ","
 #define UCVM_GTL_DELIM ":"
 
+/* Points per chunk for parallel queries */
+#define UCVM_PARALLEL_CHUNK 1024
+
+/* Points per internal block for SoA queries */
+#define UCVM_SOA_BLOCK 8192
+
 
 /* Init flag */
 int ucvm_init_flag = 0;
 
 
-/* Current query mode */
-ucvm_ctype_t ucvm_cur_qmode = UCVM_COORD_GEO_DEPTH;
+/* Default query context, used by ucvm_query(). Its model and map 
+   state pointers are NULL, selecting each model's own state */
+ucvm_ctx_t ucvm_cur_ctx = {UCVM_COORD_GEO_DEPTH, 
+			   UCVM_DEFAULT_INTERP_ZMIN,
+			   UCVM_DEFAULT_INTERP_ZMAX,
+			   UCVM_DEFAULT_QUERY_TILE,
+			   UCVM_DEFAULT_QUERY_VALS};
 
 /* Current model mode */
 ucvm_opmode_t ucvm_cur_mmode = UCVM_OPMODE_CRUSTAL;
 
+/* Serializes models without a reentrant interface */
+pthread_mutex_t ucvm_legacy_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 /* Crustal/GTL model lists */
 int ucvm_num_models = 0;
@@ -76,17 +98,74 @@ ucvm_ifunc_t ucvm_ifunc_list[UCVM_MAX_MODELS];
 /* UCVM config */
 ucvm_config_t *ucvm_cfg = NULL;
 
-/* GTL smoothing parameters */
-double ucvm_interp_zmin = UCVM_DEFAULT_INTERP_ZMIN;
-double ucvm_interp_zmax = UCVM_DEFAULT_INTERP_ZMAX;
+
+/* Per-thread contexts for parallel ucvm_query() */
+int ucvm_num_tctx = 0;
+ucvm_ctx_t *ucvm_tctx = NULL;
+
+
+/* Query result cache, disabled until sized. Cached queries hold the
+   rwlock for reading, resizing holds it for writing */
+ucvm_qcache_t ucvm_qcache;
+pthread_rwlock_t ucvm_qcache_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+/* Wall time of each model init, in ns */
+unsigned long long ucvm_model_init_ns[UCVM_MAX_MODELS];
+
+
+/* Models of one interface within a list, initialized in list order
+   by a single thread since they share that interface's tables. A 
+   model with UCVM_MODEL_CAP_PARALLEL_INIT gets a task of its own, and
+   tasks of UCVM_MODEL_CAP_EXCLUSIVE_INIT models run after the rest */
+typedef struct ucvm_init_task_t {
+  int base;
+  int first;
+  int num;
+  ucvm_modelconf_t *mconf;
+  int *status;
+} ucvm_init_task_t;
+
+
+/* Configured model regions, and the bucket index built over them */
+int ucvm_model_has_region[UCVM_MAX_MODELS];
+ucvm_region_t ucvm_model_region[UCVM_MAX_MODELS];
+ucvm_region_index_t ucvm_region_index;
+
+
+/* Free per-thread contexts */
+int ucvm_free_thread_ctx();
+
+/* Free context scratch buffers */
+int ucvm_free_scratch(ucvm_ctx_t *ctx);
+
+/* Build/free the model region index */
+int ucvm_build_region_index();
+int ucvm_free_region_index();
+
+/* Resolve model interface and config, by label */
+int ucvm_resolve_model(const char *label, ucvm_model_t *m, 
+		       ucvm_modelconf_t *mconf);
+
+/* Activate an initialized model at the end of the active list */
+int ucvm_register_model(ucvm_modelconf_t *mconf);
+
+/* Monotonic clock in ns, for instrumentation */
+unsigned long long ucvm_stat_clock();
+
+/* Query using a context, looking up the map values in vals rather 
+   than those set on the context */
+int ucvm_query_ctx_vals(ucvm_ctx_t *ctx, int vals, int n, 
+			ucvm_point_t *pnt, ucvm_data_t *data);
 
 
 /* Get topo and vs30 values from UCVM models */
-int ucvm_get_model_vals(ucvm_point_t *pnt, ucvm_data_t *data)
+int ucvm_get_model_vals(ucvm_ctx_t *ctx, ucvm_point_t *pnt, 
+			ucvm_data_t *data)
 {
 
   /* Re-compute point depth based on query mode */
-  switch (ucvm_cur_qmode) {
+  switch (ctx->qmode) {
   case UCVM_COORD_GEO_DEPTH:
     data->depth = pnt->coord[2];
     break;
@@ -102,12 +181,13 @@ int ucvm_get_model_vals(ucvm_point_t *pnt, ucvm_data_t *data)
   /* Recompute domain and depth shift values */
   switch (ucvm_cur_mmode) {
   case UCVM_OPMODE_GTL:
-    if ((data->depth < ucvm_interp_zmax) && 
-	(data->depth >= ucvm_interp_zmin)) {
-      data->shift_cr = ucvm_interp_zmax - data->depth;
-      data->shift_gtl = ucvm_interp_zmin - data->depth;
+    if ((data->depth < ctx->interp_zmax) && 
+	(data->depth >= ctx->interp_zmin)) {
+      data->shift_cr = ctx->interp_zmax - data->depth;
+      data->shift_gtl = ctx->interp_zmin - data->depth;
       data->domain = UCVM_DOMAIN_INTERP;
-    } else if ((data->depth >= 0.0) && (data->depth < ucvm_interp_zmin)) {
+    } else if ((data->depth >= 0.0) && 
+	       (data->depth < ctx->interp_zmin)) {
       data->domain = UCVM_DOMAIN_GTL;
     }
     break;
@@ -116,7 +196,7 @@ int ucvm_get_model_vals(ucvm_point_t *pnt, ucvm_data_t *data)
   }
 
   /* Disallow negative depths in depth mode */
-  switch (ucvm_cur_qmode) {
+  switch (ctx->qmode) {
   case UCVM_COORD_GEO_DEPTH:
     if (data->depth < 0.0) {
       data->domain = UCVM_DOMAIN_NONE;
@@ -130,6 +210,33 @@ int ucvm_get_model_vals(ucvm_point_t *pnt, ucvm_data_t *data)
 }
 
 
+/* Pass map-specific flags from config file */
+void ucvm_map_params(const char *label)
+{
+  char key[UCVM_CONFIG_MAX_STR];
+  char param[UCVM_CONFIG_MAX_STR];
+  char setting[UCVM_CONFIG_MAX_STR];
+  char *flag[2];
+  ucvm_config_t *cfgentry = NULL;
+
+  flag[0] = param;
+  flag[1] = setting;
+  snprintf(key, UCVM_CONFIG_MAX_STR, "%s_param", label);
+  cfgentry = ucvm_find_name(ucvm_cfg, key);
+  while (cfgentry != NULL) {
+    list_parse_s(cfgentry->value, UCVM_CONFIG_MAX_STR, 
+		 flag, 2, UCVM_CONFIG_MAX_STR);
+    cfgentry = ucvm_find_name(cfgentry->next, key);
+    if (ucvm_map_setparam(flag[0], flag[1]) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Warning: Failed to set conf %s=%s for map %s\n", 
+	      flag[0], flag[1], label);
+    }
+  }
+
+  return;
+}
+
+
 /* Initializer */
 int ucvm_init(const char *config)
 {
@@ -137,12 +244,16 @@ int ucvm_init(const char *config)
 
   /* Config file parameters */
   ucvm_config_t *cfgentry = NULL;
+  ucvm_config_t *shmentry = NULL;
   //ucvm_config_t *cfg = NULL;
   //char modelconf[UCVM_CONFIG_MAX_STR];
 
   ucvm_num_models = 0;
   memset(ucvm_model_list, 0, sizeof(ucvm_model_t)*UCVM_MAX_MODELS);
   memset(ucvm_ifunc_list, 0, sizeof(ucvm_ifunc_t)*UCVM_MAX_MODELS);
+  memset(ucvm_model_has_region, 0, sizeof(int)*UCVM_MAX_MODELS);
+  memset(ucvm_model_init_ns, 0, 
+	 sizeof(unsigned long long)*UCVM_MAX_MODELS);
 
   /* Read in general config file */
   ucvm_cfg = ucvm_parse_config(config);
@@ -160,7 +271,8 @@ int ucvm_init(const char *config)
     fprintf(stderr, "UCVM map interface not found in %s\n", config);
     return(UCVM_CODE_ERROR);
   }
-  if (strcmp(cfgentry->value, UCVM_MAP_ETREE) != 0) {
+  if ((strcmp(cfgentry->value, UCVM_MAP_ETREE) != 0) &&
+      (strcmp(cfgentry->value, UCVM_MAP_RASTER) != 0)) {
     fprintf(stderr, "Invalid UCVM map interface %s\n", cfgentry->value);
     return(UCVM_CODE_ERROR);
   }
@@ -182,13 +294,19 @@ int ucvm_init(const char *config)
   /* Free UCVM model config */
   //ucvm_free_config(cfg);
 
+  /* Optional shared memory model payloads, the map's included */
+  shmentry = ucvm_find_name(ucvm_cfg, "ucvm_shared_memory");
+  ucvm_shm_setenabled((shmentry != NULL) && 
+		      (strcmp(shmentry->value, "True") == 0));
+
   /* Initialize default map */
-  if (ucvm_map_init(UCVM_MAP_UCVM, 
+  if (ucvm_map_init(UCVM_MAP_UCVM, cfgentry->value,
 		    ucvm_find_name(ucvm_cfg, "ucvm_mappath")->value) 
       != UCVM_CODE_SUCCESS) {
     fprintf(stderr, "Failed to initialize UCVM map\n");
     return(UCVM_CODE_ERROR);
   }
+  ucvm_map_params(UCVM_MAP_UCVM);
 
   ucvm_init_flag = 1;
   return(UCVM_CODE_SUCCESS);
@@ -200,6 +318,14 @@ int ucvm_finalize()
 {
   int i;
 
+  /* Free per-thread contexts and default scratch buffers */
+  ucvm_free_thread_ctx();
+  ucvm_free_scratch(&ucvm_cur_ctx);
+  ucvm_free_region_index();
+  pthread_rwlock_wrlock(&ucvm_qcache_rwlock);
+  ucvm_qcache_free(&ucvm_qcache);
+  pthread_rwlock_unlock(&ucvm_qcache_rwlock);
+
   /* Call all model finalizers */
   for (i = 0; i < ucvm_num_models; i++) {
     (ucvm_model_list[i].finalize)();
@@ -218,8 +344,16 @@ int ucvm_finalize()
   ucvm_num_models = 0;
   memset(ucvm_model_list, 0, sizeof(ucvm_model_t)*UCVM_MAX_MODELS);
   memset(ucvm_ifunc_list, 0, sizeof(ucvm_ifunc_t)*UCVM_MAX_MODELS);
-
-  ucvm_cur_qmode = UCVM_COORD_GEO_DEPTH;
+  memset(ucvm_model_has_region, 0, sizeof(int)*UCVM_MAX_MODELS);
+  memset(ucvm_model_init_ns, 0, 
+	 sizeof(unsigned long long)*UCVM_MAX_MODELS);
+
+  ucvm_cur_ctx.qmode = UCVM_COORD_GEO_DEPTH;
+  ucvm_cur_ctx.interp_zmin = UCVM_DEFAULT_INTERP_ZMIN;
+  ucvm_cur_ctx.interp_zmax = UCVM_DEFAULT_INTERP_ZMAX;
+  ucvm_cur_ctx.tile = UCVM_DEFAULT_QUERY_TILE;
+  ucvm_cur_ctx.vals = UCVM_DEFAULT_QUERY_VALS;
+  memset(&(ucvm_cur_ctx.stats), 0, sizeof(ucvm_stats_t));
   ucvm_cur_mmode = UCVM_OPMODE_CRUSTAL;
 
   ucvm_init_flag = 0;
@@ -227,23 +361,105 @@ int ucvm_finalize()
 }
 
 
+/* Init the models of one interface, in list order */
+void *ucvm_init_worker(void *arg)
+{
+  int i, id;
+  unsigned long long t0;
+  ucvm_init_task_t *task = (ucvm_init_task_t *)arg;
+  ucvm_model_t *lead = &(ucvm_model_list[task->base + task->first]);
+
+  for (i = task->first; i < task->num; i++) {
+    id = task->base + i;
+    if ((ucvm_model_list[id].init != lead->init) ||
+	((i != task->first) && 
+	 (ucvm_model_list[id].caps & UCVM_MODEL_CAP_PARALLEL_INIT))) {
+      continue;
+    }
+    t0 = ucvm_stat_clock();
+    if (ucvm_model_list[id].caps & UCVM_MODEL_CAP_SERIAL_INIT) {
+      pthread_mutex_lock(&ucvm_legacy_lock);
+      task->status[i] = (ucvm_model_list[id].init)(id, &(task->mconf[i]));
+      pthread_mutex_unlock(&ucvm_legacy_lock);
+    } else {
+      task->status[i] = (ucvm_model_list[id].init)(id, &(task->mconf[i]));
+    }
+    ucvm_model_init_ns[id] = ucvm_stat_clock() - t0;
+
+    /* Later models of this interface are not attempted */
+    if (task->status[i] != UCVM_CODE_SUCCESS) {
+      break;
+    }
+  }
+
+  return(NULL);
+}
+
+
+/* Undo the init of the models of a list that were not enabled */
+void ucvm_release_models(int base, int num, int *status)
+{
+  int i, j, id;
+  ucvm_model_t *mptr;
+
+  for (id = ucvm_num_models; id < base + num; id++) {
+    i = id - base;
+    mptr = &(ucvm_model_list[id]);
+    if (status[i] != UCVM_CODE_SUCCESS) {
+      continue;
+    }
+    if (mptr->release != NULL) {
+      (mptr->release)(id);
+      continue;
+    }
+
+    /* Finalize the interface once, unless an enabled model uses it */
+    for (j = 0; j < id; j++) {
+      if ((ucvm_model_list[j].finalize == mptr->finalize) &&
+	  ((j < ucvm_num_models) || (status[j - base] == UCVM_CODE_SUCCESS))) {
+	break;
+      }
+    }
+    if (j == id) {
+      (mptr->finalize)();
+    }
+  }
+
+  memset(&(ucvm_model_list[ucvm_num_models]), 0, 
+	 sizeof(ucvm_model_t) * (base + num - ucvm_num_models));
+  return;
+}
+
+
 /* Enable list of models */
 int ucvm_add_model_list(const char *list) {
   char modelstr[UCVM_MAX_MODELLIST_LEN];
   char *token, *strptr;
-  int i;
+  int i, j, base, first;
   int num_models = 0;
+  int num_tasks = 0;
   char models[UCVM_MAX_MODELS][UCVM_MAX_LABEL_LEN];
   char ifuncs[UCVM_MAX_MODELS][UCVM_MAX_LABEL_LEN];
+  char mlabel[UCVM_MAX_LABEL_LEN];
+  ucvm_model_t m[UCVM_MAX_MODELS];
+  ucvm_modelconf_t mconf[UCVM_MAX_MODELS];
+  int status[UCVM_MAX_MODELS];
+  ucvm_init_task_t tasks[UCVM_MAX_MODELS];
+  pthread_t threads[UCVM_MAX_MODELS];
 
   if (strlen(list) >= UCVM_MAX_MODELLIST_LEN) {
     return(UCVM_CODE_ERROR);
   }
 
+  if (ucvm_init_flag == 0) {
+    fprintf(stderr, "UCVM not initialized\n");
+    return(UCVM_CODE_ERROR);
+  }
+
   memset(models, 0, UCVM_MAX_MODELS * UCVM_MAX_LABEL_LEN);
   memset(ifuncs, 0, UCVM_MAX_MODELS * UCVM_MAX_LABEL_LEN);
 
-  /* Parse model list */
+  /* Parse model list, skipping empty labels */
   ucvm_strcpy(modelstr, list, UCVM_MAX_MODELLIST_LEN);
   token = strtok(modelstr, UCVM_MODELLIST_DELIM);
   while (token != NULL) {
@@ -264,44 +480,151 @@ int ucvm_add_model_list(const char *list) {
     /* Parse model */
     ucvm_strcpy(models[num_models], token, UCVM_MAX_LABEL_LEN);
 
-    num_models++;
+    if (strlen(models[num_models]) > 0) {
+      num_models++;
+    }
     token = strtok(NULL, UCVM_MODELLIST_DELIM);
   }
-  
-  /* Activate each model and ifunc */
+
+  base = ucvm_num_models;
+  if (base + num_models > UCVM_MAX_MODELS) {
+    fprintf(stderr, "Maximum number of models reached\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Resolve each model */
   for (i = 0; i < num_models; i++) {
-    /* Add model */
-    if (strlen(models[i]) > 0) {
-      //fprintf(stderr, "Adding model %s\n", models[i]);
-      if (ucvm_add_model(models[i]) != UCVM_CODE_SUCCESS) {
+    for (j = 0; j < base + i; j++) {
+      if (j < base) {
+	ucvm_model_list[j].getlabel(j, mlabel, UCVM_MAX_LABEL_LEN);
+      } else {
+	ucvm_strcpy(mlabel, models[j - base], UCVM_MAX_LABEL_LEN);
+      }
+      if (strcmp(mlabel, models[i]) == 0) {
+	fprintf(stderr, "Model %s already enabled\n", models[i]);
 	fprintf(stderr, "Failed to add parsed model %s\n", models[i]);
 	return(UCVM_CODE_ERROR);
       }
+    }
+    if (ucvm_resolve_model(models[i], &(m[i]), &(mconf[i])) != 
+	UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to add parsed model %s\n", models[i]);
+      return(UCVM_CODE_ERROR);
+    }
+  }
+
+  /* Place models on the list in priority order, and group them by
+     interface for init */
+  for (i = 0; i < num_models; i++) {
+    memcpy(&(ucvm_model_list[base + i]), &(m[i]), sizeof(ucvm_model_t));
+    status[i] = UCVM_CODE_ERROR;
+    for (j = 0; j < i; j++) {
+      if ((m[j].init == m[i].init) && 
+	  !((m[i].caps | m[j].caps) & UCVM_MODEL_CAP_PARALLEL_INIT)) {
+	break;
+      }
+    }
+    if (j == i) {
+      tasks[num_tasks].base = base;
+      tasks[num_tasks].first = i;
+      if (m[i].caps & UCVM_MODEL_CAP_PARALLEL_INIT) {
+	tasks[num_tasks].num = i + 1;
+      } else {
+	tasks[num_tasks].num = num_models;
+      }
+      tasks[num_tasks].mconf = mconf;
+      tasks[num_tasks].status = status;
+      num_tasks++;
+    }
+  }
+
+  /* Init the interfaces concurrently, one thread each, with the 
+     caller taking the first */
+  first = -1;
+  for (i = 0; i < num_tasks; i++) {
+    threads[i] = pthread_self();
+    if (m[tasks[i].first].caps & UCVM_MODEL_CAP_EXCLUSIVE_INIT) {
+      continue;
+    }
+    if (first < 0) {
+      first = i;
+      continue;
+    }
+    if (pthread_create(&(threads[i]), NULL, ucvm_init_worker, 
+		       &(tasks[i])) != 0) {
+      fprintf(stderr, "Failed to start init thread, using caller\n");
+      ucvm_init_worker(&(tasks[i]));
+      threads[i] = pthread_self();
+    }
+  }
+  if (first >= 0) {
+    ucvm_init_worker(&(tasks[first]));
+  }
+  for (i = 0; i < num_tasks; i++) {
+    if (!pthread_equal(threads[i], pthread_self())) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  /* Then the exclusive ones, one after another */
+  for (i = 0; i < num_tasks; i++) {
+    if (m[tasks[i].first].caps & UCVM_MODEL_CAP_EXCLUSIVE_INIT) {
+      ucvm_init_worker(&(tasks[i]));
+    }
+  }
+
+  /* Activate each model and ifunc in list order. On failure the
+     models ahead of it stay enabled */
+  for (i = 0; i < num_models; i++) {
+    if (status[i] != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to init model %s with config '%s' and extconfig '%s'. ", 
+	      mconf[i].label, mconf[i].config, mconf[i].extconfig);
+      fprintf(stderr, 
+	      "Config keys %s_modelpath and/or %s_extmodelpath are likely undefined.\n", 
+	      mconf[i].label, mconf[i].label);
+      fprintf(stderr, "Failed to add parsed model %s\n", models[i]);
+      break;
+    }
+
+    if (ucvm_register_model(&(mconf[i])) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to add parsed model %s\n", models[i]);
+      break;
+    }
       
-      /* Associate optional interp function */
-      if (strlen(ifuncs[i]) > 0) {
-	//fprintf(stderr, "Adding ifunc %s\n", ifuncs[i]);
-	if (ucvm_assoc_ifunc(models[i], ifuncs[i]) != UCVM_CODE_SUCCESS) {
-	  fprintf(stderr, "Failed to add interp func %s for model %s\n", 
-		  ifuncs[i], models[i]);
-	  return(UCVM_CODE_ERROR);
-	}
+    /* Associate optional interp function */
+    if (strlen(ifuncs[i]) > 0) {
+      //fprintf(stderr, "Adding ifunc %s\n", ifuncs[i]);
+      if (ucvm_assoc_ifunc(models[i], ifuncs[i]) != UCVM_CODE_SUCCESS) {
+	fprintf(stderr, "Failed to add interp func %s for model %s\n", 
+		ifuncs[i], models[i]);
+	break;
       }
-    }  
+    }
+  }
+
+  /* Models initialized on other threads but not enabled are undone,
+     so that the list may be retried */
+  if (i < num_models) {
+    ucvm_release_models(base, num_models, status);
+  }
+
+  /* Index the regions of the models now enabled */
+  if (ucvm_build_region_index() != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to build model region index\n");
+    return(UCVM_CODE_ERROR);
   }
   
+  if (i < num_models) {
+    return(UCVM_CODE_ERROR);
+  }
   return(UCVM_CODE_SUCCESS);
 }
 
 
 /* Enable specific model, by label */
 int ucvm_add_model(const char *label) {
-  int is_predef = 0, is_plugin = 0;
   ucvm_model_t m;
   ucvm_modelconf_t mconf;
-  int retval = UCVM_CODE_ERROR;
-  char key[UCVM_CONFIG_MAX_STR];
-  ucvm_config_t *cfgentry = NULL;
 
   if (ucvm_init_flag == 0) {
     fprintf(stderr, "UCVM not initialized\n");
@@ -313,99 +636,118 @@ int ucvm_add_model(const char *label) {
     return(UCVM_CODE_ERROR);
   }
 
+  if (ucvm_resolve_model(label, &m, &mconf) != UCVM_CODE_SUCCESS) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Register the model */
+  return(ucvm_add_user_model_ext(&m, &mconf));
+}
+
+
+/* Resolve model interface and config, by label */
+int ucvm_resolve_model(const char *label, ucvm_model_t *m, 
+		       ucvm_modelconf_t *mconf) {
+  int is_predef = 0, is_plugin = 0;
+  int retval = UCVM_CODE_ERROR;
+  char key[UCVM_CONFIG_MAX_STR];
+  char rstr[UCVM_CONFIG_MAX_STR];
+  ucvm_config_t *cfgentry = NULL;
+
   /* Setup model conf */
-  memset(&mconf, 0, sizeof(ucvm_modelconf_t));
-  ucvm_strcpy(mconf.label, label, UCVM_MAX_LABEL_LEN);
+  memset(m, 0, sizeof(ucvm_model_t));
+  memset(mconf, 0, sizeof(ucvm_modelconf_t));
+  ucvm_strcpy(mconf->label, label, UCVM_MAX_LABEL_LEN);
 
   /* Lookup predefined models */
   /* Crustal models */
   if (strcmp(label, UCVM_MODEL_CVMS) == 0) {
 #ifdef _UCVM_ENABLE_CVMS
-    retval = ucvm_cvms_get_model(&m);
+    retval = ucvm_cvms_get_model(m);
 #endif
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_CVMH) == 0) {
 #ifdef _UCVM_ENABLE_CVMH
-    retval = ucvm_cvmh_get_model(&m);
+    retval = ucvm_cvmh_get_model(m);
 #endif
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_CENCAL) == 0) {
 #ifdef _UCVM_ENABLE_CENCAL
-    retval = ucvm_cencal_get_model(&m);
+    retval = ucvm_cencal_get_model(m);
 #endif
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_CVMSI) == 0) {
 #ifdef _UCVM_ENABLE_CVMSI
-    retval = ucvm_cvmsi_get_model(&m);
+    retval = ucvm_cvmsi_get_model(m);
 #endif
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_CVMNCI) == 0) {
 #ifdef _UCVM_ENABLE_CVMNCI
-    retval = ucvm_cvmnci_get_model(&m);
+    retval = ucvm_cvmnci_get_model(m);
 #endif
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_WFCVM) == 0) {
 #ifdef _UCVM_ENABLE_WFCVM
-    retval = ucvm_wfcvm_get_model(&m);
+    retval = ucvm_wfcvm_get_model(m);
 #endif
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_CVMLT) == 0) {
 #ifdef _UCVM_ENABLE_CVMLT
-    retval = ucvm_cvmlt_get_model(&m);
+    retval = ucvm_cvmlt_get_model(m);
 #endif
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_CMRG) == 0) {
 #ifdef _UCVM_ENABLE_CMRG
-    retval = ucvm_cmrg_get_model(&m);
+    retval = ucvm_cmrg_get_model(m);
 #endif
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_TAPE) == 0) {
 #ifdef _UCVM_ENABLE_TAPE
-    retval = ucvm_tape_get_model(&m);
+    retval = ucvm_tape_get_model(m);
 #endif
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_1D) == 0) {
-    retval = ucvm_1d_get_model(&m);
+    retval = ucvm_1d_get_model(m);
     is_predef = 1;
   }
 
   if (strcmp(label, UCVM_MODEL_BBP1D) == 0) {
-    retval = ucvm_bbp1d_get_model(&m);
+    retval = ucvm_bbp1d_get_model(m);
     is_predef = 1;
   }
 
   /* GTL models */
   if (strcmp(label, UCVM_MODEL_ELYGTL) == 0) {
-    retval = ucvm_elygtl_get_model(&m);
+    retval = ucvm_elygtl_get_model(m);
     is_predef = 1;
   }
   
   if (strcmp(label, UCVM_MODEL_1DGTL) == 0) {
-    retval = ucvm_1dgtl_get_model(&m);
+    retval = ucvm_1dgtl_get_model(m);
     is_predef = 1;
   }
 
   /* CMU Etree */
   if (strcmp(label, UCVM_MODEL_CMUETREE) == 0) {
-    retval = ucvm_cmuetree_get_model(&m);
+    retval = ucvm_cmuetree_get_model(m);
     is_predef = 1;
   }
 
@@ -413,12 +755,16 @@ int ucvm_add_model(const char *label) {
   if (retval != UCVM_CODE_SUCCESS && is_predef == 0) {
 	  snprintf(key, UCVM_CONFIG_MAX_STR, "ucvm_install_path");
 	  cfgentry = ucvm_find_name(ucvm_cfg, key);
-	  retval = ucvm_plugin_get_model(cfgentry->value, label, &m);
+	  retval = ucvm_plugin_get_model(cfgentry->value, label, m);
 
 	  //PluginModel *pm = new PluginModel();
 
-	  is_predef = 1;
-	  is_plugin = 1;
+	  /* Only a plugin that loaded takes its config from the install
+	     path, user-defined models below use their modelpath */
+	  if (retval == UCVM_CODE_SUCCESS) {
+	    is_predef = 1;
+	    is_plugin = 1;
+	  }
   }
 
   /* Lookup user-defined model */
@@ -431,10 +777,13 @@ int ucvm_add_model(const char *label) {
     if (cfgentry != NULL) {
       if (strcmp(cfgentry->value, UCVM_MODEL_ETREE) == 0) {
 	/* Get the etree model */
-	retval = ucvm_etree_get_model(&m);
+	retval = ucvm_etree_get_model(m);
       } else if (strcmp(cfgentry->value, UCVM_MODEL_PATCH) == 0) {
 	/* Get the patch model */
-	retval = ucvm_patch_get_model(&m);
+	retval = ucvm_patch_get_model(m);
+      } else if (strcmp(cfgentry->value, UCVM_MODEL_GRID) == 0) {
+	/* Get the grid model */
+	retval = ucvm_grid_get_model(m);
       }
     }
   }
@@ -454,50 +803,74 @@ int ucvm_add_model(const char *label) {
   }
 
   /* Lookup model config */
-  memset(&mconf, 0, sizeof(ucvm_modelconf_t));
-  ucvm_strcpy(mconf.label, label, UCVM_MAX_LABEL_LEN);
+  memset(mconf, 0, sizeof(ucvm_modelconf_t));
+  ucvm_strcpy(mconf->label, label, UCVM_MAX_LABEL_LEN);
+
+  snprintf(key, UCVM_CONFIG_MAX_STR, "%s_region", label);
+  cfgentry = ucvm_find_name(ucvm_cfg, key);
+  if (cfgentry != NULL) {
+    /* Parsing tokenizes, so keep the config value intact */
+    ucvm_strcpy(rstr, cfgentry->value, UCVM_CONFIG_MAX_STR);
+    if (region_parse(rstr, &(mconf->region)) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Invalid region '%s' for model %s\n", 
+	      cfgentry->value, label);
+      return(UCVM_CODE_ERROR);
+    }
+  }
 
   if (is_plugin) {
 	  snprintf(key, UCVM_CONFIG_MAX_STR, "ucvm_install_path");
 	  cfgentry = ucvm_find_name(ucvm_cfg, key);
 	  if (cfgentry != NULL) {
-	    ucvm_strcpy(mconf.config, cfgentry->value, UCVM_MAX_PATH_LEN);
+	    ucvm_strcpy(mconf->config, cfgentry->value, UCVM_MAX_PATH_LEN);
 	  }
   } else {
-	  snprintf(key, UCVM_CONFIG_MAX_STR, "%s_region", label);
-	  cfgentry = ucvm_find_name(ucvm_cfg, key);
-	  if (cfgentry != NULL) {
-	    region_parse(cfgentry->value, &(mconf.region));
-	  }
 	  snprintf(key, UCVM_CONFIG_MAX_STR, "%s_modelpath", label);
 	  cfgentry = ucvm_find_name(ucvm_cfg, key);
 	  if (cfgentry != NULL) {
-	    ucvm_strcpy(mconf.config, cfgentry->value, UCVM_MAX_PATH_LEN);
+	    ucvm_strcpy(mconf->config, cfgentry->value, UCVM_MAX_PATH_LEN);
 	  }
 	  snprintf(key, UCVM_CONFIG_MAX_STR, "%s_extmodelpath", label);
 	  cfgentry = ucvm_find_name(ucvm_cfg, key);
 	  if (cfgentry != NULL) {
-	    ucvm_strcpy(mconf.extconfig, cfgentry->value, UCVM_MAX_PATH_LEN);
+	    ucvm_strcpy(mconf->extconfig, cfgentry->value, UCVM_MAX_PATH_LEN);
 	  }
   }
 
-  /* Register the model */
-  return(ucvm_add_user_model(&m, &mconf));
+  return(UCVM_CODE_SUCCESS);
 }
 
 
-/* Enable specific model, by type and ucvm_model_t */
+/* Enable specific model, by the legacy fields of a ucvm_model_t. 
+   Callers may leave the later fields unset, so they are not read */
 int ucvm_add_user_model(ucvm_model_t *m, ucvm_modelconf_t *mconf)
+{
+  ucvm_model_t lm;
+
+  memset(&lm, 0, sizeof(ucvm_model_t));
+  lm.mtype = m->mtype;
+  lm.init = m->init;
+  lm.finalize = m->finalize;
+  lm.getversion = m->getversion;
+  lm.getlabel = m->getlabel;
+  lm.setparam = m->setparam;
+  lm.query = m->query;
+
+  /* The model may read any map value */
+  lm.needs = UCVM_DEFAULT_QUERY_VALS;
+
+  return(ucvm_add_user_model_ext(&lm, mconf));
+}
+
+
+/* Enable specific model, by a complete ucvm_model_t */
+int ucvm_add_user_model_ext(ucvm_model_t *m, ucvm_modelconf_t *mconf)
 {
   int i, mmax;
   ucvm_model_t *mptr;
   ucvm_model_t *mlist;
   char mlabel[UCVM_MAX_LABEL_LEN];
-  char key[UCVM_CONFIG_MAX_STR];
-  char param[UCVM_CONFIG_MAX_STR];
-  char setting[UCVM_CONFIG_MAX_STR];
-  char *flag[2];
-  ucvm_config_t *cfgentry = NULL;
+  unsigned long long t0;
 
   if (ucvm_init_flag == 0) {
     fprintf(stderr, "UCVM not initialized\n");
@@ -527,6 +900,7 @@ int ucvm_add_user_model(ucvm_model_t *m, ucvm_modelconf_t *mconf)
   memcpy(mptr, m, sizeof(ucvm_model_t));
 
   /* Perform init */
+  t0 = ucvm_stat_clock();
   if ((mptr->init)(mmax, mconf) != UCVM_CODE_SUCCESS) {
     fprintf(stderr, "Failed to init model %s with config '%s' and extconfig '%s'. ", 
 	    mconf->label, mconf->config, mconf->extconfig);
@@ -536,6 +910,39 @@ int ucvm_add_user_model(ucvm_model_t *m, ucvm_modelconf_t *mconf)
 
     return(UCVM_CODE_ERROR);
   }
+  ucvm_model_init_ns[mmax] = ucvm_stat_clock() - t0;
+
+  return(ucvm_register_model(mconf));
+}
+
+
+/* Activate an initialized model at the end of the active list */
+int ucvm_register_model(ucvm_modelconf_t *mconf)
+{
+  int i, mmax;
+  ucvm_model_t *mptr;
+  char key[UCVM_CONFIG_MAX_STR];
+  char param[UCVM_CONFIG_MAX_STR];
+  char setting[UCVM_CONFIG_MAX_STR];
+  char *flag[2];
+  ucvm_config_t *cfgentry = NULL;
+
+  mmax = ucvm_num_models;
+  mptr = &(ucvm_model_list[mmax]);
+
+  /* Keep the model region, with corners ordered, for the index */
+  ucvm_model_region[mmax] = mconf->region;
+  ucvm_model_region[mmax].p1[0] = fmin(mconf->region.p1[0], 
+				       mconf->region.p2[0]);
+  ucvm_model_region[mmax].p1[1] = fmin(mconf->region.p1[1], 
+				       mconf->region.p2[1]);
+  ucvm_model_region[mmax].p2[0] = fmax(mconf->region.p1[0], 
+				       mconf->region.p2[0]);
+  ucvm_model_region[mmax].p2[1] = fmax(mconf->region.p1[1], 
+				       mconf->region.p2[1]);
+  ucvm_model_has_region[mmax] = 
+    ((ucvm_model_region[mmax].p1[0] < ucvm_model_region[mmax].p2[0]) &&
+     (ucvm_model_region[mmax].p1[1] < ucvm_model_region[mmax].p2[1]));
 
   /* Activate model so that other API functions will work */
   ucvm_num_models++;
@@ -584,8 +991,9 @@ int ucvm_add_user_model(ucvm_model_t *m, ucvm_modelconf_t *mconf)
     break;
   }
 
-  if ((ucvm_cur_mmode == UCVM_OPMODE_GTL) && 
-      (ucvm_cur_qmode == UCVM_COORD_GEO_ELEV)) {
+  /* Models only force depth for elevation queries, so the flag 
+     follows the query mode of each context */
+  if (ucvm_cur_mmode == UCVM_OPMODE_GTL) {
     /* Set force depth flag for all active models */
     for (i = 0; i < ucvm_num_models; i++) {
       mptr = &(ucvm_model_list[i]);
@@ -607,6 +1015,9 @@ int ucvm_assoc_ifunc(const char *mlabel, const char *ilabel)
 {
   ucvm_ifunc_t ifunc;
 
+  /* The built-in functions only read depth and model properties */
+  memset(&ifunc, 0, sizeof(ucvm_ifunc_t));
+
   if (ucvm_init_flag == 0) {
     fprintf(stderr, "UCVM not initialized\n");
     return(UCVM_CODE_ERROR);
@@ -627,12 +1038,30 @@ int ucvm_assoc_ifunc(const char *mlabel, const char *ilabel)
   }
 
   /* Register the model */
-  return(ucvm_assoc_user_ifunc(mlabel, &ifunc));
+  return(ucvm_assoc_user_ifunc_ext(mlabel, &ifunc));
 }
 
 
-/* Associate user-defined interp func with GTL model */
+/* Associate specific interp func with GTL model, by the legacy 
+   fields of a ucvm_ifunc_t */
 int ucvm_assoc_user_ifunc(const char *mlabel, ucvm_ifunc_t *ifunc)
+{
+  ucvm_ifunc_t lf;
+
+  memset(&lf, 0, sizeof(ucvm_ifunc_t));
+  ucvm_strcpy(lf.label, ifunc->label, UCVM_MAX_LABEL_LEN);
+  lf.interp = ifunc->interp;
+
+  /* The function may read any map value */
+  lf.needs = UCVM_DEFAULT_QUERY_VALS;
+
+  return(ucvm_assoc_user_ifunc_ext(mlabel, &lf));
+}
+
+
+/* Associate specific interp func with GTL model, by a complete 
+   ucvm_ifunc_t */
+int ucvm_assoc_user_ifunc_ext(const char *mlabel, ucvm_ifunc_t *ifunc)
 {
   int i, mmax;
   ucvm_model_t *mptr;
@@ -652,6 +1081,7 @@ int ucvm_assoc_user_ifunc(const char *mlabel, ucvm_ifunc_t *ifunc)
       ucvm_strcpy(ucvm_ifunc_list[i].label, ifunc->label, 
 		  UCVM_MAX_LABEL_LEN);
       ucvm_ifunc_list[i].interp = ifunc->interp;
+      ucvm_ifunc_list[i].needs = ifunc->needs;
       return(UCVM_CODE_SUCCESS);
     }
   }
@@ -666,6 +1096,7 @@ int ucvm_assoc_user_ifunc(const char *mlabel, ucvm_ifunc_t *ifunc)
 int ucvm_use_map(const char *label) {
   char key[UCVM_CONFIG_MAX_STR];
   ucvm_config_t *cfgentry = NULL;
+  const char *iface;
 
   if (ucvm_init_flag == 0) {
     fprintf(stderr, "UCVM not initialized\n");
@@ -678,19 +1109,23 @@ int ucvm_use_map(const char *label) {
     snprintf(key, UCVM_CONFIG_MAX_STR, "%s_interface", label);
     cfgentry = ucvm_find_name(ucvm_cfg, key);
     if (cfgentry != NULL) {
-      if (strcmp(cfgentry->value, UCVM_MAP_ETREE) == 0) {
+      if ((strcmp(cfgentry->value, UCVM_MAP_ETREE) == 0) ||
+	  (strcmp(cfgentry->value, UCVM_MAP_RASTER) == 0)) {
+	iface = cfgentry->value;
 	/* Lookup mappath */
 	snprintf(key, UCVM_CONFIG_MAX_STR, "%s_mappath", label);
 	cfgentry = ucvm_find_name(ucvm_cfg, key);
 	if (cfgentry != NULL) {
 	  /* Finalize old map */
+	  ucvm_free_thread_ctx();
 	  ucvm_map_finalize();
 	  /* Initialize new map */
-	  if (ucvm_map_init(label, cfgentry->value) 
+	  if (ucvm_map_init(label, iface, cfgentry->value) 
 	      != UCVM_CODE_SUCCESS) {
 	    fprintf(stderr, "Failed to initialize map %s\n", label);
 	    return(UCVM_CODE_ERROR);
 	  }
+	  ucvm_map_params(label);
 	} else {
 	  fprintf(stderr, "Map %s is not a valid map. ", label);
 	  fprintf(stderr, "Config key %s_mappath not defined.\n", 
@@ -775,6 +1210,13 @@ int ucvm_ifunc_label(int f, char *label, int len)
 }
 
 
+/* Get number of enabled models */
+int ucvm_get_num_models()
+{
+  return(ucvm_num_models);
+}
+
+
 /* Get version for a model */
 int ucvm_model_version(int m, char *ver, int len)
 {
@@ -803,6 +1245,51 @@ int ucvm_model_version(int m, char *ver, int len)
 }
 
 
+/* Set context query parameters from argument list */
+int ucvm_ctx_vsetparam(ucvm_ctx_t *ctx, ucvm_param_t param, va_list ap)
+{
+  double dval, dval2;
+  int ival;
+
+  switch (param) {
+  case UCVM_PARAM_QUERY_MODE:
+    ctx->qmode = va_arg(ap, int);
+    break;
+  case UCVM_PARAM_IFUNC_ZRANGE:
+    dval = va_arg(ap, double);
+    dval2 = va_arg(ap, double);
+    if (dval > dval2) {
+      fprintf(stderr, "Interp min depth greater than max depth\n");
+      return(UCVM_CODE_ERROR);
+    }
+    if ((dval < 0.0) || (dval2 < 0.0)) {
+      fprintf(stderr, "Interp depth range must be positive\n");
+      return(UCVM_CODE_ERROR);
+    }
+    ctx->interp_zmin = dval;
+    ctx->interp_zmax = dval2;
+    break;
+  case UCVM_PARAM_QUERY_TILE:
+    ival = va_arg(ap, int);
+    if (ival < 0) {
+      fprintf(stderr, "Query tile size must not be negative\n");
+      return(UCVM_CODE_ERROR);
+    }
+    ctx->tile = ival;
+    break;
+  case UCVM_PARAM_QUERY_VALS:
+    ctx->vals = va_arg(ap, int);
+    break;
+  default:
+    fprintf(stderr, "Unsupported context param %d\n", param);
+    return(UCVM_CODE_ERROR);
+    break;
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Set parameters */
 int ucvm_setparam(ucvm_param_t param, ...)
 {
@@ -810,9 +1297,10 @@ int ucvm_setparam(ucvm_param_t param, ...)
   ucvm_model_t *mptr;
   char mlabel[UCVM_MAX_LABEL_LEN];
   va_list ap;
-  double dval, dval2;
   char *str, *str2, *str3;
-  int new_flag;
+  int ival;
+  double dval, dval2;
+  int retval = UCVM_CODE_SUCCESS;
 
   if (ucvm_init_flag == 0) {
     fprintf(stderr, "UCVM not initialized\n");
@@ -822,40 +1310,29 @@ int ucvm_setparam(ucvm_param_t param, ...)
   va_start(ap, param);
   switch (param) {
   case UCVM_PARAM_QUERY_MODE:
-    ucvm_cur_qmode = va_arg(ap, int);
-    if (ucvm_cur_mmode == UCVM_OPMODE_GTL) {
-      if (ucvm_cur_qmode == UCVM_COORD_GEO_ELEV) {
-	/* Set force depth flag for all active models */
-	new_flag = 1;
-      } else {
-	/* Clear force depth flag for all active models */
-	new_flag = 0;
-      }
-      for (i = 0; i < ucvm_num_models; i++) {
-	mptr = &(ucvm_model_list[i]);
-	mptr->getlabel(i, mlabel, UCVM_MAX_LABEL_LEN);
-	if (mptr->setparam(i, UCVM_MODEL_PARAM_FORCE_DEPTH_ABOVE_SURF, 
-			   new_flag) != 0) {
-	  fprintf(stderr, "Failed to set force depth flag for model %s\n", 
-		  mlabel);
-	  return(UCVM_CODE_ERROR);
-	}
-      }
-    }
-    break;
   case UCVM_PARAM_IFUNC_ZRANGE:
+  case UCVM_PARAM_QUERY_TILE:
+  case UCVM_PARAM_QUERY_VALS:
+    retval = ucvm_ctx_vsetparam(&ucvm_cur_ctx, param, ap);
+    break;
+  case UCVM_PARAM_QUERY_CACHE:
+    ival = va_arg(ap, int);
     dval = va_arg(ap, double);
     dval2 = va_arg(ap, double);
-    if (dval > dval2) {
-      fprintf(stderr, "Interp min depth greater than max depth\n");
-      return(UCVM_CODE_ERROR);
+    /* Waits for cached queries in other threads to finish */
+    pthread_rwlock_wrlock(&ucvm_qcache_rwlock);
+    ucvm_qcache_free(&ucvm_qcache);
+    if (ival > 0) {
+      retval = ucvm_qcache_init(&ucvm_qcache, ival, dval, dval2);
+    } else if (ival < 0) {
+      fprintf(stderr, "Query cache size must not be negative\n");
+      retval = UCVM_CODE_ERROR;
     }
-    if ((dval < 0.0) || (dval2 < 0.0)) {
-      fprintf(stderr, "Interp depth range must be positive\n");
-      return(UCVM_CODE_ERROR);
-    }
-    ucvm_interp_zmin = dval;
-    ucvm_interp_zmax = dval2;
+    pthread_rwlock_unlock(&ucvm_qcache_rwlock);
+    break;
+  case UCVM_PARAM_SHARED_MEMORY:
+    ival = va_arg(ap, int);
+    ucvm_shm_setenabled(ival != 0);
     break;
   case UCVM_PARAM_MODEL_CONF:
     str = va_arg(ap, char *);
@@ -879,12 +1356,12 @@ int ucvm_setparam(ucvm_param_t param, ...)
   
   va_end(ap);
 
-  return(UCVM_CODE_SUCCESS);
+  return(retval);
 }
 
 
-/* Query underlying models */
-int ucvm_query(int n, ucvm_point_t *pnt, ucvm_data_t *data)
+/* Create query context */
+int ucvm_ctx_init(ucvm_ctx_t *ctx)
 {
   int i;
   ucvm_model_t *mptr;
@@ -894,27 +1371,922 @@ int ucvm_query(int n, ucvm_point_t *pnt, ucvm_data_t *data)
     return(UCVM_CODE_ERROR);
   }
 
-  if (ucvm_num_models == 0) {
-    fprintf(stderr, "No models enabled\n");
+  if (ctx == NULL) {
     return(UCVM_CODE_ERROR);
   }
 
-  /* Initialize properties array */
-  for (i = 0; i < n; i++) {
-    data[i].surf = 0.0;
-    data[i].vs30 = 0.0;
-    switch (ucvm_cur_qmode) {
-    case UCVM_COORD_GEO_DEPTH:
-      data[i].depth = pnt[i].coord[2];
-      break;
-    case UCVM_COORD_GEO_ELEV:
-      data[i].depth = data[i].surf - pnt[i].coord[2];
-      break;
-    default:
-      fprintf(stderr, "Unsupported coord type\n");
-      return(UCVM_CODE_ERROR);
+  /* Inherit current query settings */
+  memset(ctx, 0, sizeof(ucvm_ctx_t));
+  ctx->qmode = ucvm_cur_ctx.qmode;
+  ctx->interp_zmin = ucvm_cur_ctx.interp_zmin;
+  ctx->interp_zmax = ucvm_cur_ctx.interp_zmax;
+  ctx->tile = ucvm_cur_ctx.tile;
+  ctx->vals = ucvm_cur_ctx.vals;
+
+  /* Private map and model state */
+  if (ucvm_map_ctx_init(&(ctx->mapstate)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to create map state for context\n");
+    return(UCVM_CODE_ERROR);
+  }
+  for (i = 0; i < ucvm_num_models; i++) {
+    mptr = &(ucvm_model_list[i]);
+    ctx->num_models++;
+    if (mptr->ctxinit != NULL) {
+      if ((mptr->ctxinit)(i, &(ctx->mstate[i])) != UCVM_CODE_SUCCESS) {
+	fprintf(stderr, "Failed to create state for model %d\n", i);
+	ucvm_ctx_finalize(ctx);
+	return(UCVM_CODE_ERROR);
+      }
+    }
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Destroy query context */
+int ucvm_ctx_finalize(ucvm_ctx_t *ctx)
+{
+  int i;
+  ucvm_model_t *mptr;
+
+  if ((ctx == NULL) || (ctx == &ucvm_cur_ctx)) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  for (i = 0; i < ctx->num_models; i++) {
+    mptr = &(ucvm_model_list[i]);
+    if ((mptr->ctxfinalize != NULL) && (ctx->mstate[i] != NULL)) {
+      (mptr->ctxfinalize)(i, ctx->mstate[i]);
+    }
+  }
+  if (ctx->mapstate != NULL) {
+    ucvm_map_ctx_finalize(ctx->mapstate);
+  }
+  ucvm_free_scratch(ctx);
+
+  memset(ctx, 0, sizeof(ucvm_ctx_t));
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Set query parameters for a context */
+int ucvm_ctx_setparam(ucvm_ctx_t *ctx, ucvm_param_t param, ...)
+{
+  va_list ap;
+  int retval;
+
+  if (ctx == NULL) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  va_start(ap, param);
+  retval = ucvm_ctx_vsetparam(ctx, param, ap);
+  va_end(ap);
+
+  return(retval);
+}
+
+
+/* Query a single model with the state held by a context */
+int ucvm_query_model(ucvm_ctx_t *ctx, int m, 
+		     int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int retval;
+  ucvm_model_t *mptr;
+
+  mptr = &(ucvm_model_list[m]);
+  if (mptr->ctxquery != NULL) {
+    return((mptr->ctxquery)(m, ctx->mstate[m], ctx->qmode, 
+			    n, pnt, data));
+  }
+
+  if (mptr->caps & UCVM_MODEL_CAP_THREADSAFE) {
+    return((mptr->query)(m, ctx->qmode, n, pnt, data));
+  }
+
+  /* Model keeps global query state, one caller at a time */
+  pthread_mutex_lock(&ucvm_legacy_lock);
+  retval = (mptr->query)(m, ctx->qmode, n, pnt, data);
+  pthread_mutex_unlock(&ucvm_legacy_lock);
+
+  return(retval);
+}
+
+
+/* Free context scratch buffers */
+int ucvm_free_scratch(ucvm_ctx_t *ctx)
+{
+  if (ctx->scratch_idx != NULL) {
+    free(ctx->scratch_idx);
+  }
+  if (ctx->scratch_pnt != NULL) {
+    free(ctx->scratch_pnt);
+  }
+  if (ctx->scratch_data != NULL) {
+    free(ctx->scratch_data);
+  }
+  if (ctx->scratch_mask != NULL) {
+    free(ctx->scratch_mask);
+  }
+  free(ctx->cache_idx);
+  free(ctx->cache_pnt);
+  free(ctx->cache_data);
+  ctx->cache_idx = NULL;
+  ctx->cache_pnt = NULL;
+  ctx->cache_data = NULL;
+  ctx->cache_len = 0;
+  ctx->scratch_idx = NULL;
+  ctx->scratch_pnt = NULL;
+  ctx->scratch_data = NULL;
+  ctx->scratch_mask = NULL;
+  ctx->scratch_len = 0;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Grow context scratch buffers to hold n points */
+int ucvm_grow_scratch(ucvm_ctx_t *ctx, int n)
+{
+  if (n <= ctx->scratch_len) {
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  ucvm_free_scratch(ctx);
+  ctx->scratch_idx = malloc(n * sizeof(int));
+  ctx->scratch_pnt = malloc(n * sizeof(ucvm_point_t));
+  ctx->scratch_data = malloc(n * sizeof(ucvm_data_t));
+  ctx->scratch_mask = malloc(n * sizeof(unsigned int));
+  if ((ctx->scratch_idx == NULL) || (ctx->scratch_pnt == NULL) ||
+      (ctx->scratch_data == NULL) || (ctx->scratch_mask == NULL)) {
+    fprintf(stderr, "Failed to allocate query scratch buffers\n");
+    ucvm_free_scratch(ctx);
+    return(UCVM_CODE_ERROR);
+  }
+  ctx->scratch_len = n;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Determine if a point still needs a value from models of mtype */
+int ucvm_is_unresolved(ucvm_mtype_t mtype, ucvm_data_t *data)
+{
+  if (mtype == UCVM_MODEL_CRUSTAL) {
+    return((data->crust.source == UCVM_SOURCE_NONE) &&
+	   ((data->domain == UCVM_DOMAIN_INTERP) || 
+	    (data->domain == UCVM_DOMAIN_CRUST)));
+  }
+  return((data->gtl.source == UCVM_SOURCE_NONE) &&
+	 ((data->domain == UCVM_DOMAIN_INTERP) || 
+	  (data->domain == UCVM_DOMAIN_GTL)));
+}
+
+
+/* Monotonic clock in ns, for instrumentation */
+unsigned long long ucvm_stat_clock()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+
+/* Add counters to a stat record */
+void ucvm_stat_add(ucvm_stat_t *st, unsigned long long offered,
+		   unsigned long long served, unsigned long long ns)
+{
+  st->calls++;
+  st->offered += offered;
+  st->served += served;
+  st->datagap += offered - served;
+  st->ns += ns;
+}
+
+
+/* Count points still needing a value from models of mtype */
+int ucvm_count_unresolved(ucvm_mtype_t mtype, int n, ucvm_data_t *data)
+{
+  int i, k = 0;
+
+  for (i = 0; i < n; i++) {
+    if (ucvm_is_unresolved(mtype, &(data[i]))) {
+      k++;
+    }
+  }
+
+  return(k);
+}
+
+
+/* Free the model region index */
+int ucvm_free_region_index()
+{
+  if (ucvm_region_index.full != NULL) {
+    free(ucvm_region_index.full);
+  }
+  if (ucvm_region_index.part != NULL) {
+    free(ucvm_region_index.part);
+  }
+  memset(&ucvm_region_index, 0, sizeof(ucvm_region_index_t));
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Build a bucket grid over the extent of the enabled models that 
+   have a configured region, recording per bin which of them cover 
+   it fully or in part */
+int ucvm_build_region_index()
+{
+  int i, b, bx, by;
+  double x0, x1, y0, y1, ex, ey;
+  ucvm_region_t *r;
+  ucvm_region_index_t *ri = &ucvm_region_index;
+
+  ucvm_free_region_index();
+  ri->num_models = ucvm_num_models;
+
+  /* Extent of all model regions */
+  for (i = 0; i < ucvm_num_models; i++) {
+    if (!ucvm_model_has_region[i]) {
+      continue;
+    }
+    r = &(ucvm_model_region[i]);
+    if (ri->regional == 0) {
+      ri->p1[0] = r->p1[0];
+      ri->p1[1] = r->p1[1];
+      ri->p2[0] = r->p2[0];
+      ri->p2[1] = r->p2[1];
+    } else {
+      ri->p1[0] = fmin(ri->p1[0], r->p1[0]);
+      ri->p1[1] = fmin(ri->p1[1], r->p1[1]);
+      ri->p2[0] = fmax(ri->p2[0], r->p2[0]);
+      ri->p2[1] = fmax(ri->p2[1], r->p2[1]);
+    }
+    ri->regional |= 1U << i;
+  }
+  if (ri->regional == 0) {
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  ri->nx = UCVM_REGION_INDEX_BINS;
+  ri->ny = UCVM_REGION_INDEX_BINS;
+  ri->dx = (ri->p2[0] - ri->p1[0]) / ri->nx;
+  ri->dy = (ri->p2[1] - ri->p1[1]) / ri->ny;
+  ri->full = calloc(ri->nx * ri->ny, sizeof(unsigned int));
+  ri->part = calloc(ri->nx * ri->ny, sizeof(unsigned int));
+  if ((ri->full == NULL) || (ri->part == NULL)) {
+    fprintf(stderr, "Failed to allocate region index\n");
+    ucvm_free_region_index();
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Inner bin edges are widened slightly so that a point binned 
+     with rounding error is still inside a fully covering region */
+  ex = ri->dx * 1.0e-6;
+  ey = ri->dy * 1.0e-6;
+  for (by = 0; by < ri->ny; by++) {
+    y0 = ri->p1[1] + by * ri->dy - ((by > 0) ? ey : 0.0);
+    y1 = ri->p1[1] + (by + 1) * ri->dy + ((by < ri->ny - 1) ? ey : 0.0);
+    for (bx = 0; bx < ri->nx; bx++) {
+      x0 = ri->p1[0] + bx * ri->dx - ((bx > 0) ? ex : 0.0);
+      x1 = ri->p1[0] + (bx + 1) * ri->dx + ((bx < ri->nx - 1) ? ex : 0.0);
+      b = by * ri->nx + bx;
+      for (i = 0; i < ucvm_num_models; i++) {
+	if (!ucvm_model_has_region[i]) {
+	  continue;
+	}
+	r = &(ucvm_model_region[i]);
+	if ((r->p1[0] <= x0) && (r->p2[0] >= x1) &&
+	    (r->p1[1] <= y0) && (r->p2[1] >= y1)) {
+	  ri->full[b] |= 1U << i;
+	} else if ((r->p1[0] <= x1) && (r->p2[0] >= x0) &&
+		   (r->p1[1] <= y1) && (r->p2[1] >= y0)) {
+	  ri->part[b] |= 1U << i;
+	}
+      }
+    }
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Get mask of the models whose region contains a point */
+unsigned int ucvm_region_mask(ucvm_point_t *pnt)
+{
+  int i, bx, by, b;
+  unsigned int mask, part;
+  ucvm_region_t *r;
+  ucvm_region_index_t *ri = &ucvm_region_index;
+
+  /* Models without a region take every point */
+  mask = ~(ri->regional);
+  if ((pnt->coord[0] < ri->p1[0]) || (pnt->coord[0] > ri->p2[0]) ||
+      (pnt->coord[1] < ri->p1[1]) || (pnt->coord[1] > ri->p2[1])) {
+    return(mask);
+  }
+
+  bx = (int)((pnt->coord[0] - ri->p1[0]) / ri->dx);
+  by = (int)((pnt->coord[1] - ri->p1[1]) / ri->dy);
+  if (bx >= ri->nx) {
+    bx = ri->nx - 1;
+  }
+  if (by >= ri->ny) {
+    by = ri->ny - 1;
+  }
+  b = by * ri->nx + bx;
+  mask |= ri->full[b];
+
+  /* Test the point against regions crossing its bin */
+  part = ri->part[b];
+  for (i = 0; part != 0; i++, part >>= 1) {
+    if (part & 1) {
+      r = &(ucvm_model_region[i]);
+      if ((pnt->coord[0] >= r->p1[0]) && (pnt->coord[0] <= r->p2[0]) &&
+	  (pnt->coord[1] >= r->p1[1]) && (pnt->coord[1] <= r->p2[1])) {
+	mask |= 1U << i;
+      }
+    }
+  }
+
+  return(mask);
+}
+
+
+/* Move the scratch points inside the region of model m to the 
+   front, returning their count */
+int ucvm_region_partition(ucvm_ctx_t *ctx, int m, int n)
+{
+  int lo, hi, idx;
+  unsigned int bit, mask;
+  ucvm_point_t pnt;
+  ucvm_data_t data;
+
+  bit = 1U << m;
+  if (!(ucvm_region_index.regional & bit)) {
+    return(n);
+  }
+
+  lo = 0;
+  hi = n - 1;
+  while (1) {
+    while ((lo <= hi) && (ctx->scratch_mask[lo] & bit)) {
+      lo++;
+    }
+    while ((lo <= hi) && !(ctx->scratch_mask[hi] & bit)) {
+      hi--;
+    }
+    if (lo >= hi) {
+      break;
+    }
+    idx = ctx->scratch_idx[lo];
+    pnt = ctx->scratch_pnt[lo];
+    data = ctx->scratch_data[lo];
+    mask = ctx->scratch_mask[lo];
+    ctx->scratch_idx[lo] = ctx->scratch_idx[hi];
+    ctx->scratch_pnt[lo] = ctx->scratch_pnt[hi];
+    ctx->scratch_data[lo] = ctx->scratch_data[hi];
+    ctx->scratch_mask[lo] = ctx->scratch_mask[hi];
+    ctx->scratch_idx[hi] = idx;
+    ctx->scratch_pnt[hi] = pnt;
+    ctx->scratch_data[hi] = data;
+    ctx->scratch_mask[hi] = mask;
+    lo++;
+    hi--;
+  }
+
+  return(lo);
+}
+
+
+/* Query the models of one type in priority order. Each model is 
+   handed only the points left unresolved by the models before it 
+   and, when models have configured regions, only those inside its 
+   region */
+int ucvm_query_chain(ucvm_ctx_t *ctx, ucvm_mtype_t mtype,
+		     int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int i, j, k, m, last;
+  int total, remain, whole;
+  int direct, routed;
+  int retval;
+  unsigned long long t0, t1;
+  ucvm_stat_t *stage;
+
+  if (mtype == UCVM_MODEL_CRUSTAL) {
+    stage = &(ctx->stats.stage[UCVM_STAGE_CRUSTAL]);
+  } else {
+    stage = &(ctx->stats.stage[UCVM_STAGE_GTL]);
+  }
+  t0 = ucvm_stat_clock();
+
+  /* Points are queried in place until the batch is partly filled,
+     unless they are routed by model region */
+  total = ucvm_count_unresolved(mtype, n, data);
+  remain = total;
+  routed = (ucvm_region_index.regional != 0);
+  direct = ((total == n) && (!routed));
+  if ((remain > 0) && (!direct)) {
+    if (ucvm_grow_scratch(ctx, remain) != UCVM_CODE_SUCCESS) {
+      return(UCVM_CODE_ERROR);
+    }
+    k = 0;
+    for (j = 0; j < n; j++) {
+      if (ucvm_is_unresolved(mtype, &(data[j]))) {
+	ctx->scratch_idx[k] = j;
+	ctx->scratch_pnt[k] = pnt[j];
+	ctx->scratch_data[k] = data[j];
+	if (routed) {
+	  ctx->scratch_mask[k] = ucvm_region_mask(&(pnt[j]));
+	}
+	k++;
+      }
+    }
+  }
+
+  last = -1;
+  for (i = 0; i < ucvm_num_models; i++) {
+    if (ucvm_model_list[i].mtype == mtype) {
+      last = i;
+    }
+  }
+
+  for (i = 0; (i <= last) && (remain > 0); i++) {
+    if (ucvm_model_list[i].mtype != mtype) {
+      continue;
+    }
+
+    /* Skip the model if no point is inside its region */
+    m = remain;
+    if (routed) {
+      m = ucvm_region_partition(ctx, i, remain);
+      if (m == 0) {
+	continue;
+      }
+    }
+
+    t1 = ucvm_stat_clock();
+    if (direct) {
+      retval = ucvm_query_model(ctx, i, n, pnt, data);
+      k = ucvm_count_unresolved(mtype, n, data);
+
+      /* Compact what is left for the next model */
+      if ((k > 0) && (k < n) && (i < last) && 
+	  (retval != UCVM_CODE_SUCCESS)) {
+	if (ucvm_grow_scratch(ctx, k) != UCVM_CODE_SUCCESS) {
+	  return(UCVM_CODE_ERROR);
+	}
+	k = 0;
+	for (j = 0; j < n; j++) {
+	  if (ucvm_is_unresolved(mtype, &(data[j]))) {
+	    ctx->scratch_idx[k] = j;
+	    ctx->scratch_pnt[k] = pnt[j];
+	    ctx->scratch_data[k] = data[j];
+	    k++;
+	  }
+	}
+	direct = 0;
+      }
+    } else {
+      retval = ucvm_query_model(ctx, i, m, ctx->scratch_pnt, 
+				ctx->scratch_data);
+
+      /* Return resolved points, keep the rest for the next model */
+      k = 0;
+      for (j = 0; j < remain; j++) {
+	if (ucvm_is_unresolved(mtype, &(ctx->scratch_data[j]))) {
+	  if (k != j) {
+	    ctx->scratch_idx[k] = ctx->scratch_idx[j];
+	    ctx->scratch_pnt[k] = ctx->scratch_pnt[j];
+	    ctx->scratch_data[k] = ctx->scratch_data[j];
+	    ctx->scratch_mask[k] = ctx->scratch_mask[j];
+	  }
+	  k++;
+	} else {
+	  data[ctx->scratch_idx[j]] = ctx->scratch_data[j];
+	}
+      }
+    }
+    ucvm_stat_add(&(ctx->stats.model[i]), m, remain - k, 
+		  ucvm_stat_clock() - t1);
+    whole = (m == remain);
+    remain = k;
+
+    if ((retval == UCVM_CODE_SUCCESS) && (whole)) {
       break;
     }
+  }
+
+  /* Return points no model could resolve */
+  if (!direct) {
+    for (j = 0; j < remain; j++) {
+      data[ctx->scratch_idx[j]] = ctx->scratch_data[j];
+    }
+  }
+
+  ucvm_stat_add(stage, total, total - remain, ucvm_stat_clock() - t0);
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Get query instrumentation */
+int ucvm_get_stats(ucvm_stats_t *stats)
+{
+  int i, j;
+  ucvm_stat_t *dst, *src;
+  ucvm_ctx_t *ctx;
+
+  if (stats == NULL) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  memcpy(stats, &(ucvm_cur_ctx.stats), sizeof(ucvm_stats_t));
+  for (i = 0; i < ucvm_num_tctx; i++) {
+    ctx = &(ucvm_tctx[i]);
+    for (j = 0; j < UCVM_MAX_STAGES + UCVM_MAX_MODELS; j++) {
+      if (j < UCVM_MAX_STAGES) {
+	dst = &(stats->stage[j]);
+	src = &(ctx->stats.stage[j]);
+      } else {
+	dst = &(stats->model[j - UCVM_MAX_STAGES]);
+	src = &(ctx->stats.model[j - UCVM_MAX_STAGES]);
+      }
+      dst->calls += src->calls;
+      dst->offered += src->offered;
+      dst->served += src->served;
+      dst->datagap += src->datagap;
+      dst->skipped += src->skipped;
+      dst->ns += src->ns;
+      dst->cache_hits += src->cache_hits;
+      dst->cache_misses += src->cache_misses;
+    }
+  }
+
+  /* Cache counters are kept by the models */
+  for (i = 0; i < ucvm_num_models; i++) {
+    if (ucvm_model_list[i].cachestats != NULL) {
+      ucvm_model_list[i].cachestats(i, 0, 
+				    &(stats->model[i].cache_hits),
+				    &(stats->model[i].cache_misses));
+    }
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Zero query instrumentation */
+int ucvm_reset_stats()
+{
+  int i;
+
+  memset(&(ucvm_cur_ctx.stats), 0, sizeof(ucvm_stats_t));
+  for (i = 0; i < ucvm_num_tctx; i++) {
+    memset(&(ucvm_tctx[i].stats), 0, sizeof(ucvm_stats_t));
+  }
+  for (i = 0; i < ucvm_num_models; i++) {
+    if (ucvm_model_list[i].cachestats != NULL) {
+      ucvm_model_list[i].cachestats(i, 1, NULL, NULL);
+    }
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Get model init wall times */
+int ucvm_get_init_times(unsigned long long *ns, int *len)
+{
+  int i;
+
+  if ((ns == NULL) || (len == NULL) || (*len < ucvm_num_models)) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  for (i = 0; i < ucvm_num_models; i++) {
+    ns[i] = ucvm_model_init_ns[i];
+  }
+  *len = ucvm_num_models;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Get result cache counters, over all contexts */
+int ucvm_get_cache_stats(unsigned long long *hits, 
+			 unsigned long long *misses, int *entries)
+{
+  int retval;
+
+  pthread_rwlock_rdlock(&ucvm_qcache_rwlock);
+  retval = ucvm_qcache_stats(&ucvm_qcache, hits, misses, entries);
+  pthread_rwlock_unlock(&ucvm_qcache_rwlock);
+
+  return(retval);
+}
+
+/* Free per-thread contexts */
+int ucvm_free_thread_ctx()
+{
+  int i;
+
+  /* Keep the counters of the threads */
+  if (ucvm_num_tctx > 0) {
+    ucvm_get_stats(&(ucvm_cur_ctx.stats));
+  }
+
+  for (i = 0; i < ucvm_num_tctx; i++) {
+    ucvm_ctx_finalize(&(ucvm_tctx[i]));
+  }
+  if (ucvm_tctx != NULL) {
+    free(ucvm_tctx);
+  }
+  ucvm_tctx = NULL;
+  ucvm_num_tctx = 0;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Create per-thread contexts for the current model list */
+int ucvm_setup_thread_ctx(int nt)
+{
+  int i;
+
+  if ((ucvm_num_tctx == nt) && 
+      (ucvm_tctx[0].num_models == ucvm_num_models)) {
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  ucvm_free_thread_ctx();
+  ucvm_tctx = malloc(nt * sizeof(ucvm_ctx_t));
+  if (ucvm_tctx == NULL) {
+    fprintf(stderr, "Failed to allocate thread contexts\n");
+    return(UCVM_CODE_ERROR);
+  }
+  for (i = 0; i < nt; i++) {
+    if (ucvm_ctx_init(&(ucvm_tctx[i])) != UCVM_CODE_SUCCESS) {
+      ucvm_num_tctx = i;
+      ucvm_free_thread_ctx();
+      return(UCVM_CODE_ERROR);
+    }
+  }
+  ucvm_num_tctx = nt;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Determine if all enabled models may be queried concurrently */
+int ucvm_is_threadsafe()
+{
+  int i;
+
+  if ((ucvm_init_flag == 0) || (ucvm_num_models == 0)) {
+    return(0);
+  }
+  for (i = 0; i < ucvm_num_models; i++) {
+    if (!(ucvm_model_list[i].caps & UCVM_MODEL_CAP_THREADSAFE)) {
+      return(0);
+    }
+  }
+
+  return(1);
+}
+
+
+#ifdef _OPENMP
+/* Query underlying models in parallel chunks, one context per thread */
+int ucvm_query_parallel(int vals, int n, ucvm_point_t *pnt, 
+			ucvm_data_t *data)
+{
+  int c, nc, nt;
+  int retval = UCVM_CODE_SUCCESS;
+
+  nt = omp_get_max_threads();
+  if (ucvm_setup_thread_ctx(nt) != UCVM_CODE_SUCCESS) {
+    return(ucvm_query_ctx_vals(&ucvm_cur_ctx, vals, n, pnt, data));
+  }
+
+  /* Threads use the current query settings */
+  for (c = 0; c < nt; c++) {
+    ucvm_tctx[c].qmode = ucvm_cur_ctx.qmode;
+    ucvm_tctx[c].interp_zmin = ucvm_cur_ctx.interp_zmin;
+    ucvm_tctx[c].interp_zmax = ucvm_cur_ctx.interp_zmax;
+    ucvm_tctx[c].tile = ucvm_cur_ctx.tile;
+    ucvm_tctx[c].vals = vals;
+  }
+
+  nc = (n + UCVM_PARALLEL_CHUNK - 1) / UCVM_PARALLEL_CHUNK;
+#pragma omp parallel for schedule(dynamic) num_threads(nt)
+  for (c = 0; c < nc; c++) {
+    int start = c * UCVM_PARALLEL_CHUNK;
+    int len = UCVM_PARALLEL_CHUNK;
+    if (start + len > n) {
+      len = n - start;
+    }
+    if (ucvm_query_ctx_vals(&(ucvm_tctx[omp_get_thread_num()]), vals, 
+			    len, &(pnt[start]), 
+			    &(data[start])) != UCVM_CODE_SUCCESS) {
+#pragma omp atomic write
+      retval = UCVM_CODE_ERROR;
+    }
+  }
+
+  return(retval);
+}
+#endif
+
+
+/* Query a batch for the map values in vals. Batches on the global
+   settings may be split across threads */
+int ucvm_query_batch(ucvm_ctx_t *ctx, int vals, int n, 
+		     ucvm_point_t *pnt, ucvm_data_t *data)
+{
+#ifdef _OPENMP
+  /* Split large batches across threads if all models allow it */
+  if ((ctx == &ucvm_cur_ctx) && 
+      (n >= 2 * UCVM_PARALLEL_CHUNK) && (!omp_in_parallel()) &&
+      (omp_get_max_threads() > 1) && (ucvm_is_threadsafe())) {
+    return(ucvm_query_parallel(vals, n, pnt, data));
+  }
+#endif
+
+  return(ucvm_query_ctx_vals(ctx, vals, n, pnt, data));
+}
+
+
+/* Query underlying models */
+int ucvm_query(int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  return(ucvm_query_batch(&ucvm_cur_ctx, ucvm_cur_ctx.vals, n, pnt, data));
+}
+
+
+/* Query underlying models with SoA input/output */
+int ucvm_query_soa(int n, const double *lon, const double *lat,
+		   const double *z, ucvm_soa_t *out)
+{
+  return(ucvm_query_soa_ctx(&ucvm_cur_ctx, n, lon, lat, z, out));
+}
+
+
+/* Query underlying models with SoA input/output using a context */
+int ucvm_query_soa_ctx(ucvm_ctx_t *ctx, int n, const double *lon, 
+		       const double *lat, const double *z, 
+		       ucvm_soa_t *out)
+{
+  int i, b, nb, vals;
+  ucvm_point_t *pnt;
+  ucvm_data_t *data;
+
+  if ((ctx == NULL) || (lon == NULL) || (lat == NULL) || (z == NULL) || 
+      (out == NULL)) {
+    fprintf(stderr, "Invalid SoA query arguments\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Query through a fixed size AoS block */
+  nb = n;
+  if (nb > UCVM_SOA_BLOCK) {
+    nb = UCVM_SOA_BLOCK;
+  }
+  if (nb <= 0) {
+    return(UCVM_CODE_SUCCESS);
+  }
+  pnt = malloc(nb * sizeof(ucvm_point_t));
+  data = malloc(nb * sizeof(ucvm_data_t));
+  if ((pnt == NULL) || (data == NULL)) {
+    fprintf(stderr, "Failed to allocate SoA query buffers\n");
+    free(pnt);
+    free(data);
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Only look up the map values asked for */
+  vals = 0;
+  if (out->surf != NULL) {
+    vals |= UCVM_VAL_SURF;
+  }
+  if (out->vs30 != NULL) {
+    vals |= UCVM_VAL_VS30;
+  }
+
+  for (b = 0; b < n; b += nb) {
+    if (b + nb > n) {
+      nb = n - b;
+    }
+    for (i = 0; i < nb; i++) {
+      pnt[i].coord[0] = lon[b + i];
+      pnt[i].coord[1] = lat[b + i];
+      pnt[i].coord[2] = z[b + i];
+    }
+
+    if (ucvm_query_batch(ctx, vals, nb, pnt, data) != UCVM_CODE_SUCCESS) {
+      free(pnt);
+      free(data);
+      return(UCVM_CODE_ERROR);
+    }
+
+    /* Scatter requested columns */
+    if (out->surf != NULL) {
+      for (i = 0; i < nb; i++) {
+	out->surf[b + i] = data[i].surf;
+      }
+    }
+    if (out->vs30 != NULL) {
+      for (i = 0; i < nb; i++) {
+	out->vs30[b + i] = data[i].vs30;
+      }
+    }
+    if (out->depth != NULL) {
+      for (i = 0; i < nb; i++) {
+	out->depth[b + i] = data[i].depth;
+      }
+    }
+    if (out->vp != NULL) {
+      for (i = 0; i < nb; i++) {
+	out->vp[b + i] = data[i].cmb.vp;
+      }
+    }
+    if (out->vs != NULL) {
+      for (i = 0; i < nb; i++) {
+	out->vs[b + i] = data[i].cmb.vs;
+      }
+    }
+    if (out->rho != NULL) {
+      for (i = 0; i < nb; i++) {
+	out->rho[b + i] = data[i].cmb.rho;
+      }
+    }
+    if (out->crust_source != NULL) {
+      for (i = 0; i < nb; i++) {
+	out->crust_source[b + i] = data[i].crust.source;
+      }
+    }
+    if (out->gtl_source != NULL) {
+      for (i = 0; i < nb; i++) {
+	out->gtl_source[b + i] = data[i].gtl.source;
+      }
+    }
+    if (out->cmb_source != NULL) {
+      for (i = 0; i < nb; i++) {
+	out->cmb_source[b + i] = data[i].cmb.source;
+      }
+    }
+  }
+
+  free(pnt);
+  free(data);
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Check that a context may be queried */
+int ucvm_query_check(ucvm_ctx_t *ctx)
+{
+  if (ucvm_init_flag == 0) {
+    fprintf(stderr, "UCVM not initialized\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  if (ucvm_num_models == 0) {
+    fprintf(stderr, "No models enabled\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  if ((ctx != &ucvm_cur_ctx) && (ctx->num_models != ucvm_num_models)) {
+    fprintf(stderr, "Context was created with a different model list\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  switch (ctx->qmode) {
+  case UCVM_COORD_GEO_DEPTH:
+  case UCVM_COORD_GEO_ELEV:
+    break;
+  default:
+    fprintf(stderr, "Unsupported coord type\n");
+    return(UCVM_CODE_ERROR);
+    break;
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Initialize properties array */
+void ucvm_clear_data(int n, ucvm_data_t *data)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    data[i].surf = 0.0;
+    data[i].vs30 = 0.0;
+    data[i].depth = 0.0;
     data[i].domain = UCVM_DOMAIN_CRUST;
     data[i].shift_cr = 0.0;
     data[i].shift_gtl = 0.0;
@@ -932,49 +2304,41 @@ int ucvm_query(int n, ucvm_point_t *pnt, ucvm_data_t *data)
     data[i].cmb.rho = 0.0;
   }
 
-  /* Query map model */
-  if (ucvm_map_query(ucvm_cur_qmode, n, pnt, data) != 
-      UCVM_CODE_SUCCESS) {
-    fprintf(stderr, "Failed to query UCVM map\n");
-    return(UCVM_CODE_ERROR);
-  }
+  return;
+}
+
+
+/* Query the models and interpolate points whose surface and vs30 
+   are already set. Returns the number of points interpolated */
+int ucvm_query_stages(ucvm_ctx_t *ctx, int n, ucvm_point_t *pnt, 
+		      ucvm_data_t *data)
+{
+  int i, nserved;
+  unsigned long long t1;
 
   /* Compute derived values */
   for (i = 0; i < n; i++) {
-    ucvm_get_model_vals(&(pnt[i]), &(data[i]));
-  }
-
-  /* Query crustal models */
-  for (i = 0; i < ucvm_num_models; i++) {
-    mptr = &(ucvm_model_list[i]);
-    if (mptr->mtype == UCVM_MODEL_CRUSTAL) {
-      if ((mptr->query)(i, ucvm_cur_qmode, n, pnt, data) == 
-	  UCVM_CODE_SUCCESS) {
-	break;
-      }
-    }
+    ucvm_get_model_vals(ctx, &(pnt[i]), &(data[i]));
   }
 
-  /* Query GTLs */
-  for (i = 0; i < ucvm_num_models; i++) {
-    mptr = &(ucvm_model_list[i]);
-    if (mptr->mtype == UCVM_MODEL_GTL) {
-      if ((mptr->query)(i, ucvm_cur_qmode, n, pnt, data) == 
-	  UCVM_CODE_SUCCESS) {
-	break;
-      }
-    }
+  /* Query crustal models, then GTLs */
+  if ((ucvm_query_chain(ctx, UCVM_MODEL_CRUSTAL, n, pnt, data) != 
+       UCVM_CODE_SUCCESS) ||
+      (ucvm_query_chain(ctx, UCVM_MODEL_GTL, n, pnt, data) != 
+       UCVM_CODE_SUCCESS)) {
+    return(-1);
   }
 
   /* Attempt interpolation depending on operating mode */
+  t1 = ucvm_stat_clock();
   switch (ucvm_cur_mmode) {
   case UCVM_OPMODE_CRUSTAL:
     for (i = 0; i < n; i++) {
       if ((data[i].domain == UCVM_DOMAIN_CRUST) &&
 	  (data[i].crust.source != UCVM_SOURCE_NONE)) {
-	ucvm_ifunc_list[data[i].crust.source].interp(ucvm_interp_zmin, 
-						   ucvm_interp_zmax, 
-						   ucvm_cur_qmode,
+	ucvm_ifunc_list[data[i].crust.source].interp(ctx->interp_zmin, 
+						   ctx->interp_zmax, 
+						   ctx->qmode,
 						   &(pnt[i]), 
 						   &(data[i]));
       }
@@ -983,16 +2347,16 @@ int ucvm_query(int n, ucvm_point_t *pnt, ucvm_data_t *data)
   case UCVM_OPMODE_GTL:
     for (i = 0; i < n; i++) {
       if (data[i].gtl.source != UCVM_SOURCE_NONE) {
-	ucvm_ifunc_list[data[i].gtl.source].interp(ucvm_interp_zmin, 
-						   ucvm_interp_zmax, 
-						   ucvm_cur_qmode,
+	ucvm_ifunc_list[data[i].gtl.source].interp(ctx->interp_zmin, 
+						   ctx->interp_zmax, 
+						   ctx->qmode,
 						   &(pnt[i]), 
 						   &(data[i]));
       } else if ((data[i].domain == UCVM_DOMAIN_CRUST) &&
 		 (data[i].crust.source != UCVM_SOURCE_NONE)) {
-	ucvm_ifunc_list[data[i].crust.source].interp(ucvm_interp_zmin, 
-						     ucvm_interp_zmax, 
-						     ucvm_cur_qmode,
+	ucvm_ifunc_list[data[i].crust.source].interp(ctx->interp_zmin, 
+						     ctx->interp_zmax, 
+						     ctx->qmode,
 						     &(pnt[i]), 
 						     &(data[i]));
       }
@@ -1001,11 +2365,364 @@ int ucvm_query(int n, ucvm_point_t *pnt, ucvm_data_t *data)
   default:
     break;
   }
+
+  nserved = 0;
+  for (i = 0; i < n; i++) {
+    if (data[i].cmb.source != UCVM_SOURCE_NONE) {
+      nserved++;
+    }
+  }
+  ucvm_stat_add(&(ctx->stats.stage[UCVM_STAGE_INTERP]), n, nserved,
+		ucvm_stat_clock() - t1);
+
+  return(nserved);
+}
+
+
+/* Get the map values a context query needs: those read by the 
+   caller (vals) and by the enabled models and interp funcs, and the 
+   surface in elevation mode to compute depths */
+int ucvm_query_vals(ucvm_ctx_t *ctx, int vals)
+{
+  int i;
+
+  if (ctx->qmode == UCVM_COORD_GEO_ELEV) {
+    vals |= UCVM_VAL_SURF;
+  }
+  for (i = 0; i < ucvm_num_models; i++) {
+    vals |= ucvm_model_list[i].needs;
+    if (ucvm_ifunc_list[i].interp != NULL) {
+      vals |= ucvm_ifunc_list[i].needs;
+    }
+  }
+
+  return(vals);
+}
+
+
+/* Run all query stages over one tile of points. The map is skipped
+   if no map values are needed. Returns the number of points 
+   interpolated */
+int ucvm_query_tile(ucvm_ctx_t *ctx, int vals, int n, 
+		    ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  unsigned long long t1;
+
+  ucvm_clear_data(n, data);
+
+  /* Query map model */
+  if (vals != 0) {
+    t1 = ucvm_stat_clock();
+    if (ucvm_map_ctx_query(ctx->mapstate, ctx->qmode, n, pnt, data) != 
+	UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to query UCVM map\n");
+      return(-1);
+    }
+    /* Map misses are not datagaps, so all points count as served */
+    ucvm_stat_add(&(ctx->stats.stage[UCVM_STAGE_MAP]), n, n,
+		  ucvm_stat_clock() - t1);
+  } else {
+    ctx->stats.stage[UCVM_STAGE_MAP].skipped += n;
+  }
+
+  return(ucvm_query_stages(ctx, n, pnt, data));
+}
+
+
+/* Query points through all stages one tile at a time, so that a 
+   tile of ucvm_data_t stays in cache from the map query to 
+   interpolation. Stacks with legacy or plugin models get whole 
+   batches, as those are serialized per call and batch/thread 
+   internally. Returns the number of points interpolated */
+int ucvm_query_tiles(ucvm_ctx_t *ctx, int vals, int n, 
+		     ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int b, len, tile, nserved, nt;
+
+  vals = ucvm_query_vals(ctx, vals);
+  tile = ctx->tile;
+  if ((tile <= 0) || (tile > n) || (!ucvm_is_threadsafe())) {
+    tile = n;
+  }
+
+  nserved = 0;
+  b = 0;
+  do {
+    len = tile;
+    if (b + len > n) {
+      len = n - b;
+    }
+    nt = ucvm_query_tile(ctx, vals, len, &(pnt[b]), &(data[b]));
+    if (nt < 0) {
+      return(-1);
+    }
+    nserved += nt;
+    b += len;
+  } while (b < n);
+
+  return(nserved);
+}
+
+
+/* Hash of the model stack and the settings that query results 
+   depend on, keying the result cache */
+unsigned long long ucvm_query_stack_key(ucvm_ctx_t *ctx, int vals)
+{
+  int i, k;
+  unsigned long long h = 0xCBF29CE484222325ULL;
+  char label[UCVM_MAX_LABEL_LEN];
+  unsigned char *p;
+  double zr[2];
+
+  /* FNV-1a over model/ifunc/map labels, then the settings */
+  for (i = -1; i < 2 * ucvm_num_models; i++) {
+    memset(label, 0, UCVM_MAX_LABEL_LEN);
+    if (i < 0) {
+      ucvm_map_label(label, UCVM_MAX_LABEL_LEN);
+    } else if (i % 2 == 0) {
+      ucvm_model_list[i / 2].getlabel(i / 2, label, UCVM_MAX_LABEL_LEN);
+    } else {
+      ucvm_strcpy(label, ucvm_ifunc_list[i / 2].label, 
+		  UCVM_MAX_LABEL_LEN);
+    }
+    for (k = 0; (k < UCVM_MAX_LABEL_LEN) && (label[k] != '\0'); k++) {
+      h = (h ^ (unsigned char)label[k]) * 0x100000001B3ULL;
+    }
+    h = (h ^ ',') * 0x100000001B3ULL;
+  }
+
+  vals = ucvm_query_vals(ctx, vals);
+  zr[0] = ctx->interp_zmin;
+  zr[1] = ctx->interp_zmax;
+  h = (h ^ (unsigned long long)ctx->qmode) * 0x100000001B3ULL;
+  h = (h ^ (unsigned long long)vals) * 0x100000001B3ULL;
+  p = (unsigned char *)zr;
+  for (k = 0; k < (int)sizeof(zr); k++) {
+    h = (h ^ p[k]) * 0x100000001B3ULL;
+  }
+
+  return(h);
+}
+
+
+/* Query points through the result cache, querying only the misses.
+   Returns the number of points interpolated */
+int ucvm_query_cached(ucvm_ctx_t *ctx, int vals, int n, 
+		      ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int i, nmiss, nserved;
+  unsigned long long stack;
+
+  if (n > ctx->cache_len) {
+    free(ctx->cache_idx);
+    free(ctx->cache_pnt);
+    free(ctx->cache_data);
+    ctx->cache_idx = malloc(n * sizeof(int));
+    ctx->cache_pnt = malloc(n * sizeof(ucvm_point_t));
+    ctx->cache_data = malloc(n * sizeof(ucvm_data_t));
+    ctx->cache_len = n;
+    if ((ctx->cache_idx == NULL) || (ctx->cache_pnt == NULL) ||
+	(ctx->cache_data == NULL)) {
+      fprintf(stderr, "Failed to allocate query cache buffers\n");
+      ucvm_free_scratch(ctx);
+      return(-1);
+    }
+  }
+
+  stack = ucvm_query_stack_key(ctx, vals);
+  nmiss = ucvm_qcache_lookup(&ucvm_qcache, stack, n, pnt, data, 
+			     ctx->cache_idx);
+  ctx->stats.stage[UCVM_STAGE_QUERY].cache_hits += n - nmiss;
+  ctx->stats.stage[UCVM_STAGE_QUERY].cache_misses += nmiss;
+
+  if (nmiss == n) {
+    if (ucvm_query_tiles(ctx, vals, n, pnt, data) < 0) {
+      return(-1);
+    }
+    ucvm_qcache_store(&ucvm_qcache, stack, n, pnt, data);
+  } else if (nmiss > 0) {
+    for (i = 0; i < nmiss; i++) {
+      ctx->cache_pnt[i] = pnt[ctx->cache_idx[i]];
+    }
+    if (ucvm_query_tiles(ctx, vals, nmiss, ctx->cache_pnt, 
+			 ctx->cache_data) < 0) {
+      return(-1);
+    }
+    ucvm_qcache_store(&ucvm_qcache, stack, nmiss, ctx->cache_pnt, 
+		      ctx->cache_data);
+    for (i = 0; i < nmiss; i++) {
+      data[ctx->cache_idx[i]] = ctx->cache_data[i];
+    }
+  }
+
+  nserved = 0;
+  for (i = 0; i < n; i++) {
+    if (data[i].cmb.source != UCVM_SOURCE_NONE) {
+      nserved++;
+    }
+  }
+
+  return(nserved);
+}
+
+
+/* Query using a context, looking up the map values in vals rather 
+   than those set on the context */
+int ucvm_query_ctx_vals(ucvm_ctx_t *ctx, int vals, int n, 
+			ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int nserved;
+  unsigned long long t0;
+
+  if (ucvm_query_check(ctx) != UCVM_CODE_SUCCESS) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  t0 = ucvm_stat_clock();
+  pthread_rwlock_rdlock(&ucvm_qcache_rwlock);
+  if (ucvm_qcache.size > 0) {
+    nserved = ucvm_query_cached(ctx, vals, n, pnt, data);
+    pthread_rwlock_unlock(&ucvm_qcache_rwlock);
+  } else {
+    pthread_rwlock_unlock(&ucvm_qcache_rwlock);
+    nserved = ucvm_query_tiles(ctx, vals, n, pnt, data);
+  }
+  if (nserved < 0) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  ucvm_stat_add(&(ctx->stats.stage[UCVM_STAGE_QUERY]), n, nserved,
+		ucvm_stat_clock() - t0);
   
   return(UCVM_CODE_SUCCESS);
 }
 
 
+/* Query underlying models using a context, through the result cache
+   if enabled */
+int ucvm_query_ctx(ucvm_ctx_t *ctx, int n, ucvm_point_t *pnt, 
+		   ucvm_data_t *data)
+{
+  if (ctx == NULL) {
+    return(UCVM_CODE_ERROR);
+  }
+  return(ucvm_query_ctx_vals(ctx, ctx->vals, n, pnt, data));
+}
+
+
+/* Query vertical profiles using a context */
+int ucvm_query_columns_ctx(ucvm_ctx_t *ctx, int ncols, 
+			   const double *lonlat, int nz, 
+			   const double *depths, ucvm_data_t *out)
+{
+  int c, k, b, nb, cb, n;
+  int nserved, vals;
+  unsigned long long t0, t1;
+  ucvm_point_t *pnt;
+  ucvm_point_t *cpnt;
+  ucvm_data_t *cdata;
+
+  if ((lonlat == NULL) || (depths == NULL) || (out == NULL)) {
+    fprintf(stderr, "Invalid column query arguments\n");
+    return(UCVM_CODE_ERROR);
+  }
+  if (ucvm_query_check(ctx) != UCVM_CODE_SUCCESS) {
+    return(UCVM_CODE_ERROR);
+  }
+  if ((ncols <= 0) || (nz <= 0)) {
+    return(UCVM_CODE_SUCCESS);
+  }
+  vals = ucvm_query_vals(ctx, ctx->vals);
+
+  /* Batch whole columns, about UCVM_SOA_BLOCK points at a time */
+  cb = UCVM_SOA_BLOCK / nz;
+  if (cb < 1) {
+    cb = 1;
+  }
+  if (cb > ncols) {
+    cb = ncols;
+  }
+  pnt = malloc(cb * nz * sizeof(ucvm_point_t));
+  cpnt = malloc(cb * sizeof(ucvm_point_t));
+  cdata = malloc(cb * sizeof(ucvm_data_t));
+  if ((pnt == NULL) || (cpnt == NULL) || (cdata == NULL)) {
+    fprintf(stderr, "Failed to allocate column query buffers\n");
+    free(pnt);
+    free(cpnt);
+    free(cdata);
+    return(UCVM_CODE_ERROR);
+  }
+
+  for (b = 0; b < ncols; b += nb) {
+    nb = cb;
+    if (b + nb > ncols) {
+      nb = ncols - b;
+    }
+    n = nb * nz;
+    t0 = ucvm_stat_clock();
+
+    /* Surface elevation and vs30 once per column */
+    for (c = 0; c < nb; c++) {
+      cpnt[c].coord[0] = lonlat[2*(b + c)];
+      cpnt[c].coord[1] = lonlat[2*(b + c) + 1];
+      cpnt[c].coord[2] = 0.0;
+    }
+    ucvm_clear_data(nb, cdata);
+    if (vals != 0) {
+      t1 = ucvm_stat_clock();
+      if (ucvm_map_ctx_query(ctx->mapstate, ctx->qmode, nb, cpnt, 
+			     cdata) != UCVM_CODE_SUCCESS) {
+	fprintf(stderr, "Failed to query UCVM map\n");
+	free(pnt);
+	free(cpnt);
+	free(cdata);
+	return(UCVM_CODE_ERROR);
+      }
+      ucvm_stat_add(&(ctx->stats.stage[UCVM_STAGE_MAP]), nb, nb,
+		    ucvm_stat_clock() - t1);
+    } else {
+      ctx->stats.stage[UCVM_STAGE_MAP].skipped += nb;
+    }
+
+    /* Only depth varies down a column */
+    ucvm_clear_data(n, &(out[b*nz]));
+    for (c = 0; c < nb; c++) {
+      for (k = 0; k < nz; k++) {
+	pnt[c*nz + k].coord[0] = cpnt[c].coord[0];
+	pnt[c*nz + k].coord[1] = cpnt[c].coord[1];
+	pnt[c*nz + k].coord[2] = depths[k];
+	out[(b + c)*nz + k].surf = cdata[c].surf;
+	out[(b + c)*nz + k].vs30 = cdata[c].vs30;
+      }
+    }
+
+    nserved = ucvm_query_stages(ctx, n, pnt, &(out[b*nz]));
+    if (nserved < 0) {
+      free(pnt);
+      free(cpnt);
+      free(cdata);
+      return(UCVM_CODE_ERROR);
+    }
+    ucvm_stat_add(&(ctx->stats.stage[UCVM_STAGE_QUERY]), n, nserved,
+		  ucvm_stat_clock() - t0);
+  }
+
+  free(pnt);
+  free(cpnt);
+  free(cdata);
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Query vertical profiles */
+int ucvm_query_columns(int ncols, const double *lonlat, int nz, 
+		       const double *depths, ucvm_data_t *out)
+{
+  return(ucvm_query_columns_ctx(&ucvm_cur_ctx, ncols, lonlat, nz,
+				depths, out));
+}
+
+
 /* Save resource information in structure */
 int ucvm_save_resource(ucvm_rtype_t rtype, ucvm_mtype_t mtype,
 		       const char *label, const char *version,
@@ -1295,6 +3012,11 @@ int ucvm_get_resources(ucvm_resource_t *res, int *len)
       != UCVM_CODE_SUCCESS) {
     return(UCVM_CODE_ERROR);
   }
+  if (ucvm_save_resource(UCVM_RESOURCE_MAP_IF, UCVM_MODEL_CRUSTAL,
+		     UCVM_MAP_RASTER, "", res, numinst++, *len) 
+      != UCVM_CODE_SUCCESS) {
+    return(UCVM_CODE_ERROR);
+  }
 
   *len = numinst;  
   return(UCVM_CODE_SUCCESS);
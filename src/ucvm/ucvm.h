@@ -12,15 +12,24 @@ int ucvm_init(const char *config);
 int ucvm_finalize();
 
 /* Enable specific model(s), by string list, by label, or 
-   by ucvm_model_t */
+   by ucvm_model_t. Models of a list are initialized concurrently,
+   one thread per model interface, and keep their list order */
 int ucvm_add_model_list(const char *list);
 int ucvm_add_model(const char *label);
 int ucvm_add_user_model(ucvm_model_t *m, ucvm_modelconf_t *mconf);
 
+/* Enable specific model by a complete ucvm_model_t, including the 
+   optional hooks, caps and needs. ucvm_add_user_model reads only the 
+   fields up to query. Zero the struct before filling it in, so that 
+   unused hooks are NULL */
+int ucvm_add_user_model_ext(ucvm_model_t *m, ucvm_modelconf_t *mconf);
+
 /* Associate specific interp func with GTL model, by label 
-   or by ucvm_ifunc_t */
+   or by ucvm_ifunc_t. ucvm_assoc_user_ifunc reads only the label and
+   interp, the _ext form also needs, so zero the struct first */
 int ucvm_assoc_ifunc(const char *mlabel, const char *ilabel);
 int ucvm_assoc_user_ifunc(const char *mlabel, ucvm_ifunc_t *ifunc);
+int ucvm_assoc_user_ifunc_ext(const char *mlabel, ucvm_ifunc_t *ifunc);
 
 /* Use specific map (elev, vs30) by label */
 int ucvm_use_map(const char *label);
@@ -31,15 +40,78 @@ int ucvm_model_label(int m, char *label, int len);
 /* Get label for an interpolation function */
 int ucvm_ifunc_label(int f, char *label, int len);
 
+/* Get number of enabled models. Model and interp func ids are 
+   below this number */
+int ucvm_get_num_models();
+
 /* Get version for a model */
 int ucvm_model_version(int m, char *ver, int len);
 
 /* Set parameters (see ucvm_dtypes.h for valid param flags) */
 int ucvm_setparam(ucvm_param_t param, ...);
 
-/* Query underlying models */
+/* Query underlying models. When built with OpenMP, large batches are
+   split across threads if every enabled model is thread-safe */
 int ucvm_query(int n, ucvm_point_t *pnt, ucvm_data_t *data);
 
+/* Query underlying models with separate lon/lat/z input arrays,
+   writing only the requested columns of out. vp/vs/rho are the
+   combined (cmb) properties. The map is skipped when surf and vs30
+   are not requested and no enabled model needs them */
+int ucvm_query_soa(int n, const double *lon, const double *lat,
+		   const double *z, ucvm_soa_t *out);
+
+/* Query vertical profiles. lonlat holds ncols lon,lat pairs and 
+   depths the nz Z values (depth or elevation, per query mode) shared 
+   by every column. The map is queried once per column. Results go 
+   to out[c*nz + k], which must hold ncols*nz entries */
+int ucvm_query_columns(int ncols, const double *lonlat, int nz, 
+		       const double *depths, ucvm_data_t *out);
+
+/* Create/destroy a query context from the enabled models. Contexts
+   must be created after all models are added and finalized before
+   ucvm_finalize(). The context starts with the current query mode 
+   and interp zrange */
+int ucvm_ctx_init(ucvm_ctx_t *ctx);
+int ucvm_ctx_finalize(ucvm_ctx_t *ctx);
+
+/* Set query parameters for a context (UCVM_PARAM_QUERY_MODE and 
+   UCVM_PARAM_IFUNC_ZRANGE only) */
+int ucvm_ctx_setparam(ucvm_ctx_t *ctx, ucvm_param_t param, ...);
+
+/* Query underlying models using a context. Thread-safe as long as 
+   each thread uses its own context. The built-in models (1d, bbp1d, 
+   1dgtl, elygtl, cmuetree, etree, patch and grid) and the map are
+   queried concurrently, all other models are serialized internally */
+int ucvm_query_ctx(ucvm_ctx_t *ctx, int n, ucvm_point_t *pnt, 
+		   ucvm_data_t *data);
+
+/* Query with SoA input/output using a context */
+int ucvm_query_soa_ctx(ucvm_ctx_t *ctx, int n, const double *lon, 
+		       const double *lat, const double *z, 
+		       ucvm_soa_t *out);
+
+/* Query vertical profiles using a context */
+int ucvm_query_columns_ctx(ucvm_ctx_t *ctx, int ncols, 
+			   const double *lonlat, int nz, 
+			   const double *depths, ucvm_data_t *out);
+
+/* Get query instrumentation, summed over ucvm_query() and its 
+   parallel threads. Contexts keep their own counters in ctx->stats */
+int ucvm_get_stats(ucvm_stats_t *stats);
+
+/* Zero query instrumentation */
+int ucvm_reset_stats();
+
+/* Get result cache hits, misses and entries in use, over all
+   contexts */
+int ucvm_get_cache_stats(unsigned long long *hits,
+			 unsigned long long *misses, int *entries);
+
+/* Get the wall time of each model init in ns, by model id. len is 
+   the size of ns on entry and the number of models on return */
+int ucvm_get_init_times(unsigned long long *ns, int *len);
+
 /* Get installed feature information */
 int ucvm_get_resources(ucvm_resource_t *res, int *len);
 
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ucvm_utils.h"
+#include "ucvm_client.h"
+
+
+/* Read exactly len bytes on a socket */
+int ucvm_sock_read(int fd, void *buf, size_t len)
+{
+  ssize_t r;
+  char *p = buf;
+
+  while (len > 0) {
+    r = read(fd, p, len);
+    if (r < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return(UCVM_CODE_ERROR);
+    }
+    if (r == 0) {
+      return(UCVM_CODE_ERROR);
+    }
+    p += r;
+    len -= r;
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Write exactly len bytes on a socket */
+int ucvm_sock_write(int fd, const void *buf, size_t len)
+{
+  ssize_t r;
+  const char *p = buf;
+
+  while (len > 0) {
+    r = send(fd, p, len, MSG_NOSIGNAL);
+    if (r < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return(UCVM_CODE_ERROR);
+    }
+    p += r;
+    len -= r;
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Connect to the server listening on path */
+int ucvm_client_connect(ucvm_client_t *c, const char *path)
+{
+  struct sockaddr_un addr;
+  ucvm_served_hello_t hello;
+  int nl;
+
+  memset(c, 0, sizeof(ucvm_client_t));
+  c->fd = -1;
+  c->qmode = UCVM_COORD_GEO_DEPTH;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return(UCVM_CODE_ERROR);
+  }
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  ucvm_strcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+  c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (c->fd < 0) {
+    fprintf(stderr, "Failed to create socket\n");
+    return(UCVM_CODE_ERROR);
+  }
+  if (connect(c->fd, (struct sockaddr *)&addr,
+	      sizeof(struct sockaddr_un)) != 0) {
+    fprintf(stderr, "Failed to connect to ucvm_served at %s\n", path);
+    close(c->fd);
+    c->fd = -1;
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Greeting and source labels */
+  if (ucvm_sock_read(c->fd, &hello,
+		     sizeof(ucvm_served_hello_t)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to read ucvm_served greeting\n");
+    close(c->fd);
+    c->fd = -1;
+    return(UCVM_CODE_ERROR);
+  }
+  if ((memcmp(hello.magic, UCVM_SERVED_MAGIC, 8) != 0) ||
+      (hello.datasize != sizeof(ucvm_data_t)) ||
+      (hello.num_models < 0) || (hello.num_models > UCVM_MAX_MODELS)) {
+    fprintf(stderr, "Incompatible ucvm_served at %s\n", path);
+    close(c->fd);
+    c->fd = -1;
+    return(UCVM_CODE_ERROR);
+  }
+  c->num_models = hello.num_models;
+  nl = c->num_models + 1;
+  if ((ucvm_sock_read(c->fd, c->model_labels,
+		      nl * UCVM_MAX_LABEL_LEN) != UCVM_CODE_SUCCESS) ||
+      (ucvm_sock_read(c->fd, c->ifunc_labels,
+		      (nl + 2) * UCVM_MAX_LABEL_LEN) != UCVM_CODE_SUCCESS)) {
+    fprintf(stderr, "Failed to read ucvm_served labels\n");
+    close(c->fd);
+    c->fd = -1;
+    return(UCVM_CODE_ERROR);
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* End the session and close the connection */
+int ucvm_client_close(ucvm_client_t *c)
+{
+  ucvm_served_req_t req;
+
+  if (c->fd < 0) {
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  memset(&req, 0, sizeof(ucvm_served_req_t));
+  ucvm_sock_write(c->fd, &req, sizeof(ucvm_served_req_t));
+  close(c->fd);
+  c->fd = -1;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Set query parameters, sent with each query */
+int ucvm_client_setparam(ucvm_client_t *c, ucvm_param_t param, ...)
+{
+  va_list ap;
+  int retval = UCVM_CODE_SUCCESS;
+
+  va_start(ap, param);
+  switch (param) {
+  case UCVM_PARAM_QUERY_MODE:
+    c->qmode = va_arg(ap, int);
+    break;
+  case UCVM_PARAM_IFUNC_ZRANGE:
+    c->zrange[0] = va_arg(ap, double);
+    c->zrange[1] = va_arg(ap, double);
+    c->have_zrange = 1;
+    break;
+  default:
+    fprintf(stderr, "Unsupported client param %d\n", param);
+    retval = UCVM_CODE_ERROR;
+    break;
+  }
+  va_end(ap);
+
+  return(retval);
+}
+
+
+/* Query the server's models, in requests of at most
+   UCVM_SERVED_MAX_POINTS points */
+int ucvm_client_query(ucvm_client_t *c, int n, ucvm_point_t *pnt,
+		      ucvm_data_t *data)
+{
+  int i, start, len;
+  ucvm_served_req_t req;
+  ucvm_served_resp_t resp;
+  double *buf;
+
+  if (c->fd < 0) {
+    fprintf(stderr, "Not connected to ucvm_served\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  len = (n < UCVM_SERVED_MAX_POINTS) ? n : UCVM_SERVED_MAX_POINTS;
+  buf = malloc(3 * len * sizeof(double));
+  if ((len > 0) && (buf == NULL)) {
+    fprintf(stderr, "Failed to allocate request buffer\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  for (start = 0; start < n; start += len) {
+    memset(&req, 0, sizeof(ucvm_served_req_t));
+    req.n = (n - start < len) ? n - start : len;
+    req.qmode = c->qmode;
+    req.have_zrange = c->have_zrange;
+    req.zrange[0] = c->zrange[0];
+    req.zrange[1] = c->zrange[1];
+    for (i = 0; i < req.n; i++) {
+      buf[i * 3] = pnt[start + i].coord[0];
+      buf[i * 3 + 1] = pnt[start + i].coord[1];
+      buf[i * 3 + 2] = pnt[start + i].coord[2];
+    }
+
+    if ((ucvm_sock_write(c->fd, &req, sizeof(ucvm_served_req_t)) !=
+	 UCVM_CODE_SUCCESS) ||
+	(ucvm_sock_write(c->fd, buf, 3 * req.n * sizeof(double)) !=
+	 UCVM_CODE_SUCCESS) ||
+	(ucvm_sock_read(c->fd, &resp, sizeof(ucvm_served_resp_t)) !=
+	 UCVM_CODE_SUCCESS)) {
+      fprintf(stderr, "Lost connection to ucvm_served\n");
+      free(buf);
+      return(UCVM_CODE_ERROR);
+    }
+    if (resp.status != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "ucvm_served query failed\n");
+      free(buf);
+      return(UCVM_CODE_ERROR);
+    }
+    if ((resp.n != req.n) ||
+	(ucvm_sock_read(c->fd, &(data[start]),
+			req.n * sizeof(ucvm_data_t)) != UCVM_CODE_SUCCESS)) {
+      fprintf(stderr, "Lost connection to ucvm_served\n");
+      free(buf);
+      return(UCVM_CODE_ERROR);
+    }
+  }
+
+  free(buf);
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Get label for a model of the server */
+int ucvm_client_model_label(ucvm_client_t *c, int m, char *label, int len)
+{
+  if ((m < UCVM_SOURCE_NONE) || (m >= c->num_models)) {
+    fprintf(stderr, "Invalid model ID %d\n", m);
+    return(UCVM_CODE_ERROR);
+  }
+  ucvm_strcpy(label, c->model_labels[m - UCVM_SOURCE_NONE], len);
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Get label for an interp func of the server */
+int ucvm_client_ifunc_label(ucvm_client_t *c, int f, char *label, int len)
+{
+  if ((f < UCVM_SOURCE_GTL) || (f >= c->num_models)) {
+    fprintf(stderr, "Invalid interp func ID %d\n", f);
+    return(UCVM_CODE_ERROR);
+  }
+  ucvm_strcpy(label, c->ifunc_labels[f - UCVM_SOURCE_GTL], len);
+
+  return(UCVM_CODE_SUCCESS);
+}
@@ -0,0 +1,89 @@
+#ifndef UCVM_CLIENT_H
+#define UCVM_CLIENT_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include "ucvm_dtypes.h"
+
+
+/* Default ucvm_served socket */
+#define UCVM_SERVED_SOCKET "/tmp/ucvm_served.sock"
+
+/* Largest number of points in one request */
+#define UCVM_SERVED_MAX_POINTS 100000
+
+/* Protocol magic, sent by the server on connect */
+#define UCVM_SERVED_MAGIC "UCVMSRV1"
+
+
+/* Server greeting. Followed by num_models + 1 model labels (ids from
+   UCVM_SOURCE_NONE) and num_models + 3 interp func labels (ids from
+   UCVM_SOURCE_GTL), each UCVM_MAX_LABEL_LEN bytes. datasize guards
+   against client and server built with different ucvm_data_t */
+typedef struct ucvm_served_hello_t {
+  char magic[8];
+  int num_models;
+  int datasize;
+} ucvm_served_hello_t;
+
+
+/* Query request. Followed by n lon,lat,Z double triples. A request
+   with n == 0 ends the session */
+typedef struct ucvm_served_req_t {
+  int n;
+  int qmode;
+  int have_zrange;
+  int pad;
+  double zrange[2];
+} ucvm_served_req_t;
+
+
+/* Query response. Followed by n ucvm_data_t if status is
+   UCVM_CODE_SUCCESS */
+typedef struct ucvm_served_resp_t {
+  int status;
+  int n;
+} ucvm_served_resp_t;
+
+
+/* Connection to a ucvm_served server */
+typedef struct ucvm_client_t {
+  int fd;
+  int num_models;
+  ucvm_ctype_t qmode;
+  int have_zrange;
+  double zrange[2];
+  char model_labels[UCVM_MAX_MODELS + 1][UCVM_MAX_LABEL_LEN];
+  char ifunc_labels[UCVM_MAX_MODELS + 3][UCVM_MAX_LABEL_LEN];
+} ucvm_client_t;
+
+
+/* Connect to the server listening on path */
+int ucvm_client_connect(ucvm_client_t *c, const char *path);
+
+
+/* End the session and close the connection */
+int ucvm_client_close(ucvm_client_t *c);
+
+
+/* Set query parameters (UCVM_PARAM_QUERY_MODE and
+   UCVM_PARAM_IFUNC_ZRANGE only), sent with each query */
+int ucvm_client_setparam(ucvm_client_t *c, ucvm_param_t param, ...);
+
+
+/* Query the server's models, as ucvm_query() */
+int ucvm_client_query(ucvm_client_t *c, int n, ucvm_point_t *pnt,
+		      ucvm_data_t *data);
+
+
+/* Get label for a model or interp func of the server */
+int ucvm_client_model_label(ucvm_client_t *c, int m, char *label, int len);
+int ucvm_client_ifunc_label(ucvm_client_t *c, int f, char *label, int len);
+
+
+/* Read/write exactly len bytes on a socket */
+int ucvm_sock_read(int fd, void *buf, size_t len);
+int ucvm_sock_write(int fd, const void *buf, size_t len);
+
+
+#endif
@@ -49,7 +49,7 @@ ucvm_config_t *ucvm_parse_config(const char *file)
 {
   FILE *fp;
   char line[UCVM_CONFIG_MAX_STR];
-  char *name, *value;
+  char *name, *value, *saveptr;
   ucvm_config_t celem;
   ucvm_config_t *chead = NULL;
   ucvm_config_t *cnew;
@@ -69,7 +69,7 @@ ucvm_config_t *ucvm_parse_config(const char *file)
     if ((fgets(line, UCVM_CONFIG_MAX_STR, fp) != NULL) && 
 	(strlen(line) > 0)) {
       memset(&celem, 0, sizeof(ucvm_config_t));
-      name = strtok(line, "=");
+      name = strtok_r(line, "=", &saveptr);
       if (name == NULL) {
 	continue;
       }
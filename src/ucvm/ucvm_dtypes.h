@@ -41,12 +41,39 @@
 #define UCVM_DEFAULT_INTERP_ZMAX 0.0
 
 
+/* Default points per query tile, 0 for whole batches */
+#define UCVM_DEFAULT_QUERY_TILE 512
+
+
+/* Map values (surface elevation, vs30) that a caller, model or 
+   interp func reads from ucvm_data_t */
+#define UCVM_VAL_SURF 0x01
+#define UCVM_VAL_VS30 0x02
+#define UCVM_DEFAULT_QUERY_VALS (UCVM_VAL_SURF | UCVM_VAL_VS30)
+
+
+/* Default quantization of result cache points, degrees and meters */
+#define UCVM_DEFAULT_QCACHE_HTOL 1.0e-6
+#define UCVM_DEFAULT_QCACHE_ZTOL 0.01
+
+
 /* Special source model/ifunc flags */
 #define UCVM_SOURCE_NONE -1
 #define UCVM_SOURCE_CRUST -2
 #define UCVM_SOURCE_GTL -3
 
 
+/* Bins per side of the model region index */
+#define UCVM_REGION_INDEX_BINS 64
+
+
+/* Model capability flags */
+#define UCVM_MODEL_CAP_THREADSAFE 0x01
+#define UCVM_MODEL_CAP_SERIAL_INIT 0x02
+#define UCVM_MODEL_CAP_PARALLEL_INIT 0x04
+#define UCVM_MODEL_CAP_EXCLUSIVE_INIT 0x08
+
+
 /* Predefined crustal model interfaces */
 #define UCVM_MODEL_NONE "none"
 #define UCVM_MODEL_CVMH "cvmh"
@@ -77,6 +104,7 @@
    models to be declared in conf at runtime */
 #define UCVM_MODEL_PATCH "model_patch"
 #define UCVM_MODEL_ETREE "model_etree"
+#define UCVM_MODEL_GRID "model_grid"
 
 
 /* Predefined map interfaces */
@@ -87,6 +115,7 @@
 /* These map interfaces allow user defined 
    maps to be declared in conf at runtime */
 #define UCVM_MAP_ETREE "map_etree"
+#define UCVM_MAP_RASTER "map_raster"
 
 
 /* Predefined interpolation functions */
@@ -123,6 +152,15 @@ typedef enum { UCVM_MODEL_CRUSTAL = 0,
 	       UCVM_MODEL_GTL } ucvm_mtype_t;
 
 
+/* Query stages, for instrumentation */
+typedef enum { UCVM_STAGE_QUERY = 0, 
+	       UCVM_STAGE_MAP,
+	       UCVM_STAGE_CRUSTAL,
+	       UCVM_STAGE_GTL,
+	       UCVM_STAGE_INTERP } ucvm_stage_t;
+#define UCVM_MAX_STAGES 5
+
+
 /* Supported resource types */
 typedef enum { UCVM_RESOURCE_MODEL = 0, 
 	       UCVM_RESOURCE_IFUNC,
@@ -138,11 +176,26 @@ UCVM_PARAM_IFUNC_ZRANGE  : double min, double max (meters)
 UCVM_PARAM_MODEL_CONF    : char *mlabel, char *param, char *value
   CVM-H:
     "USE_1D_BKG": "True"/"False"
+UCVM_PARAM_QUERY_TILE    : int npoints (0 queries whole batches)
+UCVM_PARAM_QUERY_VALS    : int UCVM_VAL_* flags of the map values read 
+			   from query results. The map is skipped if 
+			   neither these nor the models need it
+UCVM_PARAM_QUERY_CACHE   : int entries, double htol (degrees), 
+			   double ztol (meters). Caches query results,
+			   0 entries disables the cache (default). Waits
+			   for cached queries in other threads to finish
+UCVM_PARAM_SHARED_MEMORY : int enabled. Models added later place their
+			   read-only payloads in POSIX shared memory,
+			   shared by the processes of a node
 
 */
 typedef enum { UCVM_PARAM_QUERY_MODE = 0,
 	       UCVM_PARAM_IFUNC_ZRANGE,
-	       UCVM_PARAM_MODEL_CONF } ucvm_param_t;
+	       UCVM_PARAM_MODEL_CONF,
+	       UCVM_PARAM_QUERY_TILE,
+	       UCVM_PARAM_QUERY_VALS,
+	       UCVM_PARAM_QUERY_CACHE,
+	       UCVM_PARAM_SHARED_MEMORY } ucvm_param_t;
 
 
 /* Supported model parameters. Used internally by UCVM 
@@ -150,7 +203,8 @@ typedef enum { UCVM_PARAM_QUERY_MODE = 0,
 UCVM_MODEL_PARAM_FORCE_DEPTH_ABOVE_SURF : Force elevation points to be
   treated as offset relative to regional model surface when it is 
   above the ucvm dem surface. Removes discontinuities between model 
-  surface and GTL.
+  surface and GTL. Set while a GTL is active, and applied only to
+  queries made in elevation mode.
 
 */
 typedef enum { UCVM_MODEL_PARAM_FORCE_DEPTH_ABOVE_SURF } ucvm_mparam_t;
@@ -214,6 +268,22 @@ typedef struct ucvm_data_t
 } ucvm_data_t;
 
 
+/* Structure-of-arrays query output. Each column is a caller-owned 
+   array of n values, NULL columns are not written */
+typedef struct ucvm_soa_t 
+{
+  float *surf;
+  float *vs30;
+  float *depth;
+  float *vp;
+  float *vs;
+  float *rho;
+  int *crust_source;
+  int *gtl_source;
+  int *cmb_source;
+} ucvm_soa_t;
+
+
 /* Region box */
 typedef struct ucvm_region_t 
 {
@@ -223,6 +293,25 @@ typedef struct ucvm_region_t
 } ucvm_region_t;
 
 
+/* Bucket grid over the configured model regions. Each bin holds a
+   mask of the models whose region covers all of it and a mask of
+   those covering part of it. Models without a region, or added after
+   the index was built, are in neither and always take points */
+typedef struct ucvm_region_index_t 
+{
+  int num_models;
+  unsigned int regional;
+  double p1[2];
+  double p2[2];
+  double dx;
+  double dy;
+  int nx;
+  int ny;
+  unsigned int *full;
+  unsigned int *part;
+} ucvm_region_index_t;
+
+
 /* Model config */
 typedef struct ucvm_modelconf_t 
 {
@@ -245,6 +334,33 @@ typedef struct ucvm_model_t
   int (*query)(int id, ucvm_ctype_t cmode,
 	       int n, ucvm_point_t *pnt, 
 	       ucvm_data_t *data);
+  /* Optional reentrant interface, NULL if not supported. ctxinit 
+     creates the private query state for one ucvm_ctx_t, ctxquery
+     queries with that state (NULL selects the model's own state) */
+  int (*ctxinit)(int id, void **state);
+  int (*ctxfinalize)(int id, void *state);
+  int (*ctxquery)(int id, void *state, ucvm_ctype_t cmode,
+		  int n, ucvm_point_t *pnt, 
+		  ucvm_data_t *data);
+  /* Capability flags. UCVM_MODEL_CAP_THREADSAFE allows concurrent 
+     queries, each thread with its own ctxinit state if provided.
+     UCVM_MODEL_CAP_SERIAL_INIT keeps the model's init from overlapping
+     that of any other such model. UCVM_MODEL_CAP_PARALLEL_INIT lets 
+     models of the same interface init concurrently, otherwise they 
+     init one after another since they share the interface's tables.
+     UCVM_MODEL_CAP_EXCLUSIVE_INIT runs the init on its own, after the
+     other inits of the list finish */
+  int caps;
+  /* UCVM_VAL_* flags of the map values the model reads in either 
+     query mode */
+  int needs;
+  /* Optional lookup cache counters, zeroed if reset is set */
+  int (*cachestats)(int id, int reset, unsigned long long *hits,
+		    unsigned long long *misses);
+  /* Optional, undoes the init of one model that was never activated
+     and leaves the others of its interface in place. If NULL, the 
+     interface is finalized when no active model uses it */
+  int (*release)(int id);
 } ucvm_model_t;
 
 
@@ -254,9 +370,66 @@ typedef struct ucvm_ifunc_t
   char label[UCVM_MAX_LABEL_LEN];
   int (*interp)(double zmin, double zmax, ucvm_ctype_t cmode,
 		ucvm_point_t *pnt, ucvm_data_t *data);
+  /* UCVM_VAL_* flags of the map values the function reads */
+  int needs;
 } ucvm_ifunc_t;
 
 
+/* Query counters for one stage or model. Points offered are those
+   handed to the stage/model still needing a value, served are the 
+   ones it filled and datagap the ones it left unfilled. Skipped are
+   points the stage was not needed for. The cache counters of the 
+   query stage are those of the result cache, the model ones come 
+   from models that cache lookups, via ucvm_get_stats() */
+typedef struct ucvm_stat_t 
+{
+  unsigned long long calls;
+  unsigned long long offered;
+  unsigned long long served;
+  unsigned long long datagap;
+  unsigned long long skipped;
+  unsigned long long ns;
+  unsigned long long cache_hits;
+  unsigned long long cache_misses;
+} ucvm_stat_t;
+
+
+/* Query instrumentation, by stage and by model id */
+typedef struct ucvm_stats_t 
+{
+  ucvm_stat_t stage[UCVM_MAX_STAGES];
+  ucvm_stat_t model[UCVM_MAX_MODELS];
+} ucvm_stats_t;
+
+
+/* Query context. Holds the query settings and the per-model
+   state needed to call ucvm_query_ctx() from one thread */
+typedef struct ucvm_ctx_t 
+{
+  ucvm_ctype_t qmode;
+  double interp_zmin;
+  double interp_zmax;
+  int tile;
+  int vals;
+  int num_models;
+  void *mapstate;
+  void *mstate[UCVM_MAX_MODELS];
+  /* Scratch buffers for the unresolved points of a query */
+  int scratch_len;
+  int *scratch_idx;
+  ucvm_point_t *scratch_pnt;
+  ucvm_data_t *scratch_data;
+  unsigned int *scratch_mask;
+  /* Result cache misses of a query */
+  int cache_len;
+  int *cache_idx;
+  ucvm_point_t *cache_pnt;
+  ucvm_data_t *cache_data;
+  /* Query instrumentation */
+  ucvm_stats_t stats;
+} ucvm_ctx_t;
+
+
 /* Resource flag description */
 typedef struct ucvm_flag_t 
 {
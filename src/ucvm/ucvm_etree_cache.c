@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ucvm_etree_cache.h"
+
+
+/* Empty the cache and zero its counters */
+void ucvm_etree_cache_init(ucvm_etree_cache_t *c)
+{
+  memset(c, 0, sizeof(ucvm_etree_cache_t));
+  return;
+}
+
+
+/* Search etree at ETREE_MAXLEVEL through the cache */
+int ucvm_etree_cache_search(ucvm_etree_cache_t *c, etree_t *ep, 
+			    ucvm_etree_mem_t *mem, etree_addr_t addr, 
+			    void *payload, int size)
+{
+  int i, k;
+  etree_addr_t hit;
+
+  if ((c == NULL) || (size > UCVM_ETREE_CACHE_PAYLOAD)) {
+    if (mem != NULL) {
+      return(ucvm_etree_mem_search(mem, addr, NULL, payload));
+    }
+    return(etree_search(ep, addr, NULL, "*", payload));
+  }
+
+  /* Most recent hit first. Unsigned differences also reject points 
+     below the octant origin */
+  for (k = 0; k < c->num; k++) {
+    i = (c->last + k) % c->num;
+    if ((addr.x - c->addr[i].x < c->edge[i]) &&
+	(addr.y - c->addr[i].y < c->edge[i]) &&
+	(addr.z - c->addr[i].z < c->edge[i])) {
+      memcpy(payload, c->payload[i], size);
+      c->last = i;
+      c->hits++;
+      return(0);
+    }
+  }
+
+  c->misses++;
+  if (mem != NULL) {
+    if (ucvm_etree_mem_search(mem, addr, &hit, payload) != 0) {
+      return(-1);
+    }
+  } else if (etree_search(ep, addr, &hit, "*", payload) != 0) {
+    return(-1);
+  }
+
+  /* Replace entries round robin */
+  i = c->next;
+  c->addr[i] = hit;
+  c->edge[i] = (etree_tick_t)1 << (ETREE_MAXLEVEL - hit.level);
+  memcpy(c->payload[i], payload, size);
+  c->last = i;
+  c->next = (i + 1) % UCVM_ETREE_CACHE_SIZE;
+  if (c->num < UCVM_ETREE_CACHE_SIZE) {
+    c->num++;
+  }
+
+  return(0);
+}
+
+
+/* Append a lookup for point i, growing the batch as needed */
+int ucvm_etree_batch_add(ucvm_etree_batch_t *b, int i, 
+			 etree_addr_t *addr, ucvm_point_t *xy)
+{
+  int len;
+  int *idx;
+  etree_addr_t *a;
+  ucvm_point_t *p;
+  ucvm_etree_key_t *o;
+
+  if (b->num >= b->len) {
+    len = 2 * b->len;
+    if (len < 1024) {
+      len = 1024;
+    }
+    idx = realloc(b->idx, len * sizeof(int));
+    if (idx != NULL) {
+      b->idx = idx;
+    }
+    a = realloc(b->addr, len * sizeof(etree_addr_t));
+    if (a != NULL) {
+      b->addr = a;
+    }
+    p = realloc(b->xy, len * sizeof(ucvm_point_t));
+    if (p != NULL) {
+      b->xy = p;
+    }
+    o = realloc(b->order, len * sizeof(ucvm_etree_key_t));
+    if (o != NULL) {
+      b->order = o;
+    }
+    if ((idx == NULL) || (a == NULL) || (p == NULL) || (o == NULL)) {
+      fprintf(stderr, "Failed to allocate etree batch\n");
+      return(UCVM_CODE_ERROR);
+    }
+    b->len = len;
+  }
+
+  b->idx[b->num] = i;
+  b->addr[b->num] = *addr;
+  if (xy != NULL) {
+    b->xy[b->num] = *xy;
+  }
+  b->num++;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Spread the low 21 bits of v to every third bit */
+unsigned long long ucvm_etree_spread3(etree_tick_t v)
+{
+  unsigned long long x = v & 0x1fffff;
+
+  x = (x | (x << 32)) & 0x1f00000000ffffULL;
+  x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+  x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+  x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+  x = (x | (x << 2)) & 0x1249249249249249ULL;
+  return(x);
+}
+
+
+/* Compare batch keys */
+int ucvm_etree_key_cmp(const void *a, const void *b)
+{
+  const ucvm_etree_key_t *ka = a;
+  const ucvm_etree_key_t *kb = b;
+
+  if (ka->key < kb->key) {
+    return(-1);
+  } else if (ka->key > kb->key) {
+    return(1);
+  }
+  return(ka->pos - kb->pos);
+}
+
+
+/* Order the batch by Morton code of the addresses */
+void ucvm_etree_batch_sort(ucvm_etree_batch_t *b)
+{
+  int k;
+  int shift = ETREE_MAXLEVEL - 21;
+
+  /* The top 21 bits of each tick coordinate fit a 63 bit key */
+  for (k = 0; k < b->num; k++) {
+    b->order[k].key = (ucvm_etree_spread3(b->addr[k].z >> shift) << 2) |
+      (ucvm_etree_spread3(b->addr[k].y >> shift) << 1) |
+      ucvm_etree_spread3(b->addr[k].x >> shift);
+    b->order[k].pos = k;
+  }
+  qsort(b->order, b->num, sizeof(ucvm_etree_key_t), ucvm_etree_key_cmp);
+
+  return;
+}
+
+
+/* Free batch buffers */
+void ucvm_etree_batch_free(ucvm_etree_batch_t *b)
+{
+  free(b->idx);
+  free(b->addr);
+  free(b->xy);
+  free(b->order);
+  memset(b, 0, sizeof(ucvm_etree_batch_t));
+  return;
+}
@@ -0,0 +1,74 @@
+#ifndef UCVM_ETREE_CACHE_H
+#define UCVM_ETREE_CACHE_H
+
+#include "etree.h"
+#include "ucvm_dtypes.h"
+#include "ucvm_etree_mem.h"
+
+/* Number of leaf octants remembered */
+#define UCVM_ETREE_CACHE_SIZE 8
+
+/* Largest payload that is cached, in bytes */
+#define UCVM_ETREE_CACHE_PAYLOAD 16
+
+
+/* Cache of recently hit etree leaf octants */
+typedef struct ucvm_etree_cache_t 
+{
+  int num;
+  int last;
+  int next;
+  etree_addr_t addr[UCVM_ETREE_CACHE_SIZE];
+  etree_tick_t edge[UCVM_ETREE_CACHE_SIZE];
+  char payload[UCVM_ETREE_CACHE_SIZE][UCVM_ETREE_CACHE_PAYLOAD];
+  unsigned long long hits;
+  unsigned long long misses;
+} ucvm_etree_cache_t;
+
+
+/* Sort key of a batch entry */
+typedef struct ucvm_etree_key_t 
+{
+  unsigned long long key;
+  int pos;
+} ucvm_etree_key_t;
+
+
+/* Batch of etree lookups, visited in locational code order */
+typedef struct ucvm_etree_batch_t 
+{
+  int len;
+  int num;
+  int *idx;
+  etree_addr_t *addr;
+  ucvm_point_t *xy;
+  ucvm_etree_key_t *order;
+} ucvm_etree_batch_t;
+
+
+/* Empty the cache and zero its counters */
+void ucvm_etree_cache_init(ucvm_etree_cache_t *c);
+
+
+/* Search etree at ETREE_MAXLEVEL through the cache, reading misses 
+   from mem when it is not NULL. Returns as etree_search() */
+int ucvm_etree_cache_search(ucvm_etree_cache_t *c, etree_t *ep, 
+			    ucvm_etree_mem_t *mem, etree_addr_t addr, 
+			    void *payload, int size);
+
+
+/* Append a lookup for point i, growing the batch as needed */
+int ucvm_etree_batch_add(ucvm_etree_batch_t *b, int i, 
+			 etree_addr_t *addr, ucvm_point_t *xy);
+
+
+/* Order the batch by Morton code of the addresses. Entry k of the 
+   sorted batch is at position b->order[k].pos */
+void ucvm_etree_batch_sort(ucvm_etree_batch_t *b);
+
+
+/* Free batch buffers */
+void ucvm_etree_batch_free(ucvm_etree_batch_t *b);
+
+
+#endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ucvm_etree_mem.h"
+
+
+/* True if the highest set bit of a is below that of b */
+int ucvm_etree_less_msb(etree_tick_t a, etree_tick_t b)
+{
+  return((a < b) && (a < (a ^ b)));
+}
+
+
+/* Compare octant origins in Morton order, z bits most significant */
+int ucvm_etree_leaf_cmp(const void *a, const void *b)
+{
+  const ucvm_etree_leaf_t *la = a;
+  const ucvm_etree_leaf_t *lb = b;
+  etree_tick_t d[3];
+  etree_tick_t va[3], vb[3];
+  int j, k = 0;
+
+  va[0] = la->z;
+  va[1] = la->y;
+  va[2] = la->x;
+  vb[0] = lb->z;
+  vb[1] = lb->y;
+  vb[2] = lb->x;
+  for (j = 0; j < 3; j++) {
+    d[j] = va[j] ^ vb[j];
+  }
+  for (j = 1; j < 3; j++) {
+    if (ucvm_etree_less_msb(d[k], d[j])) {
+      k = j;
+    }
+  }
+
+  if (va[k] < vb[k]) {
+    return(-1);
+  } else if (va[k] > vb[k]) {
+    return(1);
+  }
+  return(0);
+}
+
+
+/* Read every leaf octant of ep with payloads of size bytes */
+int ucvm_etree_mem_load(ucvm_etree_mem_t *m, etree_t *ep, int size)
+{
+  size_t len;
+  char *rec;
+  etree_addr_t addr;
+  ucvm_etree_leaf_t *leaf;
+  struct timespec t0, t1;
+  int sorted = 1;
+
+  memset(m, 0, sizeof(ucvm_etree_mem_t));
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  m->size = size;
+  m->recsize = sizeof(ucvm_etree_leaf_t) + ((size + 7) / 8) * 8;
+  len = (size_t)etree_getcount(ep);
+  if (len < 1024) {
+    len = 1024;
+  }
+  m->rec = malloc(len * m->recsize);
+  if (m->rec == NULL) {
+    fprintf(stderr, "Failed to allocate in-memory etree\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Walk the leaf octants with the etree cursor */
+  addr.x = addr.y = addr.z = addr.t = addr.level = 0;
+  if (etree_initcursor(ep, addr) != 0) {
+    fprintf(stderr, "Failed to init etree cursor: %s\n",
+	    etree_strerror(etree_errno(ep)));
+    ucvm_etree_mem_free(m);
+    return(UCVM_CODE_ERROR);
+  }
+
+  do {
+    if (m->num >= len) {
+      len = 2 * len;
+      rec = realloc(m->rec, len * m->recsize);
+      if (rec == NULL) {
+	fprintf(stderr, "Failed to allocate in-memory etree\n");
+	etree_stopcursor(ep);
+	ucvm_etree_mem_free(m);
+	return(UCVM_CODE_ERROR);
+      }
+      m->rec = rec;
+    }
+
+    leaf = (ucvm_etree_leaf_t *)(m->rec + m->num * m->recsize);
+    if (etree_getcursor(ep, &addr, "*", leaf + 1) != 0) {
+      fprintf(stderr, "Failed to read etree cursor: %s\n",
+	      etree_strerror(etree_errno(ep)));
+      etree_stopcursor(ep);
+      ucvm_etree_mem_free(m);
+      return(UCVM_CODE_ERROR);
+    }
+    if (addr.type != ETREE_LEAF) {
+      continue;
+    }
+    leaf->x = addr.x;
+    leaf->y = addr.y;
+    leaf->z = addr.z;
+    leaf->level = addr.level;
+    if ((m->num > 0) &&
+	(ucvm_etree_leaf_cmp((char *)leaf - m->recsize, leaf) > 0)) {
+      sorted = 0;
+    }
+    m->num++;
+  } while (etree_advcursor(ep) == 0);
+
+  if (etree_errno(ep) != ET_END_OF_TREE) {
+    fprintf(stderr, "Failed to advance etree cursor: %s\n",
+	    etree_strerror(etree_errno(ep)));
+    etree_stopcursor(ep);
+    ucvm_etree_mem_free(m);
+    return(UCVM_CODE_ERROR);
+  }
+  etree_stopcursor(ep);
+
+  /* Cursor order normally is the search order already */
+  if (!sorted) {
+    qsort(m->rec, m->num, m->recsize, ucvm_etree_leaf_cmp);
+  }
+
+  /* Release the unused tail */
+  if (m->num > 0) {
+    rec = realloc(m->rec, m->num * m->recsize);
+    if (rec != NULL) {
+      m->rec = rec;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  m->secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1.0e-9;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Etree to load into a shared memory segment */
+typedef struct ucvm_etree_mem_src_t
+{
+  ucvm_etree_mem_t *m;
+  etree_t *ep;
+  int size;
+} ucvm_etree_mem_src_t;
+
+
+/* Use leaf records held elsewhere, not to be freed */
+int ucvm_etree_mem_attach(ucvm_etree_mem_t *m, char *rec, size_t bytes,
+			  int size)
+{
+  memset(m, 0, sizeof(ucvm_etree_mem_t));
+  m->size = size;
+  m->recsize = sizeof(ucvm_etree_leaf_t) + ((size + 7) / 8) * 8;
+  if (bytes % m->recsize != 0) {
+    memset(m, 0, sizeof(ucvm_etree_mem_t));
+    return(UCVM_CODE_ERROR);
+  }
+  m->num = bytes / m->recsize;
+  m->rec = rec;
+  m->shared = 1;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Load the leaf octants, and copy them into a new shared memory
+   segment. The private copy is kept if the segment fails */
+int ucvm_etree_mem_shm_load(ucvm_shm_t *shm, void *arg)
+{
+  ucvm_etree_mem_src_t *src = (ucvm_etree_mem_src_t *)arg;
+  void *buf;
+
+  if (ucvm_etree_mem_load(src->m, src->ep, src->size) != 
+      UCVM_CODE_SUCCESS) {
+    return(UCVM_CODE_ERROR);
+  }
+  buf = ucvm_shm_alloc(shm, ucvm_etree_mem_bytes(src->m));
+  if (buf == NULL) {
+    return(UCVM_CODE_ERROR);
+  }
+  memcpy(buf, src->m->rec, ucvm_etree_mem_bytes(src->m));
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Load leaf octants, shared when enabled */
+int ucvm_etree_mem_load_shared(ucvm_etree_mem_t *m, ucvm_shm_t *shm,
+			       etree_t *ep, const char *path, int size)
+{
+  char key[UCVM_SHM_MAX_KEY_LEN];
+  ucvm_etree_mem_src_t src;
+  struct timespec t0, t1;
+  char *rec = NULL;
+
+  memset(m, 0, sizeof(ucvm_etree_mem_t));
+  memset(shm, 0, sizeof(ucvm_shm_t));
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  snprintf(key, UCVM_SHM_MAX_KEY_LEN, "etree:%d:", size);
+  if ((ucvm_shm_isenabled()) && 
+      (ucvm_shm_addfile(key, UCVM_SHM_MAX_KEY_LEN, path) == 
+       UCVM_CODE_SUCCESS)) {
+    src.m = m;
+    src.ep = ep;
+    src.size = size;
+    rec = ucvm_shm_attach(shm, key, ucvm_etree_mem_shm_load, &src);
+  }
+
+  if (rec != NULL) {
+    /* Drop the private copy made by the loader */
+    ucvm_etree_mem_free(m);
+    if (ucvm_etree_mem_attach(m, rec, shm->len, size) != 
+	UCVM_CODE_SUCCESS) {
+      ucvm_shm_detach(shm);
+    } else {
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      m->secs = (t1.tv_sec - t0.tv_sec) + 
+	(t1.tv_nsec - t0.tv_nsec) * 1.0e-9;
+    }
+  }
+
+  if (m->rec == NULL) {
+    return(ucvm_etree_mem_load(m, ep, size));
+  }
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Find the leaf octant containing addr. Returns as etree_search() */
+int ucvm_etree_mem_search(ucvm_etree_mem_t *m, etree_addr_t addr,
+			  etree_addr_t *hitaddr, void *payload)
+{
+  size_t lo, hi, mid;
+  ucvm_etree_leaf_t key;
+  ucvm_etree_leaf_t *leaf;
+  etree_tick_t edge;
+
+  if (m->num == 0) {
+    return(-1);
+  }
+
+  /* Last leaf with origin at or before addr. Leaves do not overlap,
+     so it is the only candidate */
+  key.x = addr.x;
+  key.y = addr.y;
+  key.z = addr.z;
+  lo = 0;
+  hi = m->num;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (ucvm_etree_leaf_cmp(m->rec + mid * m->recsize, &key) <= 0) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  leaf = (ucvm_etree_leaf_t *)(m->rec + lo * m->recsize);
+  edge = (etree_tick_t)1 << (ETREE_MAXLEVEL - leaf->level);
+  if ((addr.x - leaf->x >= edge) || (addr.y - leaf->y >= edge) ||
+      (addr.z - leaf->z >= edge)) {
+    return(-1);
+  }
+
+  if (hitaddr != NULL) {
+    memset(hitaddr, 0, sizeof(etree_addr_t));
+    hitaddr->x = leaf->x;
+    hitaddr->y = leaf->y;
+    hitaddr->z = leaf->z;
+    hitaddr->level = leaf->level;
+    hitaddr->type = ETREE_LEAF;
+  }
+  memcpy(payload, leaf + 1, m->size);
+
+  return(0);
+}
+
+
+/* Resident size in bytes */
+size_t ucvm_etree_mem_bytes(ucvm_etree_mem_t *m)
+{
+  return(m->num * m->recsize);
+}
+
+
+/* Free leaf records */
+void ucvm_etree_mem_free(ucvm_etree_mem_t *m)
+{
+  if (!m->shared) {
+    free(m->rec);
+  }
+  memset(m, 0, sizeof(ucvm_etree_mem_t));
+  return;
+}
@@ -0,0 +1,56 @@
+#ifndef UCVM_ETREE_MEM_H
+#define UCVM_ETREE_MEM_H
+
+#include <stddef.h>
+#include "etree.h"
+#include "ucvm_dtypes.h"
+#include "ucvm_shm.h"
+
+
+/* Leaf octant record. Followed by the payload, padded to 8 bytes */
+typedef struct ucvm_etree_leaf_t
+{
+  etree_tick_t x;
+  etree_tick_t y;
+  etree_tick_t z;
+  int level;
+} ucvm_etree_leaf_t;
+
+
+/* Etree held in memory as leaf records sorted in locational code
+   order */
+typedef struct ucvm_etree_mem_t
+{
+  size_t num;
+  size_t recsize;
+  int size;
+  char *rec;
+  int shared;
+  double secs;
+} ucvm_etree_mem_t;
+
+
+/* Read every leaf octant of ep with payloads of size bytes */
+int ucvm_etree_mem_load(ucvm_etree_mem_t *m, etree_t *ep, int size);
+
+
+/* As ucvm_etree_mem_load() for the etree file path, placing the
+   leaf octants in shared memory when enabled */
+int ucvm_etree_mem_load_shared(ucvm_etree_mem_t *m, ucvm_shm_t *shm,
+			       etree_t *ep, const char *path, int size);
+
+
+/* Find the leaf octant containing addr. Returns as etree_search() */
+int ucvm_etree_mem_search(ucvm_etree_mem_t *m, etree_addr_t addr,
+			  etree_addr_t *hitaddr, void *payload);
+
+
+/* Resident size in bytes */
+size_t ucvm_etree_mem_bytes(ucvm_etree_mem_t *m);
+
+
+/* Free leaf records */
+void ucvm_etree_mem_free(ucvm_etree_mem_t *m);
+
+
+#endif
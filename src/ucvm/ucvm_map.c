@@ -2,16 +2,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "etree.h"
 #include "ucvm_utils.h"
 #include "ucvm_meta_etree.h"
 #include "ucvm_map.h"
 #include "ucvm_proj_ucvm.h"
+#include "ucvm_etree_cache.h"
 
 
 /* Etree buffer size in MB */
 #define UCVM_MAP_BUF_SIZE 64
 
+/* Raster map file header */
+#define UCVM_MAP_RASTER_MAGIC "UCVMRST1"
+#define UCVM_MAP_RASTER_HDR_SIZE 4096
+
+
+/* Raster map header. Followed by ny rows of nx surf,vs30 float pairs, 
+   in native byte order. The last row and column hold the samples 
+   used at the clamped far edges of the etree grid */
+typedef struct ucvm_map_raster_hdr_t {
+  char magic[8];
+  int nx;
+  int ny;
+  int level;
+  char appmeta[UCVM_MAP_RASTER_HDR_SIZE - 20];
+} ucvm_map_raster_hdr_t;
+
 
 /* Map information */
 int ucvm_map_init_flag = 0;
@@ -23,10 +44,132 @@ int ucvm_map_level;
 double ucvm_map_max_len;
 etree_tick_t ucvm_map_edgetics;
 double ucvm_map_edgesize;
+char ucvm_map_path[UCVM_MAX_PATH_LEN];
+int ucvm_map_serial = 0;
+void *ucvm_map_raster_mem = NULL;
+size_t ucvm_map_raster_size = 0;
+ucvm_mpayload_t *ucvm_map_raster = NULL;
+int ucvm_map_raster_nx;
+int ucvm_map_raster_ny;
+ucvm_etree_batch_t ucvm_map_batch;
+int ucvm_map_inmem = 0;
+ucvm_etree_mem_t ucvm_map_mem;
+ucvm_shm_t ucvm_map_shm;
+
+
+/* Per-context map state */
+typedef struct ucvm_map_state_t {
+  etree_t *ep;
+  ucvm_proj_t proj;
+  ucvm_etree_batch_t batch;
+  int serial;
+} ucvm_map_state_t;
+
+
+/* Setup projection and grid from map metadata */
+int ucvm_map_setup(const char *conf)
+{
+  /* Setup projection */
+  if (ucvm_proj_ucvm_init(ucvm_map_meta.projstr, 
+			  &(ucvm_map_meta.origin), 
+			  ucvm_map_meta.rot,
+			  &(ucvm_map_meta.dims_xyz),
+			  &(ucvm_map_proj)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to setup proj %s.\n", 
+	    ucvm_map_meta.projstr);
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Determine length of longest side */
+  if (ucvm_map_meta.dims_xyz.coord[0] > ucvm_map_meta.dims_xyz.coord[1]) {
+    ucvm_map_max_len = ucvm_map_meta.dims_xyz.coord[0];
+  } else {
+    ucvm_map_max_len = ucvm_map_meta.dims_xyz.coord[1];
+  }
+
+  /* Compute level based on grid spacing */
+  ucvm_map_level = ceil(log(ucvm_map_max_len/
+			    ucvm_map_meta.spacing) /log(2.0));
+
+  /* Compute edge size in tics */
+  ucvm_map_edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - ucvm_map_level);
+
+  /* Compute edge size in meters */
+  ucvm_map_edgesize = ucvm_map_max_len/
+    (double)((etree_tick_t)1<<ucvm_map_level);
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Init raster map */
+int ucvm_map_raster_init(const char *conf)
+{
+  int fd;
+  struct stat st;
+  ucvm_map_raster_hdr_t *hdr;
+  char appmeta[sizeof(hdr->appmeta)];
+
+  fd = open(conf, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open raster map %s\n", conf);
+    return(UCVM_CODE_ERROR);
+  }
+  if ((fstat(fd, &st) != 0) || 
+      (st.st_size < UCVM_MAP_RASTER_HDR_SIZE)) {
+    fprintf(stderr, "Raster map %s is truncated\n", conf);
+    close(fd);
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Shared, read-only mapping so the page cache serves all processes */
+  hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED) {
+    fprintf(stderr, "Failed to map raster map %s\n", conf);
+    return(UCVM_CODE_ERROR);
+  }
+  ucvm_map_raster_mem = hdr;
+  ucvm_map_raster_size = st.st_size;
+
+  if ((memcmp(hdr->magic, UCVM_MAP_RASTER_MAGIC, 8) != 0) ||
+      (memchr(hdr->appmeta, 0, sizeof(hdr->appmeta)) == NULL)) {
+    fprintf(stderr, "Raster map %s has an invalid header\n", conf);
+    return(UCVM_CODE_ERROR);
+  }
+  ucvm_map_raster_nx = hdr->nx;
+  ucvm_map_raster_ny = hdr->ny;
+  if ((hdr->nx < 2) || (hdr->ny < 2) ||
+      ((size_t)st.st_size != UCVM_MAP_RASTER_HDR_SIZE + 
+       (size_t)hdr->nx * hdr->ny * sizeof(ucvm_mpayload_t))) {
+    fprintf(stderr, "Raster map %s is truncated\n", conf);
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Metadata is copied from the source etree */
+  ucvm_strcpy(appmeta, hdr->appmeta, sizeof(hdr->appmeta));
+  if (ucvm_meta_etree_map_unpack(appmeta, &ucvm_map_meta) != 
+      UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to unpack metadata from raster map %s\n", 
+	    conf);
+    return(UCVM_CODE_ERROR);
+  }
+  if (ucvm_map_setup(conf) != UCVM_CODE_SUCCESS) {
+    return(UCVM_CODE_ERROR);
+  }
+  if (ucvm_map_level != hdr->level) {
+    fprintf(stderr, "Raster map %s does not match its metadata\n", conf);
+    return(UCVM_CODE_ERROR);
+  }
+  ucvm_map_raster = (ucvm_mpayload_t *)((char *)hdr + 
+					UCVM_MAP_RASTER_HDR_SIZE);
+
+  return(UCVM_CODE_SUCCESS);
+}
 
 
 /* Init Map */
-int ucvm_map_init(const char *label, const char *conf)
+int ucvm_map_init(const char *label, const char *iface, const char *conf)
 {
   char *appmeta;
 
@@ -46,12 +189,31 @@ int ucvm_map_init(const char *label, const char *conf)
   }
 
   if (!ucvm_is_file(conf)) {
-    fprintf(stderr, "Etree map %s is not a valid file\n", conf);
+    fprintf(stderr, "Map %s is not a valid file\n", conf);
     return(UCVM_CODE_ERROR);
   }
 
-  /* Save label */
+  /* Save label and path */
   ucvm_strcpy(ucvm_map_label_str, label, UCVM_MAX_LABEL_LEN);
+  ucvm_strcpy(ucvm_map_path, conf, UCVM_MAX_PATH_LEN);
+
+  if (strcmp(iface, UCVM_MAP_RASTER) == 0) {
+    if (ucvm_map_raster_init(conf) != UCVM_CODE_SUCCESS) {
+      if (ucvm_map_raster_mem != NULL) {
+	munmap(ucvm_map_raster_mem, ucvm_map_raster_size);
+	ucvm_map_raster_mem = NULL;
+      }
+      ucvm_map_raster = NULL;
+      ucvm_proj_ucvm_finalize(&ucvm_map_proj);
+      return(UCVM_CODE_ERROR);
+    }
+    ucvm_map_serial++;
+    ucvm_map_init_flag = 1;
+    return(UCVM_CODE_SUCCESS);
+  } else if (strcmp(iface, UCVM_MAP_ETREE) != 0) {
+    fprintf(stderr, "Unsupported map interface %s\n", iface);
+    return(UCVM_CODE_ERROR);
+  }
 
   /* Open Etree map */
   ucvm_map_ep = etree_open(conf, O_RDONLY, UCVM_MAP_BUF_SIZE, 0, 3);
@@ -73,35 +235,11 @@ int ucvm_map_init(const char *label, const char *conf)
   }
   free(appmeta);
 
-  /* Setup projection */
-  if (ucvm_proj_ucvm_init(ucvm_map_meta.projstr, 
-			  &(ucvm_map_meta.origin), 
-			  ucvm_map_meta.rot,
-			  &(ucvm_map_meta.dims_xyz),
-			  &(ucvm_map_proj)) != UCVM_CODE_SUCCESS) {
-    fprintf(stderr, "Failed to setup proj %s.\n", 
-	    ucvm_map_meta.projstr);
+  if (ucvm_map_setup(conf) != UCVM_CODE_SUCCESS) {
     return(UCVM_CODE_ERROR);
   }
 
-  /* Determine length of longest side */
-  if (ucvm_map_meta.dims_xyz.coord[0] > ucvm_map_meta.dims_xyz.coord[1]) {
-    ucvm_map_max_len = ucvm_map_meta.dims_xyz.coord[0];
-  } else {
-    ucvm_map_max_len = ucvm_map_meta.dims_xyz.coord[1];
-  }
-
-  /* Compute level based on grid spacing */
-  ucvm_map_level = ceil(log(ucvm_map_max_len/
-			    ucvm_map_meta.spacing) /log(2.0));
-
-  /* Compute edge size in tics */
-  ucvm_map_edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - ucvm_map_level);
-
-  /* Compute edge size in meters */
-  ucvm_map_edgesize = ucvm_map_max_len/
-    (double)((etree_tick_t)1<<ucvm_map_level);
-
+  ucvm_map_serial++;
   ucvm_map_init_flag = 1;
 
   return(UCVM_CODE_SUCCESS);
@@ -112,8 +250,19 @@ int ucvm_map_init(const char *label, const char *conf)
 int ucvm_map_finalize()
 {
   if (ucvm_map_init_flag) {
-    etree_close(ucvm_map_ep);
+    if (ucvm_map_raster != NULL) {
+      munmap(ucvm_map_raster_mem, ucvm_map_raster_size);
+      ucvm_map_raster_mem = NULL;
+      ucvm_map_raster = NULL;
+    } else {
+      etree_close(ucvm_map_ep);
+    }
+    ucvm_map_ep = NULL;
     ucvm_proj_ucvm_finalize(&ucvm_map_proj);
+    ucvm_etree_batch_free(&ucvm_map_batch);
+    ucvm_etree_mem_free(&ucvm_map_mem);
+    ucvm_shm_detach(&ucvm_map_shm);
+    ucvm_map_inmem = 0;
   }
 
   ucvm_map_init_flag = 0;
@@ -122,6 +271,37 @@ int ucvm_map_finalize()
 }
 
 
+/* Set map parameter */
+int ucvm_map_setparam(const char *pstr, const char *pval)
+{
+  if (ucvm_map_init_flag == 0) {
+    fprintf(stderr, "UCVM map interface not initialized\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Raster maps are already memory resident */
+  if ((strcmp(pstr, "IN_MEMORY") == 0) && (strcmp(pval, "True") == 0) &&
+      (ucvm_map_raster == NULL) && (ucvm_map_inmem == 0)) {
+    if (ucvm_etree_mem_load_shared(&ucvm_map_mem, &ucvm_map_shm, 
+				   ucvm_map_ep, ucvm_map_path, 
+				   sizeof(ucvm_mpayload_t)) != 
+	UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to load map %s into memory\n", 
+	      ucvm_map_path);
+      return(UCVM_CODE_ERROR);
+    }
+    ucvm_map_inmem = 1;
+
+    fprintf(stderr, "Loaded map %s: %lu octants, %.1f MB in %.2f s%s\n", 
+	    ucvm_map_label_str, (unsigned long)ucvm_map_mem.num, 
+	    ucvm_etree_mem_bytes(&ucvm_map_mem) / 1048576.0, 
+	    ucvm_map_mem.secs, (ucvm_map_mem.shared) ? ", shared" : "");
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Get Version Map */
 int ucvm_map_version(char *ver, int len)
 {
@@ -164,22 +344,228 @@ int ucvm_map_label(char *label, int len)
 }
 
 
+/* Create private map state for a query context */
+int ucvm_map_ctx_init(void **state)
+{
+  ucvm_map_state_t *st;
+
+  if (ucvm_map_init_flag == 0) {
+    fprintf(stderr, "UCVM map interface is not initialized\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  st = malloc(sizeof(ucvm_map_state_t));
+  if (st == NULL) {
+    fprintf(stderr, "Failed to allocate map state\n");
+    return(UCVM_CODE_ERROR);
+  }
+  st->serial = ucvm_map_serial;
+
+  /* The raster mapping and in-memory etree are read-only and shared 
+     by all contexts */
+  if ((ucvm_map_raster != NULL) || (ucvm_map_inmem)) {
+    st->ep = NULL;
+  } else {
+    st->ep = etree_open(ucvm_map_path, O_RDONLY, UCVM_MAP_BUF_SIZE, 0, 3);
+  }
+  if ((st->ep == NULL) && (ucvm_map_raster == NULL) && 
+      (ucvm_map_inmem == 0)) {
+    fprintf(stderr, "Failed to open the etree %s\n", ucvm_map_path);
+    free(st);
+    return(UCVM_CODE_ERROR);
+  }
+
+  if (ucvm_proj_ucvm_init(ucvm_map_meta.projstr, 
+			  &(ucvm_map_meta.origin), 
+			  ucvm_map_meta.rot,
+			  &(ucvm_map_meta.dims_xyz),
+			  &(st->proj)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to setup proj %s.\n", 
+	    ucvm_map_meta.projstr);
+    if (st->ep != NULL) {
+      etree_close(st->ep);
+    }
+    free(st);
+    return(UCVM_CODE_ERROR);
+  }
+  memset(&(st->batch), 0, sizeof(ucvm_etree_batch_t));
+
+  *state = st;
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Free private map state */
+int ucvm_map_ctx_finalize(void *state)
+{
+  ucvm_map_state_t *st = (ucvm_map_state_t *)state;
+
+  if (st != NULL) {
+    if (st->ep != NULL) {
+      etree_close(st->ep);
+    }
+    ucvm_proj_ucvm_finalize(&(st->proj));
+    ucvm_etree_batch_free(&(st->batch));
+    free(st);
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Read raster node, clamping to the far edge samples */
+void ucvm_map_raster_read(int x, int y, ucvm_mpayload_t *q)
+{
+  if (x >= ucvm_map_raster_nx) {
+    x = ucvm_map_raster_nx - 1;
+  }
+  if (y >= ucvm_map_raster_ny) {
+    y = ucvm_map_raster_ny - 1;
+  }
+  *q = ucvm_map_raster[(size_t)y * ucvm_map_raster_nx + x];
+  return;
+}
+
+
+/* Write the current etree map as a raster map */
+int ucvm_map_write_raster(const char *path)
+{
+  int x, y, nx, ny;
+  FILE *fp;
+  char *appmeta;
+  etree_addr_t addr;
+  ucvm_map_raster_hdr_t hdr;
+  ucvm_mpayload_t *row;
+
+  if ((ucvm_map_init_flag == 0) || (ucvm_map_ep == NULL)) {
+    fprintf(stderr, "No etree map is initialized\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* One node per octant edge, plus the clamped far edge */
+  nx = (ucvm_map_meta.ticks_xyz.dim[0] + ucvm_map_edgetics - 1) / 
+    ucvm_map_edgetics + 1;
+  ny = (ucvm_map_meta.ticks_xyz.dim[1] + ucvm_map_edgetics - 1) / 
+    ucvm_map_edgetics + 1;
+
+  memset(&hdr, 0, sizeof(ucvm_map_raster_hdr_t));
+  memcpy(hdr.magic, UCVM_MAP_RASTER_MAGIC, 8);
+  hdr.nx = nx;
+  hdr.ny = ny;
+  hdr.level = ucvm_map_level;
+  appmeta = etree_getappmeta(ucvm_map_ep);
+  if ((appmeta == NULL) || (strlen(appmeta) >= sizeof(hdr.appmeta))) {
+    fprintf(stderr, "Failed to read metadata from etree %s\n", 
+	    ucvm_map_path);
+    free(appmeta);
+    return(UCVM_CODE_ERROR);
+  }
+  ucvm_strcpy(hdr.appmeta, appmeta, sizeof(hdr.appmeta));
+  free(appmeta);
+
+  row = malloc(nx * sizeof(ucvm_mpayload_t));
+  if (row == NULL) {
+    fprintf(stderr, "Failed to allocate raster row buffer\n");
+    return(UCVM_CODE_ERROR);
+  }
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open raster map %s\n", path);
+    free(row);
+    return(UCVM_CODE_ERROR);
+  }
+  if (fwrite(&hdr, sizeof(ucvm_map_raster_hdr_t), 1, fp) != 1) {
+    fprintf(stderr, "Failed to write raster map %s\n", path);
+    fclose(fp);
+    free(row);
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Sample the same addresses ucvm_map_ctx_query() would search */
+  for (y = 0; y < ny; y++) {
+    for (x = 0; x < nx; x++) {
+      addr.x = x*ucvm_map_edgetics;
+      addr.y = y*ucvm_map_edgetics;
+      addr.z = 0;
+      addr.level = ETREE_MAXLEVEL;
+      if ((x == nx - 1) || (addr.x >= ucvm_map_meta.ticks_xyz.dim[0])) {
+	addr.x = ucvm_map_meta.ticks_xyz.dim[0] - ucvm_map_edgetics; 
+      }
+      if ((y == ny - 1) || (addr.y >= ucvm_map_meta.ticks_xyz.dim[1])) {
+	addr.y = ucvm_map_meta.ticks_xyz.dim[1] - ucvm_map_edgetics; 
+      }
+      if (etree_search(ucvm_map_ep, addr, NULL, "*", &(row[x])) != 0) {
+	fprintf(stderr, "%s (%d %d %d)\n", 
+		etree_strerror(etree_errno(ucvm_map_ep)),
+		addr.x, addr.y, addr.z);
+	fclose(fp);
+	free(row);
+	return(UCVM_CODE_ERROR);
+      }
+    }
+    if (fwrite(row, sizeof(ucvm_mpayload_t), nx, fp) != nx) {
+      fprintf(stderr, "Failed to write raster map %s\n", path);
+      fclose(fp);
+      free(row);
+      return(UCVM_CODE_ERROR);
+    }
+  }
+
+  free(row);
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Failed to write raster map %s\n", path);
+    return(UCVM_CODE_ERROR);
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Query Map */
 int ucvm_map_query(ucvm_ctype_t cmode,
 		   int n, ucvm_point_t *pnt, ucvm_data_t *data)
 {
-  int i, x, y;
+  return(ucvm_map_ctx_query(NULL, cmode, n, pnt, data));
+}
+
+
+/* Query Map with private state */
+int ucvm_map_ctx_query(void *state, ucvm_ctype_t cmode,
+		       int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int i, j, k, b, nb, x, y;
   int x0, y0;
   ucvm_point_t xy;
+  int gstatus[UCVM_PROJ_BATCH];
+  ucvm_point_t gxy[UCVM_PROJ_BATCH];
   etree_addr_t addr;
   double p[2][2];
   ucvm_mpayload_t q[2][2];
+  etree_t *ep;
+  ucvm_proj_t *proj;
+  ucvm_etree_batch_t *batch;
+  ucvm_map_state_t *st = (ucvm_map_state_t *)state;
   
   if (ucvm_map_init_flag == 0) {
     fprintf(stderr, "UCVM map interface is not initialized");
     return(UCVM_CODE_ERROR);
   }
 
+  if (st == NULL) {
+    ep = ucvm_map_ep;
+    proj = &ucvm_map_proj;
+    batch = &ucvm_map_batch;
+  } else {
+    if (st->serial != ucvm_map_serial) {
+      fprintf(stderr, "Map state is stale, map was changed\n");
+      return(UCVM_CODE_ERROR);
+    }
+    ep = st->ep;
+    proj = &(st->proj);
+    batch = &(st->batch);
+  }
+  batch->num = 0;
+
   /* Check query mode */
   switch (cmode) {
   case UCVM_COORD_GEO_DEPTH:
@@ -197,72 +583,121 @@ int ucvm_map_query(ucvm_ctype_t cmode,
   p[1][0] = 1.0;
   p[1][1] = 1.0;
 
-  for (i = 0; i < n; i++) {
-    /* Convert point from geo to xy offset in meters */
-    if (ucvm_proj_ucvm_geo2xy(&(ucvm_map_proj), 
-			      &(pnt[i]),
-			      &xy) == UCVM_CODE_SUCCESS) {
-      if ((xy.coord[0] >= 0.0) && 
-	  (xy.coord[0] < ucvm_map_meta.dims_xyz.coord[0]) &&
-	  (xy.coord[1] >= 0.0) &&
-	  (xy.coord[1] < ucvm_map_meta.dims_xyz.coord[1])) {
-
-	/* Calculate grid location in fp and integer octants */
-	xy.coord[0] = xy.coord[0]/ucvm_map_edgesize;
-	xy.coord[1] = xy.coord[1]/ucvm_map_edgesize;
-
-	x0 = (int)(xy.coord[0]);
-	y0 = (int)(xy.coord[1]);
-
-	/* Determine q values for interpolation */
-	for (y = 0; y < 2; y++) {
-	  for (x = 0; x < 2; x++) {
-	    addr.x = (x0 + x)*ucvm_map_edgetics;
-	    addr.y = (y0 + y)*ucvm_map_edgetics;
-	    addr.z = 0;
-	    addr.level = ETREE_MAXLEVEL;
-	    
-	    /* Adjust addresses for edges of grid */
-	    if (addr.x >= ucvm_map_meta.ticks_xyz.dim[0]) {
-	      addr.x = ucvm_map_meta.ticks_xyz.dim[0] - ucvm_map_edgetics; 
-	    }
-	    if (addr.y >= ucvm_map_meta.ticks_xyz.dim[1]) {
-	      addr.y = ucvm_map_meta.ticks_xyz.dim[1] - ucvm_map_edgetics; 
-	    }
-	    
-	    /* Query etree */
-	    if (etree_search(ucvm_map_ep, addr, NULL, "*", &(q[y][x])) == 0) {
-	      //printf("vals: %lf, %lf\n", q[y][x].surf, q[y][x].vs30);
-	    } else {
-	      fprintf(stderr, "%s (%d %d %d)\n", 
-		      etree_strerror(etree_errno(ucvm_map_ep)),
-		      addr.x, addr.y, addr.z);
-	      return(UCVM_CODE_ERROR);
-	    }
+  for (b = 0; b < n; b += UCVM_PROJ_BATCH) {
+    nb = n - b;
+    if (nb > UCVM_PROJ_BATCH) {
+      nb = UCVM_PROJ_BATCH;
+    }
+
+    /* Convert points from geo to xy offset in meters */
+    if (ucvm_proj_ucvm_geo2xy_batch(proj, nb, &(pnt[b]), gxy, 
+				    gstatus) != UCVM_CODE_SUCCESS) {
+      return(UCVM_CODE_ERROR);
+    }
+
+    for (j = 0; j < nb; j++) {
+      i = b + j;
+      if (gstatus[j] == UCVM_CODE_SUCCESS) {
+	xy = gxy[j];
+	if ((xy.coord[0] >= 0.0) && 
+	    (xy.coord[0] < ucvm_map_meta.dims_xyz.coord[0]) &&
+	    (xy.coord[1] >= 0.0) &&
+	    (xy.coord[1] < ucvm_map_meta.dims_xyz.coord[1])) {
+
+	  /* Calculate grid location in fp and integer octants */
+	  xy.coord[0] = xy.coord[0]/ucvm_map_edgesize;
+	  xy.coord[1] = xy.coord[1]/ucvm_map_edgesize;
+
+	  x0 = (int)(xy.coord[0]);
+	  y0 = (int)(xy.coord[1]);
+
+	  addr.x = x0*ucvm_map_edgetics;
+	  addr.y = y0*ucvm_map_edgetics;
+	  addr.z = 0;
+	  addr.level = ETREE_MAXLEVEL;
+	  if (ucvm_etree_batch_add(batch, i, &addr, 
+				   &xy) != UCVM_CODE_SUCCESS) {
+	    return(UCVM_CODE_ERROR);
 	  }
 	}
+      }
+    }
+  }
 
-	/* Bilinear interpolation of values */
-	data[i].surf = interpolate_bilinear(xy.coord[0]-x0, 
-					    xy.coord[1]-y0, 
-					    p[0][0], p[0][1],
-					    p[1][0], p[1][1], 
-					    q[0][0].surf, 
-					    q[0][1].surf, 
-					    q[1][0].surf, 
-					    q[1][1].surf);
-	
-	data[i].vs30 = interpolate_bilinear(xy.coord[0]-x0, 
-					    xy.coord[1]-y0, 
-					    p[0][0], p[0][1],
-					    p[1][0], p[1][1], 
-					    q[0][0].vs30, 
-					    q[0][1].vs30, 
-					    q[1][0].vs30, 
-					    q[1][1].vs30);
+  /* Visit etree cells in locational code order */
+  if (ucvm_map_raster == NULL) {
+    ucvm_etree_batch_sort(batch);
+  }
 
+  for (k = 0; k < batch->num; k++) {
+    if (ucvm_map_raster == NULL) {
+      j = batch->order[k].pos;
+    } else {
+      j = k;
+    }
+    i = batch->idx[j];
+    xy = batch->xy[j];
+    x0 = (int)(xy.coord[0]);
+    y0 = (int)(xy.coord[1]);
+
+    /* Determine q values for interpolation */
+    for (y = 0; y < 2; y++) {
+      for (x = 0; x < 2; x++) {
+	if (ucvm_map_raster != NULL) {
+	  ucvm_map_raster_read(x0 + x, y0 + y, &(q[y][x]));
+	  continue;
+	}
+
+	addr.x = (x0 + x)*ucvm_map_edgetics;
+	addr.y = (y0 + y)*ucvm_map_edgetics;
+	addr.z = 0;
+	addr.level = ETREE_MAXLEVEL;
+	    
+	/* Adjust addresses for edges of grid */
+	if (addr.x >= ucvm_map_meta.ticks_xyz.dim[0]) {
+	  addr.x = ucvm_map_meta.ticks_xyz.dim[0] - ucvm_map_edgetics; 
+	}
+	if (addr.y >= ucvm_map_meta.ticks_xyz.dim[1]) {
+	  addr.y = ucvm_map_meta.ticks_xyz.dim[1] - ucvm_map_edgetics; 
+	}
+	    
+	/* Query etree */
+	if (ucvm_map_inmem) {
+	  if (ucvm_etree_mem_search(&ucvm_map_mem, addr, NULL, 
+				    &(q[y][x])) != 0) {
+	    fprintf(stderr, "Map octant not found (%d %d %d)\n", 
+		    addr.x, addr.y, addr.z);
+	    return(UCVM_CODE_ERROR);
+	  }
+	} else if (etree_search(ep, addr, NULL, "*", &(q[y][x])) == 0) {
+	  //printf("vals: %lf, %lf\n", q[y][x].surf, q[y][x].vs30);
+	} else {
+	  fprintf(stderr, "%s (%d %d %d)\n", 
+		  etree_strerror(etree_errno(ep)),
+		  addr.x, addr.y, addr.z);
+	  return(UCVM_CODE_ERROR);
+	}
       }
     }
+
+    /* Bilinear interpolation of values */
+    data[i].surf = interpolate_bilinear(xy.coord[0]-x0, 
+					xy.coord[1]-y0, 
+					p[0][0], p[0][1],
+					p[1][0], p[1][1], 
+					q[0][0].surf, 
+					q[0][1].surf, 
+					q[1][0].surf, 
+					q[1][1].surf);
+	
+    data[i].vs30 = interpolate_bilinear(xy.coord[0]-x0, 
+					xy.coord[1]-y0, 
+					p[0][0], p[0][1],
+					p[1][0], p[1][1], 
+					q[0][0].vs30, 
+					q[0][1].vs30, 
+					q[1][0].vs30, 
+					q[1][1].vs30);
   }
 
   return(UCVM_CODE_SUCCESS);
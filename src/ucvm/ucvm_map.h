@@ -5,14 +5,18 @@
 #include "ucvm_dtypes.h"
 
 
-/* Init Map */
-int ucvm_map_init(const char *label, const char *conf);
+/* Init Map. iface is UCVM_MAP_ETREE or UCVM_MAP_RASTER */
+int ucvm_map_init(const char *label, const char *iface, const char *conf);
 
 
 /* Finalize Map */
 int ucvm_map_finalize();
 
 
+/* Set map parameter. IN_MEMORY,True loads an etree map into memory */
+int ucvm_map_setparam(const char *pstr, const char *pval);
+
+
 /* Get Version Map */
 int ucvm_map_version(char *ver, int len);
 
@@ -21,9 +25,26 @@ int ucvm_map_version(char *ver, int len);
 int ucvm_map_label(char *label, int len);
 
 
+/* Write the current etree map as a raster map */
+int ucvm_map_write_raster(const char *path);
+
+
 /* Query Map */
 int ucvm_map_query(ucvm_ctype_t cmode,
 		   int n, ucvm_point_t *pnt, ucvm_data_t *data);
 
 
+/* Create private map state for a query context */
+int ucvm_map_ctx_init(void **state);
+
+
+/* Free private map state */
+int ucvm_map_ctx_finalize(void *state);
+
+
+/* Query Map with private state, NULL selects the shared state */
+int ucvm_map_ctx_query(void *state, ucvm_ctype_t cmode,
+		       int n, ucvm_point_t *pnt, ucvm_data_t *data);
+
+
 #endif
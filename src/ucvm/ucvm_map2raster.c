@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ucvm_dtypes.h"
+#include "ucvm_map.h"
+
+
+/* Usage function */
+void usage() {
+  printf("Usage: ucvm_map2raster [-h] map.e map.r\n\n");
+  printf("where:\n");
+  printf("\t-h This help message.\n");
+  printf("\tmap.e Input elevation/vs30 map etree.\n");
+  printf("\tmap.r Output raster map, for use with map_raster.\n\n");
+  printf("Version: %s\n\n", VERSION);
+  return;
+}
+
+
+int main(int argc, char **argv)
+{
+  if ((argc != 3) || (strcmp(argv[1], "-h") == 0)) {
+    usage();
+    exit(1);
+  }
+
+  /* Open etree map */
+  if (ucvm_map_init(UCVM_MAP_UCVM, UCVM_MAP_ETREE, argv[1]) !=
+      UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to open map %s\n", argv[1]);
+    return(1);
+  }
+
+  /* Convert */
+  if (ucvm_map_write_raster(argv[2]) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to write raster map %s\n", argv[2]);
+    ucvm_map_finalize();
+    return(1);
+  }
+
+  ucvm_map_finalize();
+  return(0);
+}
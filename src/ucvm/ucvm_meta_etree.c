@@ -191,7 +191,7 @@ int ucvm_meta_etree_ucvm_pack(ucvm_meta_ucvm_t *meta,
 int ucvm_meta_etree_ucvm_unpack(char *metastr, ucvm_meta_ucvm_t *meta)
 {
   int index;
-  char *token;
+  char *token, *saveptr;
 
   if ((metastr == NULL) || (meta == NULL)) {
     return(UCVM_CODE_ERROR);
@@ -200,7 +200,7 @@ int ucvm_meta_etree_ucvm_unpack(char *metastr, ucvm_meta_ucvm_t *meta)
   /* Looks overlay elaborate, but allows spaces to be present 
      in any string */
   index = 0;
-  token = strtok(metastr, UCVM_META_ETREE_SEP);
+  token = strtok_r(metastr, UCVM_META_ETREE_SEP, &saveptr);
   while (token != NULL) {
     switch (index) {
     case 0:
@@ -283,7 +283,7 @@ int ucvm_meta_etree_ucvm_unpack(char *metastr, ucvm_meta_ucvm_t *meta)
       break;
     }
     index++;
-    token = strtok(NULL, UCVM_META_ETREE_SEP);
+    token = strtok_r(NULL, UCVM_META_ETREE_SEP, &saveptr);
   }
 
   if (index != 13) {
@@ -340,7 +340,7 @@ int ucvm_meta_etree_map_pack(ucvm_meta_map_t *meta,
 int ucvm_meta_etree_map_unpack(char *metastr, ucvm_meta_map_t *meta)
 {
   int index;
-  char *token;
+  char *token, *saveptr;
 
   if ((metastr == NULL) || (meta == NULL)) {
     return(UCVM_CODE_ERROR);
@@ -349,7 +349,7 @@ int ucvm_meta_etree_map_unpack(char *metastr, ucvm_meta_map_t *meta)
   /* Looks overlay elaborate, but allows spaces to be present 
      in any string */
   index = 0;
-  token = strtok(metastr, UCVM_META_ETREE_SEP);
+  token = strtok_r(metastr, UCVM_META_ETREE_SEP, &saveptr);
   while (token != NULL) {
     switch (index) {
     case 0:
@@ -420,7 +420,7 @@ int ucvm_meta_etree_map_unpack(char *metastr, ucvm_meta_map_t *meta)
       break;
     }
     index++;
-    token = strtok(NULL, UCVM_META_ETREE_SEP);
+    token = strtok_r(NULL, UCVM_META_ETREE_SEP, &saveptr);
   }
 
   if (index != 11) {
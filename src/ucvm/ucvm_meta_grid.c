@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <string.h>
+#include "ucvm_meta_grid.h"
+
+
+/* Pack grid volume header */
+int ucvm_meta_grid_pack(ucvm_meta_ucvm_t *meta, char *header, int len)
+{
+  int mlen;
+
+  if ((meta == NULL) || (header == NULL) ||
+      (len < UCVM_META_GRID_HEADER_LEN)) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  memset(header, 0, UCVM_META_GRID_HEADER_LEN);
+  mlen = strlen(UCVM_META_GRID_MAGIC);
+  memcpy(header, UCVM_META_GRID_MAGIC, mlen);
+  return(ucvm_meta_etree_ucvm_pack(meta, header + mlen,
+				   UCVM_META_GRID_HEADER_LEN - mlen));
+}
+
+
+/* Unpack grid volume header */
+int ucvm_meta_grid_unpack(const char *header, int len,
+			  ucvm_meta_ucvm_t *meta)
+{
+  int mlen;
+  char metastr[UCVM_META_GRID_HEADER_LEN];
+
+  mlen = strlen(UCVM_META_GRID_MAGIC);
+  if ((header == NULL) || (meta == NULL) ||
+      (len < UCVM_META_GRID_HEADER_LEN) ||
+      (memcmp(header, UCVM_META_GRID_MAGIC, mlen) != 0)) {
+    fprintf(stderr, "Not a grid volume header\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Unpacking tokenizes in place */
+  memcpy(metastr, header + mlen, UCVM_META_GRID_HEADER_LEN - mlen);
+  metastr[UCVM_META_GRID_HEADER_LEN - mlen - 1] = '\0';
+  memset(meta, 0, sizeof(ucvm_meta_ucvm_t));
+  if (ucvm_meta_etree_ucvm_unpack(metastr, meta) != UCVM_CODE_SUCCESS) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  if ((meta->ticks_xyz.dim[0] < 2) || (meta->ticks_xyz.dim[1] < 2) ||
+      (meta->ticks_xyz.dim[2] < 2) || (meta->dims_xyz.coord[0] <= 0.0) ||
+      (meta->dims_xyz.coord[1] <= 0.0) ||
+      (meta->dims_xyz.coord[2] <= 0.0)) {
+    fprintf(stderr, "Invalid grid volume dimensions\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Get the number of nodes per property array */
+size_t ucvm_meta_grid_nodes(ucvm_meta_ucvm_t *meta)
+{
+  return((size_t)meta->ticks_xyz.dim[0] * meta->ticks_xyz.dim[1] *
+	 meta->ticks_xyz.dim[2]);
+}
@@ -0,0 +1,39 @@
+#ifndef UCVM_META_GRID_H
+#define UCVM_META_GRID_H
+
+#include "ucvm_dtypes.h"
+#include "ucvm_meta_etree.h"
+
+
+/* Grid volume file magic */
+#define UCVM_META_GRID_MAGIC "UCVMGRD1"
+
+/* Grid volume header length. Page aligned so that the property
+   arrays can be mapped in place */
+#define UCVM_META_GRID_HEADER_LEN 4096
+
+
+/* A grid volume is a header of UCVM_META_GRID_HEADER_LEN bytes,
+   holding the magic and the packed UCVM model metadata, followed by
+   little endian float32 vp, vs and rho arrays of nx*ny*nz nodes each,
+   x fastest. ticks_xyz holds nx,ny,nz and dims_xyz the extents in
+   meters, so node i,j,k lies at i*dx,j*dy,k*dz in projected x,y and
+   depth below the free surface, with dx = dims_xyz[0]/(nx-1). Nodes
+   without model data hold 0.0 */
+
+
+/* Pack grid volume header. len must be at least
+   UCVM_META_GRID_HEADER_LEN */
+int ucvm_meta_grid_pack(ucvm_meta_ucvm_t *meta, char *header, int len);
+
+
+/* Unpack grid volume header */
+int ucvm_meta_grid_unpack(const char *header, int len,
+			  ucvm_meta_ucvm_t *meta);
+
+
+/* Get the number of nodes per property array */
+size_t ucvm_meta_grid_nodes(ucvm_meta_ucvm_t *meta);
+
+
+#endif
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include "ucvm.h"
+#include "ucvm_utils.h"
+#include "ucvm_proj_ucvm.h"
+#include "ucvm_meta_grid.h"
+
+/* Default grid projection */
+#define GRID_DEFAULT_PROJ "+proj=utm +datum=WGS84 +zone=11"
+
+/* Getopt flags */
+extern char *optarg;
+extern int optind, opterr, optopt;
+
+
+/* Usage function */
+void usage() {
+  printf("Usage: ucvm_model2grid [-h] [-f config] [-m models<:ifunc>] [-p user_map]\n");
+  printf("                       [-z zmin,zmax] [-P proj] [-r rot] -c lon,lat\n");
+  printf("                       -d xsize,ysize,zsize -n nx,ny,nz grid.vol\n\n");
+  printf("Flags:\n");
+  printf("\t-h This help message.\n");
+  printf("\t-f Configuration file. Default is ./ucvm.conf.\n");
+  printf("\t-m Comma delimited list of crustal/GTL models to query in order\n");
+  printf("\t   of preference. GTL models may optionally be suffixed with ':ifunc'\n");
+  printf("\t   to specify interpolation function.\n");
+  printf("\t-p User-defined map to use for elevation and vs30 data.\n");
+  printf("\t-z Optional depth range for gtl/crust interpolation.\n");
+  printf("\t-P Grid projection. Default is %s.\n", GRID_DEFAULT_PROJ);
+  printf("\t-r Grid rotation in degrees. Default is 0.\n");
+  printf("\t-c Longitude,latitude of the grid origin corner.\n");
+  printf("\t-d Grid extents in meters, depth from the free surface.\n");
+  printf("\t-n Nodes along each axis, at least 2.\n\n");
+  printf("Samples the model stack on a regular grid and writes it as a\n");
+  printf("grid volume, for use as a model_grid model:\n\n");
+  printf("\t<label>_interface=model_grid\n");
+  printf("\t<label>_modelpath=grid.vol\n\n");
+  printf("Version: %s\n\n", VERSION);
+  return;
+}
+
+
+/* Sample the model stack row by row into the mapped volume */
+int sample_grid(ucvm_meta_ucvm_t *meta, float *vol, size_t *nogap)
+{
+  int i, j, k, nx, ny, nz;
+  size_t n, o;
+  double dx, dy, dz;
+  double *lonlat, *depths;
+  ucvm_data_t *data;
+  ucvm_point_t xy, geo;
+  ucvm_proj_t proj;
+  float *vp, *vs, *rho;
+  int swap;
+
+  nx = meta->ticks_xyz.dim[0];
+  ny = meta->ticks_xyz.dim[1];
+  nz = meta->ticks_xyz.dim[2];
+  dx = meta->dims_xyz.coord[0] / (nx - 1);
+  dy = meta->dims_xyz.coord[1] / (ny - 1);
+  dz = meta->dims_xyz.coord[2] / (nz - 1);
+  n = ucvm_meta_grid_nodes(meta);
+  vp = vol;
+  vs = vp + n;
+  rho = vs + n;
+  swap = (system_endian() != UCVM_BYTEORDER_LSB);
+
+  if (ucvm_proj_ucvm_init(meta->projstr, &(meta->origin), meta->rot,
+			  &(meta->dims_xyz), &proj) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to setup proj %s.\n", meta->projstr);
+    return(UCVM_CODE_ERROR);
+  }
+
+  lonlat = malloc(2 * nx * sizeof(double));
+  depths = malloc(nz * sizeof(double));
+  data = malloc((size_t)nx * nz * sizeof(ucvm_data_t));
+  if ((lonlat == NULL) || (depths == NULL) || (data == NULL)) {
+    fprintf(stderr, "Failed to allocate row buffers\n");
+    ucvm_proj_ucvm_finalize(&proj);
+    return(UCVM_CODE_ERROR);
+  }
+  for (k = 0; k < nz; k++) {
+    depths[k] = k * dz;
+  }
+
+  *nogap = 0;
+  for (j = 0; j < ny; j++) {
+    for (i = 0; i < nx; i++) {
+      xy.coord[0] = i * dx;
+      xy.coord[1] = j * dy;
+      xy.coord[2] = 0.0;
+      if (ucvm_proj_ucvm_xy2geo(&proj, &xy, &geo) != UCVM_CODE_SUCCESS) {
+	fprintf(stderr, "UCVM projection failed for %lf, %lf\n",
+		xy.coord[0], xy.coord[1]);
+	return(UCVM_CODE_ERROR);
+      }
+      lonlat[i * 2] = geo.coord[0];
+      lonlat[i * 2 + 1] = geo.coord[1];
+    }
+
+    if (ucvm_query_columns(nx, lonlat, nz, depths,
+			   data) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Query failed for row %d\n", j);
+      return(UCVM_CODE_ERROR);
+    }
+
+    /* Nodes without data hold 0.0 */
+    for (i = 0; i < nx; i++) {
+      for (k = 0; k < nz; k++) {
+	o = ((size_t)k * ny + j) * nx + i;
+	if ((data[i * nz + k].cmb.source == UCVM_SOURCE_NONE) ||
+	    (data[i * nz + k].cmb.vp <= 0.0)) {
+	  vp[o] = vs[o] = rho[o] = 0.0;
+	  continue;
+	}
+	(*nogap)++;
+	vp[o] = data[i * nz + k].cmb.vp;
+	vs[o] = data[i * nz + k].cmb.vs;
+	rho[o] = data[i * nz + k].cmb.rho;
+	if (swap) {
+	  vp[o] = swap_endian_float(vp[o]);
+	  vs[o] = swap_endian_float(vs[o]);
+	  rho[o] = swap_endian_float(rho[o]);
+	}
+      }
+    }
+  }
+
+  ucvm_proj_ucvm_finalize(&proj);
+  free(lonlat);
+  free(depths);
+  free(data);
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+int main(int argc, char **argv)
+{
+  int i, opt, fd;
+  char modellist[UCVM_MAX_MODELLIST_LEN];
+  char configfile[UCVM_MAX_PATH_LEN];
+  char map_label[UCVM_MAX_LABEL_LEN];
+  double zrange[2];
+  double corner[2] = {-1000.0, -1000.0};
+  double dims[3] = {-1.0, -1.0, -1.0};
+  double ticks[3] = {-1.0, -1.0, -1.0};
+  int have_map = 0;
+  int have_zrange = 0;
+  ucvm_meta_ucvm_t meta;
+  size_t n, len, nogap;
+  char *base;
+  time_t now;
+
+  memset(&meta, 0, sizeof(ucvm_meta_ucvm_t));
+  snprintf(configfile, UCVM_MAX_PATH_LEN, "%s", "./ucvm.conf");
+  snprintf(modellist, UCVM_MAX_MODELLIST_LEN, "%s", "1d");
+  snprintf(map_label, UCVM_MAX_LABEL_LEN, "%s", UCVM_MAP_UCVM);
+  snprintf(meta.projstr, UCVM_MAX_PROJ_LEN, "%s", GRID_DEFAULT_PROJ);
+
+  /* Parse options */
+  while ((opt = getopt(argc, argv, "c:d:f:hm:n:p:P:r:z:")) != -1) {
+    switch (opt) {
+    case 'c':
+      list_parse(optarg, UCVM_MAX_PATH_LEN, corner, 2);
+      break;
+    case 'd':
+      list_parse(optarg, UCVM_MAX_PATH_LEN, dims, 3);
+      break;
+    case 'f':
+      if (strlen(optarg) < UCVM_MAX_PATH_LEN) {
+	snprintf(configfile, UCVM_MAX_PATH_LEN, "%s", optarg);
+      } else {
+	fprintf(stderr, "Invalid config file specified: %s.\n", optarg);
+	usage();
+	exit(1);
+      }
+      break;
+    case 'h':
+      usage();
+      exit(0);
+      break;
+    case 'm':
+      if (strlen(optarg) >= UCVM_MAX_MODELLIST_LEN - 1) {
+	fprintf(stderr, "Model list is too long.\n");
+	usage();
+	exit(1);
+      }
+      snprintf(modellist, UCVM_MAX_MODELLIST_LEN, "%s", optarg);
+      break;
+    case 'n':
+      list_parse(optarg, UCVM_MAX_PATH_LEN, ticks, 3);
+      break;
+    case 'p':
+      if (strlen(optarg) >= UCVM_MAX_LABEL_LEN) {
+	fprintf(stderr, "Map name is too long.\n");
+	usage();
+	exit(1);
+      }
+      snprintf(map_label, UCVM_MAX_LABEL_LEN, "%s", optarg);
+      have_map = 1;
+      break;
+    case 'P':
+      if ((strlen(optarg) >= UCVM_MAX_PROJ_LEN) ||
+	  (strstr(optarg, "|") != NULL)) {
+	fprintf(stderr, "Invalid projection specified: %s.\n", optarg);
+	usage();
+	exit(1);
+      }
+      snprintf(meta.projstr, UCVM_MAX_PROJ_LEN, "%s", optarg);
+      break;
+    case 'r':
+      meta.rot = atof(optarg);
+      break;
+    case 'z':
+      if (list_parse(optarg, UCVM_MAX_PATH_LEN,
+		     zrange, 2) != UCVM_CODE_SUCCESS) {
+	fprintf(stderr, "Invalid zrange specified: %s.\n", optarg);
+	usage();
+	exit(1);
+      }
+      have_zrange = 1;
+      break;
+    default: /* '?' */
+      usage();
+      exit(1);
+    }
+  }
+
+  if ((optind != argc - 1) || (corner[0] < -180.0) ||
+      (corner[1] < -90.0)) {
+    usage();
+    exit(1);
+  }
+  for (i = 0; i < 3; i++) {
+    if ((dims[i] <= 0.0) || (ticks[i] < 2.0)) {
+      fprintf(stderr, "Grid extents and node counts must be given.\n");
+      usage();
+      exit(1);
+    }
+    meta.dims_xyz.coord[i] = dims[i];
+    meta.ticks_xyz.dim[i] = (unsigned int)ticks[i];
+  }
+  meta.origin.coord[0] = corner[0];
+  meta.origin.coord[1] = corner[1];
+
+  /* Model list as title, empty fields do not unpack */
+  ucvm_strcpy(meta.title, modellist, UCVM_META_MAX_STRING_LEN);
+  ucvm_strcpy(meta.author, "ucvm_model2grid", UCVM_META_MAX_STRING_LEN);
+  now = time(NULL);
+  strftime(meta.date, UCVM_META_MAX_STRING_LEN, "%m/%d/%Y",
+	   localtime(&now));
+
+  /* Initialize interface and models */
+  if (ucvm_init(configfile) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to initialize UCVM API\n");
+    return(1);
+  }
+  if (ucvm_add_model_list(modellist) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to enable model list %s\n", modellist);
+    return(1);
+  }
+  if (have_map == 1) {
+    if (ucvm_use_map(map_label) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to set user map %s\n", map_label);
+      return(1);
+    }
+  }
+  if (ucvm_setparam(UCVM_PARAM_QUERY_MODE,
+		    UCVM_COORD_GEO_DEPTH) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to set depth query mode\n");
+    return(1);
+  }
+  if (have_zrange == 1) {
+    if (ucvm_setparam(UCVM_PARAM_IFUNC_ZRANGE,
+		      zrange[0], zrange[1]) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to set interpolation z range\n");
+      return(1);
+    }
+  }
+
+  /* Create and map the volume */
+  n = ucvm_meta_grid_nodes(&meta);
+  len = UCVM_META_GRID_HEADER_LEN + 3 * n * sizeof(float);
+  fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if ((fd < 0) || (ftruncate(fd, len) != 0)) {
+    fprintf(stderr, "Failed to create grid %s\n", argv[optind]);
+    return(1);
+  }
+  base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Failed to map grid %s\n", argv[optind]);
+    return(1);
+  }
+  if (ucvm_meta_grid_pack(&meta, base,
+			  UCVM_META_GRID_HEADER_LEN) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to pack grid metadata\n");
+    return(1);
+  }
+
+  if (sample_grid(&meta, (float *)(base + UCVM_META_GRID_HEADER_LEN),
+		  &nogap) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to sample model list %s\n", modellist);
+    munmap(base, len);
+    unlink(argv[optind]);
+    return(1);
+  }
+  if (msync(base, len, MS_SYNC) != 0) {
+    fprintf(stderr, "Failed to write grid %s\n", argv[optind]);
+    return(1);
+  }
+  munmap(base, len);
+
+  fprintf(stderr, "Wrote %s: %ux%ux%u nodes, %lu without data, %.1f MB\n",
+	  argv[optind], meta.ticks_xyz.dim[0], meta.ticks_xyz.dim[1],
+	  meta.ticks_xyz.dim[2], (unsigned long)(n - nogap),
+	  len / 1048576.0);
+
+  ucvm_finalize();
+  return(0);
+}
@@ -30,6 +30,11 @@ int ucvm_1d_model_query(int id, ucvm_ctype_t cmode,
 			int n, ucvm_point_t *pnt, ucvm_data_t *data);
 
 
+/* Query 1D with private state */
+int ucvm_1d_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			   int n, ucvm_point_t *pnt, ucvm_data_t *data);
+
+
 /* Fill model structure with 1D */
 int ucvm_1d_get_model(ucvm_model_t *m);
 
@@ -30,6 +30,11 @@ int ucvm_1dgtl_model_query(int id, ucvm_ctype_t cmode,
 			   int n, ucvm_point_t *pnt, ucvm_data_t *data);
 
 
+/* Query 1DGTL with private state */
+int ucvm_1dgtl_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			      int n, ucvm_point_t *pnt, ucvm_data_t *data);
+
+
 /* Fill model structure with 1DGTL */
 int ucvm_1dgtl_get_model(ucvm_model_t *m);
 
@@ -356,6 +356,14 @@ int ucvm_bbp1d_model_query(int id, ucvm_ctype_t cmode,
 }
 
 
+/* Query 1D with private state. The model keeps no query state */
+int ucvm_bbp1d_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			      int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  return(ucvm_bbp1d_model_query(id, cmode, n, pnt, data));
+}
+
+
 /* Fill model structure with 1D */
 int ucvm_bbp1d_get_model(ucvm_model_t *m)
 {
@@ -366,6 +374,8 @@ int ucvm_bbp1d_get_model(ucvm_model_t *m)
   m->getversion = ucvm_bbp1d_model_version;
   m->getlabel = ucvm_bbp1d_model_label;
   m->query = ucvm_bbp1d_model_query;
+  m->ctxquery = ucvm_bbp1d_model_ctxquery;
+  m->caps = UCVM_MODEL_CAP_THREADSAFE;
 
   return(UCVM_CODE_SUCCESS);
 }
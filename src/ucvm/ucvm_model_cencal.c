@@ -427,6 +427,8 @@ int ucvm_cencal_get_model(ucvm_model_t *m)
   m->getlabel = ucvm_cencal_model_label;
   m->setparam = ucvm_cencal_model_setparam;
   m->query = ucvm_cencal_model_query;
+  /* Falls back to UCVM topo where its DEM has no data */
+  m->needs = UCVM_VAL_SURF;
 
   return(UCVM_CODE_SUCCESS);
 }
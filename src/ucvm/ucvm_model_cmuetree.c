@@ -2,12 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "etree.h"
 #include "ucvm_config.h"
 #include "ucvm_utils.h"
 #include "ucvm_meta_etree.h"
 #include "ucvm_model_cmuetree.h"
 #include "ucvm_proj_bilinear.h"
+#include "ucvm_etree_cache.h"
 
 
 /* Init flag */
@@ -27,9 +29,23 @@ typedef struct ucvm_cmuetree_t {
   ucvm_point_t corners[4];
   ucvm_meta_cmu_t meta;
   ucvm_bilinear_t proj;
+  ucvm_etree_cache_t cache;
+  ucvm_etree_batch_t batch;
+  unsigned long long cache_hits;
+  unsigned long long cache_misses;
+  int inmem;
+  ucvm_etree_mem_t mem;
 } ucvm_cmuetree_t;
 
 
+/* Per-context CMU etree state */
+typedef struct ucvm_cmuetree_state_t {
+  etree_t *ep;
+  ucvm_etree_cache_t cache;
+  ucvm_etree_batch_t batch;
+} ucvm_cmuetree_state_t;
+
+
 /* Model ID */
 int ucvm_cmuetree_id = UCVM_SOURCE_NONE;
 
@@ -37,6 +53,9 @@ int ucvm_cmuetree_id = UCVM_SOURCE_NONE;
 /* CMU Etree info */
 ucvm_cmuetree_t ucvm_cmuetree;
 
+/* Guards the cache counters */
+pthread_mutex_t ucvm_cmuetree_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 /* Init Cmuetree */
 int ucvm_cmuetree_model_init(int id, ucvm_modelconf_t *conf)
@@ -146,6 +165,11 @@ int ucvm_cmuetree_model_init(int id, ucvm_modelconf_t *conf)
     ucvm_cmuetree.proj.dims[i] = ucvm_cmuetree.meta.dims_xyz.coord[i];
   }
 
+  ucvm_etree_cache_init(&(ucvm_cmuetree.cache));
+  memset(&(ucvm_cmuetree.batch), 0, sizeof(ucvm_etree_batch_t));
+  ucvm_cmuetree.cache_hits = 0;
+  ucvm_cmuetree.cache_misses = 0;
+
   ucvm_cmuetree_id = id;
 
   ucvm_cmuetree_init_flag = 1;
@@ -163,6 +187,8 @@ int ucvm_cmuetree_model_finalize()
 
   /* Close Etree */
   etree_close(ucvm_cmuetree.ep);
+  ucvm_etree_batch_free(&(ucvm_cmuetree.batch));
+  ucvm_etree_mem_free(&(ucvm_cmuetree.mem));
 
   ucvm_cmuetree_id = UCVM_SOURCE_NONE;
   memset(&ucvm_cmuetree, 0, sizeof(ucvm_cmuetree_t));
@@ -198,10 +224,34 @@ int ucvm_cmuetree_model_label(int id, char *lab, int len)
 }
 
 
+/* Load whole CMU etree into memory */
+int ucvm_cmuetree_model_load()
+{
+  if (ucvm_cmuetree.inmem) {
+    return(UCVM_CODE_SUCCESS);
+  }
+  if (ucvm_etree_mem_load(&(ucvm_cmuetree.mem), ucvm_cmuetree.ep, 
+			  sizeof(ucvm_epayload_t)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to load CMU etree %s into memory\n", 
+	    ucvm_cmuetree.epath);
+    return(UCVM_CODE_ERROR);
+  }
+  ucvm_cmuetree.inmem = 1;
+
+  fprintf(stderr, "Loaded etree %s: %lu octants, %.1f MB in %.2f s\n", 
+	  ucvm_cmuetree.conf.label, (unsigned long)ucvm_cmuetree.mem.num, 
+	  ucvm_etree_mem_bytes(&(ucvm_cmuetree.mem)) / 1048576.0, 
+	  ucvm_cmuetree.mem.secs);
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Setparam Cmuetree */
 int ucvm_cmuetree_model_setparam(int id, int param, ...)
 {
   va_list ap;
+  char *pstr, *pval;
+  int retval = UCVM_CODE_SUCCESS;
 
   if (id != ucvm_cmuetree_id) {
     fprintf(stderr, "Invalid model id\n");
@@ -210,12 +260,73 @@ int ucvm_cmuetree_model_setparam(int id, int param, ...)
 
   va_start(ap, param);
   switch (param) {
+  case UCVM_PARAM_MODEL_CONF:
+    pstr = va_arg(ap, char *);
+    pval = va_arg(ap, char *);
+    if ((strcmp(pstr, "IN_MEMORY") == 0) && (strcmp(pval, "True") == 0)) {
+      retval = ucvm_cmuetree_model_load();
+    }
+    break;
   default:
     break;
   }
 
   va_end(ap);
 
+  return(retval);
+}
+
+
+/* Create private state Cmuetree. The bilinear projection is
+   read-only so only the etree handle is private */
+int ucvm_cmuetree_model_ctxinit(int id, void **state)
+{
+  ucvm_cmuetree_state_t *st;
+
+  if (id != ucvm_cmuetree_id) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  st = malloc(sizeof(ucvm_cmuetree_state_t));
+  if (st == NULL) {
+    fprintf(stderr, "Failed to allocate CMU etree state\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  if (ucvm_cmuetree.inmem) {
+    st->ep = NULL;
+  } else {
+    st->ep = etree_open(ucvm_cmuetree.epath, O_RDONLY, 
+			CMUETREE_BUF_SIZE, 0, 3);
+  }
+  if ((st->ep == NULL) && (ucvm_cmuetree.inmem == 0)) {
+    fprintf(stderr, "Failed to open the CMU etree %s\n", 
+	    ucvm_cmuetree.epath);
+    free(st);
+    return(UCVM_CODE_ERROR);
+  }
+  ucvm_etree_cache_init(&(st->cache));
+  memset(&(st->batch), 0, sizeof(ucvm_etree_batch_t));
+
+  *state = st;
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Free private state Cmuetree */
+int ucvm_cmuetree_model_ctxfinalize(int id, void *state)
+{
+  ucvm_cmuetree_state_t *st = (ucvm_cmuetree_state_t *)state;
+
+  if (st != NULL) {
+    if (st->ep != NULL) {
+      etree_close(st->ep);
+    }
+    ucvm_etree_batch_free(&(st->batch));
+    free(st);
+  }
+
   return(UCVM_CODE_SUCCESS);
 }
 
@@ -224,18 +335,47 @@ int ucvm_cmuetree_model_setparam(int id, int param, ...)
 int ucvm_cmuetree_model_query(int id, ucvm_ctype_t cmode,
 			   int n, ucvm_point_t *pnt, ucvm_data_t *data)
 {
-  int i;
+  return(ucvm_cmuetree_model_ctxquery(id, NULL, cmode, n, pnt, data));
+}
+
+
+/* Query Cmuetree with private state */
+int ucvm_cmuetree_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+				 int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int i, j, k;
   double depth;
   ucvm_point_t xy;
   etree_addr_t addr;
   ucvm_epayload_t payload;
   int datagap = 0;
+  etree_t *ep;
+  ucvm_etree_cache_t *cache;
+  ucvm_etree_batch_t *batch;
+  ucvm_etree_mem_t *mem = NULL;
+  unsigned long long hits, misses;
 
   if (id != ucvm_cmuetree_id) {
     fprintf(stderr, "Invalid model id\n");
     return(UCVM_CODE_ERROR);
   }
 
+  if (state == NULL) {
+    ep = ucvm_cmuetree.ep;
+    cache = &(ucvm_cmuetree.cache);
+    batch = &(ucvm_cmuetree.batch);
+  } else {
+    ep = ((ucvm_cmuetree_state_t *)state)->ep;
+    cache = &(((ucvm_cmuetree_state_t *)state)->cache);
+    batch = &(((ucvm_cmuetree_state_t *)state)->batch);
+  }
+  if (ucvm_cmuetree.inmem) {
+    mem = &(ucvm_cmuetree.mem);
+  }
+  batch->num = 0;
+  hits = cache->hits;
+  misses = cache->misses;
+
   /* Check query mode */
   switch (cmode) {
   case UCVM_COORD_GEO_DEPTH:
@@ -279,16 +419,9 @@ int ucvm_cmuetree_model_query(int id, ucvm_ctype_t cmode,
 	  addr.y = (int)xy.coord[1];
 	  addr.z = (int)xy.coord[2];
 	  addr.level = ETREE_MAXLEVEL;
-
-	  /* Query etree */
-	  if (etree_search(ucvm_cmuetree.ep, addr, 
-			   NULL, "*", &payload) == 0) {
-	    data[i].crust.source = id;
-	    data[i].crust.vp = payload.Vp;
-	    data[i].crust.vs = payload.Vs;
-	    data[i].crust.rho = payload.density;
-	  } else {
-	    datagap = 1;
+	  if (ucvm_etree_batch_add(batch, i, &addr, 
+				   NULL) != UCVM_CODE_SUCCESS) {
+	    return(UCVM_CODE_ERROR);
 	  }
 	} else {
 	  datagap = 1;
@@ -303,6 +436,28 @@ int ucvm_cmuetree_model_query(int id, ucvm_ctype_t cmode,
     }
   }
 
+  /* Query etree in locational code order */
+  ucvm_etree_batch_sort(batch);
+  for (k = 0; k < batch->num; k++) {
+    j = batch->order[k].pos;
+    i = batch->idx[j];
+    if (ucvm_etree_cache_search(cache, ep, mem, batch->addr[j], &payload,
+				sizeof(ucvm_epayload_t)) == 0) {
+      data[i].crust.source = id;
+      data[i].crust.vp = payload.Vp;
+      data[i].crust.vs = payload.Vs;
+      data[i].crust.rho = payload.density;
+    } else {
+      datagap = 1;
+    }
+  }
+
+  /* Update cache counters */
+  pthread_mutex_lock(&ucvm_cmuetree_cache_lock);
+  ucvm_cmuetree.cache_hits += cache->hits - hits;
+  ucvm_cmuetree.cache_misses += cache->misses - misses;
+  pthread_mutex_unlock(&ucvm_cmuetree_cache_lock);
+
   if (datagap) {
     return(UCVM_CODE_DATAGAP);
   }
@@ -311,6 +466,33 @@ int ucvm_cmuetree_model_query(int id, ucvm_ctype_t cmode,
 }
 
 
+/* Get octant cache counters Cmuetree */
+int ucvm_cmuetree_model_cachestats(int id, int reset, 
+				   unsigned long long *hits, 
+				   unsigned long long *misses)
+{
+  if (id != ucvm_cmuetree_id) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  pthread_mutex_lock(&ucvm_cmuetree_cache_lock);
+  if (hits != NULL) {
+    *hits = ucvm_cmuetree.cache_hits;
+  }
+  if (misses != NULL) {
+    *misses = ucvm_cmuetree.cache_misses;
+  }
+  if (reset) {
+    ucvm_cmuetree.cache_hits = 0;
+    ucvm_cmuetree.cache_misses = 0;
+  }
+  pthread_mutex_unlock(&ucvm_cmuetree_cache_lock);
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Fill model structure with Etree */
 int ucvm_cmuetree_get_model(ucvm_model_t *m)
 {
@@ -321,6 +503,11 @@ int ucvm_cmuetree_get_model(ucvm_model_t *m)
   m->getversion = ucvm_cmuetree_model_version;
   m->getlabel = ucvm_cmuetree_model_label;
   m->query = ucvm_cmuetree_model_query;
+  m->ctxinit = ucvm_cmuetree_model_ctxinit;
+  m->ctxfinalize = ucvm_cmuetree_model_ctxfinalize;
+  m->ctxquery = ucvm_cmuetree_model_ctxquery;
+  m->cachestats = ucvm_cmuetree_model_cachestats;
+  m->caps = UCVM_MODEL_CAP_THREADSAFE;
 
   return(UCVM_CODE_SUCCESS);
 }
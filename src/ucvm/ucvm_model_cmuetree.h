@@ -26,6 +26,25 @@ int ucvm_cmuetree_model_query(int id, ucvm_ctype_t cmode,
 			   int n, ucvm_point_t *pnt, ucvm_data_t *data);
 
 
+/* Create private state Cmuetree */
+int ucvm_cmuetree_model_ctxinit(int id, void **state);
+
+
+/* Free private state Cmuetree */
+int ucvm_cmuetree_model_ctxfinalize(int id, void *state);
+
+
+/* Query Cmuetree with private state */
+int ucvm_cmuetree_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+				 int n, ucvm_point_t *pnt, ucvm_data_t *data);
+
+
+/* Get octant cache counters Cmuetree, optionally zeroing them */
+int ucvm_cmuetree_model_cachestats(int id, int reset, 
+				   unsigned long long *hits, 
+				   unsigned long long *misses);
+
+
 /* Fill model structure with CMU Etree */
 int ucvm_cmuetree_get_model(ucvm_model_t *m);
 
@@ -271,6 +271,8 @@ int ucvm_cvms_get_model(ucvm_model_t *m)
   m->getlabel = ucvm_cvms_model_label;
   m->setparam = ucvm_cvms_model_setparam;
   m->query = ucvm_cvms_model_query;
+  /* Fortran I/O units are shared with other Fortran models */
+  m->caps = UCVM_MODEL_CAP_SERIAL_INIT;
 
   return(UCVM_CODE_SUCCESS);
 }
@@ -164,6 +164,14 @@ int ucvm_elygtl_model_query(int id, ucvm_ctype_t cmode,
 }
 
 
+/* Query Ely with private state. The model keeps no query state */
+int ucvm_elygtl_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			       int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  return(ucvm_elygtl_model_query(id, cmode, n, pnt, data));
+}
+
+
 /* Fill model structure with 1D */
 int ucvm_elygtl_get_model(ucvm_model_t *m)
 {
@@ -174,6 +182,9 @@ int ucvm_elygtl_get_model(ucvm_model_t *m)
   m->getversion = ucvm_elygtl_model_version;
   m->getlabel = ucvm_elygtl_model_label;
   m->query = ucvm_elygtl_model_query;
+  m->ctxquery = ucvm_elygtl_model_ctxquery;
+  m->caps = UCVM_MODEL_CAP_THREADSAFE;
+  m->needs = UCVM_VAL_VS30;
 
   return(UCVM_CODE_SUCCESS);
 }
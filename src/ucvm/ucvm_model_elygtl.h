@@ -31,6 +31,11 @@ int ucvm_elygtl_model_query(int id, ucvm_ctype_t cmode,
 			 ucvm_data_t *data);
 
 
+/* Query Ely with private state */
+int ucvm_elygtl_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			       int n, ucvm_point_t *pnt, ucvm_data_t *data);
+
+
 /* Fill model structure with ELY */
 int ucvm_elygtl_get_model(ucvm_model_t *m);
 
@@ -2,11 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "etree.h"
 #include "ucvm_utils.h"
 #include "ucvm_meta_etree.h"
 #include "ucvm_model_etree.h"
 #include "ucvm_proj_ucvm.h"
+#include "ucvm_etree_cache.h"
 
 /* Etree buffer size in MB */
 #define UCVM_ETREE_BUF_SIZE 64
@@ -19,13 +21,32 @@ typedef struct ucvm_etree_t {
   etree_t *ep;
   ucvm_meta_ucvm_t meta;
   ucvm_proj_t proj;
+  ucvm_etree_cache_t cache;
+  ucvm_etree_batch_t batch;
+  unsigned long long cache_hits;
+  unsigned long long cache_misses;
+  int inmem;
+  ucvm_etree_mem_t mem;
+  ucvm_shm_t shm;
 } ucvm_etree_t;
 
 
+/* Per-context etree state */
+typedef struct ucvm_etree_state_t {
+  etree_t *ep;
+  ucvm_proj_t proj;
+  ucvm_etree_cache_t cache;
+  ucvm_etree_batch_t batch;
+} ucvm_etree_state_t;
+
+
 /* Etree list */
 int ucvm_num_etrees = 0;
 ucvm_etree_t ucvm_etree_list[UCVM_MAX_MODELS];
 
+/* Guards the cache counters of all etrees */
+pthread_mutex_t ucvm_etree_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 /* Init Etree */
 int ucvm_etree_model_init(int id, ucvm_modelconf_t *conf)
@@ -91,23 +112,46 @@ int ucvm_etree_model_init(int id, ucvm_modelconf_t *conf)
     return(UCVM_CODE_ERROR);
   }
 
+  ucvm_etree_cache_init(&(ucvm_etree_list[id].cache));
+  memset(&(ucvm_etree_list[id].batch), 0, sizeof(ucvm_etree_batch_t));
+  ucvm_etree_list[id].cache_hits = 0;
+  ucvm_etree_list[id].cache_misses = 0;
+
   ucvm_etree_list[id].valid = 1;
   ucvm_num_etrees++;
   return(UCVM_CODE_SUCCESS);
 }
 
 
+/* Release Etree */
+int ucvm_etree_model_release(int id)
+{
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) || 
+      (ucvm_etree_list[id].valid == 0)) {
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  /* Close Etree and finalize projection */
+  etree_close(ucvm_etree_list[id].ep);
+  ucvm_proj_ucvm_finalize(&(ucvm_etree_list[id].proj));
+  ucvm_etree_batch_free(&(ucvm_etree_list[id].batch));
+  ucvm_etree_mem_free(&(ucvm_etree_list[id].mem));
+  ucvm_shm_detach(&(ucvm_etree_list[id].shm));
+
+  memset(&(ucvm_etree_list[id]), 0, sizeof(ucvm_etree_t));
+  ucvm_num_etrees--;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Finalize Etree */
 int ucvm_etree_model_finalize()
 {
   int i;
 
-  /* Close Etrees and finalize projections */
   for (i = 0; i < UCVM_MAX_MODELS; i++) {
-    if (ucvm_etree_list[i].valid) {
-      etree_close(ucvm_etree_list[i].ep);
-      ucvm_proj_ucvm_finalize(&(ucvm_etree_list[i].proj));
-    }
+    ucvm_etree_model_release(i);
   }
 
   ucvm_num_etrees = 0;
@@ -145,10 +189,37 @@ int ucvm_etree_model_label(int id, char *lab, int len)
 }
 
 
+/* Load whole etree into memory */
+int ucvm_etree_model_load(int id)
+{
+  ucvm_etree_t *et = &(ucvm_etree_list[id]);
+
+  if (et->inmem) {
+    return(UCVM_CODE_SUCCESS);
+  }
+  if (ucvm_etree_mem_load_shared(&(et->mem), &(et->shm), et->ep, 
+				 et->conf.config, sizeof(ucvm_epayload_t)) 
+      != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to load etree %s into memory\n", 
+	    et->conf.config);
+    return(UCVM_CODE_ERROR);
+  }
+  et->inmem = 1;
+
+  fprintf(stderr, "Loaded etree %s: %lu octants, %.1f MB in %.2f s%s\n", 
+	  et->conf.label, (unsigned long)et->mem.num, 
+	  ucvm_etree_mem_bytes(&(et->mem)) / 1048576.0, et->mem.secs,
+	  (et->mem.shared) ? ", shared" : "");
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Setparam Etree */
 int ucvm_etree_model_setparam(int id, int param, ...)
 {
   va_list ap;
+  char *pstr, *pval;
+  int retval = UCVM_CODE_SUCCESS;
 
   if ((id < 0) || (id >= UCVM_MAX_MODELS) || 
       (ucvm_etree_list[id].valid == 0)) {
@@ -158,12 +229,90 @@ int ucvm_etree_model_setparam(int id, int param, ...)
 
   va_start(ap, param);
   switch (param) {
+  case UCVM_PARAM_MODEL_CONF:
+    pstr = va_arg(ap, char *);
+    pval = va_arg(ap, char *);
+    if ((strcmp(pstr, "IN_MEMORY") == 0) && (strcmp(pval, "True") == 0)) {
+      retval = ucvm_etree_model_load(id);
+    }
+    break;
   default:
     break;
   }
 
   va_end(ap);
 
+  return(retval);
+}
+
+
+/* Create private state Etree */
+int ucvm_etree_model_ctxinit(int id, void **state)
+{
+  ucvm_etree_state_t *st;
+
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) || 
+      (ucvm_etree_list[id].valid == 0)) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  st = malloc(sizeof(ucvm_etree_state_t));
+  if (st == NULL) {
+    fprintf(stderr, "Failed to allocate etree state\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Each state has its own etree handle and buffer, unless the 
+     etree is held in memory */
+  if (ucvm_etree_list[id].inmem) {
+    st->ep = NULL;
+  } else {
+    st->ep = etree_open(ucvm_etree_list[id].conf.config, 
+			O_RDONLY, UCVM_ETREE_BUF_SIZE, 0, 3);
+  }
+  if ((st->ep == NULL) && (ucvm_etree_list[id].inmem == 0)) {
+    fprintf(stderr, "Failed to open the etree %s\n", 
+	    ucvm_etree_list[id].conf.config);
+    free(st);
+    return(UCVM_CODE_ERROR);
+  }
+
+  if (ucvm_proj_ucvm_init(ucvm_etree_list[id].meta.projstr, 
+			  &(ucvm_etree_list[id].meta.origin), 
+			  ucvm_etree_list[id].meta.rot,
+			  &(ucvm_etree_list[id].meta.dims_xyz),
+			  &(st->proj)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to setup proj %s.\n", 
+	    ucvm_etree_list[id].meta.projstr);
+    if (st->ep != NULL) {
+      etree_close(st->ep);
+    }
+    free(st);
+    return(UCVM_CODE_ERROR);
+  }
+  ucvm_etree_cache_init(&(st->cache));
+  memset(&(st->batch), 0, sizeof(ucvm_etree_batch_t));
+
+  *state = st;
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Free private state Etree */
+int ucvm_etree_model_ctxfinalize(int id, void *state)
+{
+  ucvm_etree_state_t *st = (ucvm_etree_state_t *)state;
+
+  if (st != NULL) {
+    if (st->ep != NULL) {
+      etree_close(st->ep);
+    }
+    ucvm_proj_ucvm_finalize(&(st->proj));
+    ucvm_etree_batch_free(&(st->batch));
+    free(st);
+  }
+
   return(UCVM_CODE_SUCCESS);
 }
 
@@ -172,12 +321,30 @@ int ucvm_etree_model_setparam(int id, int param, ...)
 int ucvm_etree_model_query(int id, ucvm_ctype_t cmode,
 			   int n, ucvm_point_t *pnt, ucvm_data_t *data)
 {
-  int i;
+  return(ucvm_etree_model_ctxquery(id, NULL, cmode, n, pnt, data));
+}
+
+
+/* Query Etree with private state */
+int ucvm_etree_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			      int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int i, j, k, b, nb, ng;
   double depth;
   ucvm_point_t xy;
+  int gidx[UCVM_PROJ_BATCH];
+  int gstatus[UCVM_PROJ_BATCH];
+  ucvm_point_t gpnt[UCVM_PROJ_BATCH];
+  ucvm_point_t gxy[UCVM_PROJ_BATCH];
   etree_addr_t addr;
   ucvm_epayload_t payload;
   int datagap = 0;
+  etree_t *ep;
+  ucvm_proj_t *proj;
+  ucvm_etree_cache_t *cache;
+  ucvm_etree_batch_t *batch;
+  ucvm_etree_mem_t *mem = NULL;
+  unsigned long long hits, misses;
 
   if ((id < 0) || (id >= UCVM_MAX_MODELS) || 
       (ucvm_etree_list[id].valid == 0)) {
@@ -185,6 +352,24 @@ int ucvm_etree_model_query(int id, ucvm_ctype_t cmode,
     return(UCVM_CODE_ERROR);
   }
 
+  if (state == NULL) {
+    ep = ucvm_etree_list[id].ep;
+    proj = &(ucvm_etree_list[id].proj);
+    cache = &(ucvm_etree_list[id].cache);
+    batch = &(ucvm_etree_list[id].batch);
+  } else {
+    ep = ((ucvm_etree_state_t *)state)->ep;
+    proj = &(((ucvm_etree_state_t *)state)->proj);
+    cache = &(((ucvm_etree_state_t *)state)->cache);
+    batch = &(((ucvm_etree_state_t *)state)->batch);
+  }
+  if (ucvm_etree_list[id].inmem) {
+    mem = &(ucvm_etree_list[id].mem);
+  }
+  batch->num = 0;
+  hits = cache->hits;
+  misses = cache->misses;
+
   /* Check query mode */
   switch (cmode) {
   case UCVM_COORD_GEO_DEPTH:
@@ -196,70 +381,104 @@ int ucvm_etree_model_query(int id, ucvm_ctype_t cmode,
     break;
   }
 
-  for (i = 0; i < n; i++) {
-    if ((data[i].crust.source == UCVM_SOURCE_NONE) && 
-	((data[i].domain == UCVM_DOMAIN_INTERP) || 
-	 (data[i].domain == UCVM_DOMAIN_CRUST)) &&
-	(region_contains_null(&(ucvm_etree_list[id].conf.region), 
-			      cmode, &(pnt[i])))) {
-
-      /* Modify pre-computed depth to account for GTL interp range */
-      depth = data[i].depth + data[i].shift_cr;
-
-      /* Etree extends from free surface on down */
-      if (depth >= 0.0) {
-	/* Convert point to address */
-	if (ucvm_proj_ucvm_geo2xy(&(ucvm_etree_list[id].proj), 
-				  &(pnt[i]),
-				  &xy) == UCVM_CODE_SUCCESS) {
-
-	  xy.coord[0] = xy.coord[0] / 
-	    ucvm_etree_list[id].meta.dims_xyz.coord[0] *
-	    ucvm_etree_list[id].meta.ticks_xyz.dim[0]; 
-	  xy.coord[1] = xy.coord[1] / 
-	    ucvm_etree_list[id].meta.dims_xyz.coord[1] *
-	    ucvm_etree_list[id].meta.ticks_xyz.dim[1];
-	  switch (cmode) {
-	  case UCVM_COORD_GEO_DEPTH:
-	    xy.coord[2] = xy.coord[2] / 
-	      ucvm_etree_list[id].meta.dims_xyz.coord[2] *
-	      ucvm_etree_list[id].meta.ticks_xyz.dim[2];
-	    break;
-	  case UCVM_COORD_GEO_ELEV:
-	    xy.coord[2] = (data[i].surf - xy.coord[2]) / 
-	      ucvm_etree_list[id].meta.dims_xyz.coord[2] *
-	      ucvm_etree_list[id].meta.ticks_xyz.dim[2];
-	    break;
-	  }
-
-	  addr.x = (int)xy.coord[0];
-	  addr.y = (int)xy.coord[1];
-	  addr.z = (int)xy.coord[2];
-	  addr.level = ETREE_MAXLEVEL;
-
-	  /* Query etree */
-	  if (etree_search(ucvm_etree_list[id].ep, addr, 
-	  		   NULL, "*", &payload) == 0) {
-	    data[i].crust.source = id;
-	    data[i].crust.vp = payload.Vp;
-	    data[i].crust.vs = payload.Vs;
-	    data[i].crust.rho = payload.density;
-	  } else {
-	    datagap = 1;
-	  }
+  for (b = 0; b < n; b += UCVM_PROJ_BATCH) {
+    nb = n - b;
+    if (nb > UCVM_PROJ_BATCH) {
+      nb = UCVM_PROJ_BATCH;
+    }
+
+    /* Gather points to look up */
+    ng = 0;
+    for (i = b; i < b + nb; i++) {
+      if ((data[i].crust.source == UCVM_SOURCE_NONE) && 
+	  ((data[i].domain == UCVM_DOMAIN_INTERP) || 
+	   (data[i].domain == UCVM_DOMAIN_CRUST)) &&
+	  (region_contains_null(&(ucvm_etree_list[id].conf.region), 
+				cmode, &(pnt[i])))) {
+
+	/* Modify pre-computed depth to account for GTL interp range */
+	depth = data[i].depth + data[i].shift_cr;
+
+	/* Etree extends from free surface on down */
+	if (depth >= 0.0) {
+	  gidx[ng] = i;
+	  gpnt[ng] = pnt[i];
+	  ng++;
 	} else {
 	  datagap = 1;
 	}
       } else {
+	if (data[i].crust.source == UCVM_SOURCE_NONE) {
+	  datagap = 1;
+	}
+      }
+    }
+
+    /* Convert points to addresses */
+    if (ucvm_proj_ucvm_geo2xy_batch(proj, ng, gpnt, gxy, 
+				    gstatus) != UCVM_CODE_SUCCESS) {
+      return(UCVM_CODE_ERROR);
+    }
+
+    for (j = 0; j < ng; j++) {
+      i = gidx[j];
+      if (gstatus[j] != UCVM_CODE_SUCCESS) {
 	datagap = 1;
+	continue;
       }
-    } else {
-      if (data[i].crust.source == UCVM_SOURCE_NONE) {
-        datagap = 1;
+
+      xy.coord[0] = gxy[j].coord[0] / 
+	ucvm_etree_list[id].meta.dims_xyz.coord[0] *
+	ucvm_etree_list[id].meta.ticks_xyz.dim[0]; 
+      xy.coord[1] = gxy[j].coord[1] / 
+	ucvm_etree_list[id].meta.dims_xyz.coord[1] *
+	ucvm_etree_list[id].meta.ticks_xyz.dim[1];
+      switch (cmode) {
+      case UCVM_COORD_GEO_DEPTH:
+	xy.coord[2] = gxy[j].coord[2] / 
+	  ucvm_etree_list[id].meta.dims_xyz.coord[2] *
+	  ucvm_etree_list[id].meta.ticks_xyz.dim[2];
+	break;
+      case UCVM_COORD_GEO_ELEV:
+	xy.coord[2] = (data[i].surf - gxy[j].coord[2]) / 
+	  ucvm_etree_list[id].meta.dims_xyz.coord[2] *
+	  ucvm_etree_list[id].meta.ticks_xyz.dim[2];
+	break;
+      }
+
+      addr.x = (int)xy.coord[0];
+      addr.y = (int)xy.coord[1];
+      addr.z = (int)xy.coord[2];
+      addr.level = ETREE_MAXLEVEL;
+      if (ucvm_etree_batch_add(batch, i, &addr, 
+			       NULL) != UCVM_CODE_SUCCESS) {
+	return(UCVM_CODE_ERROR);
       }
     }
   }
 
+  /* Query etree in locational code order */
+  ucvm_etree_batch_sort(batch);
+  for (k = 0; k < batch->num; k++) {
+    j = batch->order[k].pos;
+    i = batch->idx[j];
+    if (ucvm_etree_cache_search(cache, ep, mem, batch->addr[j], &payload, 
+				sizeof(ucvm_epayload_t)) == 0) {
+      data[i].crust.source = id;
+      data[i].crust.vp = payload.Vp;
+      data[i].crust.vs = payload.Vs;
+      data[i].crust.rho = payload.density;
+    } else {
+      datagap = 1;
+    }
+  }
+
+  /* Update cache counters */
+  pthread_mutex_lock(&ucvm_etree_cache_lock);
+  ucvm_etree_list[id].cache_hits += cache->hits - hits;
+  ucvm_etree_list[id].cache_misses += cache->misses - misses;
+  pthread_mutex_unlock(&ucvm_etree_cache_lock);
+
   if (datagap) {
     return(UCVM_CODE_DATAGAP);
   }
@@ -268,6 +487,34 @@ int ucvm_etree_model_query(int id, ucvm_ctype_t cmode,
 }
 
 
+/* Get octant cache counters Etree */
+int ucvm_etree_model_cachestats(int id, int reset, 
+				unsigned long long *hits, 
+				unsigned long long *misses)
+{
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) || 
+      (ucvm_etree_list[id].valid == 0)) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  pthread_mutex_lock(&ucvm_etree_cache_lock);
+  if (hits != NULL) {
+    *hits = ucvm_etree_list[id].cache_hits;
+  }
+  if (misses != NULL) {
+    *misses = ucvm_etree_list[id].cache_misses;
+  }
+  if (reset) {
+    ucvm_etree_list[id].cache_hits = 0;
+    ucvm_etree_list[id].cache_misses = 0;
+  }
+  pthread_mutex_unlock(&ucvm_etree_cache_lock);
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Fill model structure with Etree */
 int ucvm_etree_get_model(ucvm_model_t *m)
 {
@@ -278,6 +525,12 @@ int ucvm_etree_get_model(ucvm_model_t *m)
   m->getversion = ucvm_etree_model_version;
   m->getlabel = ucvm_etree_model_label;
   m->query = ucvm_etree_model_query;
+  m->ctxinit = ucvm_etree_model_ctxinit;
+  m->ctxfinalize = ucvm_etree_model_ctxfinalize;
+  m->ctxquery = ucvm_etree_model_ctxquery;
+  m->cachestats = ucvm_etree_model_cachestats;
+  m->release = ucvm_etree_model_release;
+  m->caps = UCVM_MODEL_CAP_THREADSAFE;
 
   return(UCVM_CODE_SUCCESS);
 }
@@ -13,6 +13,10 @@ int ucvm_etree_model_init(int id, ucvm_modelconf_t *conf);
 int ucvm_etree_model_finalize();
 
 
+/* Release one Etree */
+int ucvm_etree_model_release(int id);
+
+
 /* Version Etree */
 int ucvm_etree_model_version(int id, char *ver, int len);
 
@@ -26,6 +30,25 @@ int ucvm_etree_model_query(int id, ucvm_ctype_t cmode,
 			   int n, ucvm_point_t *pnt, ucvm_data_t *data);
 
 
+/* Create private state Etree */
+int ucvm_etree_model_ctxinit(int id, void **state);
+
+
+/* Free private state Etree */
+int ucvm_etree_model_ctxfinalize(int id, void *state);
+
+
+/* Query Etree with private state */
+int ucvm_etree_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			      int n, ucvm_point_t *pnt, ucvm_data_t *data);
+
+
+/* Get octant cache counters Etree, optionally zeroing them */
+int ucvm_etree_model_cachestats(int id, int reset, 
+				unsigned long long *hits, 
+				unsigned long long *misses);
+
+
 /* Fill model structure with Etree */
 int ucvm_etree_get_model(ucvm_model_t *m);
 
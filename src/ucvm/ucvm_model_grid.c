@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ucvm_utils.h"
+#include "ucvm_meta_grid.h"
+#include "ucvm_model_grid.h"
+#include "ucvm_proj_ucvm.h"
+
+
+/* Grid record */
+typedef struct ucvm_grid_t {
+  int valid;
+  ucvm_modelconf_t conf;
+  ucvm_meta_ucvm_t meta;
+  ucvm_proj_t proj;
+  int mapped;
+  void *base;
+  size_t len;
+  size_t dims[3];
+  double spacing[3];
+  const float *vp;
+  const float *vs;
+  const float *rho;
+} ucvm_grid_t;
+
+
+/* Per-context grid state */
+typedef struct ucvm_grid_state_t {
+  ucvm_proj_t proj;
+} ucvm_grid_state_t;
+
+
+/* Grid list */
+int ucvm_num_grids = 0;
+ucvm_grid_t ucvm_grid_list[UCVM_MAX_MODELS];
+
+
+/* Map the grid volume file, or read and swap it on big endian hosts */
+int ucvm_grid_map(ucvm_grid_t *g)
+{
+  int fd;
+  size_t i, n;
+  struct stat st;
+  float *buf;
+
+  fd = open(g->conf.config, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open grid %s\n", g->conf.config);
+    return(UCVM_CODE_ERROR);
+  }
+  if ((fstat(fd, &st) != 0) || (st.st_size < UCVM_META_GRID_HEADER_LEN)) {
+    fprintf(stderr, "Grid %s is too short\n", g->conf.config);
+    close(fd);
+    return(UCVM_CODE_ERROR);
+  }
+  g->len = st.st_size;
+  g->base = mmap(NULL, g->len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (g->base == MAP_FAILED) {
+    fprintf(stderr, "Failed to map grid %s\n", g->conf.config);
+    g->base = NULL;
+    return(UCVM_CODE_ERROR);
+  }
+  g->mapped = 1;
+
+  if (ucvm_meta_grid_unpack(g->base, g->len,
+			    &(g->meta)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to unpack metadata from grid %s\n",
+	    g->conf.config);
+    return(UCVM_CODE_ERROR);
+  }
+  n = ucvm_meta_grid_nodes(&(g->meta));
+  if ((g->len - UCVM_META_GRID_HEADER_LEN) / (3 * sizeof(float)) < n) {
+    fprintf(stderr, "Grid %s is truncated\n", g->conf.config);
+    return(UCVM_CODE_ERROR);
+  }
+
+  g->vp = (const float *)((char *)g->base + UCVM_META_GRID_HEADER_LEN);
+  if (system_endian() != UCVM_BYTEORDER_LSB) {
+    buf = malloc(3 * n * sizeof(float));
+    if (buf == NULL) {
+      fprintf(stderr, "Failed to allocate grid buffer\n");
+      return(UCVM_CODE_ERROR);
+    }
+    for (i = 0; i < 3 * n; i++) {
+      buf[i] = swap_endian_float(g->vp[i]);
+    }
+    munmap(g->base, g->len);
+    g->mapped = 0;
+    g->base = buf;
+    g->vp = buf;
+  }
+  g->vs = g->vp + n;
+  g->rho = g->vs + n;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Release the grid volume */
+void ucvm_grid_unmap(ucvm_grid_t *g)
+{
+  if (g->mapped) {
+    munmap(g->base, g->len);
+  } else {
+    free(g->base);
+  }
+  g->base = NULL;
+  g->mapped = 0;
+  return;
+}
+
+
+/* Init Grid */
+int ucvm_grid_model_init(int id, ucvm_modelconf_t *conf)
+{
+  int i;
+  ucvm_grid_t *g;
+
+  /* Startup initialization */
+  if (ucvm_num_grids == 0) {
+    memset(ucvm_grid_list, 0, sizeof(ucvm_grid_t) * UCVM_MAX_MODELS);
+  }
+
+  if (strlen(conf->config) == 0) {
+    fprintf(stderr, "No config path defined for model %s\n", conf->label);
+    return(UCVM_CODE_ERROR);
+  }
+
+  if ((id < 0) || (id >= UCVM_MAX_MODELS)) {
+    fprintf(stderr, "Model ID is outside of max range\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  if (!ucvm_is_file(conf->config)) {
+    fprintf(stderr, "Grid %s is not a valid file\n", conf->config);
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Save model conf */
+  g = &(ucvm_grid_list[id]);
+  memcpy(&(g->conf), conf, sizeof(ucvm_modelconf_t));
+
+  if (ucvm_grid_map(g) != UCVM_CODE_SUCCESS) {
+    ucvm_grid_unmap(g);
+    return(UCVM_CODE_ERROR);
+  }
+  for (i = 0; i < 3; i++) {
+    g->dims[i] = g->meta.ticks_xyz.dim[i];
+    g->spacing[i] = g->meta.dims_xyz.coord[i] / (g->dims[i] - 1);
+  }
+
+  /* Setup projection */
+  if (ucvm_proj_ucvm_init(g->meta.projstr, &(g->meta.origin),
+			  g->meta.rot, &(g->meta.dims_xyz),
+			  &(g->proj)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to setup proj %s.\n", g->meta.projstr);
+    ucvm_grid_unmap(g);
+    return(UCVM_CODE_ERROR);
+  }
+
+  g->valid = 1;
+  ucvm_num_grids++;
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Release Grid */
+int ucvm_grid_model_release(int id)
+{
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) ||
+      (ucvm_grid_list[id].valid == 0)) {
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  /* Unmap volume and finalize projection */
+  ucvm_grid_unmap(&(ucvm_grid_list[id]));
+  ucvm_proj_ucvm_finalize(&(ucvm_grid_list[id].proj));
+
+  memset(&(ucvm_grid_list[id]), 0, sizeof(ucvm_grid_t));
+  ucvm_num_grids--;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Finalize Grid */
+int ucvm_grid_model_finalize()
+{
+  int i;
+
+  for (i = 0; i < UCVM_MAX_MODELS; i++) {
+    ucvm_grid_model_release(i);
+  }
+
+  ucvm_num_grids = 0;
+  memset(ucvm_grid_list, 0, sizeof(ucvm_grid_t) * UCVM_MAX_MODELS);
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Version Grid */
+int ucvm_grid_model_version(int id, char *ver, int len)
+{
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) ||
+      (ucvm_grid_list[id].valid == 0)) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  ucvm_strcpy(ver, ucvm_grid_list[id].meta.date, len);
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Label Grid */
+int ucvm_grid_model_label(int id, char *lab, int len)
+{
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) ||
+      (ucvm_grid_list[id].valid == 0)) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  ucvm_strcpy(lab, ucvm_grid_list[id].conf.label, len);
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Setparam Grid */
+int ucvm_grid_model_setparam(int id, int param, ...)
+{
+  va_list ap;
+
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) ||
+      (ucvm_grid_list[id].valid == 0)) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  va_start(ap, param);
+  switch (param) {
+  default:
+    break;
+  }
+
+  va_end(ap);
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Interpolate one property over the cell with corner node o */
+double ucvm_grid_trilinear(const float *a, size_t o, size_t sy,
+			   size_t sz, double *t)
+{
+  double c0, c1;
+
+  c0 = interpolate_linear(interpolate_linear(a[o], a[o + 1], t[0]),
+			  interpolate_linear(a[o + sy], a[o + sy + 1],
+					     t[0]), t[1]);
+  o += sz;
+  c1 = interpolate_linear(interpolate_linear(a[o], a[o + 1], t[0]),
+			  interpolate_linear(a[o + sy], a[o + sy + 1],
+					     t[0]), t[1]);
+
+  return(interpolate_linear(c0, c1, t[2]));
+}
+
+
+/* Get material properties at x,y,depth by trilinear interpolation */
+int ucvm_grid_getvals(ucvm_grid_t *g, ucvm_point_t *xy, ucvm_prop_t *prop)
+{
+  int d;
+  size_t idx[3], o, sy, sz;
+  double f, t[3];
+
+  for (d = 0; d < 3; d++) {
+    f = xy->coord[d] / g->spacing[d];
+    if ((f < 0.0) || (f > (double)(g->dims[d] - 1))) {
+      return(UCVM_CODE_ERROR);
+    }
+    idx[d] = (size_t)f;
+    if (idx[d] > g->dims[d] - 2) {
+      idx[d] = g->dims[d] - 2;
+    }
+    t[d] = f - idx[d];
+  }
+
+  sy = g->dims[0];
+  sz = g->dims[0] * g->dims[1];
+  o = (idx[2] * g->dims[1] + idx[1]) * g->dims[0] + idx[0];
+
+  /* Cells touching a node without data are gaps */
+  for (d = 0; d < 8; d++) {
+    if (!(g->vp[o + (d & 1) + ((d >> 1) & 1) * sy + (d >> 2) * sz] >
+	  0.0)) {
+      return(UCVM_CODE_ERROR);
+    }
+  }
+
+  prop->vp = ucvm_grid_trilinear(g->vp, o, sy, sz, t);
+  prop->vs = ucvm_grid_trilinear(g->vs, o, sy, sz, t);
+  prop->rho = ucvm_grid_trilinear(g->rho, o, sy, sz, t);
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Create private state Grid */
+int ucvm_grid_model_ctxinit(int id, void **state)
+{
+  ucvm_grid_t *g;
+  ucvm_grid_state_t *st;
+
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) ||
+      (ucvm_grid_list[id].valid == 0)) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* The volume is shared, only the projection is private */
+  g = &(ucvm_grid_list[id]);
+  st = malloc(sizeof(ucvm_grid_state_t));
+  if (st == NULL) {
+    fprintf(stderr, "Failed to allocate grid state\n");
+    return(UCVM_CODE_ERROR);
+  }
+  if (ucvm_proj_ucvm_init(g->meta.projstr, &(g->meta.origin),
+			  g->meta.rot, &(g->meta.dims_xyz),
+			  &(st->proj)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to setup proj %s.\n", g->meta.projstr);
+    free(st);
+    return(UCVM_CODE_ERROR);
+  }
+
+  *state = st;
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Free private state Grid */
+int ucvm_grid_model_ctxfinalize(int id, void *state)
+{
+  ucvm_grid_state_t *st = (ucvm_grid_state_t *)state;
+
+  if (st != NULL) {
+    ucvm_proj_ucvm_finalize(&(st->proj));
+    free(st);
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Query Grid */
+int ucvm_grid_model_query(int id, ucvm_ctype_t cmode,
+			  int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  return(ucvm_grid_model_ctxquery(id, NULL, cmode, n, pnt, data));
+}
+
+
+/* Query Grid with private state */
+int ucvm_grid_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			     int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int i, j, b, nb, ng;
+  double depth;
+  int gidx[UCVM_PROJ_BATCH];
+  int gstatus[UCVM_PROJ_BATCH];
+  ucvm_point_t gpnt[UCVM_PROJ_BATCH];
+  ucvm_point_t gxy[UCVM_PROJ_BATCH];
+  int datagap = 0;
+  ucvm_grid_t *g;
+  ucvm_proj_t *proj;
+
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) ||
+      (ucvm_grid_list[id].valid == 0)) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  g = &(ucvm_grid_list[id]);
+  if (state == NULL) {
+    proj = &(g->proj);
+  } else {
+    proj = &(((ucvm_grid_state_t *)state)->proj);
+  }
+
+  /* Check query mode */
+  switch (cmode) {
+  case UCVM_COORD_GEO_DEPTH:
+  case UCVM_COORD_GEO_ELEV:
+    break;
+  default:
+    fprintf(stderr, "Unsupported coord type\n");
+    return(UCVM_CODE_ERROR);
+    break;
+  }
+
+  for (b = 0; b < n; b += UCVM_PROJ_BATCH) {
+    nb = n - b;
+    if (nb > UCVM_PROJ_BATCH) {
+      nb = UCVM_PROJ_BATCH;
+    }
+
+    /* Gather points to look up */
+    ng = 0;
+    for (i = b; i < b + nb; i++) {
+      if ((data[i].crust.source == UCVM_SOURCE_NONE) &&
+	  ((data[i].domain == UCVM_DOMAIN_INTERP) ||
+	   (data[i].domain == UCVM_DOMAIN_CRUST)) &&
+	  (region_contains_null(&(g->conf.region), cmode, &(pnt[i])))) {
+
+	/* Modify pre-computed depth to account for GTL interp range */
+	depth = data[i].depth + data[i].shift_cr;
+
+	/* Grid extends from free surface on down */
+	if (depth >= 0.0) {
+	  gidx[ng] = i;
+	  gpnt[ng] = pnt[i];
+	  ng++;
+	} else {
+	  datagap = 1;
+	}
+      } else {
+	if (data[i].crust.source == UCVM_SOURCE_NONE) {
+	  datagap = 1;
+	}
+      }
+    }
+
+    /* Convert points to grid coordinates */
+    if (ucvm_proj_ucvm_geo2xy_batch(proj, ng, gpnt, gxy,
+				    gstatus) != UCVM_CODE_SUCCESS) {
+      return(UCVM_CODE_ERROR);
+    }
+
+    for (j = 0; j < ng; j++) {
+      i = gidx[j];
+      if (gstatus[j] != UCVM_CODE_SUCCESS) {
+	datagap = 1;
+	continue;
+      }
+
+      switch (cmode) {
+      case UCVM_COORD_GEO_DEPTH:
+	break;
+      case UCVM_COORD_GEO_ELEV:
+	gxy[j].coord[2] = (data[i].surf - gxy[j].coord[2]);
+	break;
+      }
+
+      if (ucvm_grid_getvals(g, &(gxy[j]),
+			    &(data[i].crust)) == UCVM_CODE_SUCCESS) {
+	data[i].crust.source = id;
+      } else {
+	datagap = 1;
+      }
+    }
+  }
+
+  if (datagap) {
+    return(UCVM_CODE_DATAGAP);
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Fill model structure with Grid */
+int ucvm_grid_get_model(ucvm_model_t *m)
+{
+  m->mtype = UCVM_MODEL_CRUSTAL;
+  m->init = ucvm_grid_model_init;
+  m->finalize = ucvm_grid_model_finalize;
+  m->setparam = ucvm_grid_model_setparam;
+  m->getversion = ucvm_grid_model_version;
+  m->getlabel = ucvm_grid_model_label;
+  m->query = ucvm_grid_model_query;
+  m->ctxinit = ucvm_grid_model_ctxinit;
+  m->ctxfinalize = ucvm_grid_model_ctxfinalize;
+  m->ctxquery = ucvm_grid_model_ctxquery;
+  m->release = ucvm_grid_model_release;
+  m->caps = UCVM_MODEL_CAP_THREADSAFE;
+
+  return(UCVM_CODE_SUCCESS);
+}
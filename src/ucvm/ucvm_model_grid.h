@@ -0,0 +1,50 @@
+#ifndef UCVM_MODEL_GRID_H
+#define UCVM_MODEL_GRID_H
+
+#include <stdarg.h>
+#include "ucvm_dtypes.h"
+
+
+/* Init Grid */
+int ucvm_grid_model_init(int id, ucvm_modelconf_t *conf);
+
+
+/* Finalize Grid */
+int ucvm_grid_model_finalize();
+
+
+/* Release one Grid */
+int ucvm_grid_model_release(int id);
+
+
+/* Version Grid */
+int ucvm_grid_model_version(int id, char *ver, int len);
+
+
+/* Setparam Grid */
+int ucvm_grid_model_setparam(int id, int param, ...);
+
+
+/* Query Grid */
+int ucvm_grid_model_query(int id, ucvm_ctype_t cmode,
+			  int n, ucvm_point_t *pnt, ucvm_data_t *data);
+
+
+/* Create private state Grid */
+int ucvm_grid_model_ctxinit(int id, void **state);
+
+
+/* Free private state Grid */
+int ucvm_grid_model_ctxfinalize(int id, void *state);
+
+
+/* Query Grid with private state */
+int ucvm_grid_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			     int n, ucvm_point_t *pnt, ucvm_data_t *data);
+
+
+/* Fill model structure with Grid */
+int ucvm_grid_get_model(ucvm_model_t *m);
+
+
+#endif
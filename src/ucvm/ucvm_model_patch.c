@@ -2,26 +2,53 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "ucvm_utils.h"
 #include "ucvm_config.h"
 #include "ucvm_meta_patch.h"
 #include "ucvm_model_patch.h"
 #include "ucvm_proj_ucvm.h"
+#include "ucvm_shm.h"
 
 
 /* Constants */
 #define UCVM_PATCH_POWER_FACTOR 2.0
 
+/* Number of horizontal locations with cached weights */
+#define UCVM_PATCH_CACHE_COLS 16
 
-/* Data bucket */
+
+/* Edge point with its distance^2 and weight for a horizontal location */
 typedef struct ucvm_bucket_t {
-  double vp;
-  double vs;
-  double rho;
   double dist;
+  double weight;
+  int surf;
+  int pos;
+  int n;
 } ucvm_bucket_t;
 
 
+/* Nearest edge points of a horizontal location, by distance */
+typedef struct ucvm_patch_col_t {
+  int valid;
+  double i0;
+  double j0;
+  double denom;
+  ucvm_bucket_t *near;
+} ucvm_patch_col_t;
+
+
+/* Edge point scratch space and cached columns */
+typedef struct ucvm_patch_cache_t {
+  int num_near;
+  ucvm_bucket_t *bucketlist;
+  ucvm_bucket_t *nearlist;
+  ucvm_patch_col_t cols[UCVM_PATCH_CACHE_COLS];
+  unsigned long long hits;
+  unsigned long long misses;
+} ucvm_patch_cache_t;
+
+
 /* Patch record */
 typedef struct ucvm_patch_t {
   int valid;
@@ -31,32 +58,163 @@ typedef struct ucvm_patch_t {
   ucvm_dim_t dims;
   ucvm_point_t sizes;
   ucvm_psurf_t surfs[2][2];
+  ucvm_ppayload_t *props;
+  ucvm_shm_t shm;
+  char projstr[UCVM_MAX_PROJ_LEN];
+  ucvm_point_t origin;
+  double rot;
   ucvm_proj_t proj;
   int ucvm_num_buckets;
-  ucvm_bucket_t *bucketlist;
+  ucvm_patch_cache_t cache;
+  unsigned long long cache_hits;
+  unsigned long long cache_misses;
 } ucvm_patch_t;
 
 
+/* Surface files of a patch */
+typedef struct ucvm_patch_files_t {
+  ucvm_patch_t *mptr;
+  char path[2][2][UCVM_CONFIG_MAX_STR];
+} ucvm_patch_files_t;
+
+
+/* Per-context patch state */
+typedef struct ucvm_patch_state_t {
+  ucvm_patch_cache_t cache;
+  ucvm_proj_t proj;
+} ucvm_patch_state_t;
+
+
 /* Patch list */
 int ucvm_num_patches = 0;
 ucvm_patch_t ucvm_patch_list[UCVM_MAX_MODELS];
 
+/* Guards the cache counters of all patches */
+pthread_mutex_t ucvm_patch_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Allocate edge point buffers for a patch */
+int ucvm_patch_cache_init(ucvm_patch_t *mptr, ucvm_patch_cache_t *c)
+{
+  int i;
+
+  memset(c, 0, sizeof(ucvm_patch_cache_t));
+  if (mptr->ucvm_num_buckets < 1) {
+    fprintf(stderr, "Patch has no edge points\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Weighting uses the nearest 10%, but the nearest point is always
+     needed to detect an exact hit */
+  c->num_near = mptr->ucvm_num_buckets/10;
+  if (c->num_near < 1) {
+    c->num_near = 1;
+  }
+
+  c->bucketlist = malloc(mptr->ucvm_num_buckets * sizeof(ucvm_bucket_t));
+  c->nearlist = malloc(UCVM_PATCH_CACHE_COLS * c->num_near * 
+		       sizeof(ucvm_bucket_t));
+  if ((c->bucketlist == NULL) || (c->nearlist == NULL)) {
+    fprintf(stderr, "Failed to allocate bucket buffer\n");
+    free(c->bucketlist);
+    free(c->nearlist);
+    memset(c, 0, sizeof(ucvm_patch_cache_t));
+    return(UCVM_CODE_ERROR);
+  }
+  for (i = 0; i < UCVM_PATCH_CACHE_COLS; i++) {
+    c->cols[i].near = &(c->nearlist[i * c->num_near]);
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Free edge point buffers */
+void ucvm_patch_cache_free(ucvm_patch_cache_t *c)
+{
+  free(c->bucketlist);
+  free(c->nearlist);
+  memset(c, 0, sizeof(ucvm_patch_cache_t));
+  return;
+}
+
+
+/* Read the surface files into one buffer, surface by surface */
+int ucvm_patch_read_surfs(ucvm_patch_files_t *files, ucvm_ppayload_t *buf)
+{
+  int i, j, n;
+  FILE *fp;
+  ucvm_psurf_t *surf;
+
+  for (j = 0; j < 2; j++) {
+    for (i = 0; i < 2; i++) {
+      surf = &(files->mptr->surfs[j][i]);
+      fp = fopen(files->path[j][i], "rb");
+      if (fp == NULL) {
+	fprintf(stderr, "Failed to open surf file %s\n", files->path[j][i]);
+	return(UCVM_CODE_ERROR);
+      }
+      if (fread(buf, sizeof(ucvm_ppayload_t), surf->num_points, fp) != 
+	  surf->num_points) {
+	fprintf(stderr, "Failed to read surf file %s\n", files->path[j][i]);
+	fclose(fp);
+	return(UCVM_CODE_ERROR);
+      }
+      fclose(fp);    
+
+      /* Swap endian from LSB to MSB if required */
+      if (system_endian() != UCVM_BYTEORDER_LSB) {
+	for (n = 0; n < surf->num_points; n++) {
+	  buf[n].vp = swap_endian_float(buf[n].vp);
+	  buf[n].vs = swap_endian_float(buf[n].vs);
+	  buf[n].rho = swap_endian_float(buf[n].rho);
+	}
+      }  
+      buf += surf->num_points;
+    }
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Load the surfaces into a new shared memory segment */
+int ucvm_patch_shm_load(ucvm_shm_t *shm, void *arg)
+{
+  ucvm_patch_files_t *files = (ucvm_patch_files_t *)arg;
+  ucvm_ppayload_t *buf;
+  size_t len = 0;
+  int i, j;
+
+  for (j = 0; j < 2; j++) {
+    for (i = 0; i < 2; i++) {
+      len += files->mptr->surfs[j][i].num_points;
+    }
+  }
+  buf = ucvm_shm_alloc(shm, len * sizeof(ucvm_ppayload_t));
+  if (buf == NULL) {
+    return(UCVM_CODE_ERROR);
+  }
+  return(ucvm_patch_read_surfs(files, buf));
+}
+
 
 /* Init Patch */
 int ucvm_patch_model_init(int id, ucvm_modelconf_t *conf)
 {
-  int i, j, n;
+  int i, j;
+  size_t num_points = 0;
   ucvm_patch_t *mptr;
   ucvm_config_t *chead;
   ucvm_config_t *cptr;
+  ucvm_patch_files_t files;
+  char shmkey[UCVM_SHM_MAX_KEY_LEN];
 
   /* Config params */
   char projstr[UCVM_MAX_PROJ_LEN];
   ucvm_point_t origin;
   double rot;
 
-  /* File IO */
-  FILE *fp;
   char key[UCVM_CONFIG_MAX_STR];
 
   /* Startup initialization */
@@ -211,50 +369,64 @@ int ucvm_patch_model_init(int id, ucvm_modelconf_t *conf)
 			     mptr->surfs[1][0].dims.dim[1]) +
 			    (mptr->surfs[1][1].dims.dim[0]*
 			     mptr->surfs[1][1].dims.dim[1]));
-  mptr->bucketlist = malloc(mptr->ucvm_num_buckets * 
-			    sizeof(ucvm_bucket_t));
-  if (mptr->bucketlist == NULL) {
-	fprintf(stderr, "Failed to allocate bucket buffer\n");
-	return(UCVM_CODE_ERROR);
+  if (ucvm_patch_cache_init(mptr, &(mptr->cache)) != UCVM_CODE_SUCCESS) {
+    return(UCVM_CODE_ERROR);
   }
+  mptr->cache_hits = 0;
+  mptr->cache_misses = 0;
 
-  /* Allocate buffers and read surface files */
+  /* Find surface files */
+  files.mptr = mptr;
+  snprintf(shmkey, UCVM_SHM_MAX_KEY_LEN, "patch:");
   for (j = 0; j < 2; j++) {
     for (i = 0; i < 2; i++) {
-      mptr->surfs[j][i].props = malloc(mptr->surfs[j][i].num_points * 
-				       sizeof(ucvm_ppayload_t));
-      if (mptr->surfs[j][i].props == NULL) {
-	fprintf(stderr, "Failed to allocate surface buffer %d,%d\n", i, j);
-	return(UCVM_CODE_ERROR);
-      }
-
       snprintf(key, UCVM_CONFIG_MAX_STR, "surf_%d_%d_path", i, j);
       cptr = ucvm_find_name(chead, key);
       if (cptr == NULL) {
 	fprintf(stderr, "Failed to find %s in config\n", key);
 	return(UCVM_CODE_ERROR);
       }
-
-      fp = fopen(cptr->value, "rb");
-      if (fread(mptr->surfs[j][i].props, sizeof(ucvm_ppayload_t),
-		mptr->surfs[j][i].num_points, fp) != 
-	  mptr->surfs[j][i].num_points) {
-	fprintf(stderr, "Failed to read surf file %s\n", cptr->value);
-	return(UCVM_CODE_ERROR);
+      ucvm_strcpy(files.path[j][i], cptr->value, UCVM_CONFIG_MAX_STR);
+      if ((strlen(shmkey) > 0) && 
+	  (ucvm_shm_addfile(shmkey, UCVM_SHM_MAX_KEY_LEN, 
+			    cptr->value) != UCVM_CODE_SUCCESS)) {
+	shmkey[0] = '\0';
       }
-      fclose(fp);    
+      num_points += mptr->surfs[j][i].num_points;
+    }
+  }
 
-      /* Swap endian from LSB to MSB if required */
-      if (system_endian() != UCVM_BYTEORDER_LSB) {
-	for (n = 0; n < mptr->surfs[j][i].num_points; n++) {
-	  mptr->surfs[j][i].props[n].vp = 
-	    swap_endian_float(mptr->surfs[j][i].props[n].vp);
-	  mptr->surfs[j][i].props[n].vs = 
-	    swap_endian_float(mptr->surfs[j][i].props[n].vs);
-	  mptr->surfs[j][i].props[n].rho = 
-	    swap_endian_float(mptr->surfs[j][i].props[n].rho);
-	}
-      }  
+  /* Share the surfaces with the other processes of the node, or
+     read them privately */
+  mptr->props = NULL;
+  if ((ucvm_shm_isenabled()) && (strlen(shmkey) > 0) &&
+      (strlen(shmkey) + 32 < UCVM_SHM_MAX_KEY_LEN)) {
+    snprintf(shmkey + strlen(shmkey), 32, "%lu", 
+	     (unsigned long)num_points);
+    mptr->props = ucvm_shm_attach(&(mptr->shm), shmkey, 
+				  ucvm_patch_shm_load, &files);
+    if ((mptr->props != NULL) && 
+	(mptr->shm.len != num_points * sizeof(ucvm_ppayload_t))) {
+      ucvm_shm_detach(&(mptr->shm));
+      mptr->props = NULL;
+    }
+  }
+  if (mptr->props == NULL) {
+    mptr->props = malloc(num_points * sizeof(ucvm_ppayload_t));
+    if (mptr->props == NULL) {
+      fprintf(stderr, "Failed to allocate surface buffers\n");
+      return(UCVM_CODE_ERROR);
+    }
+    if (ucvm_patch_read_surfs(&files, mptr->props) != UCVM_CODE_SUCCESS) {
+      return(UCVM_CODE_ERROR);
+    }
+  }
+
+  num_points = 0;
+  for (j = 0; j < 2; j++) {
+    for (i = 0; i < 2; i++) {
+      mptr->surfs[j][i].props = mptr->props + num_points;
+      num_points += mptr->surfs[j][i].num_points;
     }
   }
 
@@ -265,31 +437,49 @@ int ucvm_patch_model_init(int id, ucvm_modelconf_t *conf)
      return(UCVM_CODE_ERROR);
   }
 
+  /* Save projection params for private states */
+  ucvm_strcpy(mptr->projstr, projstr, UCVM_MAX_PROJ_LEN);
+  memcpy(&(mptr->origin), &origin, sizeof(ucvm_point_t));
+  mptr->rot = rot;
+
   mptr->valid = 1;
   ucvm_num_patches++;
   return(UCVM_CODE_SUCCESS);
 }
 
 
+/* Release Patch */
+int ucvm_patch_model_release(int id)
+{
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) || 
+      (ucvm_patch_list[id].valid == 0)) {
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  /* Free bucket list */
+  ucvm_patch_cache_free(&(ucvm_patch_list[id].cache));
+  /* Free or detach surface data */
+  if (ucvm_patch_list[id].shm.base != NULL) {
+    ucvm_shm_detach(&(ucvm_patch_list[id].shm));
+  } else {
+    free(ucvm_patch_list[id].props);
+  }
+
+  memset(&(ucvm_patch_list[id]), 0, sizeof(ucvm_patch_t));
+  ucvm_num_patches--;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Finalize Patch */
 int ucvm_patch_model_finalize()
 {
-  int i, j, m;
+  int m;
 
   /* Free buffers */
   for (m = 0; m < UCVM_MAX_MODELS; m++) {
-    if (ucvm_patch_list[m].valid) {
-      /* Free bucket list */
-      if (ucvm_patch_list[m].bucketlist != NULL) {
-	free(ucvm_patch_list[m].bucketlist);
-      }
-      /* Free surface data buffers */
-      for (j = 0; j < 2; j++) {
-	for (i = 0; i < 2; i++) {
-	  free(ucvm_patch_list[m].surfs[j][i].props);
-	}
-      }
-    }
+    ucvm_patch_model_release(m);
   }
 
   ucvm_num_patches = 0;
@@ -350,7 +540,7 @@ int ucvm_patch_model_setparam(int id, int param, ...)
 }
 
 
-/* Qsort bucket comparitor */
+/* Qsort bucket comparitor, ties broken by edge point order */
 int ucvm_patch_sort_comp(const void *v1, const void *v2)
 {
   ucvm_bucket_t *b1;  
@@ -361,42 +551,64 @@ int ucvm_patch_sort_comp(const void *v1, const void *v2)
 
   if (b1->dist < b2->dist) {
     return(-1);
-  } else if (b1->dist == b2->dist) {
-    return(0);
-  } else {
+  } else if (b1->dist > b2->dist) {
     return(1);
+  } else {
+    return(b1->n - b2->n);
   }
 }
 
 
-/* Get smoothed material properties at index */
-int ucvm_patch_getvals(int id, ucvm_point_t *xy, ucvm_prop_t *prop)
+/* Partially order the bucket list so that its first k entries are
+   the k nearest, in no particular order */
+void ucvm_patch_select(ucvm_bucket_t *bucketlist, int n, int k)
 {
-  ucvm_patch_t *mptr;
-  double i0, j0, k0;
-  int i, j, n, offset;
-  int a, b;
-  int fastdim, fastdimval;
-  ucvm_bucket_t ib[2];
-  double denom, weight;
+  int lo, hi, i, j;
+  ucvm_bucket_t pivot, tmp;
+
+  lo = 0;
+  hi = n - 1;
+  while (lo < hi) {
+    pivot = bucketlist[lo + (hi - lo)/2];
+    i = lo;
+    j = hi;
+    while (i <= j) {
+      while (ucvm_patch_sort_comp(&(bucketlist[i]), &pivot) < 0) {
+	i++;
+      }
+      while (ucvm_patch_sort_comp(&(bucketlist[j]), &pivot) > 0) {
+	j--;
+      }
+      if (i <= j) {
+	tmp = bucketlist[i];
+	bucketlist[i] = bucketlist[j];
+	bucketlist[j] = tmp;
+	i++;
+	j--;
+      }
+    }
+    if (k - 1 <= j) {
+      hi = j;
+    } else if (k - 1 >= i) {
+      lo = i;
+    } else {
+      break;
+    }
+  }
 
-  mptr = &(ucvm_patch_list[id]);
+  return;
+}
 
-  /* Check if point falls outside of model region */
-  if ((xy->coord[0] < 0.0) || 
-      (xy->coord[1] < 0.0) || 
-      (xy->coord[2] < 0.0) || 
-      (xy->coord[0] >= mptr->sizes.coord[0]) || 
-      (xy->coord[1] >= mptr->sizes.coord[1]) ||
-      (xy->coord[2] >= mptr->sizes.coord[2])) {
-    return(UCVM_CODE_ERROR);
-  }
 
-  i0 = xy->coord[0]/mptr->spacing;
-  j0 = xy->coord[1]/mptr->spacing;
-  k0 = xy->coord[2]/mptr->spacing;
+/* Find the nearest edge points and their inverse distance weights 
+   for horizontal location i0,j0 */
+int ucvm_patch_getcol(ucvm_patch_t *mptr, ucvm_patch_cache_t *c,
+		      double i0, double j0, ucvm_patch_col_t *col)
+{
+  int i, j, n;
+  int a, b;
 
-  /* Copy ring of points at this depth into bucket list */
+  /* Fill list of all edge points */
   n = 0;
   for (j = 0; j < 2; j++) {
     for (i = 0; i < 2; i++) {
@@ -404,54 +616,34 @@ int ucvm_patch_getvals(int id, ucvm_point_t *xy, ucvm_prop_t *prop)
       for (b = 0; b < mptr->surfs[j][i].dims.dim[1]; b++) {
 	for (a = 0; a < mptr->surfs[j][i].dims.dim[0]; a++) {
 	  if (i == 0) {
-	    fastdim = 0;
-	    fastdimval = a;
+	    c->bucketlist[n].pos = a;
 	  } else {
-	    fastdim = 1;
-	    fastdimval = b;
+	    c->bucketlist[n].pos = b;
 	  }
+	  c->bucketlist[n].surf = j*2+i;
+	  c->bucketlist[n].n = n;
 
 	  /* Compute distance^2 between query point and edge point */
 	  switch (j*2+i) {
 	  case 0:
-	    mptr->bucketlist[n].dist = ((i0-a)*(i0-a) +
-					(j0-0)*(j0-0));
+	    c->bucketlist[n].dist = ((i0-a)*(i0-a) +
+				     (j0-0)*(j0-0));
 	    break;
 	  case 1:
-	    mptr->bucketlist[n].dist = ((i0-0)*(i0-0) +
-					(j0-b)*(j0-b));
+	    c->bucketlist[n].dist = ((i0-0)*(i0-0) +
+				     (j0-b)*(j0-b));
 	    break;
 	  case 2:
-	    mptr->bucketlist[n].dist = ((i0-a)*(i0-a) +
-					(j0-mptr->dims.dim[1])*
-					(j0-mptr->dims.dim[1]));
+	    c->bucketlist[n].dist = ((i0-a)*(i0-a) +
+				     (j0-mptr->dims.dim[1])*
+				     (j0-mptr->dims.dim[1]));
 	    break;
 	  case 3:
-	    mptr->bucketlist[n].dist = ((i0-mptr->dims.dim[0])*
-					(i0-mptr->dims.dim[0]) +
-					(j0-b)*(j0-b));
+	    c->bucketlist[n].dist = ((i0-mptr->dims.dim[0])*
+				     (i0-mptr->dims.dim[0]) +
+				     (j0-b)*(j0-b));
 	    break;
 	  }
-
-	  /* Interpolate between cells along z-axis */
-	  offset = (int)(k0) * mptr->surfs[j][i].dims.dim[fastdim] 
-	    + fastdimval;
-	  ib[0].vp = mptr->surfs[j][i].props[offset].vp;
-	  ib[0].vs = mptr->surfs[j][i].props[offset].vs;
-	  ib[0].rho = mptr->surfs[j][i].props[offset].rho;
-	  if ((int)(k0) + 1 < mptr->surfs[j][i].dims.dim[2]) {
-	    offset = ((int)(k0) + 1) * mptr->surfs[j][i].dims.dim[fastdim] 
-	      + fastdimval;
-	  }
-	  ib[1].vp = mptr->surfs[j][i].props[offset].vp;
-	  ib[1].vs = mptr->surfs[j][i].props[offset].vs;
-	  ib[1].rho = mptr->surfs[j][i].props[offset].rho;
-	  mptr->bucketlist[n].vp = interpolate_linear(ib[0].vp, ib[1].vp,
-						      k0-(int)k0);
-	  mptr->bucketlist[n].vs = interpolate_linear(ib[0].vs, ib[1].vs,
-						      k0-(int)k0);
-	  mptr->bucketlist[n].rho = interpolate_linear(ib[0].rho, ib[1].rho,
-						       k0-(int)k0);
 	  n++;
 	}
       }
@@ -464,40 +656,159 @@ int ucvm_patch_getvals(int id, ucvm_point_t *xy, ucvm_prop_t *prop)
     return(UCVM_CODE_ERROR);
   }
 
-  /* Sort by distance^2 */
-  qsort(&(mptr->bucketlist[0]), mptr->ucvm_num_buckets, 
+  /* Select and sort only the nearest points */
+  ucvm_patch_select(c->bucketlist, n, c->num_near);
+  qsort(&(c->bucketlist[0]), c->num_near, 
 	sizeof(ucvm_bucket_t), ucvm_patch_sort_comp);
 
+  /* Compute inverse distance weights */
+  col->denom = 0.0;
+  for (n = 0; n < c->num_near; n++) {
+    col->near[n] = c->bucketlist[n];
+    if (n < mptr->ucvm_num_buckets/10) {
+      col->near[n].weight = 1.0/pow(sqrt(col->near[n].dist), 
+				    UCVM_PATCH_POWER_FACTOR);
+      col->denom += col->near[n].weight;
+    }
+  }
+  col->i0 = i0;
+  col->j0 = j0;
+  col->valid = 1;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Get material properties of edge point interpolated at depth k0 */
+void ucvm_patch_edgeval(ucvm_patch_t *mptr, ucvm_bucket_t *bucket, 
+			double k0, ucvm_prop_t *prop)
+{
+  int offset, fastdim;
+  ucvm_psurf_t *surf;
+  ucvm_ppayload_t *ib[2];
+
+  surf = &(mptr->surfs[bucket->surf/2][bucket->surf%2]);
+  fastdim = bucket->surf%2;
+
+  /* Interpolate between cells along z-axis */
+  offset = (int)(k0) * surf->dims.dim[fastdim] + bucket->pos;
+  ib[0] = &(surf->props[offset]);
+  if ((int)(k0) + 1 < surf->dims.dim[2]) {
+    offset = ((int)(k0) + 1) * surf->dims.dim[fastdim] + bucket->pos;
+  }
+  ib[1] = &(surf->props[offset]);
+  prop->vp = interpolate_linear(ib[0]->vp, ib[1]->vp, k0-(int)k0);
+  prop->vs = interpolate_linear(ib[0]->vs, ib[1]->vs, k0-(int)k0);
+  prop->rho = interpolate_linear(ib[0]->rho, ib[1]->rho, k0-(int)k0);
+
+  return;
+}
+
+
+/* Get smoothed material properties at index, caching the edge 
+   weights of each horizontal location */
+int ucvm_patch_getvals(int id, ucvm_patch_cache_t *cache,
+		       ucvm_point_t *xy, ucvm_prop_t *prop)
+{
+  ucvm_patch_t *mptr;
+  ucvm_patch_col_t *col;
+  double i0, j0, k0;
+  int n;
+  ucvm_prop_t ib;
+
+  mptr = &(ucvm_patch_list[id]);
+
+  /* Check if point falls outside of model region */
+  if ((xy->coord[0] < 0.0) || 
+      (xy->coord[1] < 0.0) || 
+      (xy->coord[2] < 0.0) || 
+      (xy->coord[0] >= mptr->sizes.coord[0]) || 
+      (xy->coord[1] >= mptr->sizes.coord[1]) ||
+      (xy->coord[2] >= mptr->sizes.coord[2])) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  i0 = xy->coord[0]/mptr->spacing;
+  j0 = xy->coord[1]/mptr->spacing;
+  k0 = xy->coord[2]/mptr->spacing;
+
+  /* Weights depend only on the horizontal location */
+  col = &(cache->cols[((unsigned int)i0 * 31 + (unsigned int)j0) % 
+		      UCVM_PATCH_CACHE_COLS]);
+  if ((col->valid) && (col->i0 == i0) && (col->j0 == j0)) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+    if (ucvm_patch_getcol(mptr, cache, i0, j0, col) != UCVM_CODE_SUCCESS) {
+      col->valid = 0;
+      return(UCVM_CODE_ERROR);
+    }
+  }
+
   /* Compute inverse distance weighting */
-  if (mptr->bucketlist[0].dist == 0.0) {
-    prop->vp = mptr->bucketlist[0].vp;
-    prop->vs = mptr->bucketlist[0].vs;
-    prop->rho = mptr->bucketlist[0].rho;
+  if (col->near[0].dist == 0.0) {
+    ucvm_patch_edgeval(mptr, &(col->near[0]), k0, prop);
   } else {
-    denom = 0.0;
     prop->vp = 0.0;    
     prop->vs = 0.0;
     prop->rho = 0.0;
     for (n = 0; n < mptr->ucvm_num_buckets/10; n++) {
-      denom += 1.0/pow(sqrt(mptr->bucketlist[n].dist), 
-		       UCVM_PATCH_POWER_FACTOR);
-    }
-    for (n = 0; n < mptr->ucvm_num_buckets/10; n++) {
-      weight = 1.0/pow(sqrt(mptr->bucketlist[n].dist), 
-		       UCVM_PATCH_POWER_FACTOR);
-      prop->vp += mptr->bucketlist[n].vp * weight / denom;
-      prop->vs += mptr->bucketlist[n].vs * weight / denom;
-      prop->rho += mptr->bucketlist[n].rho * weight / denom;
+      ucvm_patch_edgeval(mptr, &(col->near[n]), k0, &ib);
+      prop->vp += ib.vp * col->near[n].weight / col->denom;
+      prop->vs += ib.vs * col->near[n].weight / col->denom;
+      prop->rho += ib.rho * col->near[n].weight / col->denom;
     }
   }
 
-  //if ((i0 < 25) || (j0 < 25) ||
-  //    (i0 >= mptr->dims.dim[0] - 25) ||
-  //    (j0 >= mptr->dims.dim[1] - 25)) {
-  //   prop->vs = 8500.0;
-  //  prop->vs = 5000.0;
-   // prop->rho = 3000.0;
-  //}
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Create private state Patch */
+int ucvm_patch_model_ctxinit(int id, void **state)
+{
+  ucvm_patch_t *mptr;
+  ucvm_patch_state_t *st;
+
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) || 
+      (ucvm_patch_list[id].valid == 0)) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  mptr = &(ucvm_patch_list[id]);
+  st = malloc(sizeof(ucvm_patch_state_t));
+  if (st == NULL) {
+    fprintf(stderr, "Failed to allocate patch state\n");
+    return(UCVM_CODE_ERROR);
+  }
+  if (ucvm_patch_cache_init(mptr, &(st->cache)) != UCVM_CODE_SUCCESS) {
+    free(st);
+    return(UCVM_CODE_ERROR);
+  }
+  if (ucvm_proj_ucvm_init(mptr->projstr, &(mptr->origin), mptr->rot,
+			  &(mptr->sizes), &(st->proj)) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to setup proj %s.\n", mptr->projstr);
+    ucvm_patch_cache_free(&(st->cache));
+    free(st);
+    return(UCVM_CODE_ERROR);
+  }
+
+  *state = st;
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Free private state Patch */
+int ucvm_patch_model_ctxfinalize(int id, void *state)
+{
+  ucvm_patch_state_t *st = (ucvm_patch_state_t *)state;
+
+  if (st != NULL) {
+    ucvm_proj_ucvm_finalize(&(st->proj));
+    ucvm_patch_cache_free(&(st->cache));
+    free(st);
+  }
 
   return(UCVM_CODE_SUCCESS);
 }
@@ -507,10 +818,24 @@ int ucvm_patch_getvals(int id, ucvm_point_t *xy, ucvm_prop_t *prop)
 int ucvm_patch_model_query(int id, ucvm_ctype_t cmode,
 			   int n, ucvm_point_t *pnt, ucvm_data_t *data)
 {
-  int i;
-  ucvm_point_t xy;
+  return(ucvm_patch_model_ctxquery(id, NULL, cmode, n, pnt, data));
+}
+
+
+/* Query Patch with private state */
+int ucvm_patch_model_ctxquery(int id, void *state, ucvm_ctype_t cmode,
+			      int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int i, j, b, nb, ng;
   double depth;
+  int gidx[UCVM_PROJ_BATCH];
+  int gstatus[UCVM_PROJ_BATCH];
+  ucvm_point_t gpnt[UCVM_PROJ_BATCH];
+  ucvm_point_t gxy[UCVM_PROJ_BATCH];
   int datagap = 0;
+  ucvm_patch_cache_t *cache;
+  ucvm_proj_t *proj;
+  unsigned long long hits, misses;
 
   if ((id < 0) || (id >= UCVM_MAX_MODELS) || 
       (ucvm_patch_list[id].valid == 0)) {
@@ -518,6 +843,16 @@ int ucvm_patch_model_query(int id, ucvm_ctype_t cmode,
     return(UCVM_CODE_ERROR);
   }
 
+  if (state == NULL) {
+    cache = &(ucvm_patch_list[id].cache);
+    proj = &(ucvm_patch_list[id].proj);
+  } else {
+    cache = &(((ucvm_patch_state_t *)state)->cache);
+    proj = &(((ucvm_patch_state_t *)state)->proj);
+  }
+  hits = cache->hits;
+  misses = cache->misses;
+
   /* Check query mode */
   switch (cmode) {
   case UCVM_COORD_GEO_DEPTH:
@@ -529,52 +864,76 @@ int ucvm_patch_model_query(int id, ucvm_ctype_t cmode,
     break;
   }
 
-  for (i = 0; i < n; i++) {
-    if ((data[i].crust.source == UCVM_SOURCE_NONE) && 
-	((data[i].domain == UCVM_DOMAIN_INTERP) || 
-	 (data[i].domain == UCVM_DOMAIN_CRUST)) &&
-	(region_contains_null(&(ucvm_patch_list[id].conf.region), 
-			      cmode, &(pnt[i])))) {
-
-      /* Modify pre-computed depth to account for GTL interp range */
-      depth = data[i].depth + data[i].shift_cr;
-
-      /* Patch extends from free surface on down */
-      if (depth >= 0.0) {
-
-	/* Convert point to address */
-	if (ucvm_proj_ucvm_geo2xy(&(ucvm_patch_list[id].proj), 
-				  &(pnt[i]),
-				  &xy) == UCVM_CODE_SUCCESS) {
-
-	  switch (cmode) {
-	  case UCVM_COORD_GEO_DEPTH:
-	    break;
-	  case UCVM_COORD_GEO_ELEV:
-	    xy.coord[2] = (data[i].surf - xy.coord[2]);
-	    break;
-	  }
+  for (b = 0; b < n; b += UCVM_PROJ_BATCH) {
+    nb = n - b;
+    if (nb > UCVM_PROJ_BATCH) {
+      nb = UCVM_PROJ_BATCH;
+    }
 
-	  /* Query patch */
-	  if (ucvm_patch_getvals(id, &xy, 
-				 &(data[i].crust)) == UCVM_CODE_SUCCESS) {
-	    data[i].crust.source = id;
-	  } else {
-	    datagap = 1;
-	  }
+    /* Gather points to look up */
+    ng = 0;
+    for (i = b; i < b + nb; i++) {
+      if ((data[i].crust.source == UCVM_SOURCE_NONE) && 
+	  ((data[i].domain == UCVM_DOMAIN_INTERP) || 
+	   (data[i].domain == UCVM_DOMAIN_CRUST)) &&
+	  (region_contains_null(&(ucvm_patch_list[id].conf.region), 
+				cmode, &(pnt[i])))) {
+
+	/* Modify pre-computed depth to account for GTL interp range */
+	depth = data[i].depth + data[i].shift_cr;
+
+	/* Patch extends from free surface on down */
+	if (depth >= 0.0) {
+	  gidx[ng] = i;
+	  gpnt[ng] = pnt[i];
+	  ng++;
 	} else {
 	  datagap = 1;
 	}
       } else {
+	if (data[i].crust.source == UCVM_SOURCE_NONE) {
+	  datagap = 1;
+	}
+      }
+    }
+
+    /* Convert points to addresses */
+    if (ucvm_proj_ucvm_geo2xy_batch(proj, ng, gpnt, gxy, 
+				    gstatus) != UCVM_CODE_SUCCESS) {
+      return(UCVM_CODE_ERROR);
+    }
+
+    for (j = 0; j < ng; j++) {
+      i = gidx[j];
+      if (gstatus[j] != UCVM_CODE_SUCCESS) {
 	datagap = 1;
+	continue;
       }
-    } else {
-      if (data[i].crust.source == UCVM_SOURCE_NONE) {
-        datagap = 1;
+
+      switch (cmode) {
+      case UCVM_COORD_GEO_DEPTH:
+	break;
+      case UCVM_COORD_GEO_ELEV:
+	gxy[j].coord[2] = (data[i].surf - gxy[j].coord[2]);
+	break;
+      }
+
+      /* Query patch */
+      if (ucvm_patch_getvals(id, cache, &(gxy[j]), 
+			     &(data[i].crust)) == UCVM_CODE_SUCCESS) {
+	data[i].crust.source = id;
+      } else {
+	datagap = 1;
       }
     }
   }
 
+  /* Update cache counters */
+  pthread_mutex_lock(&ucvm_patch_cache_lock);
+  ucvm_patch_list[id].cache_hits += cache->hits - hits;
+  ucvm_patch_list[id].cache_misses += cache->misses - misses;
+  pthread_mutex_unlock(&ucvm_patch_cache_lock);
+
   if (datagap) {
     return(UCVM_CODE_DATAGAP);
   }
@@ -583,6 +942,34 @@ int ucvm_patch_model_query(int id, ucvm_ctype_t cmode,
 }
 
 
+/* Get column weight cache counters Patch, optionally zeroing them */
+int ucvm_patch_model_cachestats(int id, int reset, 
+				unsigned long long *hits, 
+				unsigned long long *misses)
+{
+  if ((id < 0) || (id >= UCVM_MAX_MODELS) || 
+      (ucvm_patch_list[id].valid == 0)) {
+    fprintf(stderr, "Invalid model id\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  pthread_mutex_lock(&ucvm_patch_cache_lock);
+  if (hits != NULL) {
+    *hits = ucvm_patch_list[id].cache_hits;
+  }
+  if (misses != NULL) {
+    *misses = ucvm_patch_list[id].cache_misses;
+  }
+  if (reset) {
+    ucvm_patch_list[id].cache_hits = 0;
+    ucvm_patch_list[id].cache_misses = 0;
+  }
+  pthread_mutex_unlock(&ucvm_patch_cache_lock);
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Fill model structure with Patch */
 int ucvm_patch_get_model(ucvm_model_t *m)
 {
@@ -593,6 +980,12 @@ int ucvm_patch_get_model(ucvm_model_t *m)
   m->getversion = ucvm_patch_model_version;
   m->getlabel = ucvm_patch_model_label;
   m->query = ucvm_patch_model_query;
+  m->ctxinit = ucvm_patch_model_ctxinit;
+  m->ctxfinalize = ucvm_patch_model_ctxfinalize;
+  m->ctxquery = ucvm_patch_model_ctxquery;
+  m->cachestats = ucvm_patch_model_cachestats;
+  m->release = ucvm_patch_model_release;
+  m->caps = UCVM_MODEL_CAP_THREADSAFE;
 
   return(UCVM_CODE_SUCCESS);
 }
@@ -1,12 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "ucvm_utils.h"
 #include "ucvm_model_plugin.h"
 
 #ifndef _UCVM_AM_STATIC
 	#include <dlfcn.h>
 #endif
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
 
 #ifdef _UCVM_AM_STATIC
 #ifdef _UCVM_ENABLE_CVMS5
@@ -41,6 +45,9 @@ ucvm_plugin_model_t plugin_models[UCVM_MAX_MODELS];
 /** Have we initialized this model yet? */
 int plugin_model_initialized = 0;
 
+/** Guards slot reservation, plugins may be initialized concurrently. */
+pthread_mutex_t plugin_model_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Initializes the model within the UCVM framework. This is accomplished
  * by dynamically loading the library symbols.
@@ -50,19 +57,66 @@ int plugin_model_initialized = 0;
  * @return UCVM_CODE_SUCCESS on success or ERROR on failure.
  */
 int ucvm_plugin_model_init(int id, ucvm_modelconf_t *conf) {
-	void *handle;
-	char sopath[1024];
+	ucvm_plugin_model_t *pptr;
+
+	// Reserve a slot under the lock, the load itself runs outside it.
+	pthread_mutex_lock(&plugin_model_lock);
+	pptr = get_plugin_by_label(conf->label);
 
-        ucvm_plugin_model_t *pptr=get_plugin_by_label(conf->label);
-      
 	// Have we initialized this model already?
 	if (pptr) {
-	  fprintf(stderr, "Model %d has already been initialized.\n", id);
-	  return UCVM_CODE_ERROR;
-	  } else {
-          // grab the first available space
-              pptr=get_plugin_by_order(plugin_model_initialized);
-        }
+		pthread_mutex_unlock(&plugin_model_lock);
+		fprintf(stderr, "Model %d has already been initialized.\n", id);
+		return UCVM_CODE_ERROR;
+	}
+
+	// grab the first available space, reusing released slots
+	pptr = get_plugin_by_free();
+	if (!pptr) {
+		pptr = get_plugin_by_order(plugin_model_initialized);
+		if (!pptr) {
+			pthread_mutex_unlock(&plugin_model_lock);
+			fprintf(stderr, "Maximum number of plugin models reached.\n");
+			return UCVM_CODE_ERROR;
+		}
+		plugin_model_initialized += 1;
+	}
+	memset(pptr, 0, sizeof(ucvm_plugin_model_t));
+	pptr->ucvm_plugin_model_id = -1;
+
+	// Save the model configuration data.
+	memcpy(&(pptr->ucvm_plugin_model_conf), conf, sizeof(ucvm_modelconf_t));
+	pthread_mutex_unlock(&plugin_model_lock);
+
+	if (ucvm_plugin_model_load(pptr, conf) != UCVM_CODE_SUCCESS) {
+		// Release the slot so that the label may be tried again.
+		pthread_mutex_lock(&plugin_model_lock);
+		memset(pptr, 0, sizeof(ucvm_plugin_model_t));
+		pptr->ucvm_plugin_model_id = -1;
+		pthread_mutex_unlock(&plugin_model_lock);
+		return UCVM_CODE_ERROR;
+	}
+
+	// Assign the id.
+	pptr->ucvm_plugin_model_id = id;
+
+	// Yes, this model has been initialized successfully.
+	return UCVM_CODE_SUCCESS;
+}
+
+/**
+ * Loads the library symbols into a reserved slot and initializes the
+ * model.
+ *
+ * @param The reserved plugin slot.
+ * @param The configuration file parameters for the model.
+ * @return UCVM_CODE_SUCCESS on success or ERROR on failure.
+ */
+int ucvm_plugin_model_load(ucvm_plugin_model_t *pptr, ucvm_modelconf_t *conf) {
+	void *handle;
+	char sopath[1024];
+
+	pptr->batch_size = MODEL_POINT_BUFFER;
 
 #ifndef _UCVM_AM_STATIC
 	snprintf(sopath, 1024, "%s/model/%s/lib/lib%s.so", conf->config, conf->label, conf->label);
@@ -92,6 +146,20 @@ int ucvm_plugin_model_init(int id, ucvm_modelconf_t *conf) {
 		return UCVM_CODE_ERROR;
 	}
 
+	// Optional SoA query.
+	dlerror();
+	MQSPTR *sptr = dlsym(handle, "get_model_query_soa");
+	if (dlerror() == NULL && sptr != NULL) {
+		pptr->model_query_soa = sptr();
+	}
+
+	// Optional capability flags.
+	dlerror();
+	MCPTR *cptr = dlsym(handle, "get_model_capabilities");
+	if (dlerror() == NULL && cptr != NULL) {
+		pptr->capabilities = cptr();
+	}
+
 	MFPTR *fptr = dlsym(handle, "get_model_finalize");
 	pptr->model_finalize = fptr();
 
@@ -171,15 +239,6 @@ int ucvm_plugin_model_init(int id, ucvm_modelconf_t *conf) {
 
 #endif
 
-	// Assign the id.
-        pptr->ucvm_plugin_model_id = id;
-
-	// Save the model configuration data.
-	memcpy(&(pptr->ucvm_plugin_model_conf), conf, sizeof(ucvm_modelconf_t));
-
-	// Yes, this model has been initialized successfully.
-	plugin_model_initialized += 1;
-
 	return UCVM_CODE_SUCCESS;
 }
 
@@ -194,7 +253,11 @@ int ucvm_plugin_model_finalize()
   for(i=0; i< plugin_model_initialized; i++) {
     // Finalize the model.
      ucvm_plugin_model_t *pptr=&plugin_models[i];
-     (pptr->model_finalize)();
+     // Slots released by a failed load have nothing to finalize.
+     if (pptr->model_finalize != NULL) {
+       (pptr->model_finalize)();
+     }
+     ucvm_plugin_model_buffers_free(pptr);
   }
   // We're no longer initialized.
   plugin_model_initialized = 0;
@@ -202,6 +265,32 @@ int ucvm_plugin_model_finalize()
   return UCVM_CODE_SUCCESS;
 }
 
+/**
+ * Finalizes one model that was never activated and frees its slot, so
+ * that the label may be initialized again.
+ *
+ * @param The model id.
+ * @return UCVM_CODE_SUCCESS
+ */
+int ucvm_plugin_model_release(int id)
+{
+  ucvm_plugin_model_t *pptr;
+
+  pthread_mutex_lock(&plugin_model_lock);
+  pptr = get_plugin_by_id(id);
+  if (pptr) {
+    if (pptr->model_finalize != NULL) {
+      (pptr->model_finalize)();
+    }
+    ucvm_plugin_model_buffers_free(pptr);
+    memset(pptr, 0, sizeof(ucvm_plugin_model_t));
+    pptr->ucvm_plugin_model_id = -1;
+  }
+  pthread_mutex_unlock(&plugin_model_lock);
+
+  return UCVM_CODE_SUCCESS;
+}
+
 /**
  * Retrieves the version of the model with which we're working.
  *
@@ -244,9 +333,171 @@ int ucvm_plugin_model_label(int id, char *lab, int len)
   return UCVM_CODE_SUCCESS;
 }
 
+/**
+ * Resizes one query buffer, leaving it untouched on failure.
+ *
+ * @param The buffer to resize.
+ * @param The new size in bytes.
+ * @return UCVM_CODE_SUCCESS on success or ERROR on failure.
+ */
+int ucvm_plugin_model_realloc(void *buf, size_t size) {
+	void **pbuf = buf;
+	void *p = realloc(*pbuf, size);
+
+	if (p == NULL) {
+		fprintf(stderr, "Memory allocation of plugin query buffers failed.\n");
+		return UCVM_CODE_ERROR;
+	}
+	*pbuf = p;
+	return UCVM_CODE_SUCCESS;
+}
+
+/**
+ * Grows the persistent query buffers of a plugin to hold len points.
+ * Only the layout used by the plugin's query function is allocated.
+ *
+ * @param The plugin.
+ * @param The number of points needed.
+ * @return UCVM_CODE_SUCCESS on success or ERROR on failure.
+ */
+int ucvm_plugin_model_buffers_grow(ucvm_plugin_model_t *pptr, int len) {
+	size_t dlen = len * sizeof(double);
+	int err = 0;
+
+	if (len <= pptr->buflen) {
+		return UCVM_CODE_SUCCESS;
+	}
+
+	err |= ucvm_plugin_model_realloc(&(pptr->index_mapping), len * sizeof(int));
+	if (pptr->model_query_soa != NULL) {
+		err |= ucvm_plugin_model_realloc(&(pptr->pnts_soa.longitude), dlen);
+		err |= ucvm_plugin_model_realloc(&(pptr->pnts_soa.latitude), dlen);
+		err |= ucvm_plugin_model_realloc(&(pptr->pnts_soa.depth), dlen);
+		err |= ucvm_plugin_model_realloc(&(pptr->data_soa.vp), dlen);
+		err |= ucvm_plugin_model_realloc(&(pptr->data_soa.vs), dlen);
+		err |= ucvm_plugin_model_realloc(&(pptr->data_soa.rho), dlen);
+		err |= ucvm_plugin_model_realloc(&(pptr->data_soa.qp), dlen);
+		err |= ucvm_plugin_model_realloc(&(pptr->data_soa.qs), dlen);
+	} else {
+		err |= ucvm_plugin_model_realloc(&(pptr->pnts_buffer), len * sizeof(basic_point_t));
+		err |= ucvm_plugin_model_realloc(&(pptr->data_buffer), len * sizeof(basic_properties_t));
+	}
+	if (err != 0) {
+		return UCVM_CODE_ERROR;
+	}
+	pptr->buflen = len;
+
+	return UCVM_CODE_SUCCESS;
+}
+
+/**
+ * Frees the persistent query buffers of a plugin.
+ *
+ * @param The plugin.
+ */
+void ucvm_plugin_model_buffers_free(ucvm_plugin_model_t *pptr) {
+	free(pptr->index_mapping);
+	free(pptr->pnts_buffer);
+	free(pptr->data_buffer);
+	free(pptr->pnts_soa.longitude);
+	free(pptr->pnts_soa.latitude);
+	free(pptr->pnts_soa.depth);
+	free(pptr->data_soa.vp);
+	free(pptr->data_soa.vs);
+	free(pptr->data_soa.rho);
+	free(pptr->data_soa.qp);
+	free(pptr->data_soa.qs);
+	pptr->index_mapping = NULL;
+	pptr->pnts_buffer = NULL;
+	pptr->data_buffer = NULL;
+	memset(&(pptr->pnts_soa), 0, sizeof(basic_points_soa_t));
+	memset(&(pptr->data_soa), 0, sizeof(basic_properties_soa_t));
+	pptr->buflen = 0;
+}
+
+/**
+ * Queries the plugin with nn buffered points starting at off.
+ *
+ * @param The plugin.
+ * @param The offset of the first point in the buffers.
+ * @param The number of points.
+ */
+void ucvm_plugin_model_call(ucvm_plugin_model_t *pptr, int off, int nn) {
+	basic_points_soa_t p;
+	basic_properties_soa_t d;
+
+	if (pptr->model_query_soa != NULL) {
+		p.longitude = pptr->pnts_soa.longitude + off;
+		p.latitude = pptr->pnts_soa.latitude + off;
+		p.depth = pptr->pnts_soa.depth + off;
+		d.vp = pptr->data_soa.vp + off;
+		d.vs = pptr->data_soa.vs + off;
+		d.rho = pptr->data_soa.rho + off;
+		d.qp = pptr->data_soa.qp + off;
+		d.qs = pptr->data_soa.qs + off;
+		(*(pptr->model_query_soa))(&p, &d, nn);
+	} else {
+		(*(pptr->model_query))(pptr->pnts_buffer + off, pptr->data_buffer + off, nn);
+	}
+}
+
+/**
+ * Queries the plugin with the nn buffered points and transfers the
+ * results to the data buffer. Reentrant plugins may be handed more
+ * than batch_size points, which are queried in parallel batches.
+ *
+ * @param The plugin.
+ * @param The number of buffered points.
+ * @param The data buffer.
+ * @return 1 if any point was not found, 0 otherwise.
+ */
+int ucvm_plugin_model_flush(ucvm_plugin_model_t *pptr, int nn, ucvm_data_t *data) {
+	int b, j, k;
+	int nb, batch = pptr->batch_size;
+	int datagap = 0;
+	double vp, vs, rho;
+
+	nb = (nn + batch - 1) / batch;
+	if (nb > 1 && (pptr->capabilities & MODEL_CAP_REENTRANT)) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (b = 0; b < nb; b++) {
+			int len = (b == nb - 1) ? nn - b * batch : batch;
+			ucvm_plugin_model_call(pptr, b * batch, len);
+		}
+	} else {
+		ucvm_plugin_model_call(pptr, 0, nn);
+	}
+
+	// Transfer our findings.
+	for (j = 0; j < nn; j++) {
+		if (pptr->model_query_soa != NULL) {
+			vp = pptr->data_soa.vp[j];
+			vs = pptr->data_soa.vs[j];
+			rho = pptr->data_soa.rho[j];
+		} else {
+			vp = pptr->data_buffer[j].vp;
+			vs = pptr->data_buffer[j].vs;
+			rho = pptr->data_buffer[j].rho;
+		}
+		if (vp >= 0 && vs >= 0 && rho >= 0) {
+			k = pptr->index_mapping[j];
+			data[k].crust.source = pptr->ucvm_plugin_model_id;
+			data[k].crust.vp = vp;
+			data[k].crust.vs = vs;
+			data[k].crust.rho = rho;
+		} else {
+			datagap = 1;
+		}
+	}
+
+	return datagap;
+}
+
 /**
  * This is the main function to query the model. It transfers to the point
- * buffer and then queries the model.
+ * buffer and then queries the model in batches of batch_size points.
  *
  * @param The model id.
  * @param Co-ordinate mode (elevation or depth or neither).
@@ -255,7 +506,7 @@ int ucvm_plugin_model_label(int id, char *lab, int len)
  * @param The data buffer.
  */
 int ucvm_plugin_model_query(int id, ucvm_ctype_t cmode, int n, ucvm_point_t *pnt, ucvm_data_t *data) {
-	int i = 0, j = 0, nn = 0;
+	int i = 0, nn = 0, len;
 	double depth = 0;
 	int datagap = 0;
 
@@ -272,15 +523,16 @@ int ucvm_plugin_model_query(int id, ucvm_ctype_t cmode, int n, ucvm_point_t *pnt
 		return UCVM_CODE_ERROR;
 	}
 
-        /** Stores the points in in WGS84 format. */
-        /** The returned data from the plugin model. */
-        basic_point_t *ucvm_plugin_pnts_buffer = malloc(MODEL_POINT_BUFFER * sizeof(basic_point_t));
-        basic_properties_t *ucvm_plugin_data_buffer = malloc(MODEL_POINT_BUFFER * sizeof(basic_properties_t));
-
-        /** Stores the mapping between data array and query buffer array */
-	int* index_mapping = malloc(sizeof(int)*MODEL_POINT_BUFFER);
-	if (index_mapping==NULL || ucvm_plugin_pnts_buffer == NULL || ucvm_plugin_data_buffer == NULL) {
-		fprintf(stderr, "Memory allocation of pnts_buffer, data_buffer or index_mapping failed, aborting.\n");
+	// Buffers persist across calls, sized to the largest batch seen.
+	len = (n < pptr->batch_size) ? n : pptr->batch_size;
+#ifdef _OPENMP
+	// Reentrant plugins take the whole call, split across threads.
+	if ((pptr->capabilities & MODEL_CAP_REENTRANT) && (n >= 2 * pptr->batch_size) &&
+	    (!omp_in_parallel()) && (omp_get_max_threads() > 1)) {
+		len = n;
+	}
+#endif
+	if (ucvm_plugin_model_buffers_grow(pptr, len) != UCVM_CODE_SUCCESS) {
 		return UCVM_CODE_ERROR;
 	}
 
@@ -291,29 +543,23 @@ int ucvm_plugin_model_query(int id, ucvm_ctype_t cmode, int n, ucvm_point_t *pnt
 	        /* Modify pre-computed depth to account for GTL interp range */
 	        depth = data[i].depth + data[i].shift_cr;
 
-                index_mapping[nn]=i;
-
-    		ucvm_plugin_pnts_buffer[nn].longitude = pnt[i].coord[0];
-    		ucvm_plugin_pnts_buffer[nn].latitude = pnt[i].coord[1];
-    		ucvm_plugin_pnts_buffer[nn].depth = depth;
+		pptr->index_mapping[nn]=i;
+
+		if (pptr->model_query_soa != NULL) {
+			pptr->pnts_soa.longitude[nn] = pnt[i].coord[0];
+			pptr->pnts_soa.latitude[nn] = pnt[i].coord[1];
+			pptr->pnts_soa.depth[nn] = depth;
+		} else {
+			pptr->pnts_buffer[nn].longitude = pnt[i].coord[0];
+			pptr->pnts_buffer[nn].latitude = pnt[i].coord[1];
+			pptr->pnts_buffer[nn].depth = depth;
+		}
     		nn++;
 
-	    	if (nn == MODEL_POINT_BUFFER || i == n - 1) {
+		if (nn == len) {
 	    		// We've reached the maximum buffer. Do the query.
-	    		(*(pptr->model_query))(ucvm_plugin_pnts_buffer, ucvm_plugin_data_buffer, nn);
-	    		// Transfer our findings.
-	    		for (j = 0; j < nn; j++) {
-	    			if (ucvm_plugin_data_buffer[j].vp >= 0 && ucvm_plugin_data_buffer[j].vs >= 0 && ucvm_plugin_data_buffer[j].rho >= 0) {
-	    				data[index_mapping[j]].crust.source = pptr->ucvm_plugin_model_id;
-	    				data[index_mapping[j]].crust.vp = ucvm_plugin_data_buffer[j].vp;
-	    				data[index_mapping[j]].crust.vs = ucvm_plugin_data_buffer[j].vs;
-	    				data[index_mapping[j]].crust.rho = ucvm_plugin_data_buffer[j].rho;
-	    			} else {
-	    				datagap = 1;
-	    			}
-	    		}
-	    	// Reset nn.
-	    	nn = 0;
+			datagap |= ucvm_plugin_model_flush(pptr, nn, data);
+			nn = 0;
     		}
 	    } else {
 	    	if (data[i].crust.source == UCVM_SOURCE_NONE) datagap = 1;
@@ -321,24 +567,9 @@ int ucvm_plugin_model_query(int id, ucvm_ctype_t cmode, int n, ucvm_point_t *pnt
 	}
         /* catch the last bits of partial chunk */
         if(nn != 0) {
-	    (*(pptr->model_query))(ucvm_plugin_pnts_buffer, ucvm_plugin_data_buffer, nn);
-	    // Transfer our findings.
-	    for (j = 0; j < nn; j++) {
-	    	if (ucvm_plugin_data_buffer[j].vp >= 0 && ucvm_plugin_data_buffer[j].vs >= 0 && ucvm_plugin_data_buffer[j].rho >= 0) {
-	    		data[index_mapping[j]].crust.source = pptr->ucvm_plugin_model_id;
-	    		data[index_mapping[j]].crust.vp = ucvm_plugin_data_buffer[j].vp;
-	    		data[index_mapping[j]].crust.vs = ucvm_plugin_data_buffer[j].vs;
-	    		data[index_mapping[j]].crust.rho = ucvm_plugin_data_buffer[j].rho;
-	    	} else {
-	    		datagap = 1;
-	    	}
-	   } 
+	    datagap |= ucvm_plugin_model_flush(pptr, nn, data);
         }
 
-	free(index_mapping);
-        free(ucvm_plugin_data_buffer);
-        free(ucvm_plugin_pnts_buffer);
-
 	if (datagap == 1) {
 		return UCVM_CODE_DATAGAP;
 	}
@@ -346,6 +577,33 @@ int ucvm_plugin_model_query(int id, ucvm_ctype_t cmode, int n, ucvm_point_t *pnt
 	return UCVM_CODE_SUCCESS;
 }
 
+/**
+ * Probes the capability flags of a plugin library, without
+ * initializing the model.
+ *
+ * @param sofile The plugin library.
+ * @return MODEL_CAP_* flags, 0 if not exported or not loadable.
+ */
+int ucvm_plugin_get_capabilities(const char *sofile) {
+	int caps = 0;
+#ifndef _UCVM_AM_STATIC
+	void *handle;
+	MCPTR *cptr;
+
+	handle = dlopen(sofile, RTLD_LAZY);
+	if (!handle) {
+		return 0;
+	}
+	dlerror();
+	cptr = dlsym(handle, "get_model_capabilities");
+	if (dlerror() == NULL && cptr != NULL) {
+		caps = cptr();
+	}
+	dlclose(handle);
+#endif
+	return caps;
+}
+
 /**
  * Fill model structure with the plugin model, if it exists.
  *
@@ -369,6 +627,13 @@ int ucvm_plugin_get_model(const char *dir, const char *label, ucvm_model_t *m) {
 		m->getlabel = ucvm_plugin_model_label;
 		m->setparam = ucvm_plugin_model_setparam;
 		m->query = ucvm_plugin_model_query;
+		m->release = ucvm_plugin_model_release;
+		// Plugins expect a serial init, unless they advertise otherwise.
+		if (ucvm_plugin_get_capabilities(sofile) & MODEL_CAP_PARALLEL_INIT) {
+			m->caps = UCVM_MODEL_CAP_PARALLEL_INIT;
+		} else {
+			m->caps = UCVM_MODEL_CAP_EXCLUSIVE_INIT;
+		}
 		return UCVM_CODE_SUCCESS;
 	} else{
 		return UCVM_CODE_ERROR;
@@ -379,6 +644,8 @@ int ucvm_plugin_get_model(const char *dir, const char *label, ucvm_model_t *m) {
 int ucvm_plugin_model_setparam(int id, int param, ...)
 {
   va_list ap;
+  char *pstr, *pval;
+  int batch;
 
   ucvm_plugin_model_t *pptr=get_plugin_by_id(id);
   if (!pptr) {
@@ -388,6 +655,19 @@ int ucvm_plugin_model_setparam(int id, int param, ...)
 
   va_start(ap, param);
   switch (param) {
+  case UCVM_PARAM_MODEL_CONF:
+    pstr = va_arg(ap, char *);
+    pval = va_arg(ap, char *);
+    if (strcmp(pstr, "BATCH_SIZE") == 0) {
+      batch = atoi(pval);
+      if (batch <= 0) {
+	fprintf(stderr, "Invalid batch size %s.\n", pval);
+	va_end(ap);
+	return(UCVM_CODE_ERROR);
+      }
+      pptr->batch_size = batch;
+    }
+    break;
   default:
     break;
   }
@@ -416,6 +696,17 @@ ucvm_plugin_model_t *get_plugin_by_id(int id) {
    return(0);
 };
 
+ucvm_plugin_model_t *get_plugin_by_free() {
+   int i;
+   // Released slots have no id and no label, loading ones keep a label.
+   for(i =0; i< plugin_model_initialized; i++) {
+     if( plugin_models[i].ucvm_plugin_model_id == -1 &&
+	 plugin_models[i].ucvm_plugin_model_conf.label[0] == '\0')
+	return &plugin_models[i];
+   }
+   return(0);
+};
+
 ucvm_plugin_model_t *get_plugin_by_order(int id) {
    if(id < UCVM_MAX_MODELS) {
         return &plugin_models[id];
@@ -22,6 +22,10 @@
 // Defines
 #define MODEL_POINT_BUFFER	1000
 
+// Flags returned by the optional get_model_capabilities
+#define MODEL_CAP_REENTRANT	0x01	/** model_query may run concurrently */
+#define MODEL_CAP_PARALLEL_INIT	0x02	/** model_init may run alongside other inits */
+
 // Structures
 typedef struct basic_point_t {
 	double longitude;
@@ -37,6 +41,21 @@ typedef struct basic_properties_t {
 	double qs;
 } basic_properties_t;
 
+/* Structure of arrays forms for get_model_query_soa */
+typedef struct basic_points_soa_t {
+	double *longitude;
+	double *latitude;
+	double *depth;
+} basic_points_soa_t;
+
+typedef struct basic_properties_soa_t {
+	double *vp;
+	double *vs;
+	double *rho;
+	double *qp;
+	double *qs;
+} basic_properties_soa_t;
+
 typedef struct ucvm_plugin_model_t {
 /** Used to store the model ID. */
 int ucvm_plugin_model_id;
@@ -46,26 +65,50 @@ int (*model_init)(const char *dir, const char *label);
 int (*model_query)(basic_point_t *points, basic_properties_t *data, int numpoints);
 int (*model_finalize)();
 int (*model_version)(char *ver, int len);
+/** Optional SoA query, NULL if the plugin does not export one. */
+int (*model_query_soa)(basic_points_soa_t *points, basic_properties_soa_t *data, int numpoints);
+/** MODEL_CAP_* flags from get_model_capabilities, 0 if not exported. */
+int capabilities;
+/** Points per plugin call, set with BATCH_SIZE. */
+int batch_size;
+/** Persistent query buffers, grown as needed. */
+int buflen;
+int *index_mapping;
+basic_point_t *pnts_buffer;
+basic_properties_t *data_buffer;
+basic_points_soa_t pnts_soa;
+basic_properties_soa_t data_soa;
 } ucvm_plugin_model_t;
 
 ucvm_plugin_model_t *get_plugin_by_label(char *);
 ucvm_plugin_model_t *get_plugin_by_id(int);
 ucvm_plugin_model_t *get_plugin_by_order(int);
+ucvm_plugin_model_t *get_plugin_by_free();
+
+int ucvm_plugin_model_load(ucvm_plugin_model_t *, ucvm_modelconf_t *);
+int ucvm_plugin_model_buffers_grow(ucvm_plugin_model_t *, int);
+void ucvm_plugin_model_buffers_free(ucvm_plugin_model_t *);
+void ucvm_plugin_model_call(ucvm_plugin_model_t *, int, int);
+int ucvm_plugin_model_flush(ucvm_plugin_model_t *, int, ucvm_data_t *);
 
 typedef int (*MIPTR())(const char *, const char *);
 typedef int (*MQPTR())(basic_point_t *, basic_properties_t *, int);
+typedef int (*MQSPTR())(basic_points_soa_t *, basic_properties_soa_t *, int);
 typedef int (*MFPTR())();
 typedef int (*MVPTR())(char *, int);
+typedef int MCPTR();
 
 // UCVM API Required Functions
 int ucvm_plugin_model_init(int id, ucvm_modelconf_t *conf);		/** Initializes CVM-S5. */
 int ucvm_plugin_model_finalize();								/** Cleans up memory, closes CVM-S5. */
+int ucvm_plugin_model_release(int id);							/** Cleans up one model that was never activated. */
 int ucvm_plugin_model_version(int id, char *ver, int len);		/** Retrieves the version of CVM-S5 that we are using. */
 int ucvm_plugin_model_label(int id, char *lab, int len);			/** Retrieves the label for CVM-S5. */
 int ucvm_plugin_model_setparam(int id, int param, ...);			/** Sets optional parameters. */
 int ucvm_plugin_model_query(int id, ucvm_ctype_t cmode,			/** Actually queries the model. */
 			  int n, ucvm_point_t *pnt,
 			  ucvm_data_t *data);
+int ucvm_plugin_get_capabilities(const char *sofile);			/** Probes the MODEL_CAP_* flags of a library. */
 int ucvm_plugin_get_model(const char *dir, const char *label,
 			  ucvm_model_t *m);						/** Fills the UCVM model structure with S5. */
 
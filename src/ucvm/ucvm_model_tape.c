@@ -191,6 +191,8 @@ int ucvm_tape_get_model(ucvm_model_t *m)
   m->getlabel = ucvm_tape_model_label;
   m->setparam = ucvm_tape_model_setparam;
   m->query = ucvm_tape_model_query;
+  /* Has no DEM of its own, uses UCVM topo */
+  m->needs = UCVM_VAL_SURF;
 
   return(UCVM_CODE_SUCCESS);
 }
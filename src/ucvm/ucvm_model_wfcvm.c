@@ -270,6 +270,8 @@ int ucvm_wfcvm_get_model(ucvm_model_t *m)
   m->getlabel = ucvm_wfcvm_model_label;
   m->setparam = ucvm_wfcvm_model_setparam;
   m->query = ucvm_wfcvm_model_query;
+  /* Fortran I/O units are shared with other Fortran models */
+  m->caps = UCVM_MODEL_CAP_SERIAL_INIT;
 
   return(UCVM_CODE_SUCCESS);
 }
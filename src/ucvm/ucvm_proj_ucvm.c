@@ -1,9 +1,16 @@
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
 #include "ucvm_utils.h"
 #include "ucvm_proj_ucvm.h"
 
 
+/* Proj.4 init and pj_errno are not thread safe, and model inits may
+   run concurrently */
+pthread_mutex_t ucvm_proj_ucvm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
 /* Initialize projection */
 int ucvm_proj_ucvm_init(const char* pstr, const ucvm_point_t *o, 
 			double r, ucvm_point_t *s, ucvm_proj_t *p)
@@ -13,18 +20,22 @@ int ucvm_proj_ucvm_init(const char* pstr, const ucvm_point_t *o,
   }
 
   /* Setup projection */
+  pthread_mutex_lock(&ucvm_proj_ucvm_lock);
   p->ipj = pj_init_plus(UCVM_PROJ_GEO);
   p->opj = pj_init_plus(pstr);
 
   if (p->ipj == NULL) {
+    pthread_mutex_unlock(&ucvm_proj_ucvm_lock);
     fprintf(stderr, "Failed to create input UCVM projection\n");
     return(UCVM_CODE_ERROR);
   }
   if (p->opj == NULL) {
     fprintf(stderr, "Failed to create output UCVM projection %s\n", pstr);
     fprintf(stderr, "Proj.4 Error: %s\n", pj_strerrno(pj_errno));
+    pthread_mutex_unlock(&ucvm_proj_ucvm_lock);
     return(UCVM_CODE_ERROR);
   }
+  pthread_mutex_unlock(&ucvm_proj_ucvm_lock);
 
   memcpy(&(p->p1), o, sizeof(ucvm_point_t));
   p->rot = r * DEG_TO_RAD;
@@ -106,6 +117,81 @@ int ucvm_proj_ucvm_geo2xy(ucvm_proj_t *p, ucvm_point_t *geo,
 }
 
 
+/* Convert n lon,lat to x,y with one projection call */
+int ucvm_proj_ucvm_geo2xy_batch(ucvm_proj_t *p, int n, ucvm_point_t *geo, 
+				ucvm_point_t *xy, int *status)
+{
+  int i, u;
+  double x, y, cosr, sinr;
+
+  if ((geo == NULL) || (xy == NULL) || (status == NULL) || (p == NULL)) {
+    return(UCVM_CODE_ERROR);
+  }
+  if (n <= 0) {
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  /* Consecutive points at the same lon,lat, such as the depths of a
+     column, are projected once. Pack the u distinct ones to the front */
+  u = 0;
+  for (i = 0; i < n; i++) {
+    if ((i == 0) || (geo[i].coord[0] != geo[i-1].coord[0]) || 
+	(geo[i].coord[1] != geo[i-1].coord[1])) {
+      xy[u].coord[0] = geo[i].coord[0] * DEG_TO_RAD;
+      xy[u].coord[1] = geo[i].coord[1] * DEG_TO_RAD;
+      u++;
+    }
+  }
+
+  /* Convert points to proj coords, point by point if any one fails */
+  if (pj_transform(p->ipj, p->opj, u, 
+		   sizeof(ucvm_point_t) / sizeof(double), 
+		   &(xy[0].coord[0]), &(xy[0].coord[1]), NULL) != 0) {
+    for (i = 0; i < n; i++) {
+      status[i] = ucvm_proj_ucvm_geo2xy(p, &(geo[i]), &(xy[i]));
+    }
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  /* Offset and rotate */
+  cosr = cos(p->rot);
+  sinr = sin(p->rot);
+  for (i = 0; i < u; i++) {
+    if ((xy[i].coord[0] == HUGE_VAL) || (xy[i].coord[1] == HUGE_VAL)) {
+      status[i] = UCVM_CODE_ERROR;
+      continue;
+    }
+    x = xy[i].coord[0] - p->offset.coord[0];
+    y = xy[i].coord[1] - p->offset.coord[1];
+    xy[i].coord[0] = x * cosr - y * sinr;
+    xy[i].coord[1] = x * sinr + y * cosr;
+
+    if ((xy[i].coord[0] < 0.0) || (xy[i].coord[1] < 0.0) || 
+	(xy[i].coord[0] > p->size.coord[0]) || 
+	(xy[i].coord[1] > p->size.coord[1])) {
+      status[i] = UCVM_CODE_ERROR;
+    } else {
+      status[i] = UCVM_CODE_SUCCESS;
+    }
+  }
+
+  /* Spread the distinct results back over their runs, from the end
+     so that no packed result is overwritten before it is copied */
+  for (i = n - 1; i >= 0; i--) {
+    xy[i].coord[0] = xy[u-1].coord[0];
+    xy[i].coord[1] = xy[u-1].coord[1];
+    xy[i].coord[2] = geo[i].coord[2];
+    status[i] = status[u-1];
+    if ((i > 0) && ((geo[i].coord[0] != geo[i-1].coord[0]) || 
+		    (geo[i].coord[1] != geo[i-1].coord[1]))) {
+      u--;
+    }
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
 /* Convert x,y to lon,lat */
 int ucvm_proj_ucvm_xy2geo(ucvm_proj_t *p, ucvm_point_t *xy, 
 			  ucvm_point_t *geo)
@@ -4,6 +4,8 @@
 #include "ucvm_dtypes.h"
 #include "proj_api.h"
 
+/* Points per batch projection in the model query loops */
+#define UCVM_PROJ_BATCH 256
 
 /* Projection parameters */
 typedef struct ucvm_proj_t 
@@ -28,6 +30,14 @@ int ucvm_proj_ucvm_finalize(ucvm_proj_t *p);
 int ucvm_proj_ucvm_geo2xy(ucvm_proj_t *p, ucvm_point_t *geo, ucvm_point_t *xy);
 
 
+/* Convert n lon,lat to x,y with one projection call. geo and xy 
+   must not overlap. status[i] is set to UCVM_CODE_SUCCESS for points
+   inside the projected region. Runs of points sharing a lon,lat are
+   projected once, so callers should keep columns contiguous */
+int ucvm_proj_ucvm_geo2xy_batch(ucvm_proj_t *p, int n, ucvm_point_t *geo, 
+				ucvm_point_t *xy, int *status);
+
+
 /* Convert x,y to lon,lat */
 int ucvm_proj_ucvm_xy2geo(ucvm_proj_t *p, ucvm_point_t *xy, ucvm_point_t *geo);
 
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ucvm_qcache.h"
+
+
+/* Quantize a coordinate. Without a tolerance the bit pattern is
+   used, so only identical values match */
+long long ucvm_qcache_quant(double v, double tol)
+{
+  long long k;
+
+  if (tol <= 0.0) {
+    memcpy(&k, &v, sizeof(long long));
+    return(k);
+  }
+  return((long long)floor(v / tol + 0.5));
+}
+
+
+/* Hash bucket of a key */
+int ucvm_qcache_bucket(ucvm_qcache_t *c, unsigned long long stack,
+		       long long *key)
+{
+  unsigned long long h;
+
+  h = stack;
+  h ^= (unsigned long long)key[0] * 0x9E3779B97F4A7C15ULL;
+  h ^= (unsigned long long)key[1] * 0xC2B2AE3D27D4EB4FULL;
+  h ^= (unsigned long long)key[2] * 0x165667B19E3779F9ULL;
+  h ^= h >> 29;
+
+  return((int)(h & (unsigned long long)(c->nbuckets - 1)));
+}
+
+
+/* Find the entry of a key on its hash chain, -1 if absent */
+int ucvm_qcache_find(ucvm_qcache_t *c, int b, unsigned long long stack,
+		     long long *key)
+{
+  int e;
+  ucvm_qcache_entry_t *ent;
+
+  for (e = c->buckets[b]; e >= 0; e = ent->chain) {
+    ent = &(c->entries[e]);
+    if ((ent->key[0] == key[0]) && (ent->key[1] == key[1]) &&
+	(ent->key[2] == key[2]) && (ent->stack == stack)) {
+      return(e);
+    }
+  }
+
+  return(-1);
+}
+
+
+/* Take an entry off the LRU list */
+void ucvm_qcache_unlink(ucvm_qcache_t *c, int e)
+{
+  ucvm_qcache_entry_t *ent = &(c->entries[e]);
+
+  if (ent->newer >= 0) {
+    c->entries[ent->newer].older = ent->older;
+  } else {
+    c->newest = ent->older;
+  }
+  if (ent->older >= 0) {
+    c->entries[ent->older].newer = ent->newer;
+  } else {
+    c->oldest = ent->newer;
+  }
+
+  return;
+}
+
+
+/* Put an entry at the recent end of the LRU list */
+void ucvm_qcache_push(ucvm_qcache_t *c, int e)
+{
+  ucvm_qcache_entry_t *ent = &(c->entries[e]);
+
+  ent->newer = -1;
+  ent->older = c->newest;
+  if (c->newest >= 0) {
+    c->entries[c->newest].newer = e;
+  } else {
+    c->oldest = e;
+  }
+  c->newest = e;
+
+  return;
+}
+
+
+/* Create a cache of size entries */
+int ucvm_qcache_init(ucvm_qcache_t *c, int size, double htol,
+		     double ztol)
+{
+  int i;
+
+  memset(c, 0, sizeof(ucvm_qcache_t));
+  if ((size <= 0) || (htol < 0.0) || (ztol < 0.0)) {
+    fprintf(stderr, "Invalid query cache size/tolerance\n");
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Power of two buckets, about two per entry */
+  c->nbuckets = 1;
+  while ((c->nbuckets < 2 * size) && (c->nbuckets < (1 << 30))) {
+    c->nbuckets *= 2;
+  }
+  c->buckets = malloc(c->nbuckets * sizeof(int));
+  c->entries = malloc(size * sizeof(ucvm_qcache_entry_t));
+  if ((c->buckets == NULL) || (c->entries == NULL)) {
+    fprintf(stderr, "Failed to allocate query cache of %d entries\n",
+	    size);
+    free(c->buckets);
+    free(c->entries);
+    memset(c, 0, sizeof(ucvm_qcache_t));
+    return(UCVM_CODE_ERROR);
+  }
+  for (i = 0; i < c->nbuckets; i++) {
+    c->buckets[i] = -1;
+  }
+
+  c->size = size;
+  c->htol = htol;
+  c->ztol = ztol;
+  c->newest = -1;
+  c->oldest = -1;
+  pthread_mutex_init(&(c->lock), NULL);
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Free cache entries */
+int ucvm_qcache_free(ucvm_qcache_t *c)
+{
+  if (c->size > 0) {
+    pthread_mutex_destroy(&(c->lock));
+  }
+  free(c->buckets);
+  free(c->entries);
+  memset(c, 0, sizeof(ucvm_qcache_t));
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Look up n points, returning the miss count */
+int ucvm_qcache_lookup(ucvm_qcache_t *c, unsigned long long stack,
+		       int n, ucvm_point_t *pnt, ucvm_data_t *data,
+		       int *miss)
+{
+  int i, e, nmiss = 0;
+  long long key[3];
+
+  pthread_mutex_lock(&(c->lock));
+  for (i = 0; i < n; i++) {
+    key[0] = ucvm_qcache_quant(pnt[i].coord[0], c->htol);
+    key[1] = ucvm_qcache_quant(pnt[i].coord[1], c->htol);
+    key[2] = ucvm_qcache_quant(pnt[i].coord[2], c->ztol);
+    e = ucvm_qcache_find(c, ucvm_qcache_bucket(c, stack, key),
+			 stack, key);
+    if (e < 0) {
+      miss[nmiss++] = i;
+      continue;
+    }
+    data[i] = c->entries[e].data;
+    if (c->newest != e) {
+      ucvm_qcache_unlink(c, e);
+      ucvm_qcache_push(c, e);
+    }
+  }
+  c->hits += n - nmiss;
+  c->misses += nmiss;
+  pthread_mutex_unlock(&(c->lock));
+
+  return(nmiss);
+}
+
+
+/* Store the results of n points */
+int ucvm_qcache_store(ucvm_qcache_t *c, unsigned long long stack,
+		      int n, ucvm_point_t *pnt, ucvm_data_t *data)
+{
+  int i, e, b, ob, *link;
+  long long key[3];
+  ucvm_qcache_entry_t *ent;
+
+  pthread_mutex_lock(&(c->lock));
+  for (i = 0; i < n; i++) {
+    key[0] = ucvm_qcache_quant(pnt[i].coord[0], c->htol);
+    key[1] = ucvm_qcache_quant(pnt[i].coord[1], c->htol);
+    key[2] = ucvm_qcache_quant(pnt[i].coord[2], c->ztol);
+    b = ucvm_qcache_bucket(c, stack, key);
+
+    e = ucvm_qcache_find(c, b, stack, key);
+    if (e >= 0) {
+      /* Duplicate within the batch */
+      c->entries[e].data = data[i];
+      ucvm_qcache_unlink(c, e);
+      ucvm_qcache_push(c, e);
+      continue;
+    }
+
+    if (c->num < c->size) {
+      e = c->num++;
+    } else {
+      /* Evict the least recently used entry from its chain */
+      e = c->oldest;
+      ent = &(c->entries[e]);
+      ucvm_qcache_unlink(c, e);
+      ob = ucvm_qcache_bucket(c, ent->stack, ent->key);
+      for (link = &(c->buckets[ob]); *link != e;
+	   link = &(c->entries[*link].chain));
+      *link = ent->chain;
+    }
+
+    ent = &(c->entries[e]);
+    ent->stack = stack;
+    ent->key[0] = key[0];
+    ent->key[1] = key[1];
+    ent->key[2] = key[2];
+    ent->data = data[i];
+    ent->chain = c->buckets[b];
+    c->buckets[b] = e;
+    ucvm_qcache_push(c, e);
+  }
+  pthread_mutex_unlock(&(c->lock));
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Get the hit/miss counters and entries in use */
+int ucvm_qcache_stats(ucvm_qcache_t *c, unsigned long long *hits,
+		      unsigned long long *misses, int *num)
+{
+  if (c->size > 0) {
+    pthread_mutex_lock(&(c->lock));
+  }
+  *hits = c->hits;
+  *misses = c->misses;
+  *num = c->num;
+  if (c->size > 0) {
+    pthread_mutex_unlock(&(c->lock));
+  }
+
+  return(UCVM_CODE_SUCCESS);
+}
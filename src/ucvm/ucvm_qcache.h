@@ -0,0 +1,68 @@
+#ifndef UCVM_QCACHE_H
+#define UCVM_QCACHE_H
+
+#include <pthread.h>
+#include "ucvm_dtypes.h"
+
+
+/* Cached result, on a hash chain and on the LRU list */
+typedef struct ucvm_qcache_entry_t
+{
+  unsigned long long stack;
+  long long key[3];
+  int chain;
+  int newer;
+  int older;
+  ucvm_data_t data;
+} ucvm_qcache_entry_t;
+
+
+/* Size-bounded LRU cache of query results. Points are keyed on
+   lon/lat quantized to htol degrees and Z to ztol meters, plus a
+   key of the model stack and query settings they were queried with */
+typedef struct ucvm_qcache_t
+{
+  int size;
+  int num;
+  int nbuckets;
+  double htol;
+  double ztol;
+  int *buckets;
+  ucvm_qcache_entry_t *entries;
+  int newest;
+  int oldest;
+  unsigned long long hits;
+  unsigned long long misses;
+  pthread_mutex_t lock;
+} ucvm_qcache_t;
+
+
+/* Create a cache of size entries. A tolerance of 0 matches exact
+   coordinates only */
+int ucvm_qcache_init(ucvm_qcache_t *c, int size, double htol,
+		     double ztol);
+
+
+/* Free cache entries */
+int ucvm_qcache_free(ucvm_qcache_t *c);
+
+
+/* Look up n points queried with stack key stack. Hits are copied to
+   data, the indices of misses go to miss. Returns the miss count */
+int ucvm_qcache_lookup(ucvm_qcache_t *c, unsigned long long stack,
+		       int n, ucvm_point_t *pnt, ucvm_data_t *data,
+		       int *miss);
+
+
+/* Store the results of n points queried with stack key stack,
+   evicting the least recently used entries */
+int ucvm_qcache_store(ucvm_qcache_t *c, unsigned long long stack,
+		      int n, ucvm_point_t *pnt, ucvm_data_t *data);
+
+
+/* Get the hit/miss counters and entries in use */
+int ucvm_qcache_stats(ucvm_qcache_t *c, unsigned long long *hits,
+		      unsigned long long *misses, int *num);
+
+
+#endif
@@ -2,18 +2,92 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "ucvm.h"
 #include "ucvm_utils.h"
+#include "ucvm_client.h"
 
 /* Constants */
 #define MAX_RES_LEN 256
 #define NUM_POINTS 20000
+#define NUM_BATCHES 4
 #define ZRANGE_MIN 0.0
 #define ZRANGE_MAX 350.0
 #define OUTPUT_FMT "%10.4lf %10.4lf %10.3lf %10.3lf %10.3lf %10s %10.3lf %10.3lf %10.3lf %10s %10.3lf %10.3lf %10.3lf %10s %10.3lf %10.3lf %10.3lf\n"
 
 #define JSON_OUTPUT_FMT "{ \"lon\":%.4lf,\"lat\":%.4lf,\"Z\":%.3lf,\"surf\":%.3lf,\"vs30\":%.3lf,\"crustal\":\"%s\",\"cr_vp\":%.3lf,\"cr_vs\":%.3lf,\"cr_rho\":%.3lf,\"gtl\":\"%s\",\"gtl_vp\":%.3lf,\"gtl_vs\":%.3lf,\"gtl_rho\":%.3lf,\"cmb_algo\":\"%s\",\"cmb_vp\":%.3lf,\"cmb_vs\":%.3lf,\"cvm_rho\":%.3lf }\n"
 
+/* Binary output */
+#define BIN_MAGIC "UCVMQRY1"
+#define BIN_NUM_COLS 17
+#define BIN_COL_LEN 16
+#define BIN_SRC_MODEL 0
+#define BIN_SRC_IFUNC 1
+
+/* Binary output header. Followed by nsrc source table entries, then
+   one record of ncols float32 values per point, in native byte order. 
+   Columns are as in text output, with the crustal and gtl columns 
+   holding model ids and cmb_algo an interp func id */
+typedef struct bin_hdr_t {
+  char magic[8];
+  int ncols;
+  int nsrc;
+  char cols[BIN_NUM_COLS][BIN_COL_LEN];
+} bin_hdr_t;
+
+/* Source table entry, kind is BIN_SRC_MODEL or BIN_SRC_IFUNC */
+typedef struct bin_src_t {
+  int kind;
+  int id;
+  char label[UCVM_MAX_LABEL_LEN];
+} bin_src_t;
+
+/* Source labels by id, looked up once after models are added */
+#define MODEL_LABEL(id) model_labels[(id) - UCVM_SOURCE_NONE]
+#define IFUNC_LABEL(id) ifunc_labels[(id) - UCVM_SOURCE_GTL]
+int num_models = 0;
+char model_labels[UCVM_MAX_MODELS + 1][UCVM_MAX_LABEL_LEN];
+char ifunc_labels[UCVM_MAX_MODELS + 3][UCVM_MAX_LABEL_LEN];
+
+/* Batch of points passed through the query pipeline */
+typedef struct batch_t {
+  int n;
+  ucvm_point_t *pnts;
+  ucvm_data_t *props;
+  double *inbuf;
+  float *binbuf;
+} batch_t;
+
+/* Bounded queue of batches between pipeline stages. A NULL batch
+   marks the end of input */
+typedef struct ring_t {
+  batch_t *slot[NUM_BATCHES + 1];
+  int head;
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty;
+  pthread_cond_t nonfull;
+} ring_t;
+
+/* Reader -> query -> writer pipeline. Batches cycle from free to 
+   full to done and back to free */
+typedef struct pipeline_t {
+  int batch_size;
+  int input_bin;
+  int output_json;
+  int output_bin;
+  int rerr;
+  int werr;
+  batch_t batches[NUM_BATCHES];
+  ring_t free;
+  ring_t full;
+  ring_t done;
+} pipeline_t;
+
+/* Connection used instead of local models with --connect */
+int use_server = 0;
+ucvm_client_t server;
+
 /* Getopt flags */
 extern char *optarg;
 extern int optind, opterr, optopt;
@@ -80,6 +154,66 @@ int disp_resources(int active_only)
 }
 
 
+/* Display query instrumentation as JSON */
+int disp_stats(FILE *fp)
+{
+  int i, nm = 0;
+  ucvm_stats_t stats;
+  ucvm_stat_t *st;
+  unsigned long long init_ns[UCVM_MAX_MODELS];
+  char label[UCVM_MAX_LABEL_LEN];
+  const char *stages[UCVM_MAX_STAGES] = {"query", "map", "crustal", 
+					 "gtl", "interp"};
+
+  if (ucvm_get_stats(&stats) != UCVM_CODE_SUCCESS) {
+    return(1);
+  }
+
+  fprintf(fp, "{ \"stages\": [");
+  for (i = 0; i < UCVM_MAX_STAGES; i++) {
+    st = &(stats.stage[i]);
+    fprintf(fp, "%s\n  { \"stage\": \"%s\", \"calls\": %llu, "
+	    "\"offered\": %llu, \"served\": %llu, \"datagap\": %llu, "
+	    "\"skipped\": %llu, \"ns\": %llu, \"cache_hits\": %llu, "
+	    "\"cache_misses\": %llu }", (i > 0) ? "," : "", 
+	    stages[i], st->calls, st->offered, st->served, st->datagap, 
+	    st->skipped, st->ns, st->cache_hits, st->cache_misses);
+  }
+  fprintf(fp, " ],\n  \"models\": [");
+
+  /* Only models that were consulted */
+  for (i = 0; i < UCVM_MAX_MODELS; i++) {
+    st = &(stats.model[i]);
+    if (st->calls == 0) {
+      continue;
+    }
+    ucvm_model_label(i, label, UCVM_MAX_LABEL_LEN);
+    fprintf(fp, "%s\n  { \"id\": %d, \"label\": \"%s\", \"calls\": %llu, "
+	    "\"offered\": %llu, \"served\": %llu, \"datagap\": %llu, "
+	    "\"ns\": %llu, \"cache_hits\": %llu, \"cache_misses\": %llu }", 
+	    (nm > 0) ? "," : "", i, label, st->calls, st->offered, 
+	    st->served, st->datagap, st->ns, st->cache_hits, 
+	    st->cache_misses);
+    nm++;
+  }
+  fprintf(fp, " ],\n  \"init\": [");
+
+  /* Model init wall times, in priority order */
+  nm = UCVM_MAX_MODELS;
+  if (ucvm_get_init_times(init_ns, &nm) != UCVM_CODE_SUCCESS) {
+    nm = 0;
+  }
+  for (i = 0; i < nm; i++) {
+    ucvm_model_label(i, label, UCVM_MAX_LABEL_LEN);
+    fprintf(fp, "%s\n  { \"id\": %d, \"label\": \"%s\", \"ns\": %llu }",
+	    (i > 0) ? "," : "", i, label, init_ns[i]);
+  }
+  fprintf(fp, " ] }\n");
+
+  return(0);
+}
+
+
 
 /* Usage function */
 void usage() {
@@ -97,6 +231,19 @@ void usage() {
   printf("\t-z Optional depth range for gtl/crust interpolation.\n\n");
   printf("\t-b Optional output in json format\n\n");
   printf("\t-l Optional input lat,lon,Z(depth/elevation)\n\n");
+  printf("\t-S Optional query statistics and model init times in json\n\t   format on stderr\n\n");
+  printf("\t-n Optional points per query batch, default %d.\n\n", NUM_POINTS);
+  printf("\t-t Optional points per query tile, 0 for whole batches,\n");
+  printf("\t   default %d.\n\n", UCVM_DEFAULT_QUERY_TILE);
+  printf("\t-M Optional skip of the surface/vs30 map lookup unless the\n");
+  printf("\t   query needs it. surf and vs30 are then output as 0.\n\n");
+  printf("\t-q Optional result cache of size entries, as size[,htol,ztol].\n");
+  printf("\t   Points within htol degrees and ztol meters share results,\n");
+  printf("\t   default %g,%g.\n\n", UCVM_DEFAULT_QCACHE_HTOL, UCVM_DEFAULT_QCACHE_ZTOL);
+  printf("\t--connect socket Query a running ucvm_served instead of loading\n");
+  printf("\t   the models. -m, -p, -v, -S, -t, -M and -q are ignored.\n\n");
+  printf("\t-I Optional input format: text (default), bin.\n\n");
+  printf("\t-O Optional output format: text (default), bin.\n\n");
   exit (0);
 }
 
@@ -116,10 +263,28 @@ void usage_detail() {
   printf("\t-z Optional depth range for gtl/crust interpolation.\n\n");
   printf("\t-b Optional output in json format\n\n");
   printf("\t-l Optional input lon,lat,Z(depth/elevation)\n\n");
+  printf("\t-S Optional query statistics and model init times in json\n\t   format on stderr\n\n");
+  printf("\t-n Optional points per query batch, default %d.\n\n", NUM_POINTS);
+  printf("\t-t Optional points per query tile, 0 for whole batches,\n");
+  printf("\t   default %d.\n\n", UCVM_DEFAULT_QUERY_TILE);
+  printf("\t-M Optional skip of the surface/vs30 map lookup unless the\n");
+  printf("\t   query needs it. surf and vs30 are then output as 0.\n\n");
+  printf("\t-q Optional result cache of size entries, as size[,htol,ztol].\n");
+  printf("\t   Points within htol degrees and ztol meters share results,\n");
+  printf("\t   default %g,%g.\n\n", UCVM_DEFAULT_QCACHE_HTOL, UCVM_DEFAULT_QCACHE_ZTOL);
+  printf("\t--connect socket Query a running ucvm_served instead of loading\n");
+  printf("\t   the models. -m, -p, -v, -S, -t, -M and -q are ignored.\n\n");
+  printf("\t-I Optional input format: text (default), bin.\n\n");
+  printf("\t-O Optional output format: text (default), bin.\n\n");
   printf("Input format is:\n");
   printf("\tlon lat Z\n\n");
   printf("Output format is:\n");
   printf("\tlon lat Z surf vs30 crustal cr_vp cr_vs cr_rho gtl gtl_vp gtl_vs gtl_rho cmb_algo cmb_vp cmb_vs cmb_rho\n\n");
+  printf("Binary input is packed float64 lon,lat,Z records. Binary output is a\n");
+  printf("header (magic %s, ncols, nsrc, ncols %d-byte column names), nsrc source\n", BIN_MAGIC, BIN_COL_LEN);
+  printf("table entries (int kind, int id, %d-byte label; kind 0 is a model id\n", UCVM_MAX_LABEL_LEN);
+  printf("used in crustal/gtl, kind 1 an interp func id used in cmb_algo), then\n");
+  printf("packed float32 records of the output columns. All in native byte order.\n\n");
   printf("Notes:\n");
   printf("\t- If running interactively, type Cntl-D to end input coord list.\n\n");
   printf("Version: %s\n\n", VERSION);
@@ -127,54 +292,413 @@ void usage_detail() {
   exit (0);
 }
 
-void process_query(ucvm_point_t *pnts, ucvm_data_t *props,int numread,int output_json) {
+/* Look up source labels */
+void load_labels()
+{
+  int i;
+
+  if (use_server) {
+    num_models = server.num_models;
+    for (i = UCVM_SOURCE_NONE; i < num_models; i++) {
+      ucvm_client_model_label(&server, i, MODEL_LABEL(i), 
+			      UCVM_MAX_LABEL_LEN);
+    }
+    for (i = UCVM_SOURCE_GTL; i < num_models; i++) {
+      ucvm_client_ifunc_label(&server, i, IFUNC_LABEL(i), 
+			      UCVM_MAX_LABEL_LEN);
+    }
+    return;
+  }
+
+  num_models = ucvm_get_num_models();
+  for (i = UCVM_SOURCE_NONE; i < num_models; i++) {
+    ucvm_model_label(i, MODEL_LABEL(i), UCVM_MAX_LABEL_LEN);
+  }
+  for (i = UCVM_SOURCE_GTL; i < num_models; i++) {
+    ucvm_ifunc_label(i, IFUNC_LABEL(i), UCVM_MAX_LABEL_LEN);
+  }
+}
+
+
+/* Query the local models or the server */
+int query_points(int n, ucvm_point_t *pnts, ucvm_data_t *props)
+{
+  if (use_server) {
+    return(ucvm_client_query(&server, n, pnts, props));
+  }
+  return(ucvm_query(n, pnts, props));
+}
+
 
+/* Write binary output header and source table */
+int write_bin_header(FILE *fp)
+{
   int i;
-  char cr_label[UCVM_MAX_LABEL_LEN];
-  char gtl_label[UCVM_MAX_LABEL_LEN];
-  char if_label[UCVM_MAX_LABEL_LEN];
+  bin_hdr_t hdr;
+  bin_src_t src;
+  const char *cols[BIN_NUM_COLS] = {"lon", "lat", "Z", "surf", "vs30", 
+				    "crustal", "cr_vp", "cr_vs", "cr_rho", 
+				    "gtl", "gtl_vp", "gtl_vs", "gtl_rho", 
+				    "cmb_algo", "cmb_vp", "cmb_vs", 
+				    "cmb_rho"};
 
-	/* Query the UCVM */
-	if (ucvm_query(numread, pnts, props) != UCVM_CODE_SUCCESS) {
-	  fprintf(stderr, "Query CVM failed\n");
-	  return;
+  memset(&hdr, 0, sizeof(bin_hdr_t));
+  memcpy(hdr.magic, BIN_MAGIC, 8);
+  hdr.ncols = BIN_NUM_COLS;
+  hdr.nsrc = (num_models + 1) + (num_models + 3);
+  for (i = 0; i < BIN_NUM_COLS; i++) {
+    ucvm_strcpy(hdr.cols[i], cols[i], BIN_COL_LEN);
+  }
+  if (fwrite(&hdr, sizeof(bin_hdr_t), 1, fp) != 1) {
+    return(1);
+  }
+
+  for (i = UCVM_SOURCE_NONE; i < num_models; i++) {
+    memset(&src, 0, sizeof(bin_src_t));
+    src.kind = BIN_SRC_MODEL;
+    src.id = i;
+    ucvm_strcpy(src.label, MODEL_LABEL(i), UCVM_MAX_LABEL_LEN);
+    if (fwrite(&src, sizeof(bin_src_t), 1, fp) != 1) {
+      return(1);
+    }
+  }
+  for (i = UCVM_SOURCE_GTL; i < num_models; i++) {
+    memset(&src, 0, sizeof(bin_src_t));
+    src.kind = BIN_SRC_IFUNC;
+    src.id = i;
+    ucvm_strcpy(src.label, IFUNC_LABEL(i), UCVM_MAX_LABEL_LEN);
+    if (fwrite(&src, sizeof(bin_src_t), 1, fp) != 1) {
+      return(1);
+    }
+  }
+
+  return(0);
+}
+
+
+/* Write results as binary records */
+int write_bin(FILE *fp, ucvm_point_t *pnts, ucvm_data_t *props, 
+	      int numread, float *buf)
+{
+  int i;
+  float *rec;
+
+  for (i = 0; i < numread; i++) {
+    rec = &(buf[i * BIN_NUM_COLS]);
+    rec[0] = pnts[i].coord[0];
+    rec[1] = pnts[i].coord[1];
+    rec[2] = pnts[i].coord[2];
+    rec[3] = props[i].surf;
+    rec[4] = props[i].vs30;
+    rec[5] = props[i].crust.source;
+    rec[6] = props[i].crust.vp;
+    rec[7] = props[i].crust.vs;
+    rec[8] = props[i].crust.rho;
+    rec[9] = props[i].gtl.source;
+    rec[10] = props[i].gtl.vp;
+    rec[11] = props[i].gtl.vs;
+    rec[12] = props[i].gtl.rho;
+    rec[13] = props[i].cmb.source;
+    rec[14] = props[i].cmb.vp;
+    rec[15] = props[i].cmb.vs;
+    rec[16] = props[i].cmb.rho;
+  }
+
+  if (fwrite(buf, BIN_NUM_COLS * sizeof(float), numread, fp) != 
+      (size_t)numread) {
+    return(1);
+  }
+
+  return(0);
+}
+
+
+/* Write results as text or json lines */
+void write_text(FILE *fp, ucvm_point_t *pnts, ucvm_data_t *props, 
+		int numread, int output_json)
+{
+  int i;
+
+  for (i = 0; i < numread; i++) {
+    fprintf(fp, output_json ? JSON_OUTPUT_FMT : OUTPUT_FMT, 
+	    pnts[i].coord[0], pnts[i].coord[1], pnts[i].coord[2],
+	    props[i].surf, props[i].vs30,
+	    MODEL_LABEL(props[i].crust.source), props[i].crust.vp, 
+	    props[i].crust.vs, props[i].crust.rho, 
+	    MODEL_LABEL(props[i].gtl.source), props[i].gtl.vp,
+	    props[i].gtl.vs, props[i].gtl.rho,
+	    IFUNC_LABEL(props[i].cmb.source), props[i].cmb.vp, 
+	    props[i].cmb.vs, props[i].cmb.rho);
+  }
+}
+
+
+/* Write a batch of results */
+int write_batch(batch_t *b, int output_json)
+{
+  if (b->binbuf != NULL) {
+    if (write_bin(stdout, b->pnts, b->props, b->n, b->binbuf) != 0) {
+      fprintf(stderr, "Failed to write binary output\n");
+      return(1);
+    }
+  } else {
+    write_text(stdout, b->pnts, b->props, b->n, output_json);
+  }
+
+  return(0);
+}
+
+
+/* Allocate batch buffers */
+int batch_init(batch_t *b, int len, int input_bin, int output_bin)
+{
+  memset(b, 0, sizeof(batch_t));
+  b->pnts = malloc(len * sizeof(ucvm_point_t));
+  b->props = malloc(len * sizeof(ucvm_data_t));
+  if (input_bin) {
+    b->inbuf = malloc(len * 3 * sizeof(double));
+  }
+  if (output_bin) {
+    b->binbuf = malloc(len * BIN_NUM_COLS * sizeof(float));
+  }
+  if ((b->pnts == NULL) || (b->props == NULL) || 
+      (input_bin && (b->inbuf == NULL)) || 
+      (output_bin && (b->binbuf == NULL))) {
+    fprintf(stderr, "Failed to allocate buffers\n");
+    return(1);
+  }
+
+  return(0);
+}
+
+
+/* Free batch buffers */
+void batch_free(batch_t *b)
+{
+  free(b->pnts);
+  free(b->props);
+  free(b->inbuf);
+  free(b->binbuf);
+  memset(b, 0, sizeof(batch_t));
+}
+
+
+/* Initialize a batch queue */
+void ring_init(ring_t *r)
+{
+  r->head = 0;
+  r->count = 0;
+  pthread_mutex_init(&(r->lock), NULL);
+  pthread_cond_init(&(r->nonempty), NULL);
+  pthread_cond_init(&(r->nonfull), NULL);
+}
+
+
+/* Destroy a batch queue */
+void ring_free(ring_t *r)
+{
+  pthread_mutex_destroy(&(r->lock));
+  pthread_cond_destroy(&(r->nonempty));
+  pthread_cond_destroy(&(r->nonfull));
+}
+
+
+/* Append a batch, waiting for room */
+void ring_put(ring_t *r, batch_t *b)
+{
+  pthread_mutex_lock(&(r->lock));
+  while (r->count == NUM_BATCHES + 1) {
+    pthread_cond_wait(&(r->nonfull), &(r->lock));
+  }
+  r->slot[(r->head + r->count) % (NUM_BATCHES + 1)] = b;
+  r->count++;
+  pthread_cond_signal(&(r->nonempty));
+  pthread_mutex_unlock(&(r->lock));
+}
+
+
+/* Remove the oldest batch, waiting for one */
+batch_t *ring_get(ring_t *r)
+{
+  batch_t *b;
+
+  pthread_mutex_lock(&(r->lock));
+  while (r->count == 0) {
+    pthread_cond_wait(&(r->nonempty), &(r->lock));
+  }
+  b = r->slot[r->head];
+  r->head = (r->head + 1) % (NUM_BATCHES + 1);
+  r->count--;
+  pthread_cond_signal(&(r->nonfull));
+  pthread_mutex_unlock(&(r->lock));
+
+  return(b);
+}
+
+
+/* Read up to batch_size points from stdin. Returns with b->n == 0
+   at end of input */
+void read_batch(pipeline_t *p, batch_t *b)
+{
+  int i;
+  size_t nrec;
+
+  b->n = 0;
+  if (p->input_bin) {
+    while ((b->n == 0) && 
+	   ((nrec = fread(b->inbuf, 3 * sizeof(double), p->batch_size, 
+			  stdin)) > 0)) {
+      for (i = 0; i < (int)nrec; i++) {
+	/* Skip null points, as for text input */
+	if ((b->inbuf[i * 3] == 0.0) || (b->inbuf[i * 3 + 1] == 0.0)) {
+	  continue;
 	}
+	memset(&(b->pnts[b->n]), 0, sizeof(ucvm_point_t));
+	b->pnts[b->n].coord[0] = b->inbuf[i * 3];
+	b->pnts[b->n].coord[1] = b->inbuf[i * 3 + 1];
+	b->pnts[b->n].coord[2] = b->inbuf[i * 3 + 2];
+	b->n++;
+      }
+    }
+    if (ferror(stdin)) {
+      fprintf(stderr, "Failed to read binary input\n");
+      p->rerr = 1;
+    }
+    return;
+  }
+
+  while ((b->n < p->batch_size) && (!feof(stdin))) {
+    memset(&(b->pnts[b->n]), 0, sizeof(ucvm_point_t));
+    if (fscanf(stdin,"%lf %lf %lf",
+	       &(b->pnts[b->n].coord[0]),
+	       &(b->pnts[b->n].coord[1]),
+	       &(b->pnts[b->n].coord[2])) == 3) {
+      /* Check for scan failure */
+      if ((b->pnts[b->n].coord[0] == 0.0) || 
+	  (b->pnts[b->n].coord[1] == 0.0)) {
+	continue;
+      }
+      b->n++;
+    }
+  }
+}
+
+
+/* Reader stage, parses input into free batches */
+void *reader_thread(void *arg)
+{
+  pipeline_t *p = arg;
+  batch_t *b;
+
+  while (1) {
+    b = ring_get(&(p->free));
+    read_batch(p, b);
+    if (b->n == 0) {
+      ring_put(&(p->free), b);
+      break;
+    }
+    ring_put(&(p->full), b);
+  }
+  ring_put(&(p->full), NULL);
+
+  return(NULL);
+}
+
+
+/* Writer stage, formats queried batches */
+void *writer_thread(void *arg)
+{
+  pipeline_t *p = arg;
+  batch_t *b;
+
+  while ((b = ring_get(&(p->done))) != NULL) {
+    if ((p->werr == 0) && (write_batch(b, p->output_json) != 0)) {
+      p->werr = 1;
+    }
+    ring_put(&(p->free), b);
+  }
+
+  return(NULL);
+}
+
+
+/* Query stdin to stdout. Input parsing and output formatting run in
+   their own threads, overlapping the query of the batch in between */
+int run_pipeline(int batch_size, int input_bin, int output_json, 
+		 int output_bin)
+{
+  int i, retval = 0;
+  pipeline_t p;
+  batch_t *b;
+  pthread_t reader, writer;
+
+  memset(&p, 0, sizeof(pipeline_t));
+  p.batch_size = batch_size;
+  p.input_bin = input_bin;
+  p.output_json = output_json;
+  p.output_bin = output_bin;
+  ring_init(&(p.free));
+  ring_init(&(p.full));
+  ring_init(&(p.done));
+  for (i = 0; i < NUM_BATCHES; i++) {
+    if (batch_init(&(p.batches[i]), batch_size, 
+		   input_bin, output_bin) != 0) {
+      retval = 1;
+      break;
+    }
+    ring_put(&(p.free), &(p.batches[i]));
+  }
 
-	/* Display results */
-	for (i = 0; i < numread; i++) {
-	  ucvm_model_label(props[i].crust.source, 
-			   cr_label, UCVM_MAX_LABEL_LEN);
-	  ucvm_model_label(props[i].gtl.source, 
-	  		   gtl_label, UCVM_MAX_LABEL_LEN);
-	  ucvm_ifunc_label(props[i].cmb.source, 
-			   if_label, UCVM_MAX_LABEL_LEN);
-
-          if(output_json) {
-	      printf(JSON_OUTPUT_FMT, 
-		 pnts[i].coord[0], pnts[i].coord[1], pnts[i].coord[2],
-		 props[i].surf, props[i].vs30,
-		 cr_label, props[i].crust.vp, props[i].crust.vs, 
-		 props[i].crust.rho, gtl_label, props[i].gtl.vp,
-		 props[i].gtl.vs, props[i].gtl.rho,
-		 if_label, props[i].cmb.vp, props[i].cmb.vs, 
-		 props[i].cmb.rho);
-          } else {
-	      printf(OUTPUT_FMT, 
-		 pnts[i].coord[0], pnts[i].coord[1], pnts[i].coord[2],
-		 props[i].surf, props[i].vs30,
-		 cr_label, props[i].crust.vp, props[i].crust.vs, 
-		 props[i].crust.rho, gtl_label, props[i].gtl.vp,
-		 props[i].gtl.vs, props[i].gtl.rho,
-		 if_label, props[i].cmb.vp, props[i].cmb.vs, 
-		 props[i].cmb.rho);
-          }
+  if (retval == 0) {
+    if (pthread_create(&reader, NULL, reader_thread, &p) != 0) {
+      fprintf(stderr, "Failed to start reader thread\n");
+      retval = 1;
+    } else if (pthread_create(&writer, NULL, writer_thread, &p) != 0) {
+      fprintf(stderr, "Failed to start writer thread\n");
+      /* Drain input so the reader can finish */
+      while ((b = ring_get(&(p.full))) != NULL) {
+	ring_put(&(p.free), b);
+      }
+      pthread_join(reader, NULL);
+      retval = 1;
+    } else {
+      /* Query stage. After a failure the remaining input is drained
+	 without querying */
+      while ((b = ring_get(&(p.full))) != NULL) {
+	if (retval != 0) {
+	  ring_put(&(p.free), b);
+	  continue;
+	}
+	if (query_points(b->n, b->pnts, b->props) != UCVM_CODE_SUCCESS) {
+	  fprintf(stderr, "Query CVM failed\n");
+	  retval = 1;
+	  ring_put(&(p.free), b);
+	  continue;
 	}
+	ring_put(&(p.done), b);
+      }
+      ring_put(&(p.done), NULL);
+      pthread_join(reader, NULL);
+      pthread_join(writer, NULL);
+      if (p.rerr || p.werr) {
+	retval = 1;
+      }
+    }
+  }
+
+  for (i = 0; i < NUM_BATCHES; i++) {
+    batch_free(&(p.batches[i]));
+  }
+  ring_free(&(p.free));
+  ring_free(&(p.full));
+  ring_free(&(p.done));
+
+  return(retval);
 }
 
 
 int main(int argc, char **argv)
 {
-  int i;
   int opt;
   char modellist[UCVM_MAX_MODELLIST_LEN];
   char configfile[UCVM_MAX_PATH_LEN];
@@ -189,28 +713,62 @@ int main(int argc, char **argv)
   int have_zrange = 0;
   int have_map = 0;
   int output_json =0;
+  int output_stats = 0;
 
-  ucvm_point_t *pnts;
-  ucvm_data_t *props;
-  int numread = 0;
+  batch_t batch;
+  int batch_size = NUM_POINTS;
+  int tile = UCVM_DEFAULT_QUERY_TILE;
+  int have_tile = 0;
+  int skip_map = 0;
+  double qcache[3];
+  int have_qcache = 0;
   char map_label[UCVM_MAX_LABEL_LEN];
-  char cr_label[UCVM_MAX_LABEL_LEN];
-  char gtl_label[UCVM_MAX_LABEL_LEN];
-  char if_label[UCVM_MAX_LABEL_LEN];
+  int input_bin = 0;
+  int output_bin = 0;
+  char sockpath[UCVM_MAX_PATH_LEN];
+  struct option long_opts[] = {{"connect", required_argument, NULL, 'C'},
+			       {NULL, 0, NULL, 0}};
 
   cmode = UCVM_COORD_GEO_DEPTH;
   snprintf(configfile, UCVM_MAX_PATH_LEN, "%s", "./ucvm.conf");
   snprintf(modellist, UCVM_MAX_MODELLIST_LEN, "%s", "1d");
   snprintf(map_label, UCVM_MAX_LABEL_LEN, "%s", UCVM_MAP_UCVM);
+  snprintf(sockpath, UCVM_MAX_PATH_LEN, "%s", UCVM_SERVED_SOCKET);
   zrange[0] = ZRANGE_MIN;
   zrange[1] = ZRANGE_MAX;
 
   /* Parse options */
-  while ((opt = getopt(argc, argv, "c:f:Hhm:p:vbz:l:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "c:f:HhMm:n:p:q:t:vbSz:l:I:O:", 
+			    long_opts, NULL)) != -1) {
     switch (opt) {
+    case 'C':
+      if (strlen(optarg) >= UCVM_MAX_PATH_LEN) {
+	fprintf(stderr, "Socket path is too long.\n");
+	usage();
+	exit(1);
+      }
+      snprintf(sockpath, UCVM_MAX_PATH_LEN, "%s", optarg);
+      use_server = 1;
+      break;
     case 'b':
       output_json=1;
       break;
+    case 'S':
+      output_stats = 1;
+      break;
+    case 'I':
+    case 'O':
+      if ((strcmp(optarg, "bin") != 0) && (strcmp(optarg, "text") != 0)) {
+	fprintf(stderr, "Invalid -%c format %s.\n", opt, optarg);
+	usage();
+	exit(1);
+      }
+      if (opt == 'I') {
+	input_bin = (strcmp(optarg, "bin") == 0);
+      } else {
+	output_bin = (strcmp(optarg, "bin") == 0);
+      }
+      break;
     case 'l':  // lon,lat,Z
       if (list_parse(optarg, UCVM_MAX_PATH_LEN,
                      lvals, 3) != UCVM_CODE_SUCCESS) {
@@ -261,6 +819,14 @@ int main(int argc, char **argv)
 	have_model = 1;
       }
       break;
+    case 'n':
+      batch_size = atoi(optarg);
+      if (batch_size <= 0) {
+	fprintf(stderr, "Invalid batch size %s.\n", optarg);
+	usage();
+	exit(1);
+      }
+      break;
     case 'p':
       if (strlen(optarg) >= UCVM_MAX_LABEL_LEN) {
 	fprintf(stderr, "Map name is too long.\n");
@@ -271,6 +837,30 @@ int main(int argc, char **argv)
 	have_map = 1;
       }
       break;
+    case 't':
+      tile = atoi(optarg);
+      if (tile < 0) {
+	fprintf(stderr, "Invalid tile size %s.\n", optarg);
+	usage();
+	exit(1);
+      }
+      have_tile = 1;
+      break;
+    case 'M':
+      skip_map = 1;
+      break;
+    case 'q':
+      qcache[1] = UCVM_DEFAULT_QCACHE_HTOL;
+      qcache[2] = UCVM_DEFAULT_QCACHE_ZTOL;
+      if ((list_parse(optarg, UCVM_MAX_PATH_LEN, 
+		      qcache, 3) != UCVM_CODE_SUCCESS) || 
+	  (qcache[0] < 1.0) || (qcache[1] < 0.0) || (qcache[2] < 0.0)) {
+	fprintf(stderr, "Invalid result cache specified: %s.\n", optarg);
+	usage();
+	exit(1);
+      }
+      have_qcache = 1;
+      break;
     case 'v':
       dispver = 1;
       break;
@@ -289,46 +879,91 @@ int main(int argc, char **argv)
     }
   }
 
-  /* Initialize interface */
-  if (ucvm_init(configfile) != UCVM_CODE_SUCCESS) {
-    fprintf(stderr, "Failed to initialize UCVM API\n");
-    return(1);
-  }
-
-  /* Add models */
-  if (have_model == 0) {
-    /* Add default model if none specified */
-    fprintf(stderr, "Using 1D as default model.\n");
-  }
-  if (ucvm_add_model_list(modellist) != UCVM_CODE_SUCCESS) {
-    fprintf(stderr, "Failed to enable model list %s\n", modellist);
-    return(1);
-  }
+  if (use_server) {
+    /* Query a running ucvm_served, which has its own models and map */
+    if (ucvm_client_connect(&server, sockpath) != UCVM_CODE_SUCCESS) {
+      return(1);
+    }
+    if (have_model || have_map || dispver || output_stats || have_tile ||
+	skip_map || have_qcache) {
+      fprintf(stderr, 
+	      "Ignoring -m, -p, -v, -S, -t, -M and -q with --connect.\n");
+      dispver = 0;
+      output_stats = 0;
+    }
+    if (!have_cmode) {
+      fprintf(stderr, "Using Geo Depth coordinates as default mode.\n");
+    }
+    ucvm_client_setparam(&server, UCVM_PARAM_QUERY_MODE, cmode);
+    if (have_zrange) {
+      ucvm_client_setparam(&server, UCVM_PARAM_IFUNC_ZRANGE, 
+			   zrange[0], zrange[1]);
+    }
+  } else {
+    /* Initialize interface */
+    if (ucvm_init(configfile) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to initialize UCVM API\n");
+      return(1);
+    }
 
-  /* Set user map if necessary */
-  if (have_map == 1) {
-    if (ucvm_use_map(map_label) != UCVM_CODE_SUCCESS) {
-      fprintf(stderr, "Failed to set user map %s\n", map_label);
+    /* Add models */
+    if (have_model == 0) {
+      /* Add default model if none specified */
+      fprintf(stderr, "Using 1D as default model.\n");
+    }
+    if (ucvm_add_model_list(modellist) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to enable model list %s\n", modellist);
       return(1);
     }
-  }
 
-  /* Set z mode */
-  if (!have_cmode) {
-    cmode = UCVM_COORD_GEO_DEPTH;
-    fprintf(stderr, "Using Geo Depth coordinates as default mode.\n");
-  }
-  if (ucvm_setparam(UCVM_PARAM_QUERY_MODE, cmode) != UCVM_CODE_SUCCESS) {
-    fprintf(stderr, "Failed to set z mode\n");
-    return(1);
-   }
+    /* Set user map if necessary */
+    if (have_map == 1) {
+      if (ucvm_use_map(map_label) != UCVM_CODE_SUCCESS) {
+	fprintf(stderr, "Failed to set user map %s\n", map_label);
+	return(1);
+      }
+    }
+
+    /* Set z mode */
+    if (!have_cmode) {
+      cmode = UCVM_COORD_GEO_DEPTH;
+      fprintf(stderr, "Using Geo Depth coordinates as default mode.\n");
+    }
+    if (ucvm_setparam(UCVM_PARAM_QUERY_MODE, cmode) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to set z mode\n");
+      return(1);
+     }
 
-  /* Set interpolation z range */
-  if (have_zrange) {
-    if (ucvm_setparam(UCVM_PARAM_IFUNC_ZRANGE, 
+    /* Set interpolation z range */
+    if (have_zrange) {
+      if (ucvm_setparam(UCVM_PARAM_IFUNC_ZRANGE, 
 		      zrange[0], zrange[1]) != UCVM_CODE_SUCCESS) {
-    fprintf(stderr, "Failed to set interpolation z range\n");
-    return(1);
+      fprintf(stderr, "Failed to set interpolation z range\n");
+      return(1);
+      }
+    }
+
+    /* Set query tile size */
+    if (ucvm_setparam(UCVM_PARAM_QUERY_TILE, tile) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to set query tile size\n");
+      return(1);
+    }
+
+    /* Map values are only looked up if the query needs them */
+    if (skip_map) {
+      if (ucvm_setparam(UCVM_PARAM_QUERY_VALS, 0) != UCVM_CODE_SUCCESS) {
+	fprintf(stderr, "Failed to set query map values\n");
+	return(1);
+      }
+    }
+
+    /* Enable result cache */
+    if (have_qcache) {
+      if (ucvm_setparam(UCVM_PARAM_QUERY_CACHE, (int)qcache[0], 
+			qcache[1], qcache[2]) != UCVM_CODE_SUCCESS) {
+	fprintf(stderr, "Failed to enable result cache\n");
+	return(1);
+      }
     }
   }
 
@@ -337,121 +972,57 @@ int main(int argc, char **argv)
     return(0);
   }
 
-  /* Allocate buffers */
-  pnts = malloc(NUM_POINTS * sizeof(ucvm_point_t));
-  props = malloc(NUM_POINTS * sizeof(ucvm_data_t));
+  if (output_json && output_bin) {
+    fprintf(stderr, "Json output is not available with -O bin\n");
+    return(1);
+  }
+
+  /* Labels are only looked up once */
+  load_labels();
+  if (output_bin) {
+    if (write_bin_header(stdout) != 0) {
+      fprintf(stderr, "Failed to write binary output\n");
+      return(1);
+    }
+  }
 
   /* Read in coords */
   if(use_cmdline) { // just 1 set
 
-    memset(&(pnts[numread]), 0, sizeof(ucvm_point_t));
-    pnts[numread].coord[0]=lvals[1];
-    pnts[numread].coord[1]=lvals[0];
-    pnts[numread].coord[2]=lvals[2];
-    numread++;
-    process_query(pnts, props, numread, output_json);
+    if (batch_init(&batch, 1, 0, output_bin) != 0) {
+      return(1);
+    }
+    memset(&(batch.pnts[0]), 0, sizeof(ucvm_point_t));
+    batch.pnts[0].coord[0]=lvals[1];
+    batch.pnts[0].coord[1]=lvals[0];
+    batch.pnts[0].coord[2]=lvals[2];
+    batch.n = 1;
+    if (query_points(batch.n, batch.pnts, batch.props) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Query CVM failed\n");
+      return(1);
+    }
+    if (write_batch(&batch, output_json) != 0) {
+      return(1);
+    }
+    batch_free(&batch);
 
   } else {
 
-    while (!feof(stdin)) {
-      memset(&(pnts[numread]), 0, sizeof(ucvm_point_t));
-      if (fscanf(stdin,"%lf %lf %lf",
-               &(pnts[numread].coord[0]),
-	       &(pnts[numread].coord[1]),
-	       &(pnts[numread].coord[2])) == 3) {
-        /* Check for scan failure */
-        if ((pnts[numread].coord[0] == 0.0) || 
-	  (pnts[numread].coord[1] == 0.0)) {
-	  continue;
-        }
-
-        numread++;
-        if (numread == NUM_POINTS) {
-	  /* Query the UCVM */
-	  if (ucvm_query(numread, pnts, props) != UCVM_CODE_SUCCESS) {
-	    fprintf(stderr, "Query CVM failed\n");
-	    return(1);
-	  }
-  
-	  /* Display results */
-	  for (i = 0; i < numread; i++) {
-	    ucvm_model_label(props[i].crust.source, 
-			   cr_label, UCVM_MAX_LABEL_LEN);
-	    ucvm_model_label(props[i].gtl.source, 
-	  		   gtl_label, UCVM_MAX_LABEL_LEN);
-	    ucvm_ifunc_label(props[i].cmb.source, 
-			   if_label, UCVM_MAX_LABEL_LEN);
-
-            if(output_json) {
-	      printf(JSON_OUTPUT_FMT, 
-		 pnts[i].coord[0], pnts[i].coord[1], pnts[i].coord[2],
-		 props[i].surf, props[i].vs30,
-		 cr_label, props[i].crust.vp, props[i].crust.vs, 
-		 props[i].crust.rho, gtl_label, props[i].gtl.vp,
-		 props[i].gtl.vs, props[i].gtl.rho,
-		 if_label, props[i].cmb.vp, props[i].cmb.vs, 
-		 props[i].cmb.rho);
-            } else {
-	      printf(OUTPUT_FMT, 
-		 pnts[i].coord[0], pnts[i].coord[1], pnts[i].coord[2],
-		 props[i].surf, props[i].vs30,
-		 cr_label, props[i].crust.vp, props[i].crust.vs, 
-		 props[i].crust.rho, gtl_label, props[i].gtl.vp,
-		 props[i].gtl.vs, props[i].gtl.rho,
-		 if_label, props[i].cmb.vp, props[i].cmb.vs, 
-		 props[i].cmb.rho);
-            }
-	  }
-
-	  numread = 0;
-        }
-      }
+    if (run_pipeline(batch_size, input_bin, output_json, output_bin) != 0) {
+      return(1);
     }
 
-    if (numread > 0) {
-      /* Query the UCVM */
-      if (ucvm_query(numread, pnts, props) != UCVM_CODE_SUCCESS) {
-        fprintf(stderr, "Query CVM failed\n");
-        return(1);
-      }
-      
-      /* Display results */
-      for (i = 0; i < numread; i++) {
-        ucvm_model_label(props[i].crust.source, 
-		       cr_label, UCVM_MAX_LABEL_LEN);
-        ucvm_model_label(props[i].gtl.source, 
-		       gtl_label, UCVM_MAX_LABEL_LEN);
-        ucvm_ifunc_label(props[i].cmb.source, 
-		       if_label, UCVM_MAX_LABEL_LEN);
-
-        if( output_json ) {
-            printf(JSON_OUTPUT_FMT, 
-	     pnts[i].coord[0], pnts[i].coord[1], pnts[i].coord[2],
-	     props[i].surf, props[i].vs30,
-	     cr_label, props[i].crust.vp, props[i].crust.vs, 
-	     props[i].crust.rho, gtl_label, props[i].gtl.vp,
-	     props[i].gtl.vs, props[i].gtl.rho,
-	     if_label, props[i].cmb.vp, props[i].cmb.vs, 
-	     props[i].cmb.rho);
-         } else {
-            printf(OUTPUT_FMT, 
-	     pnts[i].coord[0], pnts[i].coord[1], pnts[i].coord[2],
-	     props[i].surf, props[i].vs30,
-	     cr_label, props[i].crust.vp, props[i].crust.vs, 
-	     props[i].crust.rho, gtl_label, props[i].gtl.vp,
-	     props[i].gtl.vs, props[i].gtl.rho,
-	     if_label, props[i].cmb.vp, props[i].cmb.vs, 
-	     props[i].cmb.rho);
-         }
-      }
-    
-      numread = 0;
-    }
   }
 
-  ucvm_finalize();
-  free(pnts);
-  free(props);
+  if (output_stats) {
+    disp_stats(stderr);
+  }
+
+  if (use_server) {
+    ucvm_client_close(&server);
+  } else {
+    ucvm_finalize();
+  }
 
   return(0);
 }
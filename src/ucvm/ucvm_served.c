@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ucvm.h"
+#include "ucvm_utils.h"
+#include "ucvm_client.h"
+
+/* Most concurrent client sessions */
+#define MAX_SESSIONS 64
+
+/* Getopt flags */
+extern char *optarg;
+extern int optind, opterr, optopt;
+
+/* Greeting sent to each client */
+ucvm_served_hello_t served_hello;
+char served_model_labels[UCVM_MAX_MODELS + 1][UCVM_MAX_LABEL_LEN];
+char served_ifunc_labels[UCVM_MAX_MODELS + 3][UCVM_MAX_LABEL_LEN];
+
+/* Active session sockets, shut down on exit */
+int served_fds[MAX_SESSIONS];
+int served_num_sessions = 0;
+pthread_mutex_t served_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t served_idle = PTHREAD_COND_INITIALIZER;
+
+/* Listening socket, shut down by SIGINT/SIGTERM */
+int served_sfd = -1;
+volatile sig_atomic_t served_stop = 0;
+
+
+/* Usage function */
+void usage() {
+  printf("Usage: ucvm_served [-m models<:ifunc>] [-p user_map] [-f config] [-s socket]\n");
+  printf("                   [-c size<,htol,ztol>]\n\n");
+  printf("Flags:\n");
+  printf("\t-c Share an LRU cache of size query results between sessions.\n");
+  printf("\t   Points match within htol degrees/ztol meters (default %g,%g).\n",
+	 UCVM_DEFAULT_QCACHE_HTOL, UCVM_DEFAULT_QCACHE_ZTOL);
+  printf("\t-h This help message.\n");
+  printf("\t-m Comma delimited list of crustal/GTL models to query in order\n");
+  printf("\t   of preference. GTL models may optionally be suffixed with ':ifunc'\n");
+  printf("\t   to specify interpolation function.\n");
+  printf("\t-f Configuration file. Default is ./ucvm.conf.\n");
+  printf("\t-p User-defined map to use for elevation and vs30 data.\n");
+  printf("\t-s Unix socket path. Default is %s.\n\n", UCVM_SERVED_SOCKET);
+  printf("Initializes the models once and serves binary query requests\n");
+  printf("until SIGINT/SIGTERM. Query with ucvm_query --connect socket or\n");
+  printf("with the ucvm_client API.\n\n");
+  printf("Version: %s\n\n", VERSION);
+  return;
+}
+
+
+/* Signal handler */
+void served_signal(int sig)
+{
+  served_stop = 1;
+  shutdown(served_sfd, SHUT_RDWR);
+}
+
+
+/* Register/unregister a session socket */
+int served_add_session(int fd)
+{
+  int retval = UCVM_CODE_ERROR;
+
+  pthread_mutex_lock(&served_lock);
+  if (served_num_sessions < MAX_SESSIONS) {
+    served_fds[served_num_sessions++] = fd;
+    retval = UCVM_CODE_SUCCESS;
+  }
+  pthread_mutex_unlock(&served_lock);
+
+  return(retval);
+}
+
+
+void served_remove_session(int fd)
+{
+  int i;
+
+  pthread_mutex_lock(&served_lock);
+  for (i = 0; i < served_num_sessions; i++) {
+    if (served_fds[i] == fd) {
+      served_fds[i] = served_fds[--served_num_sessions];
+      break;
+    }
+  }
+  if (served_num_sessions == 0) {
+    pthread_cond_signal(&served_idle);
+  }
+  pthread_mutex_unlock(&served_lock);
+}
+
+
+/* Serve one client until it ends the session or disconnects */
+void *served_session(void *arg)
+{
+  int fd = (int)(long)arg;
+  int len = 0;
+  int i;
+  ucvm_ctx_t ctx;
+  ucvm_served_req_t req;
+  ucvm_served_resp_t resp;
+  double *buf = NULL;
+  ucvm_point_t *pnts = NULL;
+  ucvm_data_t *data = NULL;
+  void *p1, *p2, *p3;
+
+  if (ucvm_ctx_init(&ctx) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to create query context\n");
+    served_remove_session(fd);
+    close(fd);
+    return(NULL);
+  }
+
+  if ((ucvm_sock_write(fd, &served_hello,
+		       sizeof(ucvm_served_hello_t)) != UCVM_CODE_SUCCESS) ||
+      (ucvm_sock_write(fd, served_model_labels,
+		       (served_hello.num_models + 1) *
+		       UCVM_MAX_LABEL_LEN) != UCVM_CODE_SUCCESS) ||
+      (ucvm_sock_write(fd, served_ifunc_labels,
+		       (served_hello.num_models + 3) *
+		       UCVM_MAX_LABEL_LEN) != UCVM_CODE_SUCCESS)) {
+    ucvm_ctx_finalize(&ctx);
+    served_remove_session(fd);
+    close(fd);
+    return(NULL);
+  }
+
+  while (ucvm_sock_read(fd, &req,
+			sizeof(ucvm_served_req_t)) == UCVM_CODE_SUCCESS) {
+    if ((req.n <= 0) || (req.n > UCVM_SERVED_MAX_POINTS)) {
+      break;
+    }
+
+    /* Buffers grow to the largest request seen */
+    if (req.n > len) {
+      p1 = realloc(buf, 3 * req.n * sizeof(double));
+      if (p1 != NULL) buf = p1;
+      p2 = realloc(pnts, req.n * sizeof(ucvm_point_t));
+      if (p2 != NULL) pnts = p2;
+      p3 = realloc(data, req.n * sizeof(ucvm_data_t));
+      if (p3 != NULL) data = p3;
+      if ((p1 == NULL) || (p2 == NULL) || (p3 == NULL)) {
+	fprintf(stderr, "Failed to allocate request buffers\n");
+	break;
+      }
+      len = req.n;
+    }
+
+    if (ucvm_sock_read(fd, buf, 3 * req.n * sizeof(double)) !=
+	UCVM_CODE_SUCCESS) {
+      break;
+    }
+    for (i = 0; i < req.n; i++) {
+      memset(&(pnts[i]), 0, sizeof(ucvm_point_t));
+      pnts[i].coord[0] = buf[i * 3];
+      pnts[i].coord[1] = buf[i * 3 + 1];
+      pnts[i].coord[2] = buf[i * 3 + 2];
+    }
+
+    resp.status = ucvm_ctx_setparam(&ctx, UCVM_PARAM_QUERY_MODE,
+				    req.qmode);
+    if ((resp.status == UCVM_CODE_SUCCESS) && (req.have_zrange)) {
+      resp.status = ucvm_ctx_setparam(&ctx, UCVM_PARAM_IFUNC_ZRANGE,
+				      req.zrange[0], req.zrange[1]);
+    }
+    if (resp.status == UCVM_CODE_SUCCESS) {
+      resp.status = ucvm_query_ctx(&ctx, req.n, pnts, data);
+    }
+    resp.n = (resp.status == UCVM_CODE_SUCCESS) ? req.n : 0;
+
+    if ((ucvm_sock_write(fd, &resp, sizeof(ucvm_served_resp_t)) !=
+	 UCVM_CODE_SUCCESS) ||
+	(ucvm_sock_write(fd, data, resp.n * sizeof(ucvm_data_t)) !=
+	 UCVM_CODE_SUCCESS)) {
+      break;
+    }
+  }
+
+  free(buf);
+  free(pnts);
+  free(data);
+  ucvm_ctx_finalize(&ctx);
+  served_remove_session(fd);
+  close(fd);
+
+  return(NULL);
+}
+
+
+int main(int argc, char **argv)
+{
+  int i, opt, fd;
+  char modellist[UCVM_MAX_MODELLIST_LEN];
+  char configfile[UCVM_MAX_PATH_LEN];
+  char map_label[UCVM_MAX_LABEL_LEN];
+  char sockpath[UCVM_MAX_PATH_LEN];
+  int have_map = 0;
+  double qcache[3];
+  int have_qcache = 0;
+  unsigned long long hits, misses;
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  sigset_t sigs, oldsigs;
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  snprintf(configfile, UCVM_MAX_PATH_LEN, "%s", "./ucvm.conf");
+  snprintf(modellist, UCVM_MAX_MODELLIST_LEN, "%s", "1d");
+  snprintf(map_label, UCVM_MAX_LABEL_LEN, "%s", UCVM_MAP_UCVM);
+  snprintf(sockpath, UCVM_MAX_PATH_LEN, "%s", UCVM_SERVED_SOCKET);
+
+  /* Parse options */
+  while ((opt = getopt(argc, argv, "c:f:hm:p:s:")) != -1) {
+    switch (opt) {
+    case 'c':
+      qcache[1] = UCVM_DEFAULT_QCACHE_HTOL;
+      qcache[2] = UCVM_DEFAULT_QCACHE_ZTOL;
+      if ((list_parse(optarg, UCVM_MAX_PATH_LEN, 
+		      qcache, 3) != UCVM_CODE_SUCCESS) || 
+	  (qcache[0] < 1.0) || (qcache[1] < 0.0) || (qcache[2] < 0.0)) {
+	fprintf(stderr, "Invalid result cache specified: %s.\n", optarg);
+	usage();
+	exit(1);
+      }
+      have_qcache = 1;
+      break;
+    case 'f':
+      if (strlen(optarg) < UCVM_MAX_PATH_LEN) {
+	snprintf(configfile, UCVM_MAX_PATH_LEN, "%s", optarg);
+      } else {
+	fprintf(stderr, "Invalid config file specified: %s.\n", optarg);
+	usage();
+	exit(1);
+      }
+      break;
+    case 'h':
+      usage();
+      exit(0);
+      break;
+    case 'm':
+      if (strlen(optarg) >= UCVM_MAX_MODELLIST_LEN - 1) {
+	fprintf(stderr, "Model list is too long.\n");
+	usage();
+	exit(1);
+      }
+      snprintf(modellist, UCVM_MAX_MODELLIST_LEN, "%s", optarg);
+      break;
+    case 'p':
+      if (strlen(optarg) >= UCVM_MAX_LABEL_LEN) {
+	fprintf(stderr, "Map name is too long.\n");
+	usage();
+	exit(1);
+      }
+      snprintf(map_label, UCVM_MAX_LABEL_LEN, "%s", optarg);
+      have_map = 1;
+      break;
+    case 's':
+      if (strlen(optarg) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "Socket path is too long.\n");
+	usage();
+	exit(1);
+      }
+      snprintf(sockpath, UCVM_MAX_PATH_LEN, "%s", optarg);
+      break;
+    default: /* '?' */
+      usage();
+      exit(1);
+    }
+  }
+
+  /* Initialize interface and models once */
+  if (ucvm_init(configfile) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to initialize UCVM API\n");
+    return(1);
+  }
+  if (ucvm_add_model_list(modellist) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "Failed to enable model list %s\n", modellist);
+    return(1);
+  }
+  if (have_map == 1) {
+    if (ucvm_use_map(map_label) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to set user map %s\n", map_label);
+      return(1);
+    }
+  }
+  if (have_qcache == 1) {
+    if (ucvm_setparam(UCVM_PARAM_QUERY_CACHE, (int)qcache[0], 
+		      qcache[1], qcache[2]) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Failed to set up result cache\n");
+      return(1);
+    }
+  }
+
+  /* Greeting and labels */
+  memset(&served_hello, 0, sizeof(ucvm_served_hello_t));
+  memcpy(served_hello.magic, UCVM_SERVED_MAGIC, 8);
+  served_hello.num_models = ucvm_get_num_models();
+  served_hello.datasize = sizeof(ucvm_data_t);
+  memset(served_model_labels, 0, sizeof(served_model_labels));
+  memset(served_ifunc_labels, 0, sizeof(served_ifunc_labels));
+  for (i = UCVM_SOURCE_NONE; i < served_hello.num_models; i++) {
+    ucvm_model_label(i, served_model_labels[i - UCVM_SOURCE_NONE],
+		     UCVM_MAX_LABEL_LEN);
+  }
+  for (i = UCVM_SOURCE_GTL; i < served_hello.num_models; i++) {
+    ucvm_ifunc_label(i, served_ifunc_labels[i - UCVM_SOURCE_GTL],
+		     UCVM_MAX_LABEL_LEN);
+  }
+
+  /* Listen. A stale socket file from an earlier run is replaced */
+  served_sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (served_sfd < 0) {
+    fprintf(stderr, "Failed to create socket\n");
+    return(1);
+  }
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  ucvm_strcpy(addr.sun_path, sockpath, sizeof(addr.sun_path));
+  unlink(sockpath);
+  if ((bind(served_sfd, (struct sockaddr *)&addr,
+	    sizeof(struct sockaddr_un)) != 0) || 
+      (listen(served_sfd, 16) != 0)) {
+    fprintf(stderr, "Failed to listen on %s\n", sockpath);
+    close(served_sfd);
+    return(1);
+  }
+
+  /* Stop on SIGINT/SIGTERM, handled by this thread only */
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = served_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  fprintf(stderr, "Serving %s on %s\n", modellist, sockpath);
+
+  while (!served_stop) {
+    fd = accept(served_sfd, NULL, NULL);
+    if (fd < 0) {
+      if ((errno != EINTR) && (!served_stop)) {
+	fprintf(stderr, "Failed to accept connection\n");
+      }
+      continue;
+    }
+    if (served_add_session(fd) != UCVM_CODE_SUCCESS) {
+      fprintf(stderr, "Too many sessions, connection refused\n");
+      close(fd);
+      continue;
+    }
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    if (pthread_create(&thread, &attr, served_session,
+		       (void *)(long)fd) != 0) {
+      fprintf(stderr, "Failed to start session thread\n");
+      served_remove_session(fd);
+      close(fd);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+  }
+
+  /* End open sessions and wait for them before finalizing */
+  close(served_sfd);
+  unlink(sockpath);
+  pthread_mutex_lock(&served_lock);
+  for (i = 0; i < served_num_sessions; i++) {
+    shutdown(served_fds[i], SHUT_RDWR);
+  }
+  while (served_num_sessions > 0) {
+    pthread_cond_wait(&served_idle, &served_lock);
+  }
+  pthread_mutex_unlock(&served_lock);
+  pthread_attr_destroy(&attr);
+
+  if (have_qcache == 1) {
+    ucvm_get_cache_stats(&hits, &misses, &i);
+    fprintf(stderr, "Result cache: %llu hits, %llu misses, %d entries\n",
+	    hits, misses, i);
+  }
+
+  ucvm_finalize();
+
+  return(0);
+}
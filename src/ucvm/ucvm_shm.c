@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ucvm_shm.h"
+
+/* Segment magic */
+#define UCVM_SHM_MAGIC "UCVMSHM1"
+
+/* Poll interval while another process loads, in ns */
+#define UCVM_SHM_POLL_NS 10000000
+
+/* Polls an unlocked segment without a header is given, since its
+   creator locks it only after creating it */
+#define UCVM_SHM_CREATE_POLLS 200
+
+
+/* Segment header. The owner sets ready once the payload is loaded,
+   and holds an exclusive lock on the segment until then */
+typedef struct ucvm_shm_header_t
+{
+  char magic[8];
+  unsigned long long len;
+  volatile int ready;
+  char key[UCVM_SHM_MAX_KEY_LEN];
+} ucvm_shm_header_t;
+
+
+/* Shared payloads, disabled by default */
+int ucvm_shm_enabled = 0;
+
+
+/* Segment name of a key, from its FNV-1a hash */
+void ucvm_shm_name(const char *key, char *name, int len)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+
+  while (*key != '\0') {
+    h ^= (unsigned char)*key++;
+    h *= 0x100000001b3ULL;
+  }
+  snprintf(name, len, "/ucvm.%016llx", h);
+  return;
+}
+
+
+/* Short sleep between polls */
+void ucvm_shm_pause()
+{
+  struct timespec ts;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = UCVM_SHM_POLL_NS;
+  nanosleep(&ts, NULL);
+  return;
+}
+
+
+/* Enable/disable shared payloads */
+int ucvm_shm_setenabled(int enabled)
+{
+  ucvm_shm_enabled = enabled;
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* True if shared payloads are enabled */
+int ucvm_shm_isenabled()
+{
+  return(ucvm_shm_enabled);
+}
+
+
+/* Append path with its size and mtime to key */
+int ucvm_shm_addfile(char *key, int len, const char *path)
+{
+  struct stat st;
+  int n;
+
+  if (stat(path, &st) != 0) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  n = strlen(key);
+  if (snprintf(key + n, len - n, "%s:%lld:%lld;", path,
+	       (long long)st.st_size, (long long)st.st_mtime) >= len - n) {
+    return(UCVM_CODE_ERROR);
+  }
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Create the segment of key on fd and load its payload */
+void *ucvm_shm_create(ucvm_shm_t *shm, const char *key,
+		      ucvm_shm_load_t load, void *arg)
+{
+  ucvm_shm_header_t *hdr;
+
+  /* Attaching processes wait while the lock is held */
+  flock(shm->fd, LOCK_EX);
+  shm->owner = 1;
+
+  if ((load(shm, arg) != UCVM_CODE_SUCCESS) || (shm->base == NULL)) {
+    shm_unlink(shm->name);
+    close(shm->fd);
+    ucvm_shm_detach(shm);
+    return(NULL);
+  }
+
+  hdr = (ucvm_shm_header_t *)shm->base;
+  memcpy(hdr->magic, UCVM_SHM_MAGIC, sizeof(hdr->magic));
+  hdr->len = shm->len;
+  strcpy(hdr->key, key);
+  __sync_synchronize();
+  hdr->ready = 1;
+
+  mprotect(shm->base, shm->maplen, PROT_READ);
+  flock(shm->fd, LOCK_UN);
+  close(shm->fd);
+  shm->fd = -1;
+
+  return((char *)shm->base + UCVM_SHM_HEADER_LEN);
+}
+
+
+/* Wait for the owner of the segment on fd to load it. Returns 1 if
+   the owner went away without finishing, so the segment is stale */
+int ucvm_shm_wait(ucvm_shm_t *shm, const char *key)
+{
+  struct stat st;
+  ucvm_shm_header_t *hdr = NULL;
+  int idle = 0;
+  size_t len;
+
+  while ((hdr == NULL) || (hdr->ready == 0)) {
+    if (fstat(shm->fd, &st) != 0) {
+      break;
+    }
+    if ((hdr == NULL) && (st.st_size >= UCVM_SHM_HEADER_LEN)) {
+      hdr = mmap(NULL, UCVM_SHM_HEADER_LEN, PROT_READ, MAP_SHARED,
+		 shm->fd, 0);
+      if (hdr == MAP_FAILED) {
+	return(-1);
+      }
+      continue;
+    }
+
+    /* The owner sizes the segment under the lock, so once the header
+       exists an unlocked segment twice in a row has lost its owner.
+       Before that, the owner may not have locked it yet */
+    if (flock(shm->fd, LOCK_SH | LOCK_NB) == 0) {
+      flock(shm->fd, LOCK_UN);
+      __sync_synchronize();
+      if ((hdr == NULL) || (hdr->ready == 0)) {
+	if (++idle >= ((hdr == NULL) ? UCVM_SHM_CREATE_POLLS : 2)) {
+	  if (hdr != NULL) {
+	    munmap(hdr, UCVM_SHM_HEADER_LEN);
+	  }
+	  return(1);
+	}
+      }
+    } else {
+      idle = 0;
+    }
+    ucvm_shm_pause();
+  }
+  if (hdr == NULL) {
+    return(-1);
+  }
+  __sync_synchronize();
+
+  /* Distinct keys may hash alike */
+  len = hdr->len;
+  if ((memcmp(hdr->magic, UCVM_SHM_MAGIC, sizeof(hdr->magic)) != 0) ||
+      (strcmp(hdr->key, key) != 0)) {
+    munmap(hdr, UCVM_SHM_HEADER_LEN);
+    return(-1);
+  }
+  munmap(hdr, UCVM_SHM_HEADER_LEN);
+
+  shm->maplen = UCVM_SHM_HEADER_LEN + len;
+  if ((fstat(shm->fd, &st) != 0) || ((size_t)st.st_size != shm->maplen)) {
+    return(-1);
+  }
+  shm->base = mmap(NULL, shm->maplen, PROT_READ, MAP_SHARED, shm->fd, 0);
+  if (shm->base == MAP_FAILED) {
+    shm->base = NULL;
+    return(-1);
+  }
+  shm->len = len;
+
+  return(0);
+}
+
+
+/* Attach to the payload of key, creating it if needed */
+void *ucvm_shm_attach(ucvm_shm_t *shm, const char *key,
+		      ucvm_shm_load_t load, void *arg)
+{
+  int attempt, retval;
+
+  memset(shm, 0, sizeof(ucvm_shm_t));
+  if (strlen(key) >= UCVM_SHM_MAX_KEY_LEN) {
+    return(NULL);
+  }
+  ucvm_shm_name(key, shm->name, sizeof(shm->name));
+
+  /* A stale segment is removed and created once more */
+  for (attempt = 0; attempt < 2; attempt++) {
+    shm->fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (shm->fd >= 0) {
+      return(ucvm_shm_create(shm, key, load, arg));
+    }
+    if (errno != EEXIST) {
+      fprintf(stderr, "Failed to create shared memory %s: %s\n",
+	      shm->name, strerror(errno));
+      return(NULL);
+    }
+
+    shm->fd = shm_open(shm->name, O_RDONLY, 0);
+    if (shm->fd < 0) {
+      continue;
+    }
+    retval = ucvm_shm_wait(shm, key);
+    close(shm->fd);
+    shm->fd = -1;
+    if (retval == 0) {
+      return((char *)shm->base + UCVM_SHM_HEADER_LEN);
+    }
+    if (retval < 0) {
+      fprintf(stderr, "Failed to attach shared memory %s, loading privately\n",
+	      shm->name);
+      return(NULL);
+    }
+    shm_unlink(shm->name);
+  }
+
+  return(NULL);
+}
+
+
+/* Size the payload of a segment being created */
+void *ucvm_shm_alloc(ucvm_shm_t *shm, size_t len)
+{
+  int err;
+
+  if ((shm->owner == 0) || (shm->base != NULL)) {
+    return(NULL);
+  }
+
+  /* Reserve the pages, so a full /dev/shm fails here rather than
+     with SIGBUS on first touch */
+  shm->maplen = UCVM_SHM_HEADER_LEN + len;
+  err = posix_fallocate(shm->fd, 0, shm->maplen);
+  if (err != 0) {
+    fprintf(stderr, "Failed to size shared memory %s: %s\n",
+	    shm->name, strerror(err));
+    return(NULL);
+  }
+  shm->base = mmap(NULL, shm->maplen, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, shm->fd, 0);
+  if (shm->base == MAP_FAILED) {
+    shm->base = NULL;
+    return(NULL);
+  }
+  shm->len = len;
+
+  return((char *)shm->base + UCVM_SHM_HEADER_LEN);
+}
+
+
+/* Detach from a payload */
+int ucvm_shm_detach(ucvm_shm_t *shm)
+{
+  if (shm->base != NULL) {
+    munmap(shm->base, shm->maplen);
+  }
+  memset(shm, 0, sizeof(ucvm_shm_t));
+  return(UCVM_CODE_SUCCESS);
+}
@@ -0,0 +1,64 @@
+#ifndef UCVM_SHM_H
+#define UCVM_SHM_H
+
+#include <stddef.h>
+#include "ucvm_dtypes.h"
+
+
+/* Segment header length. Page aligned so that the payload is too */
+#define UCVM_SHM_HEADER_LEN 4096
+
+/* Longest payload key */
+#define UCVM_SHM_MAX_KEY_LEN 3072
+
+
+/* Read-only model payload in named POSIX shared memory, shared by
+   the processes of a node. The segment is named after a hash of the
+   key, which should name the source files with their size and mtime
+   so that a changed model is loaded afresh */
+typedef struct ucvm_shm_t
+{
+  char name[64];
+  int fd;
+  int owner;
+  void *base;
+  size_t maplen;
+  size_t len;
+} ucvm_shm_t;
+
+
+/* Payload loader, run by the one process of the node that creates
+   the segment. It must call ucvm_shm_alloc() once with the payload
+   size and fill the buffer returned */
+typedef int (*ucvm_shm_load_t)(ucvm_shm_t *shm, void *arg);
+
+
+/* Enable/disable shared payloads for models initialized later */
+int ucvm_shm_setenabled(int enabled);
+
+
+/* True if shared payloads are enabled */
+int ucvm_shm_isenabled();
+
+
+/* Append path with its size and mtime to key */
+int ucvm_shm_addfile(char *key, int len, const char *path);
+
+
+/* Attach to the payload of key, creating it with load if no other
+   process has. Returns the read-only payload, of shm->len bytes, or
+   NULL if it could not be shared and should be loaded privately */
+void *ucvm_shm_attach(ucvm_shm_t *shm, const char *key,
+		      ucvm_shm_load_t load, void *arg);
+
+
+/* Size the payload of a segment being created */
+void *ucvm_shm_alloc(ucvm_shm_t *shm, size_t len);
+
+
+/* Detach from a payload. The segment stays for later processes,
+   until removed from /dev/shm */
+int ucvm_shm_detach(ucvm_shm_t *shm);
+
+
+#endif
@@ -80,7 +80,7 @@ int ucvm_strcpy(char *str1, const char *str2, int str1len)
 /* Parses string list into double array */
 int list_parse(const char *lstr, int llen, double *arr, int an)
 {
-  char *token;
+  char *token, *saveptr;
   char *strbuf;
   int i = 0;
 
@@ -95,10 +95,10 @@ int list_parse(const char *lstr, int llen, double *arr, int an)
   }
 
   ucvm_strcpy(strbuf, lstr, llen);
-  token = strtok(lstr, LIST_DELIM);
+  token = strtok_r(strbuf, LIST_DELIM, &saveptr);
   while ((token != NULL) && (i < an)) {
     arr[i++] = atof(token);
-    token = strtok(NULL, LIST_DELIM);
+    token = strtok_r(NULL, LIST_DELIM, &saveptr);
   }
 
   free(strbuf);
@@ -110,7 +110,7 @@ int list_parse(const char *lstr, int llen, double *arr, int an)
 int list_parse_s(const char *lstr, int llen, 
 		 char **arr, int an, int alen)
 {
-  char *token;
+  char *token, *saveptr;
   char *strbuf;
   int i = 0;
 
@@ -125,10 +125,10 @@ int list_parse_s(const char *lstr, int llen,
   }
 
   ucvm_strcpy(strbuf, lstr, llen);
-  token = strtok(strbuf, LIST_DELIM);
+  token = strtok_r(strbuf, LIST_DELIM, &saveptr);
   while ((token != NULL) && (i < an)) {
     ucvm_strcpy(arr[i++], token, alen);
-    token = strtok(NULL, LIST_DELIM);
+    token = strtok_r(NULL, LIST_DELIM, &saveptr);
   }
 
   free(strbuf);
@@ -164,13 +164,13 @@ int region_contains_null(ucvm_region_t *r, ucvm_ctype_t c, ucvm_point_t *p)
 /* Parses string region specification into structure struct */
 int region_parse(char *rstr, ucvm_region_t *r)
 {
-  char *token;
+  char *token, *saveptr;
   int i = 0;
 
   r->p1[2] = 0.0;
   r->p2[2] = 0.0;
 
-  token = strtok(rstr, REGION_DELIM);
+  token = strtok_r(rstr, REGION_DELIM, &saveptr);
   while ((token != NULL) && (i < 4)) {
     switch(i) {
     case 0:
@@ -188,7 +188,7 @@ int region_parse(char *rstr, ucvm_region_t *r)
       break;
     }
     i++;
-    token = strtok(NULL, REGION_DELIM);
+    token = strtok_r(NULL, REGION_DELIM, &saveptr);
   }
 
   return(UCVM_CODE_ERROR);
@@ -207,6 +207,7 @@ int main(int argc, char **argv)
   free(cvm_pnts);
   free(etree_pnts);
   free(props);
+  extract_finalize();
 
   /* Apply the metadata to the etree */
   printf("Setting application metadata\n");
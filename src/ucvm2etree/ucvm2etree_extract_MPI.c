@@ -420,6 +420,7 @@ int main(int argc, char **argv)
     free(cvm_pnts);
     free(etree_pnts);
     free(props);
+    extract_finalize();
 
     /* Finalize UCVM */
     ucvm_finalize();
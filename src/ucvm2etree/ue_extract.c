@@ -8,6 +8,15 @@
 #include "ucvm_proj_bilinear.h"
 #include "ucvm_proj_ucvm.h"
 
+
+/* Column grids already generated, by level. The x-y layout of a
+   column at a given level does not change with depth */
+int ue_grid_col = -1;
+int ue_grid_num[ETREE_MAXLEVEL + 1];
+int ue_grid_len[ETREE_MAXLEVEL + 1];
+ucvm_point_t *ue_grid_cvm[ETREE_MAXLEVEL + 1];
+etree_addr_t *ue_grid_etree[ETREE_MAXLEVEL + 1];
+
 /* Insert 2D grid at required resolution in a buffer */
 int insert_grid_buf(ue_cfg_t *cfg,
 		     etree_addr_t *pnts, ucvm_data_t *props, 
@@ -162,6 +171,84 @@ int get_grid(ue_cfg_t *cfg, int x, int y, etree_tick_t z, int level,
 }
 
 
+/* Get 2D grid at required resolution, reusing the x-y layout of 
+   grids already generated for this column */
+int get_grid_cached(ue_cfg_t *cfg, int col, int x, int y, etree_tick_t z, 
+		    int level, ucvm_point_t *cvm_pnts, 
+		    etree_addr_t *etree_pnts, int *num_points)
+{
+  int n;
+  double edgesize;
+  double grid_z;
+
+  if (ue_grid_col != col) {
+    memset(ue_grid_num, 0, sizeof(ue_grid_num));
+    ue_grid_col = col;
+  }
+
+  if (ue_grid_num[level] > 0) {
+    *num_points = ue_grid_num[level];
+    memcpy(cvm_pnts, ue_grid_cvm[level], 
+	   *num_points * sizeof(ucvm_point_t));
+    memcpy(etree_pnts, ue_grid_etree[level], 
+	   *num_points * sizeof(etree_addr_t));
+
+    /* Move to depth z */
+    edgesize = cfg->ecfg.max_length/(double)((etree_tick_t)1<<level);
+    grid_z = (z * cfg->ecfg.ticksize) + edgesize/2.0;
+    for (n = 0; n < *num_points; n++) {
+      cvm_pnts[n].coord[2] = grid_z;
+      etree_pnts[n].z = z;
+    }
+    return(UCVM_CODE_SUCCESS);
+  }
+
+  if (get_grid(cfg, x, y, z, level, cvm_pnts, etree_pnts, 
+	       num_points) != UCVM_CODE_SUCCESS) {
+    return(UCVM_CODE_ERROR);
+  }
+
+  /* Remember grid, buffers are kept for the next column */
+  if (*num_points > ue_grid_len[level]) {
+    free(ue_grid_cvm[level]);
+    free(ue_grid_etree[level]);
+    ue_grid_cvm[level] = malloc(*num_points * sizeof(ucvm_point_t));
+    ue_grid_etree[level] = malloc(*num_points * sizeof(etree_addr_t));
+    ue_grid_len[level] = *num_points;
+    if ((ue_grid_cvm[level] == NULL) || (ue_grid_etree[level] == NULL)) {
+      ue_grid_len[level] = 0;
+      return(UCVM_CODE_SUCCESS);
+    }
+  }
+  memcpy(ue_grid_cvm[level], cvm_pnts, 
+	 *num_points * sizeof(ucvm_point_t));
+  memcpy(ue_grid_etree[level], etree_pnts, 
+	 *num_points * sizeof(etree_addr_t));
+  ue_grid_num[level] = *num_points;
+
+  return(UCVM_CODE_SUCCESS);
+}
+
+
+/* Free cached column grids */
+void extract_finalize()
+{
+  int i;
+
+  for (i = 0; i <= ETREE_MAXLEVEL; i++) {
+    free(ue_grid_cvm[i]);
+    free(ue_grid_etree[i]);
+    ue_grid_cvm[i] = NULL;
+    ue_grid_etree[i] = NULL;
+    ue_grid_num[i] = 0;
+    ue_grid_len[i] = 0;
+  }
+  ue_grid_col = -1;
+
+  return;
+}
+
+
 /* Scan properties for lowest Vs and calculated desired etree level */
 int get_level(ue_cfg_t *cfg, int n, ucvm_point_t *pnts, ucvm_data_t *props, 
 	      int *level, int *min_index, double *vs_min)
@@ -248,8 +335,8 @@ int extract(ue_cfg_t *cfg,
   gettimeofday(&start,NULL);
   
   /* Generate new grid at max level */
-  if ((get_grid(cfg, i, j, ztics, level, cvm_pnts, etree_pnts,
-		&num_points) != 0) || (num_points == 0)) {
+  if ((get_grid_cached(cfg, col, i, j, ztics, level, cvm_pnts, etree_pnts,
+		       &num_points) != 0) || (num_points == 0)) {
     fprintf(stderr, 
 	    "[%d] Failed to generate grid for %d,%d,ztics=%u\n",
 	    cfg->rank, i, j, ztics);
@@ -309,8 +396,8 @@ int extract(ue_cfg_t *cfg,
       level = scanlevel;
       edgesize = cfg->ecfg.max_length/(double)((etree_tick_t)1<<level);
       edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - level);
-      if ((get_grid(cfg, i, j, ztics, level, cvm_pnts, 
-		    etree_pnts, &num_points) != 0) || 
+      if ((get_grid_cached(cfg, col, i, j, ztics, level, cvm_pnts, 
+			   etree_pnts, &num_points) != 0) || 
 	  (num_points == 0)) {
 	fprintf(stderr, 
 		"[%d] Failed to re-generate grid for %d,%d,ztics=%u\n",
@@ -343,8 +430,8 @@ int extract(ue_cfg_t *cfg,
 	  level = l;
 	  edgesize = cfg->ecfg.max_length/(double)((etree_tick_t)1<<level);
 	  edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - level);
-	  if ((get_grid(cfg, i, j, ztics, level, cvm_pnts, 
-			etree_pnts, &num_points) != 0) || 
+	  if ((get_grid_cached(cfg, col, i, j, ztics, level, cvm_pnts, 
+			       etree_pnts, &num_points) != 0) || 
 	      (num_points == 0)) {
 	    fprintf(stderr, 
 		    "[%d] Failed to re-generate grid for %d,%d,ztics=%u\n",
@@ -28,5 +28,9 @@ int extract(ue_cfg_t *cfg,
 	    unsigned long *num_extracted);
 
 
+/* Free grids cached across extract() calls */
+void extract_finalize();
+
+
 #endif
 
@@ -96,7 +96,10 @@ int extract(int myid, int nproc, mesh_config_t *cfg)
   /* Buffers */
   int num_grid, num_points;
   ucvm_point_t *pntbuf;
-  ucvm_data_t *propbuf;
+  double *lonbuf, *latbuf, *zbuf;
+  ucvm_soa_t props;
+  float *propbuf;
+  int *srcbuf;
   mesh_ijk32_t *node_buf;
 
   int part_dims[3];
@@ -139,12 +142,26 @@ int extract(int myid, int nproc, mesh_config_t *cfg)
   /* Allocate buffers */
   fprintf(stdout, "[%d] Allocating %d grid points\n", myid, num_grid);
   pntbuf = malloc(num_grid * sizeof(ucvm_point_t));
-  propbuf = malloc(num_grid * sizeof(ucvm_data_t));
+  lonbuf = malloc(3 * num_grid * sizeof(double));
+  propbuf = malloc(3 * num_grid * sizeof(float));
+  srcbuf = malloc(3 * num_grid * sizeof(int));
   node_buf = malloc(num_grid * sizeof(mesh_ijk32_t));
-  if ((pntbuf == NULL) || (propbuf == NULL) || (node_buf == NULL)) {
+  if ((pntbuf == NULL) || (lonbuf == NULL) || (propbuf == NULL) || 
+      (srcbuf == NULL) || (node_buf == NULL)) {
     fprintf(stderr, "[%d] Failed to allocate buffers\n", myid);
     return(1);
   }
+  latbuf = &(lonbuf[num_grid]);
+  zbuf = &(lonbuf[2 * num_grid]);
+
+  /* Only the combined properties and sources are needed */
+  memset(&props, 0, sizeof(ucvm_soa_t));
+  props.vp = &(propbuf[0]);
+  props.vs = &(propbuf[num_grid]);
+  props.rho = &(propbuf[2 * num_grid]);
+  props.crust_source = &(srcbuf[0]);
+  props.gtl_source = &(srcbuf[num_grid]);
+  props.cmb_source = &(srcbuf[2 * num_grid]);
 
   /* Compute rank's local i,j,k range */
   k_start = ((int)(myid / (cfg->proc_dims.dim[0] * cfg->proc_dims.dim[1]))
@@ -186,6 +203,13 @@ int extract(int myid, int nproc, mesh_config_t *cfg)
   /* Close grid file */
   fclose(ifp);
 
+  /* Split grid into lon/lat columns */
+  for (n = 0; n < num_grid; n++) {
+    lonbuf[n] = pntbuf[n].coord[0];
+    latbuf[n] = pntbuf[n].coord[1];
+  }
+  free(pntbuf);
+
   /* For each k in k range, query UCVM */
   if (myid == 0) {
     fprintf(stdout, "[%d] Starting extraction\n", myid);
@@ -197,19 +221,20 @@ int extract(int myid, int nproc, mesh_config_t *cfg)
     /* Set z coordinate */
     z = cfg->origin.coord[2] + (k * cfg->spacing);
     for (n = 0; n < num_grid; n++) {
-      pntbuf[n].coord[2] = z;
+      zbuf[n] = z;
     }
 
     /* Query UCVM at this k */
-    if (ucvm_query(num_grid, pntbuf, propbuf) != UCVM_CODE_SUCCESS) {
+    if (ucvm_query_soa(num_grid, lonbuf, latbuf, zbuf, 
+		       &props) != UCVM_CODE_SUCCESS) {
       fprintf(stderr, "[%d] Query UCVM failed\n", myid);
       return(1);
     }
 
     /* Convert the data points to a mesh node list */
-    if (mesh_data_to_node(0, i_start, i_end, j_start, j_end,
-			  k, pntbuf, propbuf, node_buf, cfg->vp_min,
-			  cfg->vs_min) != 0) {
+    if (mesh_soa_to_node(0, i_start, i_end, j_start, j_end,
+			 k, lonbuf, latbuf, zbuf, &props, node_buf, 
+			 cfg->vp_min, cfg->vs_min) != 0) {
       return(1);
     }
 
@@ -264,8 +289,9 @@ int extract(int myid, int nproc, mesh_config_t *cfg)
   mesh_close_mpi();
 
   /* Free buffers */
-  free(pntbuf);
+  free(lonbuf);
   free(propbuf);
+  free(srcbuf);
   free(node_buf);
 
   mpi_barrier();
@@ -113,6 +113,62 @@ int mesh_data_to_node(int myid, int i_start, int i_end,
 }
 
 
+/* Convert UCVM SoA columns to mesh node list and check that it is 
+   valid. props must hold vp, vs, rho and the source columns */
+int mesh_soa_to_node(int myid, int i_start, int i_end,
+		     int j_start, int j_end, int k,
+		     double *lon, double *lat, double *z, ucvm_soa_t *props, 
+		     mesh_ijk32_t *node_buf, double vp_min, double vs_min)
+{
+  int i, j, n;
+
+  n = 0;
+  for (j = j_start; j < j_end; j++) {  
+    for (i = i_start; i < i_end; i++) {
+      /* Copy payload */
+      node_buf[n].i = i + 1;
+      node_buf[n].j = j + 1;
+      node_buf[n].k = k + 1;
+      node_buf[n].vp = props->vp[n];
+      node_buf[n].vs = props->vs[n];
+      node_buf[n].rho = props->rho[n];
+      
+      /* Apply min Vs */
+      if (node_buf[n].vs < vs_min) {
+	node_buf[n].vs = vs_min;
+	node_buf[n].vp = vp_min;
+      }
+	
+      /* Qp/Qs via Kim Olsen */
+      node_buf[n].qs = 50.0 * (node_buf[n].vs / 1000.0);
+      node_buf[n].qp = 2.0 * node_buf[n].qs;
+
+      /* Check the node */
+      if (mesh_node_valid(i+1, j+1, k+1, &(node_buf[n])) != 0) {
+	fprintf(stderr, "[%d] Node:\n", myid);
+	fprintf(stderr, "\t[%d] i,j,k: %d, %d, %d\n", myid, 
+		i + 1, j + 1, k + 1);
+	fprintf(stderr, "\t[%d] lon,lat,dep: %lf, %lf, %lf\n", myid, 
+		lon[n], lat[n], z[n]);
+	fprintf(stderr, 
+		"\t[%d] Crust, GTL, Cmb, Vp, Vs, Rho: %d, %d, %d, %f, %f, %f\n", 
+		myid,
+		props->crust_source[n],
+		props->gtl_source[n],
+		props->cmb_source[n],
+		node_buf[n].vp, 
+		node_buf[n].vs, 
+		node_buf[n].rho);
+	return(1);
+      }
+      n++;
+    }
+  }
+
+  return(0);
+}
+
+
 int mesh_open_serial(ucvm_dim_t *mesh_dims, char *output, 
 		     mesh_format_t mtype, int bufsize)
 {
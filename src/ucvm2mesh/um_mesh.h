@@ -55,6 +55,12 @@ int mesh_data_to_node(int myid, int i_start, int i_end,
 		      ucvm_point_t *pntbuf, ucvm_data_t *propbuf, 
 		      mesh_ijk32_t *node_buf, double vp_min, double vs_min);
 
+/* Convert UCVM SoA columns to mesh node list and check that it is valid */
+int mesh_soa_to_node(int myid, int i_start, int i_end,
+		     int j_start, int j_end, int k,
+		     double *lon, double *lat, double *z, ucvm_soa_t *props, 
+		     mesh_ijk32_t *node_buf, double vp_min, double vs_min);
+
 
 /* Serial mesh writer */
 int mesh_open_serial(ucvm_dim_t *mesh_dims, char *output, 
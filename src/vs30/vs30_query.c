@@ -36,26 +36,31 @@ void usage() {
 int vs30_query(int points, ucvm_point_t *pnts, double z_inter) {
   int p = 0;
   int i = 0;
-  ucvm_point_t query_pt;
-  ucvm_data_t query_data;
+  double lonlat[2];
+  double query_z[31];
+  ucvm_data_t query_data[31];
 
   double vs_sum = 0.0;
   double vs = 0.0;
 
+  for (i = 0; i <= 30; i++) {
+    query_z[i] = i;
+  }
+
   for (p = 0; p < points; p++) {
      vs_sum = 0.0;
      vs = 0.0;
 
-     query_pt.coord[0] = pnts[p].coord[0];
-     query_pt.coord[1] = pnts[p].coord[1];
+     lonlat[0] = pnts[p].coord[0];
+     lonlat[1] = pnts[p].coord[1];
 
+     if (ucvm_query_columns(1, lonlat, 31, query_z, query_data) != 
+         UCVM_CODE_SUCCESS) {
+       fprintf(stderr, "UCVM query failed.\n");
+       exit(-3);
+     }
      for (i = 0; i <= 30; i++) {
-       query_pt.coord[2] = i;
-       if (ucvm_query(1, &query_pt, &query_data) != UCVM_CODE_SUCCESS) {
-         fprintf(stderr, "UCVM query failed.\n");
-         exit(-3);
-       }
-     vs_sum += 1.0/query_data.cmb.vs;
+       vs_sum += 1.0/query_data[i].cmb.vs;
      }
      vs = 31/vs_sum;
      printf(OUTPUT_FMT, pnts[p].coord[0], pnts[p].coord[1], vs);
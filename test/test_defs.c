@@ -8,11 +8,15 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include "test_defs.h"
 
 /* Test model ID */
 int test_id;
 
+/* Test model force depth flag */
+int test_force_depth = 0;
+
 /* Assert two integers are equal */
 int test_assert_int(int val1, int val2)
 {
@@ -27,7 +31,7 @@ int test_assert_int(int val1, int val2)
 /* Assert two floats are approximately equal */
 int test_assert_float(float val1, float val2)
 {
-  if (abs(val1 - val2) > 0.01) {
+  if (fabs(val1 - val2) > 0.01) {
     fprintf(stderr, "FAIL: assertion %f != %f\n", val1, val2);
     return(1);
   }
@@ -38,7 +42,7 @@ int test_assert_float(float val1, float val2)
 /* Assert two doubles are approximately equal */
 int test_assert_double(double val1, double val2)
 {
-  if (abs(val1 - val2) > 0.01) {
+  if (fabs(val1 - val2) > 0.01) {
     fprintf(stderr, "FAIL: assertion %lf != %lf\n", val1, val2);
     return(1);
   }
@@ -361,6 +365,40 @@ int run_ucvm_query(const char *bindir, const char *conf,
 }
 
 
+/* Run UCVM model to grid tool */
+int run_ucvm_model2grid(const char *bindir, const char *conf,
+			const char *model, const char *corner,
+			const char *dims, const char *ticks,
+			const char *outfile)
+{
+  char bin[MAX_STRING_LEN];
+  pid_t pid;
+  int status;
+
+  snprintf(bin, MAX_STRING_LEN, "%s/ucvm_model2grid", bindir);
+
+  /* Fork process */
+  pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    printf("FAIL: unable to fork\n");
+    return(1);
+  } else if (pid == 0) {
+    execl(bin, bin, "-f", conf, "-m", model, "-c", corner, 
+	  "-d", dims, "-n", ticks, outfile, (char *)0);
+    perror("execl");
+    _exit(1);
+  }
+
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+    printf("FAIL: ucvm_model2grid exited abnormally\n");
+    return(1);
+  }
+
+  return(0);
+}
+
 /* Init test model */
 int test_model_init(int m, ucvm_modelconf_t *conf)
 {
@@ -401,9 +439,22 @@ int test_model_label(int id, char *lab, int len)
 /* Setparam test model */
 int test_model_setparam(int id, int param, ...)
 {
+  va_list ap;
+
   if (id != test_id) {
     return(UCVM_CODE_ERROR);
   }
+
+  va_start(ap, param);
+  switch (param) {
+  case UCVM_MODEL_PARAM_FORCE_DEPTH_ABOVE_SURF:
+    test_force_depth = va_arg(ap, int);
+    break;
+  default:
+    break;
+  }
+  va_end(ap);
+
   return(UCVM_CODE_SUCCESS);
 }
 
@@ -421,6 +472,11 @@ int test_model_query(int id, ucvm_ctype_t cmode,
   for (i = 0; i < n; i++) {
     data[i].crust.source = test_id;
     data[i].crust.vp = 200.0;
+    /* Forced depth points above surface get a distinct vp */
+    if ((test_force_depth) && (cmode == UCVM_COORD_GEO_ELEV) && 
+	(data[i].depth < 0.0)) {
+      data[i].crust.vp = 300.0;
+    }
     data[i].crust.vs = 100.0;
     data[i].crust.rho = 50.0;
   }
@@ -432,6 +488,7 @@ int test_model_query(int id, ucvm_ctype_t cmode,
 /* Fill model structure with test model */
 int get_test_model(ucvm_model_t *m)
 {
+  memset(m, 0, sizeof(ucvm_model_t));
   m->mtype = UCVM_MODEL_CRUSTAL;
   m->init = test_model_init;
   m->finalize = test_model_finalize;
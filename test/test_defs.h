@@ -68,6 +68,12 @@ int run_ucvm_query(const char *bindir, const char *conf,
 		   const char *model, const char *map,
 		   const char *infile, const char *outfile);
 
+/* UCVM model to grid tool */
+int run_ucvm_model2grid(const char *bindir, const char *conf,
+			const char *model, const char *corner,
+			const char *dims, const char *ticks,
+			const char *outfile);
+
 /* Fill model structure with test model */
 int get_test_model(ucvm_model_t *m);
 
@@ -3,9 +3,13 @@
 #include <stdio.h>
 #include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "test_defs.h"
 #include "unittest_suite_lib.h"
 #include "ucvm.h"
+#include "ucvm_map.h"
+#include "ucvm_meta_etree.h"
+#include "etree.h"
 
 
 int test_lib_init()
@@ -286,6 +290,975 @@ int test_lib_model_version_1d()
   return(0);
 }
 
+int test_lib_query_ctx_1d()
+{
+  int nn = 1;
+  ucvm_point_t pnts;
+  ucvm_data_t data;
+  ucvm_ctx_t ctx;
+
+  printf("Test: UCVM lib query context 1D\n");
+
+  /* Setup UCVM */
+  if (ucvm_init("../conf/ucvm.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    return(1);
+  }
+
+  /* Add model */
+  if (ucvm_add_model(UCVM_MODEL_1D) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to enable model %s\n", UCVM_MODEL_1D);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Create context */
+  if (ucvm_ctx_init(&ctx) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to create query context\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Query a point in elevation mode */
+  if (ucvm_ctx_setparam(&ctx, UCVM_PARAM_QUERY_MODE, 
+			UCVM_COORD_GEO_ELEV) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to set context query mode\n");
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+
+  pnts.coord[0] = -118.0;
+  pnts.coord[1] = 34.0;
+  pnts.coord[2] = 0.0;
+
+  if (ucvm_query_ctx(&ctx, nn, &pnts, &data) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query 1d with context\n");
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Check values */
+  if (test_assert_double(data.depth, data.surf) != 0) {
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+  if (test_assert_int(data.crust.source, 0) != 0) {
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Finalize UCVM */
+  ucvm_ctx_finalize(&ctx);
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
+int test_lib_query_soa_1d()
+{
+  double lon[2], lat[2], z[2];
+  float vp[2], vs[2], rho[2];
+  ucvm_soa_t out;
+
+  printf("Test: UCVM lib SoA query 1D\n");
+
+  /* Setup UCVM */
+  if (ucvm_init("../conf/ucvm.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    return(1);
+  }
+
+  /* Add model */
+  if (ucvm_add_model(UCVM_MODEL_1D) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to enable model %s\n", UCVM_MODEL_1D);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Query two points, requesting only vp/vs/rho */
+  lon[0] = -118.0;
+  lat[0] = 34.0;
+  z[0] = 0.0;
+  lon[1] = -118.0;
+  lat[1] = 34.0;
+  z[1] = 0.0;
+  memset(&out, 0, sizeof(ucvm_soa_t));
+  out.vp = vp;
+  out.vs = vs;
+  out.rho = rho;
+
+  if (ucvm_query_soa(2, lon, lat, z, &out) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query 1d\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Check values */
+  if (test_assert_float(vp[1], 5000.0) != 0) {
+    ucvm_finalize();
+    return(1);
+  }
+  if (test_assert_float(vs[1], 2886.751346) != 0) {
+    ucvm_finalize();
+    return(1);
+  }
+  if (test_assert_float(rho[1], 2654.5) != 0) {
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Finalize UCVM */
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
+int test_lib_query_soa_ctx_1d()
+{
+  double lon[2], lat[2], z[2];
+  float vp[2], surf[2];
+  ucvm_soa_t out;
+  ucvm_ctx_t ctx;
+
+  printf("Test: UCVM lib SoA query context 1D\n");
+
+  /* Setup UCVM */
+  if (ucvm_init("../conf/ucvm.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    return(1);
+  }
+
+  /* Add model */
+  if (ucvm_add_model(UCVM_MODEL_1D) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to enable model %s\n", UCVM_MODEL_1D);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Create context */
+  if (ucvm_ctx_init(&ctx) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to create query context\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Query two points, requesting vp and the surface */
+  lon[0] = -118.0;
+  lat[0] = 34.0;
+  z[0] = 0.0;
+  lon[1] = -118.0;
+  lat[1] = 34.0;
+  z[1] = 0.0;
+  memset(&out, 0, sizeof(ucvm_soa_t));
+  out.vp = vp;
+  out.surf = surf;
+
+  if (ucvm_query_soa_ctx(&ctx, 2, lon, lat, z, &out) != 
+      UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query 1d with context\n");
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Check values, and that the context settings are untouched */
+  if ((test_assert_float(vp[1], 5000.0) != 0) ||
+      (test_assert_float(surf[0], surf[1]) != 0) ||
+      (test_assert_int(ctx.vals, UCVM_DEFAULT_QUERY_VALS) != 0)) {
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Finalize UCVM */
+  ucvm_ctx_finalize(&ctx);
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
+int test_lib_stats_1d()
+{
+  ucvm_point_t pnt[2];
+  ucvm_data_t data[2];
+  ucvm_stats_t stats;
+
+  printf("Test: UCVM lib query stats 1D\n");
+
+  /* Setup UCVM */
+  if (ucvm_init("../conf/ucvm.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    return(1);
+  }
+
+  /* Add model */
+  if (ucvm_add_model(UCVM_MODEL_1D) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to enable model %s\n", UCVM_MODEL_1D);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Query two points */
+  memset(pnt, 0, 2 * sizeof(ucvm_point_t));
+  pnt[0].coord[0] = -118.0;
+  pnt[0].coord[1] = 34.0;
+  pnt[1].coord[0] = -118.0;
+  pnt[1].coord[1] = 34.0;
+  ucvm_reset_stats();
+  if (ucvm_query(2, pnt, data) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query 1d\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Check counters */
+  if ((ucvm_get_stats(&stats) != UCVM_CODE_SUCCESS) ||
+      (stats.stage[UCVM_STAGE_QUERY].calls != 1) ||
+      (stats.stage[UCVM_STAGE_QUERY].offered != 2) ||
+      (stats.stage[UCVM_STAGE_CRUSTAL].served != 2) ||
+      (stats.model[0].offered != 2) ||
+      (stats.model[0].datagap != 0)) {
+    fprintf(stderr, "FAIL: Unexpected query stats\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Finalize UCVM */
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
+int test_lib_query_columns_1d()
+{
+  double lonlat[2];
+  double depths[2];
+  ucvm_data_t data[2];
+
+  printf("Test: UCVM lib column query 1D\n");
+
+  /* Setup UCVM */
+  if (ucvm_init("../conf/ucvm.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    return(1);
+  }
+
+  /* Add model */
+  if (ucvm_add_model(UCVM_MODEL_1D) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to enable model %s\n", UCVM_MODEL_1D);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Query one column at two depths */
+  lonlat[0] = -118.0;
+  lonlat[1] = 34.0;
+  depths[0] = 0.0;
+  depths[1] = 0.0;
+  if (ucvm_query_columns(1, lonlat, 2, depths, data) != 
+      UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query 1d\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Check values */
+  if (test_assert_double(data[1].cmb.vp, 5000.0) != 0) {
+    ucvm_finalize();
+    return(1);
+  }
+  if (test_assert_double(data[1].cmb.vs, 2886.751346) != 0) {
+    ucvm_finalize();
+    return(1);
+  }
+  if (test_assert_double(data[1].cmb.rho, 2654.5) != 0) {
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Finalize UCVM */
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
+int test_lib_query_ctx_gtl_elev()
+{
+  ucvm_point_t pnts;
+  ucvm_data_t data, data2;
+  ucvm_model_t m;
+  ucvm_modelconf_t mconf;
+  ucvm_ctx_t ctx;
+
+  printf("Test: UCVM lib query context GTL elevation\n");
+
+  /* Setup UCVM */
+  if (ucvm_init("../conf/ucvm.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    return(1);
+  }
+
+  /* Add test model, which honors the force depth flag, and a GTL */
+  get_test_model(&m);
+  memset(&mconf, 0, sizeof(ucvm_modelconf_t));
+  strcpy(mconf.label, "test");
+  if ((ucvm_add_user_model(&m, &mconf) != UCVM_CODE_SUCCESS) ||
+      (ucvm_add_model(UCVM_MODEL_ELYGTL) != UCVM_CODE_SUCCESS)) {
+    fprintf(stderr, "FAIL: Failed to enable test model and GTL\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Context in elevation mode, global settings left in depth mode */
+  if (ucvm_ctx_init(&ctx) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to create query context\n");
+    ucvm_finalize();
+    return(1);
+  }
+  if (ucvm_ctx_setparam(&ctx, UCVM_PARAM_QUERY_MODE, 
+			UCVM_COORD_GEO_ELEV) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to set context query mode\n");
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Query a point above the surface */
+  pnts.coord[0] = -118.0;
+  pnts.coord[1] = 34.0;
+  pnts.coord[2] = 0.0;
+  if (ucvm_query_ctx(&ctx, 1, &pnts, &data) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query with context\n");
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+  pnts.coord[2] = data.surf + 100.0;
+  if (ucvm_query_ctx(&ctx, 1, &pnts, &data) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query with context\n");
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Same point with global elevation mode */
+  if ((ucvm_setparam(UCVM_PARAM_QUERY_MODE, 
+		     UCVM_COORD_GEO_ELEV) != UCVM_CODE_SUCCESS) ||
+      (ucvm_query(1, &pnts, &data2) != UCVM_CODE_SUCCESS)) {
+    fprintf(stderr, "FAIL: Failed to query in elevation mode\n");
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Both forced to depth */
+  if ((test_assert_double(data.crust.vp, 300.0) != 0) ||
+      (test_assert_double(data.crust.vp, data2.crust.vp) != 0) ||
+      (test_assert_double(data.cmb.vp, data2.cmb.vp) != 0)) {
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Finalize UCVM */
+  ucvm_ctx_finalize(&ctx);
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
+/* Write a small map etree, 32x22 octants at level 5 */
+int test_create_map(const char *path)
+{
+  int i, j;
+  etree_t *ep;
+  etree_addr_t addr;
+  etree_tick_t edgetics;
+  ucvm_mpayload_t payload;
+  ucvm_meta_map_t meta;
+  char schema[UCVM_META_MIN_SCHEMA_LEN];
+  char appmeta[UCVM_META_MIN_META_LEN];
+
+  ep = etree_open(path, O_CREAT|O_TRUNC|O_RDWR, 64, 0, 3);
+  if (ep == NULL) {
+    fprintf(stderr, "FAIL: Failed to create etree %s\n", path);
+    return(1);
+  }
+  if ((ucvm_schema_etree_map_pack(schema, UCVM_META_MIN_SCHEMA_LEN) != 
+       UCVM_CODE_SUCCESS) || (etree_registerschema(ep, schema) != 0)) {
+    fprintf(stderr, "FAIL: Failed to register map schema\n");
+    etree_close(ep);
+    return(1);
+  }
+
+  addr.level = 5;
+  addr.type = ETREE_LEAF;
+  addr.z = 0;
+  edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - 5);
+  for (j = 0; j < 22; j++) {
+    for (i = 0; i < 32; i++) {
+      addr.x = i * edgetics;
+      addr.y = j * edgetics;
+      payload.surf = 100.0 + 3.0 * i + 5.0 * j;
+      payload.vs30 = 300.0 + 2.0 * i + j;
+      if (etree_insert(ep, addr, &payload) != 0) {
+	fprintf(stderr, "FAIL: Failed to insert map octant\n");
+	etree_close(ep);
+	return(1);
+      }
+    }
+  }
+
+  /* 30x20 km, so the last column and row are partial */
+  memset(&meta, 0, sizeof(ucvm_meta_map_t));
+  strcpy(meta.title, "test");
+  strcpy(meta.author, "test");
+  strcpy(meta.date, "test");
+  meta.spacing = 1000.0;
+  strcpy(meta.projstr, 
+	 "+proj=aeqd +lat_0=36.0 +lon_0=-120.0 +x_0=0.0 +y_0=0.0");
+  meta.origin.coord[0] = -120.0;
+  meta.origin.coord[1] = 36.0;
+  meta.rot = 0.0;
+  meta.dims_xyz.coord[0] = 30000.0;
+  meta.dims_xyz.coord[1] = 20000.0;
+  meta.ticks_xyz.dim[0] = 32 * edgetics;
+  meta.ticks_xyz.dim[1] = 22 * edgetics;
+  meta.ticks_xyz.dim[2] = 0;
+  if ((ucvm_meta_etree_map_pack(&meta, appmeta, 
+				UCVM_META_MIN_META_LEN) != UCVM_CODE_SUCCESS) ||
+      (etree_setappmeta(ep, appmeta) != 0)) {
+    fprintf(stderr, "FAIL: Failed to set map metadata\n");
+    etree_close(ep);
+    return(1);
+  }
+
+  if (etree_close(ep) != 0) {
+    fprintf(stderr, "FAIL: Failed to close etree %s\n", path);
+    return(1);
+  }
+
+  return(0);
+}
+
+int test_lib_map_raster()
+{
+  int i, n = 0;
+  ucvm_point_t pnts[441];
+  ucvm_data_t data[441], data2[441];
+
+  printf("Test: UCVM lib raster map matches etree map\n");
+
+  if (test_create_map("unittest_map.e") != 0) {
+    return(1);
+  }
+
+  /* Points over the map, past its far edges and on its origin */
+  for (i = 0; i < 441; i++) {
+    pnts[i].coord[0] = -120.0 + (i % 21) * 0.02;
+    pnts[i].coord[1] = 36.0 + (i / 21) * 0.011;
+    pnts[i].coord[2] = 0.0;
+  }
+  for (i = 0; i < 441; i++) {
+    data[i].surf = -1.0;
+    data[i].vs30 = -1.0;
+    data2[i] = data[i];
+  }
+
+  /* Query the etree, and convert it to a raster */
+  if (ucvm_map_init(UCVM_MAP_UCVM, UCVM_MAP_ETREE, 
+		    "unittest_map.e") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to open etree map\n");
+    unlink("unittest_map.e");
+    return(1);
+  }
+  if ((ucvm_map_query(UCVM_COORD_GEO_DEPTH, 441, pnts, 
+		      data) != UCVM_CODE_SUCCESS) ||
+      (ucvm_map_write_raster("unittest_map.r") != UCVM_CODE_SUCCESS)) {
+    fprintf(stderr, "FAIL: Failed to query or convert etree map\n");
+    ucvm_map_finalize();
+    unlink("unittest_map.e");
+    unlink("unittest_map.r");
+    return(1);
+  }
+  ucvm_map_finalize();
+
+  /* Query the raster */
+  if (ucvm_map_init(UCVM_MAP_UCVM, UCVM_MAP_RASTER, 
+		    "unittest_map.r") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to open raster map\n");
+    unlink("unittest_map.e");
+    unlink("unittest_map.r");
+    return(1);
+  }
+  if (ucvm_map_query(UCVM_COORD_GEO_DEPTH, 441, pnts, 
+		     data2) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query raster map\n");
+    ucvm_map_finalize();
+    unlink("unittest_map.e");
+    unlink("unittest_map.r");
+    return(1);
+  }
+  ucvm_map_finalize();
+  unlink("unittest_map.e");
+  unlink("unittest_map.r");
+
+  /* Check values */
+  for (i = 0; i < 441; i++) {
+    if (data[i].surf >= 0.0) {
+      n++;
+    }
+    if ((test_assert_double(data[i].surf, data2[i].surf) != 0) ||
+	(test_assert_double(data[i].vs30, data2[i].vs30) != 0)) {
+      fprintf(stderr, "FAIL: Mismatch at %lf, %lf\n", 
+	      pnts[i].coord[0], pnts[i].coord[1]);
+      return(1);
+    }
+  }
+  if (n == 0) {
+    fprintf(stderr, "FAIL: No points fell inside the map\n");
+    return(1);
+  }
+
+  printf("PASS\n");
+  return(0);
+}
+
+/* Copy the test config, appending extra lines */
+int test_write_conf(const char *path, const char *extra)
+{
+  FILE *fin, *fout;
+  char line[MAX_STRING_LEN];
+
+  fin = fopen("../conf/ucvm.conf", "r");
+  if (fin == NULL) {
+    fprintf(stderr, "FAIL: Failed to open ../conf/ucvm.conf\n");
+    return(1);
+  }
+  fout = fopen(path, "w");
+  if (fout == NULL) {
+    fprintf(stderr, "FAIL: Failed to create %s\n", path);
+    fclose(fin);
+    return(1);
+  }
+  while (fgets(line, MAX_STRING_LEN, fin) != NULL) {
+    fputs(line, fout);
+  }
+  fputs("\n", fout);
+  fputs(extra, fout);
+  fclose(fin);
+  fclose(fout);
+  return(0);
+}
+
+int test_lib_region_1d()
+{
+  int i;
+  ucvm_point_t pnts[9];
+  ucvm_data_t data[9];
+  ucvm_model_t m;
+  ucvm_modelconf_t mconf;
+  char label[UCVM_MAX_LABEL_LEN];
+  /* Expected model for each point */
+  const char *expect[9] = {"1d", "bbp1d", "1d", "test", "test", 
+			   "1d", "test", "1d", "1d"};
+  double lonlat[9][2] = {
+    {-118.9, 34.9},   /* inside 1d only, full bin */
+    {-116.6, 34.0},   /* inside bbp1d only */
+    {-118.0, 34.0},   /* inside both, first in list wins */
+    {-116.6, 33.2},   /* inside index extent, outside both */
+    {-120.0, 34.0},   /* outside index extent */
+    {-117.0, 34.9},   /* on 1d edge, partial bin */
+    {-116.99, 34.9},  /* just past 1d edge, same partial bin */
+    {-119.0, 33.0},   /* on 1d corner, index origin */
+    {-118.9, 35.0}};  /* on 1d edge, index far side */
+
+  printf("Test: UCVM lib model region routing\n");
+
+  /* Overlapping regions, so the index has full and partial bins */
+  if (test_write_conf("unittest_region.conf", 
+		      "1d_region=-119.0,33.0,-117.0,35.0\n"
+		      "bbp1d_region=-118.5,33.5,-116.5,34.5\n") != 0) {
+    return(1);
+  }
+
+  /* Setup UCVM */
+  if (ucvm_init("unittest_region.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    unlink("unittest_region.conf");
+    return(1);
+  }
+  unlink("unittest_region.conf");
+
+  /* Regional models, then the test model taking everything else */
+  get_test_model(&m);
+  memset(&mconf, 0, sizeof(ucvm_modelconf_t));
+  strcpy(mconf.label, "test");
+  if ((ucvm_add_model_list("1d,bbp1d") != UCVM_CODE_SUCCESS) ||
+      (ucvm_add_user_model(&m, &mconf) != UCVM_CODE_SUCCESS)) {
+    fprintf(stderr, "FAIL: Failed to enable models\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  for (i = 0; i < 9; i++) {
+    pnts[i].coord[0] = lonlat[i][0];
+    pnts[i].coord[1] = lonlat[i][1];
+    pnts[i].coord[2] = 0.0;
+  }
+  if (ucvm_query(9, pnts, data) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query models\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Check which model served each point */
+  for (i = 0; i < 9; i++) {
+    strcpy(label, "");
+    ucvm_model_label(data[i].crust.source, label, UCVM_MAX_LABEL_LEN);
+    if (test_assert_string(label, expect[i]) != 0) {
+      fprintf(stderr, "FAIL: Point %lf, %lf\n", 
+	      pnts[i].coord[0], pnts[i].coord[1]);
+      ucvm_finalize();
+      return(1);
+    }
+  }
+
+  /* Finalize UCVM */
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
+int test_lib_region_invalid()
+{
+  int retval;
+
+  printf("Test: UCVM lib invalid model region\n");
+
+  if (test_write_conf("unittest_region.conf", 
+		      "1d_region=-119.0,33.0\n") != 0) {
+    return(1);
+  }
+
+  /* Setup UCVM */
+  if (ucvm_init("unittest_region.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    unlink("unittest_region.conf");
+    return(1);
+  }
+  unlink("unittest_region.conf");
+
+  /* A malformed region keeps the model from loading */
+  retval = ucvm_add_model(UCVM_MODEL_1D);
+  ucvm_finalize();
+  if (test_assert_int(retval, UCVM_CODE_ERROR) != 0) {
+    return(1);
+  }
+
+  printf("PASS\n");
+  return(0);
+}
+
+/* Query one point, checking the cache counters afterwards */
+int test_cache_step(double lon, double lat, double z, 
+		    unsigned long long hits, unsigned long long misses, 
+		    int entries)
+{
+  ucvm_point_t pnt;
+  ucvm_data_t data;
+  unsigned long long h, m;
+  int e;
+
+  pnt.coord[0] = lon;
+  pnt.coord[1] = lat;
+  pnt.coord[2] = z;
+  if (ucvm_query(1, &pnt, &data) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to query 1d\n");
+    return(1);
+  }
+  if ((test_assert_double(data.cmb.vp, 5000.0) != 0) ||
+      (ucvm_get_cache_stats(&h, &m, &e) != UCVM_CODE_SUCCESS) ||
+      (test_assert_int((int)h, (int)hits) != 0) ||
+      (test_assert_int((int)m, (int)misses) != 0) ||
+      (test_assert_int(e, entries) != 0)) {
+    fprintf(stderr, "FAIL: Point %lf, %lf, %lf\n", lon, lat, z);
+    return(1);
+  }
+
+  return(0);
+}
+
+int test_lib_query_cache_1d()
+{
+  printf("Test: UCVM lib query cache 1D\n");
+
+  /* Setup UCVM */
+  if (ucvm_init("../conf/ucvm.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    return(1);
+  }
+
+  /* Add model */
+  if (ucvm_add_model(UCVM_MODEL_1D) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to enable model %s\n", UCVM_MODEL_1D);
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Two entries, 0.001 degree and 1 m tolerance */
+  if (ucvm_setparam(UCVM_PARAM_QUERY_CACHE, 2, 0.001, 1.0) != 
+      UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to enable query cache\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Miss, then a hit within tolerance and a miss just outside it */
+  if ((test_cache_step(-118.0, 34.0, 0.0, 0, 1, 1) != 0) ||
+      (test_cache_step(-118.0002, 34.0003, 0.3, 1, 1, 1) != 0) ||
+      (test_cache_step(-118.0006, 34.0, 0.0, 1, 2, 2) != 0)) {
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Touch the first point, so the second is evicted next */
+  if ((test_cache_step(-118.0, 34.0, 0.0, 2, 2, 2) != 0) ||
+      (test_cache_step(-118.01, 34.0, 0.0, 2, 3, 2) != 0) ||
+      (test_cache_step(-118.0, 34.0, 0.0, 3, 3, 2) != 0) ||
+      (test_cache_step(-118.0006, 34.0, 0.0, 3, 4, 2) != 0)) {
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Resizing empties the cache */
+  if ((ucvm_setparam(UCVM_PARAM_QUERY_CACHE, 4, 0.001, 1.0) != 
+       UCVM_CODE_SUCCESS) ||
+      (test_cache_step(-118.0, 34.0, 0.0, 0, 1, 1) != 0)) {
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Finalize UCVM */
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
+int test_lib_model_grid_1d()
+{
+  int i;
+  ucvm_point_t pnts[9];
+  ucvm_data_t ref[9];
+  ucvm_data_t data[9];
+  /* Nodes every 500 m, then depths between nodes where 1D vp is 
+     linear, and one point below the grid */
+  double depths[9] = {0.0, 500.0, 1000.0, 5000.0, 15500.0, 
+		      5250.0, 7300.0, 12100.0, 25000.0};
+
+  printf("Test: UCVM lib model grid 1D round trip\n");
+
+  /* Materialize the 1D model as a grid volume */
+  if (run_ucvm_model2grid("../bin", "../conf/ucvm.conf", "1d", 
+			  "-118.2,33.9", "4000,4000,20000", "3,3,41",
+			  "unittest_grid.vol") != 0) {
+    fprintf(stderr, "FAIL: Failed to create grid volume\n");
+    return(1);
+  }
+  if (test_write_conf("unittest_grid.conf", 
+		      "grid_interface=model_grid\n"
+		      "grid_modelpath=unittest_grid.vol\n") != 0) {
+    unlink("unittest_grid.vol");
+    return(1);
+  }
+
+  for (i = 0; i < 9; i++) {
+    pnts[i].coord[0] = -118.19;
+    pnts[i].coord[1] = 33.91;
+    pnts[i].coord[2] = depths[i];
+  }
+
+  /* Query the 1D model */
+  if ((ucvm_init("unittest_grid.conf") != UCVM_CODE_SUCCESS) ||
+      (ucvm_add_model(UCVM_MODEL_1D) != UCVM_CODE_SUCCESS) ||
+      (ucvm_query(9, pnts, ref) != UCVM_CODE_SUCCESS)) {
+    fprintf(stderr, "FAIL: Failed to query model %s\n", UCVM_MODEL_1D);
+    ucvm_finalize();
+    unlink("unittest_grid.conf");
+    unlink("unittest_grid.vol");
+    return(1);
+  }
+  ucvm_finalize();
+
+  /* Query the grid */
+  if ((ucvm_init("unittest_grid.conf") != UCVM_CODE_SUCCESS) ||
+      (ucvm_add_model("grid") != UCVM_CODE_SUCCESS) ||
+      (ucvm_query(9, pnts, data) != UCVM_CODE_SUCCESS)) {
+    fprintf(stderr, "FAIL: Failed to query grid model\n");
+    ucvm_finalize();
+    unlink("unittest_grid.conf");
+    unlink("unittest_grid.vol");
+    return(1);
+  }
+  ucvm_finalize();
+  unlink("unittest_grid.conf");
+  unlink("unittest_grid.vol");
+
+  /* Nodes hold the 1D values, between nodes vp interpolates */
+  for (i = 0; i < 8; i++) {
+    if ((data[i].crust.source == UCVM_SOURCE_NONE) ||
+	(test_assert_double(data[i].cmb.vp, ref[i].cmb.vp) != 0)) {
+      fprintf(stderr, "FAIL: Grid differs from 1D at depth %lf\n", 
+	      depths[i]);
+      return(1);
+    }
+    if ((i < 5) && 
+	((test_assert_double(data[i].cmb.vs, ref[i].cmb.vs) != 0) ||
+	 (test_assert_double(data[i].cmb.rho, ref[i].cmb.rho) != 0))) {
+      fprintf(stderr, "FAIL: Grid differs from 1D at depth %lf\n", 
+	      depths[i]);
+      return(1);
+    }
+  }
+  if (data[8].crust.source != UCVM_SOURCE_NONE) {
+    fprintf(stderr, "FAIL: Grid answered below its extent\n");
+    return(1);
+  }
+
+  printf("PASS\n");
+  return(0);
+}
+
+int test_lib_add_model_list_retry()
+{
+  printf("Test: UCVM lib add model list retry after failure\n");
+
+  if (test_write_conf("unittest_retry.conf", 
+		      "bad_interface=model_grid\n"
+		      "bad_modelpath=unittest_missing.vol\n") != 0) {
+    return(1);
+  }
+
+  /* Setup UCVM */
+  if (ucvm_init("unittest_retry.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    unlink("unittest_retry.conf");
+    return(1);
+  }
+  unlink("unittest_retry.conf");
+
+  /* 1D inits alongside the failing model, but is not enabled */
+  if (ucvm_add_model_list("bad,1d") == UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Model list with missing grid was enabled\n");
+    ucvm_finalize();
+    return(1);
+  }
+  if (test_assert_int(ucvm_get_num_models(), 0) != 0) {
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Retry without the failing model */
+  if (ucvm_add_model_list("1d") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to enable model list 1d on retry\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Finalize UCVM */
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
+int test_lib_add_user_model_legacy()
+{
+  ucvm_point_t pnts;
+  ucvm_data_t data;
+  ucvm_model_t m, tm;
+  ucvm_modelconf_t mconf;
+  ucvm_ctx_t ctx;
+
+  printf("Test: UCVM lib add user model with legacy fields\n");
+
+  /* Setup UCVM */
+  if (ucvm_init("../conf/ucvm.conf") != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to initialize UCVM API\n");
+    return(1);
+  }
+
+  /* Only the legacy fields are set, the rest is garbage */
+  get_test_model(&tm);
+  memset(&m, 0xff, sizeof(ucvm_model_t));
+  m.mtype = tm.mtype;
+  m.init = tm.init;
+  m.finalize = tm.finalize;
+  m.setparam = tm.setparam;
+  m.getversion = tm.getversion;
+  m.getlabel = tm.getlabel;
+  m.query = tm.query;
+  memset(&mconf, 0, sizeof(ucvm_modelconf_t));
+  strcpy(mconf.label, "test");
+  if (ucvm_add_user_model(&m, &mconf) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to enable test model\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* The caller reads no map values, but the model may */
+  if (ucvm_setparam(UCVM_PARAM_QUERY_VALS, 0) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to set query vals\n");
+    ucvm_finalize();
+    return(1);
+  }
+  pnts.coord[0] = -118.0;
+  pnts.coord[1] = 34.0;
+  pnts.coord[2] = 0.0;
+  memset(&data, 0, sizeof(ucvm_data_t));
+  if ((ucvm_query(1, &pnts, &data) != UCVM_CODE_SUCCESS) ||
+      (test_assert_double(data.cmb.vp, 200.0) != 0) ||
+      (data.vs30 <= 0.0)) {
+    fprintf(stderr, "FAIL: Failed to query test model\n");
+    ucvm_finalize();
+    return(1);
+  }
+
+  /* Contexts use the optional hooks, which must be unset */
+  if (ucvm_ctx_init(&ctx) != UCVM_CODE_SUCCESS) {
+    fprintf(stderr, "FAIL: Failed to create query context\n");
+    ucvm_finalize();
+    return(1);
+  }
+  memset(&data, 0, sizeof(ucvm_data_t));
+  if ((ucvm_query_ctx(&ctx, 1, &pnts, &data) != UCVM_CODE_SUCCESS) ||
+      (test_assert_double(data.cmb.vp, 200.0) != 0)) {
+    fprintf(stderr, "FAIL: Failed to query test model with context\n");
+    ucvm_ctx_finalize(&ctx);
+    ucvm_finalize();
+    return(1);
+  }
+  ucvm_ctx_finalize(&ctx);
+
+  /* Finalize UCVM */
+  ucvm_finalize();
+
+  printf("PASS\n");
+  return(0);
+}
+
 int test_lib_add_model_cencal()
 {
   printf("Test: UCVM lib add model USGS CenCal\n");
@@ -497,7 +1470,7 @@ int suite_lib(const char *xmldir)
   FILE *lf = NULL;
 
   /* Setup test suite */
-  numfixed = 7;
+  numfixed = 20;
   strcpy(suite.suite_name, "suite_grid");
   suite.num_tests = numfixed;
 #ifdef _UCVM_ENABLE_CENCAL
@@ -568,6 +1541,60 @@ int suite_lib(const char *xmldir)
   suite.tests[6].test_func = &test_lib_model_version_1d;
   suite.tests[6].elapsed_time = 0.0;
 
+  strcpy(suite.tests[7].test_name, 
+  	 "test_lib_query_ctx_1d");
+  suite.tests[7].test_func = &test_lib_query_ctx_1d;
+  suite.tests[7].elapsed_time = 0.0;
+
+  strcpy(suite.tests[8].test_name, 
+  	 "test_lib_query_soa_1d");
+  suite.tests[8].test_func = &test_lib_query_soa_1d;
+  suite.tests[8].elapsed_time = 0.0;
+  strcpy(suite.tests[9].test_name, 
+  	 "test_lib_stats_1d");
+  suite.tests[9].test_func = &test_lib_stats_1d;
+  suite.tests[9].elapsed_time = 0.0;
+  strcpy(suite.tests[10].test_name, 
+  	 "test_lib_query_columns_1d");
+  suite.tests[10].test_func = &test_lib_query_columns_1d;
+  suite.tests[10].elapsed_time = 0.0;
+  strcpy(suite.tests[11].test_name, 
+	 "test_lib_query_ctx_gtl_elev");
+  suite.tests[11].test_func = &test_lib_query_ctx_gtl_elev;
+  suite.tests[11].elapsed_time = 0.0;
+  strcpy(suite.tests[12].test_name, 
+	 "test_lib_query_soa_ctx_1d");
+  suite.tests[12].test_func = &test_lib_query_soa_ctx_1d;
+  suite.tests[12].elapsed_time = 0.0;
+  strcpy(suite.tests[13].test_name, 
+	 "test_lib_map_raster");
+  suite.tests[13].test_func = &test_lib_map_raster;
+  suite.tests[13].elapsed_time = 0.0;
+  strcpy(suite.tests[14].test_name, 
+	 "test_lib_region_1d");
+  suite.tests[14].test_func = &test_lib_region_1d;
+  suite.tests[14].elapsed_time = 0.0;
+  strcpy(suite.tests[15].test_name, 
+	 "test_lib_region_invalid");
+  suite.tests[15].test_func = &test_lib_region_invalid;
+  suite.tests[15].elapsed_time = 0.0;
+  strcpy(suite.tests[16].test_name, 
+	 "test_lib_query_cache_1d");
+  suite.tests[16].test_func = &test_lib_query_cache_1d;
+  suite.tests[16].elapsed_time = 0.0;
+  strcpy(suite.tests[17].test_name, 
+	 "test_lib_model_grid_1d");
+  suite.tests[17].test_func = &test_lib_model_grid_1d;
+  suite.tests[17].elapsed_time = 0.0;
+  strcpy(suite.tests[18].test_name, 
+	 "test_lib_add_model_list_retry");
+  suite.tests[18].test_func = &test_lib_add_model_list_retry;
+  suite.tests[18].elapsed_time = 0.0;
+  strcpy(suite.tests[19].test_name, 
+	 "test_lib_add_user_model_legacy");
+  suite.tests[19].test_func = &test_lib_add_user_model_legacy;
+  suite.tests[19].elapsed_time = 0.0;
+
 #ifdef _UCVM_ENABLE_CENCAL
   strcpy(suite.tests[suite.num_tests].test_name, 
   	 "test_lib_add_model_cencal");